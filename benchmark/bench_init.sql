@@ -0,0 +1,86 @@
+-- Tables and helpers for the external join benchmark.
+-- usage: psql -v scale=N -f bench_init.sql   (N * 1M rows per table)
+
+DROP TABLE IF EXISTS bench_t1;
+DROP TABLE IF EXISTS bench_t2;
+
+CREATE TABLE bench_t1(key int, dval float);
+CREATE TABLE bench_t2(key int, dval float);
+
+INSERT INTO bench_t1 (SELECT generate_series(1, 1000000 * :scale), random() * 100);
+INSERT INTO bench_t2 (SELECT generate_series(1, 1000000 * :scale), random() * 100);
+VACUUM ANALYZE bench_t1;
+VACUUM ANALYZE bench_t2;
+
+-- first ExternalJoin node of an EXPLAIN (FORMAT JSON) plan
+CREATE OR REPLACE FUNCTION ej_bench_find(node json) RETURNS json AS $$
+DECLARE
+	child json;
+	found json;
+BEGIN
+	IF node->>'Custom Plan Provider' = 'ExternalJoin' THEN
+		RETURN node;
+	END IF;
+	IF node->'Plans' IS NULL THEN
+		RETURN NULL;
+	END IF;
+	FOR child IN SELECT * FROM json_array_elements(node->'Plans') LOOP
+		found := ej_bench_find(child);
+		IF found IS NOT NULL THEN
+			RETURN found;
+		END IF;
+	END LOOP;
+	RETURN NULL;
+END;
+$$ LANGUAGE plpgsql;
+
+-- run query under EXPLAIN ANALYZE and report throughput of the scan, ship and decode stages
+CREATE OR REPLACE FUNCTION ej_bench_stages(query text)
+RETURNS TABLE(stage text, rows bigint, mbytes float8, ms float8, rows_per_sec float8, mb_per_sec float8) AS $$
+DECLARE
+	plan json;
+	node json;
+	input_rows bigint := 0;
+	input_bytes bigint := 0;
+	i int := 1;
+	decode_ms float8;
+BEGIN
+	EXECUTE 'EXPLAIN (ANALYZE, FORMAT JSON) ' || query INTO plan;
+	node := ej_bench_find(plan->0->'Plan');
+	IF node IS NULL THEN
+		RAISE EXCEPTION 'query has no ExternalJoin node, is external_join.enable on?';
+	END IF;
+	WHILE node->>('Input ' || i) IS NOT NULL LOOP
+		input_rows := input_rows + substring(node->>('Input ' || i) from 'rows=(\d+)')::bigint;
+		input_bytes := input_bytes + substring(node->>('Input ' || i) from 'bytes=(\d+)')::bigint;
+		i := i + 1;
+	END LOOP;
+
+	stage := 'scan';
+	rows := input_rows;
+	mbytes := input_bytes / 1e6;
+	ms := (node->>'Scan Time')::float8;
+	rows_per_sec := CASE WHEN ms > 0 THEN rows / ms * 1000 END;
+	mb_per_sec := CASE WHEN ms > 0 THEN mbytes / ms * 1000 END;
+	RETURN NEXT;
+
+	stage := 'ship';
+	mbytes := (node->>'Bytes Sent')::float8 / 1e6;
+	ms := CASE WHEN (node->>'Send Throughput MB/s')::float8 > 0
+		THEN mbytes / (node->>'Send Throughput MB/s')::float8 * 1000 ELSE 0 END;
+	rows_per_sec := CASE WHEN ms > 0 THEN rows / ms * 1000 END;
+	mb_per_sec := CASE WHEN ms > 0 THEN mbytes / ms * 1000 END;
+	RETURN NEXT;
+
+	-- node time after the first result, minus time spent waiting for the engine
+	decode_ms := (node->>'Actual Total Time')::float8 - (node->>'Time To First Result')::float8
+		- (node->>'Result Wait Time')::float8;
+	stage := 'decode';
+	rows := (node->>'Actual Rows')::bigint;
+	mbytes := (node->>'Bytes Received')::float8 / 1e6;
+	ms := greatest(decode_ms, 0);
+	rows_per_sec := CASE WHEN ms > 0 THEN rows / ms * 1000 END;
+	mb_per_sec := CASE WHEN ms > 0 THEN mbytes / ms * 1000 END;
+	RETURN NEXT;
+END;
+$$ LANGUAGE plpgsql;
@@ -0,0 +1,316 @@
+/*
+ * Micro-benchmarks of the two hottest loops of external_join:
+ * TupleBuffer::putTuple() and ResultDecoder::decode().
+ *
+ * Both are driven with synthetic tuples and result buffers, without a
+ * database; the few backend functions the headers need are stubbed below.
+ * Results are printed in ns/row and MB/s per column layout.
+ */
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdarg>
+
+extern "C" {
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "postgres.h"
+
+#include "access/htup_details.h"
+#include "access/tupdesc.h"
+#include "access/tuptoaster.h"
+#include "catalog/pg_type.h"
+#include "commands/explain.h"
+#include "executor/instrument.h"
+#include "executor/tuptable.h"
+#include "miscadmin.h"
+#include "storage/fd.h"
+#include "utils/memutils.h"
+
+#include "ExternalProtocol.hpp"
+#include "BufferPool.hpp"
+#include "TupleBuffer.hpp"
+#include "ResultBuffer.hpp"
+#include "PipelineTrace.hpp"
+#include "JoinInstrumentation.hpp"
+#include "ResultDecoder.hpp"
+
+/* ---- backend stubs ---- */
+MemoryContext CurrentMemoryContext = NULL;
+volatile bool InterruptPending = false;
+
+void *palloc(Size size) { return std::malloc(size); }
+void *palloc0(Size size) { return std::calloc(1, size); }
+void pfree(void *pointer) { std::free(pointer); }
+void MemoryContextRegisterResetCallback(MemoryContext context, MemoryContextCallback *cb) { }
+void ProcessInterrupts(void) { }
+void MemoryContextReset(MemoryContext context) { }
+void *MemoryContextAlloc(MemoryContext context, Size size) { return std::malloc(size); }
+void slot_getallattrs(TupleTableSlot *slot) { }
+struct varlena *pg_detoast_datum_packed(struct varlena *datum) { return datum; }
+
+Datum
+Float8GetDatum(float8 X)
+{
+	union { float8 value; int64 retval; } myunion;
+	
+	myunion.value = X;
+	return Int64GetDatum(myunion.retval);
+}
+
+Datum
+Float4GetDatum(float4 X)
+{
+	union { float4 value; int32 retval; } myunion;
+	
+	myunion.value = X;
+	return Int32GetDatum(myunion.retval);
+}
+
+bool
+errstart(int elevel, const char *filename, int lineno, const char *funcname, const char *domain)
+{
+	if (elevel >= ERROR) {
+		std::fprintf(stderr, "error at %s:%d\n", filename, lineno);
+		std::abort();
+	}
+	return false;
+}
+void errfinish(int dummy, ...) { }
+int errcode(int sqlerrcode) { return 0; }
+int errmsg(const char *fmt, ...) { return 0; }
+void elog_start(const char *filename, int lineno, const char *funcname) { }
+void elog_finish(int elevel, const char *fmt, ...) { }
+
+TupleTableSlot *
+ExecClearTuple(TupleTableSlot *slot)
+{
+	slot->tts_isempty = true;
+	slot->tts_nvalid = 0;
+	return slot;
+}
+
+TupleTableSlot *
+ExecStoreVirtualTuple(TupleTableSlot *slot)
+{
+	slot->tts_isempty = false;
+	slot->tts_nvalid = slot->tts_tupleDescriptor->natts;
+	return slot;
+}
+}
+
+/* ---- harness ---- */
+struct Layout {
+	const char *name;
+	int natts;
+	Oid types[8];
+};
+
+static const Layout LAYOUTS[] = {
+	{ "int4", 1, { INT4OID } },
+	{ "int4,float8", 2, { INT4OID, FLOAT8OID } },
+	{ "int4,float8,int4,float8", 4, { INT4OID, FLOAT8OID, INT4OID, FLOAT8OID } },
+	{ "int2,bool,int4,oid", 4, { INT2OID, BOOLOID, INT4OID, OIDOID } },
+	{ "int8 x8", 8, { INT8OID, INT8OID, INT8OID, INT8OID, INT8OID, INT8OID, INT8OID, INT8OID } },
+};
+
+static int
+typeLength(Oid type)
+{
+	switch (type) {
+	case INT8OID: case FLOAT8OID: return 8;
+	case INT4OID: case FLOAT4OID: case OIDOID: return 4;
+	case INT2OID: return 2;
+	default: return 1;
+	}
+}
+
+/* size of one row as the decoder lays it out, assuming the row starts aligned */
+static std::size_t
+rowSize(const Layout *layout)
+{
+	std::size_t off = 0;
+	
+	for (int i = 0; i < layout->natts; i++) {
+		std::size_t len = typeLength(layout->types[i]);
+		
+		off = (off + len - 1) / len * len + len;
+	}
+	return off;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static TupleDesc
+makeTupleDesc(const Layout *layout)
+{
+	TupleDesc td = static_cast<TupleDesc>(std::calloc(1, sizeof(*td)));
+	
+	td->natts = layout->natts;
+	td->attrs = static_cast<Form_pg_attribute *>(std::calloc(layout->natts, sizeof(Form_pg_attribute)));
+	for (int i = 0; i < layout->natts; i++) {
+		td->attrs[i] = static_cast<Form_pg_attribute>(std::calloc(1, ATTRIBUTE_FIXED_PART_SIZE));
+		td->attrs[i]->atttypid = layout->types[i];
+		td->attrs[i]->attlen = typeLength(layout->types[i]);
+	}
+	return td;
+}
+
+static void
+benchPutTuple(const Layout *layout, long nrows)
+{
+	static constexpr int NTUPLES = 1024;
+	std::size_t width = rowSize(layout);
+	std::size_t hoff = MAXALIGN(offsetof(HeapTupleHeaderData, t_bits));
+	HeapTupleData tuples[NTUPLES];
+	TupleTableSlot slot;
+	TupleBuffer tb;
+	double begin, elapsed;
+	
+	/* distinct tuples, so that the source is not always in L1 */
+	for (int i = 0; i < NTUPLES; i++) {
+		char *data = static_cast<char *>(std::calloc(1, hoff + width));
+		
+		reinterpret_cast<HeapTupleHeader>(data)->t_hoff = hoff;
+		tuples[i].t_len = hoff + width;
+		tuples[i].t_data = reinterpret_cast<HeapTupleHeader>(data);
+	}
+	std::memset(static_cast<void *>(&slot), 0, sizeof(slot));
+	
+	tb.init(TupleBuffer::CHUNK_SIZE);
+	begin = now();
+	for (long i = 0; i < nrows; i++) {
+		slot.tts_tuple = &tuples[i % NTUPLES];
+		/* a full chunk would be handed to the sender here */
+		if (tb.isFull(width)) {
+			tb.fini();
+			tb.init(TupleBuffer::CHUNK_SIZE);
+		}
+		tb.putTuple(&slot);
+	}
+	elapsed = now() - begin;
+	tb.fini();
+	
+	std::printf("putTuple  %-34s %3zu B/row %8.2f ns/row %9.1f MB/s\n", layout->name, width,
+		    elapsed * 1e9 / nrows, nrows * width / elapsed / 1e6);
+	for (int i = 0; i < NTUPLES; i++)
+		std::free(tuples[i].t_data);
+}
+
+/* write batches of rows to stream, every null_every-th row has a NULL in its first column; returns rows */
+static long
+fillStream(char *stream, std::size_t size, std::size_t width, int natts, int null_every)
+{
+	static constexpr uint32_t BATCH_ROWS = 1024;
+	std::size_t words = (BATCH_ROWS + 63) / 64;
+	std::size_t batch_size = sizeof(ResultBatchHeader) + (null_every > 0 ? natts * words * sizeof(uint64_t) : 0) + BATCH_ROWS * width;
+	std::size_t off = 0;
+	long nrows = 0;
+	
+	std::memset(stream, 1, size);
+	while (TYPEALIGN(8, off) + batch_size <= size) {
+		ResultBatchHeader *batch;
+		
+		off = TYPEALIGN(8, off);
+		batch = reinterpret_cast<ResultBatchHeader *>(stream + off);
+		batch->nrows = BATCH_ROWS;
+		batch->flags = (null_every > 0) ? RESULT_HAS_NULLS : 0;
+		off += sizeof(*batch);
+		if (null_every > 0) {
+			uint64_t *valid = reinterpret_cast<uint64_t *>(stream + off);
+			
+			std::memset(valid, 0xFF, natts * words * sizeof(uint64_t));
+			for (uint32_t i = 0; i < BATCH_ROWS; i += null_every)
+				valid[i / 64] &= ~(UINT64CONST(1) << (i % 64));
+			off += natts * words * sizeof(uint64_t);
+		}
+		off += BATCH_ROWS * width;
+		nrows += BATCH_ROWS;
+	}
+	return nrows;
+}
+
+static void
+benchDecode(const Layout *layout, int repeat, int null_every)
+{
+	TupleDesc td = makeTupleDesc(layout);
+	TupleTableSlot slot;
+	ResultCursor rc;
+	JoinInstrumentation instr;
+	std::size_t width = rowSize(layout);
+	/* both buffers, so that every pass switches buffers once */
+	char *stream = static_cast<char *>(std::malloc(ResultBuffer::BUFSIZE * 2));
+	long nrows = fillStream(stream, ResultBuffer::BUFSIZE * 2, width, td->natts, null_every);
+	long decoded = 0;
+	double begin, elapsed = 0;
+	char name[64];
+	
+	std::memset(static_cast<void *>(&slot), 0, sizeof(slot));
+	slot.tts_tupleDescriptor = td;
+	slot.tts_values = static_cast<Datum *>(std::calloc(td->natts, sizeof(Datum)));
+	slot.tts_isnull = static_cast<bool *>(std::calloc(td->natts, sizeof(bool)));
+	std::memset(static_cast<void *>(&rc), 0, sizeof(rc));
+	rc.drb.init();
+	instr.init(false);
+	
+	for (int r = 0; r < repeat; r++) {
+		rc.drb.changeResultBuffer(0);
+		for (int b = 0; b < 2; b++) {
+			ResultBuffer *rb = (b == 0) ? rc.drb.getCurrentResultBuffer() : rc.drb.getNextResultBuffer();
+			
+			std::memcpy(rb->getBufferPointer(), stream + b * ResultBuffer::BUFSIZE, ResultBuffer::BUFSIZE);
+			rb->setContentSize(ResultBuffer::BUFSIZE);
+		}
+		rc.prb = rc.drb.getCurrentResultBuffer();
+		rc.poffset = 0;
+		rc.psize = ResultBuffer::BUFSIZE;
+		rc.batch_rows = 0;
+		
+		/* exactly the rows written, the decoder would wait for a third buffer otherwise */
+		begin = now();
+		for (long i = 0; i < nrows; i++) {
+			if (ResultDecoder::decode(&rc, &slot, &instr) == NULL)
+				break;
+			decoded++;
+		}
+		elapsed += now() - begin;
+	}
+	rc.drb.fini();
+	std::free(rc.valid);
+	std::free(stream);
+	
+	if (null_every > 0)
+		std::snprintf(name, sizeof(name), "%s 1/%d null", layout->name, null_every);
+	else
+		std::snprintf(name, sizeof(name), "%s", layout->name);
+	std::printf("decode    %-34s %3zu B/row %8.2f ns/row %9.1f MB/s\n", name, width,
+		    elapsed * 1e9 / decoded, decoded * width / elapsed / 1e6);
+}
+
+int
+main(int argc, char **argv)
+{
+	long nrows = (argc > 1) ? std::atol(argv[1]) : 50000000L;
+	int repeat = (argc > 2) ? std::atoi(argv[2]) : 3;
+	
+	std::printf("usage: %s [putTuple rows] [decode passes]\n", argv[0]);
+	for (const Layout &layout : LAYOUTS)
+		benchPutTuple(&layout, nrows);
+	for (const Layout &layout : LAYOUTS)
+		benchDecode(&layout, repeat, 0);
+	for (const Layout &layout : LAYOUTS)
+		benchDecode(&layout, repeat, 16);
+	return 0;
+}
@@ -0,0 +1,41 @@
+#!/bin/bash
+# External join benchmark, runs on one box against the null engine.
+#
+#   SCALE     millions of rows per table (default 1)
+#   RESULTS   result rows the engine sends back per query (default 1000)
+#   CLIENTS   pgbench clients (default 1)
+#   DURATION  pgbench duration in seconds (default 30)
+#   PORT      engine port (default 59999)
+#   PGBIN     directory of psql and pgbench (default ../tmp_install/bin)
+#   SETUP=0   skip loading the tables
+#
+# The database must run with external_join installed (sh ext_install.sh).
+
+cd "$(dirname "$0")"
+
+SCALE=${SCALE:-1}
+RESULTS=${RESULTS:-1000}
+CLIENTS=${CLIENTS:-1}
+DURATION=${DURATION:-30}
+PORT=${PORT:-59999}
+PGBIN=${PGBIN:-../tmp_install/bin}
+SETUP=${SETUP:-1}
+QUERY="SELECT t1.key, t1.dval, t2.key, t2.dval FROM bench_t1 t1, bench_t2 t2 WHERE t1.key = t2.key"
+
+make -C ../external_sample > /dev/null || exit 1
+../external_sample/null_engine -p $PORT -i 2 -r $RESULTS 2> ${TMPDIR:-/tmp}/null_engine.log &
+ENGINE=$!
+trap "kill $ENGINE" EXIT
+sleep 1
+
+if [ "$SETUP" != "0" ]; then
+	$PGBIN/psql -q -v ON_ERROR_STOP=1 -v scale=$SCALE -f bench_init.sql || exit 1
+fi
+
+echo "== stages (scale $SCALE) =="
+PGOPTIONS="-c external_join.enable=on -c external_join.port=$PORT" \
+	$PGBIN/psql -v ON_ERROR_STOP=1 -c "SELECT * FROM ej_bench_stages('$QUERY')" || exit 1
+
+echo "== pgbench ($CLIENTS clients, $DURATION s) =="
+PGOPTIONS="-c external_join.port=$PORT" \
+	$PGBIN/pgbench -n -c $CLIENTS -j $CLIENTS -T $DURATION -f external_join.pgbench
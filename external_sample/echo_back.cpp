@@ -7,6 +7,9 @@
 #include <netdb.h>
 
 #include "socket_lapper.h"
+#include "ExternalProtocol.hpp"
+#include "input_reader.h"
+#include "result_writer.h"
 
 /* this can be modified */
 #define PG_PORT (59999)
@@ -20,7 +23,9 @@ struct Tuple {
 int main(void)
 {
 	int lsock, csock;
+	InputHeader header;
 	size_t size;
+	ResultWriter writer;
 	
 	size_t ntup;
 	Tuple *tuples;
@@ -30,19 +35,16 @@ int main(void)
 	/* accept connection from PostgreSQL */
 	csock = acceptSock(lsock);
 	
-	/* receive total size of tuples */
-	receiveStrong(csock, &size, sizeof(size));
+	/* receive all chunks of the input */
+	tuples = (Tuple *)receiveInput(csock, &header, &size);
 	ntup = size / sizeof(*tuples);
-	/* alloc buffer to contain tuples */
-	tuples = (Tuple *)malloc(size);
-	/* receive tuples */
-	receiveStrong(csock, tuples, size);
 		
 	/* print information */
 	puts("-----");
 	printf("size of tuples = %zu\n", size);
 	printf("size of tuple = %zu\n", sizeof(*tuples));
 	printf("number of tuples = %zu\n", ntup);
+	printf("estimated tuples = %llu\n", (unsigned long long)header.est_rows);
 	puts("-----");
 	/* print tuple contents */
 	for (int i = 0; i < ntup; i++)
@@ -50,8 +52,9 @@ int main(void)
 	
 	/**********************************/
 	/* send back tuples twice */
+	initResultWriter(&writer, csock);
 	for (int j = 0; j < 2; j++)
-		sendStrong(csock, tuples, sizeof(*tuples) * ntup);
+		sendResultBatch(&writer, tuples, ntup, sizeof(*tuples));
 	/**********************************/
 
 	close(lsock);
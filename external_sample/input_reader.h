@@ -0,0 +1,323 @@
+#ifndef INPUTREADER_HEAD_
+#define INPUTREADER_HEAD_
+
+#include <cstdlib>
+#include <cstring>
+
+/* parts of an input besides its rows */
+struct InputAreas {
+	/* variable length areas of all chunks, which VarlenaRef offsets of the rows point into */
+	char *var;
+	size_t var_size;
+	/* number of rows */
+	size_t nrows;
+	/* number of columns, known once a chunk had null bitmaps */
+	int natts;
+	/* validity bitmaps of all rows laid out like those of a chunk, NULL if no row has a NULL */
+	uint64_t *valid;
+	/* join key hash of every row, in row order, NULL unless the input is hashed (header radix_bits) */
+	uint32_t *hashes;
+	/* the terminator asked for a runtime filter, which must be answered before reading on */
+	bool filter_requested;
+	FilterRequest filter;
+};
+
+/* make the bitmaps of areas hold capacity rows (a multiple of 64), new rows are not NULL */
+static inline 
+void 
+growValidBitmaps(InputAreas *areas, size_t *capacity, size_t rows)
+{
+	size_t newcap = (*capacity > 0) ? *capacity : 4096;
+	uint64_t *valid;
+	
+	while (newcap < rows)
+		newcap *= 2;
+	if (newcap == *capacity)
+		return;
+	valid = (uint64_t *)malloc(areas->natts * (newcap / 64) * sizeof(uint64_t));
+	memset(valid, 0xFF, areas->natts * (newcap / 64) * sizeof(uint64_t));
+	for (int i = 0; areas->valid != NULL && i < areas->natts; i++)
+		memcpy(valid + i * (newcap / 64), areas->valid + i * (*capacity / 64), (*capacity / 64) * sizeof(uint64_t));
+	free(areas->valid);
+	areas->valid = valid;
+	*capacity = newcap;
+}
+
+/*
+ * Receive one input (InputHeader, chunks, terminator) into a malloc()ed buffer.
+ * Returns the buffer and stores total size of tuples into *size.
+ * Variable length areas and null bitmaps of the chunks are merged into
+ * malloc()ed arrays of *areas.
+ */
+static inline 
+void *
+receiveInputAreas(const int sock, InputHeader *header, size_t *size, InputAreas *areas)
+{
+	ChunkHeader chunk;
+	char *buf;
+	size_t capacity;
+	size_t var_capacity = 4096;
+	size_t valid_capacity = 0;
+	size_t hash_capacity = 0;
+	
+	/* receive planner estimates */
+	receiveStrong(sock, header, sizeof(*header));
+	capacity = (header->est_bytes > 0) ? header->est_bytes : 4096;
+	buf = (char *)malloc(capacity);
+	*size = 0;
+	areas->var = (char *)malloc(var_capacity);
+	areas->var_size = 0;
+	areas->nrows = 0;
+	areas->natts = 0;
+	areas->valid = NULL;
+	areas->hashes = NULL;
+	areas->filter_requested = false;
+	
+	for (;;) {
+		/* receive size of chunk, 0 terminates the input */
+		if (receiveStrong(sock, &chunk, sizeof(chunk)) <= 0)
+			break;
+		if (chunk.size == 0) {
+			if (chunk.flags & CHUNK_FILTER_REQUEST) {
+				receiveStrong(sock, &areas->filter, sizeof(areas->filter));
+				areas->filter_requested = true;
+			}
+			break;
+		}
+		while (*size + chunk.size > capacity)
+			capacity *= 2;
+		buf = (char *)realloc(buf, capacity);
+		/* receive tuples */
+		receiveStrong(sock, buf + *size, chunk.size);
+		*size += chunk.size;
+		
+		/* areas of all chunks form one array */
+		while (areas->var_size + chunk.var_size > var_capacity)
+			var_capacity *= 2;
+		areas->var = (char *)realloc(areas->var, var_capacity);
+		if (chunk.var_size > 0)
+			receiveStrong(sock, areas->var + areas->var_size, chunk.var_size);
+		areas->var_size += chunk.var_size;
+		
+		/* copy the NULLs of the chunk into the bitmaps of the input */
+		if (chunk.null_size > 0) {
+			size_t words = (chunk.nrows + 63) / 64;
+			uint64_t *bits = (uint64_t *)malloc(chunk.null_size);
+			
+			receiveStrong(sock, bits, chunk.null_size);
+			areas->natts = chunk.null_size / (words * sizeof(uint64_t));
+			growValidBitmaps(areas, &valid_capacity, areas->nrows + chunk.nrows);
+			for (int i = 0; i < areas->natts; i++) {
+				for (size_t r = 0; r < chunk.nrows; r++) {
+					size_t row = areas->nrows + r;
+					
+					if (!(bits[i * words + r / 64] & (1ULL << (r % 64))))
+						areas->valid[i * (valid_capacity / 64) + row / 64] &= ~(1ULL << (row % 64));
+				}
+			}
+			free(bits);
+		}
+		else if (areas->valid != NULL)
+			growValidBitmaps(areas, &valid_capacity, areas->nrows + chunk.nrows);
+		
+		/* rows of a hashed chunk are grouped by partition; the partition counts are not kept */
+		if (chunk.hash_size > 0) {
+			size_t counts = chunk.hash_size / sizeof(uint32_t) - chunk.nrows;
+			uint32_t *skip = (uint32_t *)malloc(counts * sizeof(uint32_t));
+			
+			while (areas->nrows + chunk.nrows > hash_capacity)
+				hash_capacity = (hash_capacity > 0) ? hash_capacity * 2 : 4096;
+			areas->hashes = (uint32_t *)realloc(areas->hashes, hash_capacity * sizeof(uint32_t));
+			receiveStrong(sock, skip, counts * sizeof(uint32_t));
+			receiveStrong(sock, areas->hashes + areas->nrows, chunk.nrows * sizeof(uint32_t));
+			free(skip);
+		}
+		areas->nrows += chunk.nrows;
+	}
+	
+	/* pack the bitmaps to (nrows + 63) / 64 words per column */
+	if (areas->valid != NULL) {
+		size_t words = (areas->nrows + 63) / 64;
+		
+		for (int i = 0; i < areas->natts; i++) {
+			memmove(areas->valid + i * words, areas->valid + i * (valid_capacity / 64), words * sizeof(uint64_t));
+			if (areas->nrows % 64 != 0)
+				areas->valid[i * words + words - 1] &= (1ULL << (areas->nrows % 64)) - 1;
+		}
+	}
+	return buf;
+}
+
+static int
+compareKeys(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+	
+	return (x > y) - (x < y);
+}
+
+/*
+ * Answer the filter request of an input, if any, with the keys of its rows.
+ * rows are nrows rows of row_size bytes, and the key is at key_offset of each
+ * row; the request tells its column (for NULLs), its width is key_width.
+ * Returns false if the connection is gone.
+ */
+static inline 
+bool 
+answerFilterRequest(const int sock, const InputAreas *areas, const void *rows, size_t row_size, size_t key_offset, size_t key_width)
+{
+	FilterReply reply;
+	int64_t *keys;
+	size_t nkeys = 0, words = (areas->nrows + 63) / 64;
+	
+	if (!areas->filter_requested)
+		return true;
+	keys = (int64_t *)malloc((areas->nrows + 1) * sizeof(int64_t));
+	for (size_t r = 0; r < areas->nrows; r++) {
+		const char *p = (const char *)rows + r * row_size + key_offset;
+		
+		if (areas->valid != NULL && areas->filter.column < (uint32_t)areas->natts &&
+		    !(areas->valid[areas->filter.column * words + r / 64] & (1ULL << (r % 64))))
+			continue;
+		if (key_width == 2)
+			keys[nkeys++] = *(const int16_t *)p;
+		else if (key_width == 4)
+			keys[nkeys++] = *(const int32_t *)p;
+		else
+			keys[nkeys++] = *(const int64_t *)p;
+	}
+	
+	memset(&reply, 0, sizeof(reply));
+	if (nkeys == 0)
+		reply.flags = FILTER_EMPTY;
+	else {
+		size_t n = 1;
+		
+		/* distinct keys, listed if there are few enough */
+		qsort(keys, nkeys, sizeof(*keys), compareKeys);
+		for (size_t i = 1; i < nkeys; i++)
+			if (keys[i] != keys[n - 1])
+				keys[n++] = keys[i];
+		reply.flags = FILTER_RANGE;
+		reply.min = keys[0];
+		reply.max = keys[n - 1];
+		if (n <= areas->filter.max_values) {
+			reply.flags |= FILTER_VALUES;
+			reply.nvalues = n;
+		}
+	}
+	if (sendStrong(sock, &reply, sizeof(reply)) <= 0 ||
+	    (reply.nvalues > 0 && sendStrong(sock, keys, reply.nvalues * sizeof(*keys)) <= 0)) {
+		free(keys);
+		return false;
+	}
+	free(keys);
+	return true;
+}
+
+/* what a RunHeader brings; zero it before the first run of a connection */
+struct RunInfo {
+	RunHeader header;
+	/* template text of the connection, kept from the run that sent it */
+	char *text;
+	size_t text_size;
+	/* header.norder keys the results must be sorted by, major key first */
+	OrderKey *order;
+	/* join graph of header.graph_size bytes, NULL if none; see nextJoinNode() */
+	JoinGraphHeader *graph;
+	/* header.nparams parameters and their values in text form, NULL if NULL or unknown */
+	ParamValue *params;
+	char **values;
+};
+
+/* receive the RunHeader that starts a run with plan templates or sorted results, false if the connection is gone */
+static inline 
+bool 
+receiveRunHeader(const int sock, RunInfo *run)
+{
+	for (uint32_t i = 0; run->values != NULL && i < run->header.nparams; i++)
+		free(run->values[i]);
+	free(run->values);
+	free(run->params);
+	free(run->order);
+	free(run->graph);
+	run->values = NULL;
+	run->params = NULL;
+	run->order = NULL;
+	run->graph = NULL;
+	if (receiveStrong(sock, &run->header, sizeof(run->header)) <= 0)
+		return false;
+	/* the template comes once per connection */
+	if (run->header.template_size > 0) {
+		free(run->text);
+		run->text_size = run->header.template_size;
+		run->text = (char *)malloc(run->text_size + 1);
+		if (receiveStrong(sock, run->text, run->text_size) <= 0)
+			return false;
+		run->text[run->text_size] = '\0';
+	}
+	run->order = (OrderKey *)calloc(run->header.norder + 1, sizeof(OrderKey));
+	if (run->header.norder > 0 && receiveStrong(sock, run->order, sizeof(OrderKey) * run->header.norder) <= 0)
+		return false;
+	if (run->header.graph_size > 0) {
+		run->graph = (JoinGraphHeader *)malloc(run->header.graph_size);
+		if (receiveStrong(sock, run->graph, run->header.graph_size) <= 0)
+			return false;
+	}
+	run->params = (ParamValue *)calloc(run->header.nparams + 1, sizeof(ParamValue));
+	run->values = (char **)calloc(run->header.nparams + 1, sizeof(char *));
+	for (uint32_t i = 0; i < run->header.nparams; i++) {
+		if (receiveStrong(sock, &run->params[i], sizeof(ParamValue)) <= 0)
+			return false;
+		if (run->params[i].flags & (PARAM_VALUE_NULL | PARAM_VALUE_UNKNOWN))
+			continue;
+		run->values[i] = (char *)malloc(run->params[i].size + 1);
+		if (run->params[i].size > 0 && receiveStrong(sock, run->values[i], run->params[i].size) <= 0)
+			return false;
+		run->values[i][run->params[i].size] = '\0';
+	}
+	return true;
+}
+
+/* JoinInputs of a join graph */
+static inline 
+JoinInput * 
+joinGraphInputs(JoinGraphHeader *graph)
+{
+	return (JoinInput *)(graph + 1);
+}
+
+/*
+ * walk the JoinNodes of a join graph: pass NULL for the first, the node
+ * returned last for the next; its clauses follow it
+ */
+static inline 
+JoinNode * 
+nextJoinNode(JoinGraphHeader *graph, JoinNode *node)
+{
+	if (node == NULL)
+		return (JoinNode *)(joinGraphInputs(graph) + graph->ninputs);
+	return (JoinNode *)((JoinClause *)(node + 1) + node->nclauses);
+}
+
+/* receive an input whose layout is unknown here; a filter request is answered with no filter */
+static inline 
+void *
+receiveInput(const int sock, InputHeader *header, size_t *size)
+{
+	InputAreas areas;
+	void *buf = receiveInputAreas(sock, header, size, &areas);
+	
+	if (areas.filter_requested) {
+		FilterReply reply;
+		
+		memset(&reply, 0, sizeof(reply));
+		sendStrong(sock, &reply, sizeof(reply));
+	}
+	free(areas.var);
+	free(areas.valid);
+	free(areas.hashes);
+	return buf;
+}
+
+#endif//INPUTREADER_HEAD_
@@ -1,5 +1,6 @@
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <strings.h>
 #include <sys/socket.h>
 #include <unistd.h>
@@ -7,71 +8,196 @@
 #include <netdb.h>
 
 #include "socket_lapper.h"
+#include "ExternalProtocol.hpp"
+#include "input_reader.h"
+#include "result_writer.h"
+
+/*
+ * Sample engine running one join of two inputs on one connection.
+ * NULL columns are taken from the null bitmaps of the inputs: a NULL never
+ * matches, and is sent back as NULL.
+ *
+ * usage: join_sample [-p port] [-t]
+ * -t joins rows of "key text, val int" on equal keys, otherwise rows of
+ * "key int, dval float8" as below.
+ */
 
 /* this can be modified */
 #define PG_PORT (59999)
 
 /****** modify this... ******/
 struct Tuple {
-	int key; 
+	int key;
 	double dval;
 };
 /****** modify this... ******/
-struct Result {
-	int key1;
-	double dval1;
-	int key2;
-	double dval2;
+struct TextTuple {
+	VarlenaRef key;
+	int val;
+};
+
+/* an input and what came with its rows */
+struct Input {
+	InputHeader header;
+	InputAreas areas;
+	char *rows;
+	size_t nrows;
 };
 
+static void
+receiveRows(const int sock, Input *input, size_t row_size)
+{
+	size_t size;
+
+	input->rows = (char *)receiveInputAreas(sock, &input->header, &size, &input->areas);
+	input->nrows = size / row_size;
+	/* no runtime filter here */
+	if (input->areas.filter_requested) {
+		FilterReply reply;
+
+		memset(&reply, 0, sizeof(reply));
+		sendStrong(sock, &reply, sizeof(reply));
+	}
+}
+
+/* column col of row is not NULL */
+static bool
+isValid(const Input *input, int col, size_t row)
+{
+	const InputAreas *areas = &input->areas;
+	size_t words = (areas->nrows + 63) / 64;
+
+	return areas->valid == NULL || col >= areas->natts ||
+		(areas->valid[col * words + row / 64] & (1ULL << (row % 64)));
+}
+
+/* SELECT * FROM t1, t2 WHERE (t1.dval - t2.dval)^2 < 10, and its semi and anti joins */
+static int
+joinFloat(Input *inputs, ResultWriter *writer)
+{
+	Tuple *tuples[2] = { (Tuple *)inputs[0].rows, (Tuple *)inputs[1].rows };
+	ResultBatch batch;
+
+	/******** semi / anti join ********/
+	/* SELECT * FROM t1 WHERE [NOT] EXISTS (SELECT 1 FROM t2 WHERE (t1.dval - t2.dval)^2 < 10); */
+	if (inputs[0].header.join_type == JOIN_TYPE_SEMI || inputs[0].header.join_type == JOIN_TYPE_ANTI) {
+		/* rows of the outer side only, so the result rows are input rows */
+		int o = (inputs[0].header.flags & INPUT_OUTER) ? 0 : 1;
+
+		initResultBatch(&batch, 2);
+		for (size_t i = 0; i < inputs[o].nrows; i++) {
+			bool matched = false;
+
+			for (size_t j = 0; j < inputs[1 - o].nrows && !matched && isValid(&inputs[o], 1, i); j++) {
+				double diff = tuples[o][i].dval - tuples[1 - o][j].dval;
+
+				matched = isValid(&inputs[1 - o], 1, j) && (diff * diff < 10);
+			}
+			if (matched != (inputs[0].header.join_type == JOIN_TYPE_SEMI))
+				continue;
+			appendColumn(&batch, &tuples[o][i].key, sizeof(int), isValid(&inputs[o], 0, i));
+			appendColumn(&batch, &tuples[o][i].dval, sizeof(double), isValid(&inputs[o], 1, i));
+			endRow(writer, &batch);
+		}
+		flushResultBatch(writer, &batch);
+		return 0;
+	}
+	/* outer joins would need NULL-extended rows, not done here */
+	if (inputs[0].header.join_type != JOIN_TYPE_INNER) {
+		fprintf(stderr, "join_sample: join type %u is not supported, set external_join.join_types = 'inner, semi, anti'\n",
+			inputs[0].header.join_type);
+		return 1;
+	}
+	/******** nest loop join ********/
+	initResultBatch(&batch, 4);
+	for (size_t i = 0; i < inputs[0].nrows; i++) {
+		if (!isValid(&inputs[0], 1, i))
+			continue;
+		for (size_t j = 0; j < inputs[1].nrows; j++) {
+			double diff = tuples[0][i].dval - tuples[1][j].dval;
+
+			if (!isValid(&inputs[1], 1, j) || diff * diff >= 10)
+				continue;
+			appendColumn(&batch, &tuples[0][i].key, sizeof(int), isValid(&inputs[0], 0, i));
+			appendColumn(&batch, &tuples[0][i].dval, sizeof(double), true);
+			appendColumn(&batch, &tuples[1][j].key, sizeof(int), isValid(&inputs[1], 0, j));
+			appendColumn(&batch, &tuples[1][j].dval, sizeof(double), true);
+			endRow(writer, &batch);
+		}
+	}
+	flushResultBatch(writer, &batch);
+	return 0;
+}
+
+/* SELECT * FROM s1, s2 WHERE s1.key = s2.key */
+static int
+joinText(Input *inputs, ResultWriter *writer)
+{
+	TextTuple *tuples[2] = { (TextTuple *)inputs[0].rows, (TextTuple *)inputs[1].rows };
+	ResultBatch batch;
+
+	if (inputs[0].header.join_type != JOIN_TYPE_INNER) {
+		fprintf(stderr, "join_sample: join type %u is not supported with text keys\n", inputs[0].header.join_type);
+		return 1;
+	}
+	initResultBatch(&batch, 4);
+	for (size_t i = 0; i < inputs[0].nrows; i++) {
+		const VarlenaRef *k1 = &tuples[0][i].key;
+
+		if (!isValid(&inputs[0], 0, i))
+			continue;
+		for (size_t j = 0; j < inputs[1].nrows; j++) {
+			const VarlenaRef *k2 = &tuples[1][j].key;
 
-int main(void)
+			if (!isValid(&inputs[1], 0, j) || k1->length != k2->length ||
+			    memcmp(inputs[0].areas.var + k1->offset, inputs[1].areas.var + k2->offset, k1->length) != 0)
+				continue;
+			appendVarlena(&batch, inputs[0].areas.var + k1->offset, k1->length, true);
+			appendColumn(&batch, &tuples[0][i].val, sizeof(int), isValid(&inputs[0], 1, i));
+			appendVarlena(&batch, inputs[1].areas.var + k2->offset, k2->length, true);
+			appendColumn(&batch, &tuples[1][j].val, sizeof(int), isValid(&inputs[1], 1, j));
+			endRow(writer, &batch);
+		}
+	}
+	flushResultBatch(writer, &batch);
+	return 0;
+}
+
+int main(int argc, char **argv)
 {
 	int lsock, csock;
-		
-	size_t size[2];
-	size_t ntup[2];
-	Tuple *tuples[2];
-	
+	int port = PG_PORT;
+	bool text = false;
+	Input inputs[2];
+	ResultWriter writer;
+	int opt, rc;
+
+	while ((opt = getopt(argc, argv, "p:t")) != -1) {
+		switch (opt) {
+		case 'p': port = atoi(optarg); break;
+		case 't': text = true; break;
+		default:
+			fprintf(stderr, "usage: %s [-p port] [-t]\n", argv[0]);
+			return 1;
+		}
+	}
+
 	/* listen on specified port */
-	lsock = listenSock(PG_PORT);
+	if ((lsock = listenSock(port)) < 0)
+		return 1;
 	/* accept connection from PostgreSQL */
 	csock = acceptSock(lsock);
-	
+
 	for (int i = 0; i < 2; i++) {
-		/* receive total size of tuples */
-		receiveStrong(csock, &size[i], sizeof(size[0]));
-		ntup[i] = size[i] / sizeof(*tuples[0]);
-		/* alloc buffer to contain tuples */
-		tuples[i] = (Tuple *)malloc(size[i]);
-		/* receive tuples */
-		receiveStrong(csock, tuples[i], size[i]);
+		/* receive all chunks of the input */
+		receiveRows(csock, &inputs[i], text ? sizeof(TextTuple) : sizeof(Tuple));
 	}
-	
-	
-	/******** nest loop join ********/
-	/* SELECT * FROM t1, t2 WHERE (t1.dval - t2.dval)^2 < 10; */
-	for (int i = 0; i < ntup[0]; i++) {
-		for (int j = 0; j < ntup[1]; j++) {
-			double diff = tuples[0][i].dval - tuples[1][j].dval;
-			
-			if (diff * diff < 10) {
-				Result result;
-				
-				result.key1 = tuples[0][i].key;
-				result.dval1 = tuples[0][i].dval;
-				result.key2 = tuples[1][j].key;
-				result.dval2 = tuples[1][j].dval;
-				
-				sendStrong(csock, &result, sizeof(result));
-			}
-		}
-	}
-	/*******************************/
-	
+
+	initResultWriter(&writer, csock);
+	rc = text ? joinText(inputs, &writer) : joinFloat(inputs, &writer);
+
 	close(lsock);
 	close(csock);
-	
-	return 0;
-}
 
+	return rc;
+}
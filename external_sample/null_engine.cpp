@@ -0,0 +1,156 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <strings.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#include "socket_lapper.h"
+#include "ExternalProtocol.hpp"
+#include "input_reader.h"
+#include "result_writer.h"
+
+/*
+ * Engine for benchmarks: discards every input at line rate and sends back
+ * a given number of zero filled result rows, so that only PostgreSQL's
+ * scan, ship and decode stages are measured.
+ * Every connection is served by its own process, so pgbench may run
+ * several clients. A kept session is served run after run until PostgreSQL
+ * closes it.
+ *
+ * usage: null_engine [-p port] [-i inputs] [-r result rows] [-w result row width] [-t]
+ * -t reads the RunHeader of external_join.plan_templates, sorted_results or join_graph ahead
+ * of every run; its rows are all alike, so they are sorted in any order.
+ * The default result row (32 bytes) fits "int, float8, int, float8".
+ */
+
+#define PG_PORT (59999)
+#define BLOCK_SIZE (1024 * 1024)
+
+static double
+now(void)
+{
+	struct timeval tv;
+	
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* serve one run of the session, returns true if the session is kept for another */
+static bool
+serve(int csock, int ninputs, long result_rows, long width, RunInfo *run)
+{
+	static char block[BLOCK_SIZE];
+	unsigned long long bytes = 0, rows = 0, remain;
+	double begin = now(), received;
+	ResultWriter writer;
+	uint32_t flags = 0;
+	
+	if (run != NULL) {
+		if (!receiveRunHeader(csock, run))
+			return false;
+		fprintf(stderr, "null_engine: template %016llx, %u parameters%s, %u joins\n",
+			(unsigned long long)run->header.template_id, run->header.nparams,
+			run->header.template_size > 0 ? " (new)" : "", run->graph != NULL ? run->graph->njoins : 0);
+	}
+	for (int i = 0; i < ninputs; i++) {
+		InputHeader header;
+		ChunkHeader chunk;
+		
+		if (receiveStrong(csock, &header, sizeof(header)) <= 0)
+			return false;
+		/* nothing is kept, a reused input only has its terminator anyway */
+		flags = header.flags;
+		/* discard chunks until the terminator */
+		while (receiveStrong(csock, &chunk, sizeof(chunk)) > 0 && chunk.size > 0) {
+			for (remain = chunk.size + chunk.var_size + chunk.null_size + chunk.hash_size; remain > 0; ) {
+				long n = (remain < BLOCK_SIZE) ? remain : BLOCK_SIZE;
+				
+				if (receiveStrong(csock, block, n) <= 0)
+					return false;
+				remain -= n;
+			}
+			bytes += chunk.size + chunk.var_size + chunk.null_size + chunk.hash_size;
+			rows += chunk.nrows;
+		}
+		/* no keys are kept, so a runtime filter request gets no filter */
+		if (chunk.size == 0 && (chunk.flags & CHUNK_FILTER_REQUEST)) {
+			FilterRequest req;
+			FilterReply reply;
+			
+			if (receiveStrong(csock, &req, sizeof(req)) <= 0)
+				return false;
+			memset(&reply, 0, sizeof(reply));
+			sendStrong(csock, &reply, sizeof(reply));
+		}
+	}
+	received = now();
+	
+	/* send back result rows in batches of a block */
+	memset(block, 0, sizeof(block));
+	initResultWriterForRun(&writer, csock, flags);
+	for (remain = result_rows; remain > 0; ) {
+		long n = (remain < BLOCK_SIZE / width) ? remain : BLOCK_SIZE / width;
+		
+		if (!sendResultBatch(&writer, block, n, width))
+			break;
+		remain -= n;
+	}
+	
+	fprintf(stderr, "null_engine: received %llu rows, %llu bytes in %.3f s (%.1f MB/s), sent %ld rows in %.3f s\n",
+		rows, bytes, received - begin, bytes / (received - begin) / 1000000.0,
+		result_rows, now() - received);
+	return endResults(&writer) && writer.segmented;
+}
+
+int main(int argc, char **argv)
+{
+	int lsock, csock;
+	int port = PG_PORT;
+	int ninputs = 2;
+	long result_rows = 0;
+	long width = 32;
+	bool templates = false;
+	int opt;
+	
+	while ((opt = getopt(argc, argv, "p:i:r:w:t")) != -1) {
+		switch (opt) {
+		case 'p': port = atoi(optarg); break;
+		case 'i': ninputs = atoi(optarg); break;
+		case 'r': result_rows = atol(optarg); break;
+		case 'w': width = atol(optarg); break;
+		case 't': templates = true; break;
+		default:
+			fprintf(stderr, "usage: %s [-p port] [-i inputs] [-r result rows] [-w result row width] [-t]\n", argv[0]);
+			return 1;
+		}
+	}
+	
+	/* children are not waited for */
+	signal(SIGCHLD, SIG_IGN);
+	/* listen on specified port */
+	if ((lsock = listenSock(port)) < 0)
+		return 1;
+	for (;;) {
+		/* accept connection from PostgreSQL */
+		if ((csock = acceptSock(lsock)) < 0)
+			continue;
+		if (fork() == 0) {
+			RunInfo run;
+			
+			close(lsock);
+			memset(&run, 0, sizeof(run));
+			while (serve(csock, ninputs, result_rows, width, templates ? &run : NULL))
+				;
+			close(csock);
+			return 0;
+		}
+		close(csock);
+	}
+	
+	return 0;
+}
@@ -0,0 +1,225 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#include "socket_lapper.h"
+#include "ExternalProtocol.hpp"
+
+/*
+ * Replays input streams captured with external_join.capture against an
+ * engine, without PostgreSQL, so an engine can be benchmarked and profiled
+ * on the exact bytes a query ships to it.
+ * Every file is sent on its own connection, all at once as the sessions of
+ * a node run, at up to a given rate per connection, and the results are
+ * drained while sending. The results are counted in bytes only, since their
+ * rows depend on the query; the replies to runtime filter requests are
+ * drained with them. Replaying a kept session sends all of its runs, then
+ * closes the connection, as PostgreSQL does.
+ *
+ * usage: replay [-h host] [-p port] [-r MB/s per connection, 0 unlimited] [-n times] file.cap...
+ */
+
+#define PG_PORT (59999)
+#define BLOCK_SIZE (1024 * 1024)
+
+struct Replay {
+	const char *path;
+	char *host;
+	int port;
+	double rate;
+	int sock;
+	CaptureHeader header;
+	/* filled by the threads */
+	unsigned long long sent;
+	unsigned long long received;
+	double begin;
+	double sent_at;
+	double first_result;
+	double done;
+	bool failed;
+};
+
+static double
+now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* send the stream following the CaptureHeader, paced to rate */
+static void *
+sendStream(void *arg)
+{
+	Replay *r = static_cast<Replay *>(arg);
+	char *block = static_cast<char *>(malloc(BLOCK_SIZE));
+	int fd;
+	long n;
+
+	if ((fd = open(r->path, O_RDONLY)) < 0 ||
+	    lseek(fd, sizeof(CaptureHeader), SEEK_SET) < 0) {
+		fprintf(stderr, "replay: could not read %s: %s\n", r->path, strerror(errno));
+		r->failed = true;
+		r->sent_at = now();
+		shutdown(r->sock, SHUT_WR);
+		free(block);
+		return NULL;
+	}
+	while ((n = read(fd, block, BLOCK_SIZE)) > 0) {
+		if (r->rate > 0) {
+			double due = r->begin + r->sent / (r->rate * 1000000.0);
+			double wait = due - now();
+
+			if (wait > 0)
+				usleep(static_cast<useconds_t>(wait * 1000000));
+		}
+		if (sendStrong(r->sock, block, n) != n) {
+			fprintf(stderr, "replay: engine closed %s after %llu bytes\n", r->path, r->sent);
+			r->failed = true;
+			break;
+		}
+		r->sent += n;
+	}
+	close(fd);
+	free(block);
+	r->sent_at = now();
+	/* the engine sees the end of a kept session */
+	shutdown(r->sock, SHUT_WR);
+	return NULL;
+}
+
+/* drain what the engine sends back until it closes the connection */
+static void *
+drainResults(void *arg)
+{
+	Replay *r = static_cast<Replay *>(arg);
+	char *block = static_cast<char *>(malloc(BLOCK_SIZE));
+	long n;
+
+	while ((n = recv(r->sock, block, BLOCK_SIZE, 0)) > 0) {
+		if (r->received == 0)
+			r->first_result = now();
+		r->received += n;
+	}
+	free(block);
+	r->done = now();
+	return NULL;
+}
+
+static bool
+readHeader(const char *path, CaptureHeader *header)
+{
+	FILE *fp = fopen(path, "rb");
+	bool ok;
+
+	if (fp == NULL) {
+		fprintf(stderr, "replay: could not open %s: %s\n", path, strerror(errno));
+		return false;
+	}
+	ok = fread(header, sizeof(*header), 1, fp) == 1 && header->magic == CAPTURE_MAGIC;
+	fclose(fp);
+	if (!ok)
+		fprintf(stderr, "replay: %s is not an external join capture\n", path);
+	return ok;
+}
+
+/* replay all files at once, returns false if one failed */
+static bool
+replayAll(Replay *replays, int nreplays)
+{
+	pthread_t senders[nreplays], receivers[nreplays];
+	unsigned long long sent = 0, received = 0;
+	double begin = now(), end;
+	bool ok = true;
+
+	for (int i = 0; i < nreplays; i++) {
+		Replay *r = &replays[i];
+
+		r->sent = r->received = 0;
+		r->first_result = 0;
+		r->failed = false;
+		if ((r->sock = connectSock(r->host, r->port)) < 0)
+			return false;
+		r->begin = now();
+		pthread_create(&receivers[i], NULL, drainResults, r);
+		pthread_create(&senders[i], NULL, sendStream, r);
+	}
+	for (int i = 0; i < nreplays; i++) {
+		Replay *r = &replays[i];
+		double sending, total;
+
+		pthread_join(senders[i], NULL);
+		pthread_join(receivers[i], NULL);
+		close(r->sock);
+		sending = r->sent_at - r->begin;
+		total = r->done - r->begin;
+		fprintf(stderr, "replay: %s (session %u of backend %d to %s): sent %llu bytes in %.3f s (%.1f MB/s), "
+			"received %llu bytes in %.3f s (%.1f MB/s, first after %.3f s)\n",
+			r->path, r->header.session, r->header.pid, r->header.endpoint,
+			r->sent, sending, r->sent / sending / 1000000.0,
+			r->received, total, r->received / total / 1000000.0,
+			r->received > 0 ? r->first_result - r->begin : 0.0);
+		sent += r->sent;
+		received += r->received;
+		ok = ok && !r->failed;
+	}
+	end = now();
+	fprintf(stderr, "replay: total sent %llu bytes, received %llu bytes in %.3f s (%.1f MB/s in, %.1f MB/s out)\n",
+		sent, received, end - begin, sent / (end - begin) / 1000000.0, received / (end - begin) / 1000000.0);
+	return ok;
+}
+
+int main(int argc, char **argv)
+{
+	char *host = const_cast<char *>("127.0.0.1");
+	int port = PG_PORT;
+	double rate = 0;
+	int times = 1;
+	int nreplays;
+	Replay *replays;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "h:p:r:n:")) != -1) {
+		switch (opt) {
+		case 'h': host = optarg; break;
+		case 'p': port = atoi(optarg); break;
+		case 'r': rate = atof(optarg); break;
+		case 'n': times = atoi(optarg); break;
+		default:
+			fprintf(stderr, "usage: %s [-h host] [-p port] [-r MB/s per connection] [-n times] file.cap...\n", argv[0]);
+			return 1;
+		}
+	}
+	if (optind >= argc) {
+		fprintf(stderr, "usage: %s [-h host] [-p port] [-r MB/s per connection] [-n times] file.cap...\n", argv[0]);
+		return 1;
+	}
+
+	nreplays = argc - optind;
+	replays = static_cast<Replay *>(calloc(nreplays, sizeof(Replay)));
+	for (int i = 0; i < nreplays; i++) {
+		replays[i].path = argv[optind + i];
+		replays[i].host = host;
+		replays[i].port = port;
+		replays[i].rate = rate;
+		if (!readHeader(replays[i].path, &replays[i].header))
+			return 1;
+	}
+	for (int i = 0; i < times; i++) {
+		if (!replayAll(replays, nreplays))
+			return 1;
+	}
+	free(replays);
+
+	return 0;
+}
@@ -0,0 +1,204 @@
+#ifndef RESULTWRITER_HEAD_
+#define RESULTWRITER_HEAD_
+
+/*
+ * Send result rows in batches (see ExternalProtocol.hpp).
+ * Batch headers are aligned to 8 bytes from the start of the stream, so the
+ * writer keeps track of the bytes sent. For a run with INPUT_KEEP_SESSION
+ * every batch is sent as a segment, and endResults() terminates the run.
+ */
+struct ResultWriter {
+	int sock;
+	unsigned long long offset;
+	bool segmented;
+};
+
+static inline 
+void 
+initResultWriter(ResultWriter *w, const int sock)
+{
+	w->sock = sock;
+	w->offset = 0;
+	w->segmented = false;
+}
+
+/* results of a run whose InputHeaders have flags */
+static inline 
+void 
+initResultWriterForRun(ResultWriter *w, const int sock, uint32_t flags)
+{
+	initResultWriter(w, sock);
+	w->segmented = (flags & INPUT_KEEP_SESSION) != 0;
+}
+
+/*
+ * send nrows rows of size bytes in total; valid holds natts validity bitmaps
+ * of (nrows + 63) / 64 words each, or is NULL if no row has a NULL.
+ * Returns false if the connection is gone.
+ */
+static inline 
+bool 
+sendResultBatchWithNulls(ResultWriter *w, const void *rows, uint32_t nrows, size_t size, const uint64_t *valid, int natts)
+{
+	static const char zeros[8] = {0};
+	ResultBatchHeader batch;
+	size_t pad = (8 - w->offset % 8) % 8;
+	size_t valid_size = (valid != NULL) ? natts * ((nrows + 63) / 64) * sizeof(uint64_t) : 0;
+	
+	batch.nrows = nrows;
+	batch.flags = (valid != NULL) ? RESULT_HAS_NULLS : 0;
+	if (w->segmented) {
+		uint64_t len = pad + sizeof(batch) + valid_size + size;
+		
+		if (sendStrong(w->sock, &len, sizeof(len)) <= 0)
+			return false;
+	}
+	if (pad > 0 && sendStrong(w->sock, (void *)zeros, pad) <= 0)
+		return false;
+	if (sendStrong(w->sock, &batch, sizeof(batch)) <= 0)
+		return false;
+	if (valid_size > 0 && sendStrong(w->sock, (void *)valid, valid_size) <= 0)
+		return false;
+	if (size > 0 && sendStrong(w->sock, (void *)rows, size) <= 0)
+		return false;
+	w->offset += pad + sizeof(batch) + valid_size + size;
+	return true;
+}
+
+/* send nrows rows of row_size bytes without NULL, returns false if the connection is gone */
+static inline 
+bool 
+sendResultBatch(ResultWriter *w, const void *rows, uint32_t nrows, size_t row_size)
+{
+	return sendResultBatchWithNulls(w, rows, nrows, nrows * row_size, NULL, 0);
+}
+
+/*
+ * Rows of a batch built column by column, for rows with NULLs or varlena
+ * columns. Columns are appended with appendColumn() / appendVarlena() and
+ * endRow() finishes a row; a column appended with valid false is NULL.
+ * Batch rows start 8 byte aligned in the stream, so aligning the columns
+ * from the start of the rows aligns them in the stream.
+ */
+struct ResultBatch {
+	static const uint32_t MAX_ROWS = 4096;
+	static const int MAX_COLUMNS = 16;
+	
+	char *rows;
+	size_t size;
+	size_t capacity;
+	uint32_t nrows;
+	int natts;
+	int column;
+	bool has_nulls;
+	uint64_t valid[MAX_COLUMNS][MAX_ROWS / 64];
+};
+
+static inline 
+void 
+resetResultBatch(ResultBatch *b)
+{
+	b->size = 0;
+	b->nrows = 0;
+	b->column = 0;
+	b->has_nulls = false;
+	memset(b->valid, 0xFF, sizeof(b->valid));
+}
+
+static inline 
+void 
+initResultBatch(ResultBatch *b, int natts)
+{
+	b->capacity = 1024 * 1024;
+	b->rows = (char *)malloc(b->capacity);
+	b->natts = natts;
+	resetResultBatch(b);
+}
+
+/* append size bytes, aligned to align */
+static inline 
+void 
+appendBytes(ResultBatch *b, const void *data, size_t size, size_t align)
+{
+	size_t off = (b->size + align - 1) / align * align;
+	
+	while (off + size > b->capacity) {
+		b->capacity *= 2;
+		b->rows = (char *)realloc(b->rows, b->capacity);
+	}
+	memset(b->rows + b->size, 0, off - b->size);
+	if (size > 0)
+		memcpy(b->rows + off, data, size);
+	b->size = off + size;
+}
+
+/* append a column of size bytes, NULL if not valid */
+static inline 
+void 
+appendColumn(ResultBatch *b, const void *value, size_t size, bool valid)
+{
+	if (!valid) {
+		b->valid[b->column][b->nrows / 64] &= ~(1ULL << (b->nrows % 64));
+		b->has_nulls = true;
+	}
+	appendBytes(b, value, size, size);
+	b->column++;
+}
+
+/* append a varlena column of length bytes, NULL if not valid */
+static inline 
+void 
+appendVarlena(ResultBatch *b, const char *value, uint32_t length, bool valid)
+{
+	if (!valid)
+		length = 0;
+	appendColumn(b, &length, sizeof(length), valid);
+	appendBytes(b, value, length, 1);
+}
+
+/* send the rows of the batch and start an empty one, returns false if the connection is gone */
+static inline 
+bool 
+flushResultBatch(ResultWriter *w, ResultBatch *b)
+{
+	size_t words = (b->nrows + 63) / 64;
+	uint64_t *valid = NULL;
+	bool ok;
+	
+	if (b->nrows == 0)
+		return true;
+	if (b->has_nulls) {
+		valid = (uint64_t *)malloc(b->natts * words * sizeof(uint64_t));
+		for (int i = 0; i < b->natts; i++)
+			memcpy(valid + i * words, b->valid[i], words * sizeof(uint64_t));
+	}
+	ok = sendResultBatchWithNulls(w, b->rows, b->nrows, b->size, valid, b->natts);
+	free(valid);
+	resetResultBatch(b);
+	return ok;
+}
+
+/* finish the row, sending the batch once it is full; returns false if the connection is gone */
+static inline 
+bool 
+endRow(ResultWriter *w, ResultBatch *b)
+{
+	b->column = 0;
+	if (++b->nrows == ResultBatch::MAX_ROWS)
+		return flushResultBatch(w, b);
+	return true;
+}
+
+/* end the results of the run; a kept session then waits for the next one */
+static inline 
+bool 
+endResults(ResultWriter *w)
+{
+	uint64_t len = 0;
+	
+	if (!w->segmented)
+		return true;
+	return sendStrong(w->sock, &len, sizeof(len)) > 0;
+}
+
+#endif//RESULTWRITER_HEAD_
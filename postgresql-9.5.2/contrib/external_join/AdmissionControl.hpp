@@ -0,0 +1,282 @@
+#ifndef ADMISSIONCONTROL_HEAD_
+#define ADMISSIONCONTROL_HEAD_
+
+/*
+ * Admission of runs to the external processes, shared by all backends
+ * (only when the module is in shared_preload_libraries).
+ *
+ * A run is admitted to all endpoints of its node at once, when each has
+ * fewer than external_join.max_concurrency runs and room for the bytes the
+ * run is estimated to ship there under external_join.max_bytes_in_flight;
+ * a run larger than the limit is admitted to an otherwise idle endpoint.
+ * Runs that do not fit wait in ticket order: a run is not admitted while
+ * an older one waits for one of its endpoints, so large runs are not
+ * starved by small ones. A backend which already holds an admission is
+ * admitted at once, since the runs of one query cannot finish one after
+ * another. Waiting ends after external_join.admission_timeout, and the
+ * node runs natively or fails. Everything a backend holds is given back
+ * at its exit.
+ */
+class AdmissionControl {
+public:
+	static constexpr int MAX_ENDPOINTS = 64;
+
+	/* what a node was admitted to */
+	struct Admission {
+		bool held;
+		/* endpoints, as bits of their entry */
+		uint64 mask;
+		/* bytes counted per endpoint */
+		int64 bytes;
+	};
+
+private:
+	struct Entry {
+		char endpoint[ENDPOINT_LEN];
+		int running;
+		int64 bytes;
+	};
+	/* a waiting backend, ticket 0 if it does not wait */
+	struct Waiter {
+		uint64 ticket;
+		uint64 mask;
+	};
+	struct Shared {
+		LWLock *lock;
+		uint64 next_ticket;
+		int nentries;
+		Entry entries[MAX_ENDPOINTS];
+		int nwaiters;
+		Waiter waiters[FLEXIBLE_ARRAY_MEMBER];
+	};
+
+	Shared *shared;
+	/* held by this backend, given back at its exit */
+	int running[MAX_ENDPOINTS];
+	int64 bytes[MAX_ENDPOINTS];
+	int nheld;
+	bool exit_registered;
+
+public:
+	AdmissionControl(void) { this->init(); }
+	~AdmissionControl(void) { this->fini(); }
+
+	/* per backend handle of the shared state */
+	static AdmissionControl *
+	instance(void) {
+		static AdmissionControl ac;
+		return &ac;
+	}
+
+	void init(void) {
+		this->shared = NULL;
+		std::memset(static_cast<void *>(this->running), 0, sizeof(this->running));
+		std::memset(static_cast<void *>(this->bytes), 0, sizeof(this->bytes));
+		this->nheld = 0;
+		this->exit_registered = false;
+	}
+	void fini(void) {
+	}
+
+	/* MaxBackends is not known yet when the library is preloaded */
+	static
+	int
+	maxWaiters(void) {
+		return MaxConnections + autovacuum_max_workers + 1 + max_worker_processes;
+	}
+
+	static
+	Size
+	shmemSize(void) {
+		return add_size(offsetof(Shared, waiters), mul_size(sizeof(Waiter), AdmissionControl::maxWaiters()));
+	}
+
+	/* reserve shared memory; must be called from _PG_init of a preloaded library */
+	static
+	void
+	request(void) {
+		RequestAddinShmemSpace(MAXALIGN(AdmissionControl::shmemSize()));
+		RequestAddinLWLocks(1);
+	}
+
+	/* create or attach to the shared state, called from shmem_startup_hook */
+	void
+	startup(void) {
+		bool found;
+
+		LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+		this->shared = static_cast<Shared *>(ShmemInitStruct("external_join admission", AdmissionControl::shmemSize(), &found));
+		if (!found) {
+			std::memset(static_cast<void *>(this->shared), 0, AdmissionControl::shmemSize());
+			this->shared->lock = LWLockAssign();
+			this->shared->nwaiters = AdmissionControl::maxWaiters();
+		}
+		LWLockRelease(AddinShmemInitLock);
+	}
+
+	bool
+	isEnabled(void) const {
+		return (this->shared != NULL);
+	}
+
+	/*
+	 * admit a run shipping about bytes to each of n endpoints, waiting up to
+	 * timeout ms (0 waits as long as it takes); false if it was not admitted.
+	 * Limits of 0 are no limits.
+	 */
+	bool
+	admit(char (*endpoints)[ENDPOINT_LEN], int n, int64 bytes, int max_running, int64 max_bytes,
+	      int timeout, Admission *adm) {
+		Waiter *me;
+		TimestampTz start = GetCurrentTimestamp();
+
+		adm->held = false;
+		adm->mask = 0;
+		adm->bytes = bytes;
+		if (!this->isEnabled() || (max_running == 0 && max_bytes == 0))
+			return true;
+		if (MyBackendId <= 0 || MyBackendId > this->shared->nwaiters)
+			return true;
+		if (!this->exit_registered) {
+			before_shmem_exit(AdmissionControl::onExit, 0);
+			this->exit_registered = true;
+		}
+		me = &this->shared->waiters[MyBackendId - 1];
+
+		LWLockAcquire(this->shared->lock, LW_EXCLUSIVE);
+		for (int i = 0; i < n; i++)
+			adm->mask |= this->lookup(endpoints[i]);
+		me->ticket = ++this->shared->next_ticket;
+		me->mask = adm->mask;
+		for (;;) {
+			uint64 ticket;
+
+			if (this->nheld > 0 || this->fits(me, bytes, max_running, max_bytes)) {
+				this->take(adm);
+				me->ticket = 0;
+				LWLockRelease(this->shared->lock);
+				return true;
+			}
+			ticket = me->ticket;
+			LWLockRelease(this->shared->lock);
+
+			if (timeout > 0 && TimestampDifferenceExceeds(start, GetCurrentTimestamp(), timeout)) {
+				LWLockAcquire(this->shared->lock, LW_EXCLUSIVE);
+				me->ticket = 0;
+				LWLockRelease(this->shared->lock);
+				return false;
+			}
+			/* a cancelled wait must not hold back the runs behind it */
+			if (InterruptPending) {
+				LWLockAcquire(this->shared->lock, LW_EXCLUSIVE);
+				me->ticket = 0;
+				LWLockRelease(this->shared->lock);
+				CHECK_FOR_INTERRUPTS();
+			}
+			::usleep(1000);
+			LWLockAcquire(this->shared->lock, LW_EXCLUSIVE);
+			me->ticket = ticket;
+		}
+	}
+
+	/* give back what a node was admitted to */
+	void
+	release(Admission *adm) {
+		if (!adm->held)
+			return ;
+		LWLockAcquire(this->shared->lock, LW_EXCLUSIVE);
+		this->give(adm->mask, adm->bytes);
+		LWLockRelease(this->shared->lock);
+		adm->held = false;
+	}
+
+private:
+	/* bit of the entry of endpoint, 0 if the table is full */
+	uint64
+	lookup(const char *endpoint) {
+		int i;
+
+		for (i = 0; i < this->shared->nentries; i++) {
+			if (std::strcmp(this->shared->entries[i].endpoint, endpoint) == 0)
+				return UINT64CONST(1) << i;
+		}
+		if (i == MAX_ENDPOINTS)
+			return 0;
+		strlcpy(this->shared->entries[i].endpoint, endpoint, ENDPOINT_LEN);
+		this->shared->entries[i].running = 0;
+		this->shared->entries[i].bytes = 0;
+		this->shared->nentries++;
+		return UINT64CONST(1) << i;
+	}
+
+	/* every endpoint has room, and no older run waits for one of them */
+	bool
+	fits(Waiter *me, int64 bytes, int max_running, int64 max_bytes) {
+		for (int i = 0; i < MAX_ENDPOINTS; i++) {
+			Entry *entry = &this->shared->entries[i];
+
+			if ((me->mask & (UINT64CONST(1) << i)) == 0)
+				continue;
+			if (max_running > 0 && entry->running >= max_running)
+				return false;
+			if (max_bytes > 0 && entry->bytes > 0 && entry->bytes + bytes > max_bytes)
+				return false;
+		}
+		for (int i = 0; i < this->shared->nwaiters; i++) {
+			Waiter *w = &this->shared->waiters[i];
+
+			if (w != me && w->ticket != 0 && w->ticket < me->ticket && (w->mask & me->mask) != 0)
+				return false;
+		}
+		return true;
+	}
+
+	void
+	take(Admission *adm) {
+		for (int i = 0; i < MAX_ENDPOINTS; i++) {
+			if ((adm->mask & (UINT64CONST(1) << i)) == 0)
+				continue;
+			this->shared->entries[i].running++;
+			this->shared->entries[i].bytes += adm->bytes;
+			this->running[i]++;
+			this->bytes[i] += adm->bytes;
+		}
+		this->nheld++;
+		adm->held = true;
+	}
+
+	void
+	give(uint64 mask, int64 bytes) {
+		for (int i = 0; i < MAX_ENDPOINTS; i++) {
+			if ((mask & (UINT64CONST(1) << i)) == 0)
+				continue;
+			this->shared->entries[i].running--;
+			this->shared->entries[i].bytes -= bytes;
+			this->running[i]--;
+			this->bytes[i] -= bytes;
+		}
+		this->nheld--;
+	}
+
+	/* a backend leaving with admissions, after an error or FATAL */
+	static
+	void
+	onExit(int code, Datum arg) {
+		AdmissionControl *ac = AdmissionControl::instance();
+
+		LWLockReleaseAll();
+		LWLockAcquire(ac->shared->lock, LW_EXCLUSIVE);
+		for (int i = 0; i < MAX_ENDPOINTS; i++) {
+			ac->shared->entries[i].running -= ac->running[i];
+			ac->shared->entries[i].bytes -= ac->bytes[i];
+			ac->running[i] = 0;
+			ac->bytes[i] = 0;
+		}
+		ac->nheld = 0;
+		if (MyBackendId > 0 && MyBackendId <= ac->shared->nwaiters)
+			ac->shared->waiters[MyBackendId - 1].ticket = 0;
+		LWLockRelease(ac->shared->lock);
+	}
+};
+
+#endif //ADMISSIONCONTROL_HEAD_
@@ -0,0 +1,268 @@
+#ifndef BUFFERPOOL_HEAD_
+#define BUFFERPOOL_HEAD_
+
+/*
+ * Backend-lifetime pool of large buffers used by TupleBuffer and ResultBuffer.
+ *
+ * Buffers are mapped with MAP_HUGETLB when possible (otherwise anonymous memory
+ * advised with MADV_HUGEPAGE) and are kept mapped across queries, so a query
+ * does not fault in hundreds of MB of fresh 4K pages every time.
+ * A buffer acquired by a query is tied to the memory context that was current
+ * at acquire time; if that context is reset or deleted (e.g. query cancel)
+ * before the buffer is released, the buffer returns to the pool automatically.
+ *
+ * release() may be called from the tuple sending thread, so the pool never
+ * calls palloc/pfree/elog while holding its mutex except from acquire().
+ * Idle blocks are only unmapped by the backend in acquire(): when a query is
+ * cancelled, its buffers are marked idle before its threads are stopped, and
+ * nobody must unmap a block a thread still fills.
+ */
+class BufferPool {
+private:
+	/* slots of the block table, which grows when all of them are mapped */
+	static constexpr int INITIAL_BLOCKS = 256;
+	static constexpr std::size_t HUGE_PAGE_SIZE = 1024UL * 1024UL * 2;
+
+	struct Block {
+		void *addr;
+		std::size_t size;
+		bool huge;
+		bool in_use;
+		/* incremented on every acquire, used to detect stale reset callbacks */
+		uint64_t generation;
+	};
+	/* registered in the owner memory context of an acquired buffer */
+	struct Owner {
+		MemoryContextCallback cb;
+		BufferPool *pool;
+		int index;
+		uint64_t generation;
+	};
+
+	Block *blocks;
+	int nblocks;
+	pthread_mutex_t mutex;
+	/* upper limit of bytes kept mapped while nobody uses them */
+	std::size_t idle_limit;
+	bool use_huge_pages;
+
+public:
+	BufferPool(void) { this->init(); }
+	~BufferPool(void) { this->fini(); }
+
+	static BufferPool *
+	instance(void) {
+		static BufferPool pool;
+		return &pool;
+	}
+
+	void init(void) {
+		this->blocks = static_cast<Block *>(std::calloc(INITIAL_BLOCKS, sizeof(Block)));
+		this->nblocks = (this->blocks != NULL) ? INITIAL_BLOCKS : 0;
+		pthread_mutex_init(&this->mutex, NULL);
+		this->idle_limit = 1024UL * 1024UL * 512;
+		this->use_huge_pages = true;
+	}
+	void fini(void) {
+		for (int i = 0; i < this->nblocks; i++) {
+			if (this->blocks[i].addr != NULL)
+				::munmap(this->blocks[i].addr, this->blocks[i].size);
+		}
+		std::free(this->blocks);
+		this->blocks = NULL;
+		this->nblocks = 0;
+	}
+
+	void
+	setIdleLimit(std::size_t limit) {
+		pthread_mutex_lock(&this->mutex);
+		/* trimmed on the next acquire(), the threads of an aborting query may still run */
+		this->idle_limit = limit;
+		pthread_mutex_unlock(&this->mutex);
+	}
+
+	void
+	setUseHugePages(bool use) {
+		this->use_huge_pages = use;
+	}
+
+	/* returns a buffer of at least size bytes, owned by CurrentMemoryContext */
+	void *
+	acquire(std::size_t size) {
+		int index = -1;
+		int empty = -1;
+		Owner *owner;
+
+		size = BufferPool::roundUp(size);
+
+		pthread_mutex_lock(&this->mutex);
+		this->trim();
+		/* best fit from idle blocks */
+		for (int i = 0; i < this->nblocks; i++) {
+			Block *b = &this->blocks[i];
+
+			if (b->addr == NULL) {
+				if (empty < 0)
+					empty = i;
+				continue;
+			}
+			if (!b->in_use && b->size >= size && (index < 0 || b->size < this->blocks[index].size))
+				index = i;
+		}
+		if (index < 0) {
+			if (empty < 0)
+				empty = this->grow();
+			if (empty < 0)
+				empty = this->evict();
+			if (empty >= 0 && this->map(&this->blocks[empty], size))
+				index = empty;
+		}
+		if (index >= 0) {
+			this->blocks[index].in_use = true;
+			this->blocks[index].generation++;
+		}
+		pthread_mutex_unlock(&this->mutex);
+
+		if (index < 0) {
+			ereport(ERROR, (errcode(ERRCODE_OUT_OF_MEMORY),
+					errmsg("cannot map %zu bytes for external join buffer\n", size)));
+		}
+
+		/* return the buffer to pool when the owner context goes away */
+		owner = static_cast<Owner *>(palloc(sizeof(*owner)));
+		owner->cb.func = BufferPool::ownerResetCallback;
+		owner->cb.arg = static_cast<void *>(owner);
+		owner->pool = this;
+		owner->index = index;
+		owner->generation = this->blocks[index].generation;
+		MemoryContextRegisterResetCallback(CurrentMemoryContext, &owner->cb);
+
+		return this->blocks[index].addr;
+	}
+
+	void
+	release(void *addr) {
+		pthread_mutex_lock(&this->mutex);
+		for (int i = 0; i < this->nblocks; i++) {
+			if (this->blocks[i].addr == addr) {
+				this->blocks[i].in_use = false;
+				break;
+			}
+		}
+		pthread_mutex_unlock(&this->mutex);
+	}
+
+private:
+	static
+	std::size_t
+	roundUp(std::size_t size) {
+		return (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+	}
+
+	static
+	void
+	ownerResetCallback(void *arg) {
+		Owner *owner = static_cast<Owner *>(arg);
+		BufferPool *pool = owner->pool;
+		Block *b;
+
+		pthread_mutex_lock(&pool->mutex);
+		/* the table may have moved since acquire() */
+		b = &pool->blocks[owner->index];
+		/*
+		 * Buffer was not released by its user (e.g. query was cancelled).
+		 * Do not unmap here: a thread of the cancelled query may still touch
+		 * the buffer until its own reset callback stops it. Idle blocks are
+		 * trimmed on the next acquire().
+		 */
+		if (b->in_use && b->generation == owner->generation)
+			b->in_use = false;
+		pthread_mutex_unlock(&pool->mutex);
+	}
+
+	/* must be called with mutex held */
+	bool
+	map(Block *b, std::size_t size) {
+		void *addr = MAP_FAILED;
+		bool huge = false;
+
+		if (this->use_huge_pages) {
+			addr = ::mmap(NULL, size, PROT_READ | PROT_WRITE,
+				      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+			huge = (addr != MAP_FAILED);
+		}
+		if (addr == MAP_FAILED) {
+			addr = ::mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (addr == MAP_FAILED)
+				return false;
+#ifdef MADV_HUGEPAGE
+			/* ask for transparent huge pages instead */
+			if (this->use_huge_pages)
+				::madvise(addr, size, MADV_HUGEPAGE);
+#endif
+		}
+		b->addr = addr;
+		b->size = size;
+		b->huge = huge;
+		b->in_use = false;
+		return true;
+	}
+
+	/* must be called with mutex held */
+	void
+	unmap(Block *b) {
+		::munmap(b->addr, b->size);
+		b->addr = NULL;
+		b->size = 0;
+		b->huge = false;
+		b->in_use = false;
+	}
+
+	/* double the block table and return its first new slot, or -1; must be called with mutex held */
+	int
+	grow(void) {
+		int first = this->nblocks;
+		int n = (first > 0) ? first * 2 : INITIAL_BLOCKS;
+		Block *blocks = static_cast<Block *>(std::realloc(this->blocks, n * sizeof(Block)));
+
+		if (blocks == NULL)
+			return -1;
+		std::memset(static_cast<void *>(blocks + first), 0, (n - first) * sizeof(Block));
+		this->blocks = blocks;
+		this->nblocks = n;
+		return first;
+	}
+
+	/* unmap the largest idle block and return its slot, or -1; must be called with mutex held */
+	int
+	evict(void) {
+		int victim = -1;
+
+		for (int i = 0; i < this->nblocks; i++) {
+			Block *b = &this->blocks[i];
+
+			if (b->addr != NULL && !b->in_use && (victim < 0 || b->size > this->blocks[victim].size))
+				victim = i;
+		}
+		if (victim >= 0)
+			this->unmap(&this->blocks[victim]);
+		return victim;
+	}
+
+	/* shrink idle blocks down to idle_limit; must be called with mutex held */
+	void
+	trim(void) {
+		for (;;) {
+			std::size_t idle = 0;
+
+			for (int i = 0; i < this->nblocks; i++) {
+				if (this->blocks[i].addr != NULL && !this->blocks[i].in_use)
+					idle += this->blocks[i].size;
+			}
+			if (idle <= this->idle_limit || this->evict() < 0)
+				break;
+		}
+	}
+};
+
+#endif //BUFFERPOOL_HEAD_
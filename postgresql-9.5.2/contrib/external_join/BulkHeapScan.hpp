@@ -0,0 +1,138 @@
+#ifndef BULKHEAPSCAN_HEAD_
+#define BULKHEAPSCAN_HEAD_
+
+/*
+ * Page at a time reading of a heap scan whose tuples are shipped as they are.
+ *
+ * A SeqScan node hands out one tuple per ExecProcNode() and stores it in a
+ * slot, checks quals and resets its expression context each time. Without
+ * qual and projection none of that is needed, so this walks the pages of the
+ * node's scan descriptor itself: heapgetpage() decides visibility for a whole
+ * page under one buffer lock (and skips the check for pages marked
+ * all-visible, the bit the visibility map mirrors), after which the visible
+ * tuples are read straight off the pinned page. The descriptor is left like
+ * after a completed heap_getnext() scan, so that a rescan starts over.
+ */
+class BulkHeapScan {
+private:
+	HeapScanDesc scan;
+	/* pages left and the next one to read */
+	BlockNumber remaining;
+	BlockNumber page;
+	/* next entry of rs_vistuples on the current page */
+	int index;
+
+public:
+	BulkHeapScan(void) { this->init(); }
+	~BulkHeapScan(void) { this->fini(); }
+
+	static BulkHeapScan *constructor(void) {
+		BulkHeapScan *bhs = static_cast<BulkHeapScan *>(palloc(sizeof(*bhs)));
+		bhs->init();
+		return bhs;
+	}
+	static void destructor(BulkHeapScan *bhs) {
+		bhs->fini();
+		pfree(bhs);
+	}
+
+	void init(void) {
+		this->scan = NULL;
+		this->remaining = 0;
+		this->page = 0;
+		this->index = 0;
+	}
+	void fini(void) {
+		this->end();
+	}
+
+	/* a SeqScan node that would only pass heap tuples through */
+	static
+	bool
+	isEligible(PlanState *ps) {
+		HeapScanDesc scan;
+
+		if (!IsA(ps, SeqScanState) || ps->qual != NIL || ps->ps_ProjInfo != NULL)
+			return false;
+		scan = reinterpret_cast<ScanState *>(ps)->ss_currentScanDesc;
+		/* page mode needs an MVCC snapshot; a started scan must go on tuple by tuple */
+		if (scan == NULL || !scan->rs_pageatatime || scan->rs_inited)
+			return false;
+		/* varlena values are detoasted and encoded from a slot */
+		return !TupleBuffer::hasVarlena(RelationGetDescr(scan->rs_rd));
+	}
+
+	/* read the pages of scan, from its start block and within its limits */
+	void
+	begin(HeapScanDesc scan) {
+		this->scan = scan;
+		this->remaining = scan->rs_nblocks;
+		if (scan->rs_numblocks != InvalidBlockNumber)
+			this->remaining = Min(this->remaining, scan->rs_numblocks);
+		this->page = scan->rs_startblock;
+		this->index = 0;
+		scan->rs_ntuples = 0;
+	}
+
+	/* read the next page, returns the number of its visible tuples or -1 after the last page */
+	int
+	nextPage(void) {
+		if (this->scan == NULL || this->remaining == 0)
+			return -1;
+		heapgetpage(this->scan, this->page);
+		this->index = 0;
+		this->remaining--;
+		if (++this->page >= this->scan->rs_nblocks)
+			this->page = 0;
+		/* let scans of the same relation follow this one */
+		if (this->scan->rs_syncscan)
+			ss_report_location(this->scan->rs_rd, this->page);
+		return this->scan->rs_ntuples;
+	}
+
+	/* next visible tuple of the current page, valid until the next page is read */
+	bool
+	nextTuple(HeapTuple tuple) {
+		Page dp;
+		OffsetNumber offnum;
+		ItemId lp;
+
+		if (this->scan == NULL || this->index >= this->scan->rs_ntuples)
+			return false;
+		dp = BufferGetPage(this->scan->rs_cbuf);
+		offnum = this->scan->rs_vistuples[this->index++];
+		lp = PageGetItemId(dp, offnum);
+		tuple->t_data = reinterpret_cast<HeapTupleHeader>(PageGetItem(dp, lp));
+		tuple->t_len = ItemIdGetLength(lp);
+		tuple->t_tableOid = RelationGetRelid(this->scan->rs_rd);
+		ItemPointerSet(&tuple->t_self, this->scan->rs_cblock, offnum);
+		pgstat_count_heap_getnext(this->scan->rs_rd);
+		return true;
+	}
+
+	/* next visible tuple of the relation, or false at its end */
+	bool
+	next(HeapTuple tuple) {
+		while (!this->nextTuple(tuple)) {
+			if (this->nextPage() < 0)
+				return false;
+		}
+		return true;
+	}
+
+	/* unpin the last page, as heap_getnext() does at the end of a scan */
+	void
+	end(void) {
+		if (this->scan == NULL)
+			return ;
+		if (BufferIsValid(this->scan->rs_cbuf))
+			ReleaseBuffer(this->scan->rs_cbuf);
+		this->scan->rs_cbuf = InvalidBuffer;
+		this->scan->rs_cblock = InvalidBlockNumber;
+		this->scan->rs_ctup.t_data = NULL;
+		this->scan->rs_inited = false;
+		this->scan = NULL;
+	}
+};
+
+#endif //BULKHEAPSCAN_HEAD_
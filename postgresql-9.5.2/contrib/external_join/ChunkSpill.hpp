@@ -0,0 +1,204 @@
+#ifndef CHUNKSPILL_HEAD_
+#define CHUNKSPILL_HEAD_
+
+/*
+ * FIFO of input chunks kept in a temporary file.
+ *
+ * When the external engine reads slower than inputs are scanned, chunks that
+ * do not fit in external_join.max_buffer_memory are written here and read
+ * back once the sender has caught up, so the backend never holds more than
+ * the limit in TupleBuffers. Only the backend thread may use this class
+ * (BufFile is not thread safe); the sender thread only sees chunks that were
+ * moved back into memory.
+ */
+class ChunkSpill {
+private:
+	/* TupleBuffer state written in front of its tuple data */
+	struct Record {
+		uint64_t content_size;
+		uint64_t buffer_size;
+		/* variable length area, null bitmaps and hashes at the end of the content */
+		uint64_t var_size;
+		uint64_t null_size;
+		uint64_t hash_size;
+		InputHeader hint;
+		uint32_t nrows;
+		uint8_t first;
+		uint8_t last;
+		uint8_t filter_requested;
+		uint8_t padding;
+		FilterRequest filter;
+	};
+
+	BufFile *file;
+	/* position of the next record to read and write */
+	int read_fileno;
+	off_t read_offset;
+	int write_fileno;
+	off_t write_offset;
+	/* number of records in the file */
+	int length;
+	/* buffer size of the next record to read, 0 if not read yet */
+	std::size_t head_size;
+	/* total bytes ever written, for instrumentation */
+	uint64_t spilled_bytes;
+
+public:
+	ChunkSpill(void) { this->init(); }
+	~ChunkSpill(void) { this->fini(); }
+
+	static ChunkSpill *constructor(void) {
+		ChunkSpill *cs = static_cast<ChunkSpill *>(palloc(sizeof(*cs)));
+		cs->init();
+		return cs;
+	}
+	static void destructor(ChunkSpill *cs) {
+		cs->fini();
+		pfree(cs);
+	}
+
+	void init(void) {
+		this->file = NULL;
+		this->read_fileno = 0;
+		this->read_offset = 0;
+		this->write_fileno = 0;
+		this->write_offset = 0;
+		this->length = 0;
+		this->head_size = 0;
+		this->spilled_bytes = 0;
+	}
+	void fini(void) {
+		if (this->file != NULL)
+			BufFileClose(this->file);
+		this->file = NULL;
+		this->length = 0;
+	}
+
+	/* write tb to the end of the file and free it */
+	void
+	put(TupleBuffer *tb) {
+		Record rec;
+
+		tb->seal();
+		if (this->file == NULL)
+			this->file = BufFileCreateTemp(false);
+
+		std::memset(static_cast<void *>(&rec), 0, sizeof(rec));
+		rec.content_size = tb->getContentSize();
+		rec.buffer_size = tb->getBufferSize();
+		rec.var_size = tb->getVarSize();
+		rec.null_size = tb->getNullSize();
+		rec.hash_size = tb->getHashSize();
+		rec.hint = *tb->getHint();
+		rec.nrows = tb->getRowCount();
+		rec.first = tb->isFirst();
+		rec.last = tb->isLast();
+		if (tb->getFilterRequest() != NULL) {
+			rec.filter_requested = true;
+			rec.filter = *tb->getFilterRequest();
+		}
+
+		this->seek(this->write_fileno, this->write_offset);
+		this->write(&rec, sizeof(rec));
+		this->write(tb->getBufferPointer(), rec.content_size);
+		BufFileTell(this->file, &this->write_fileno, &this->write_offset);
+
+		this->length++;
+		this->spilled_bytes += rec.content_size;
+		TupleBuffer::destructor(tb);
+	}
+
+	/* read the oldest chunk back into a new TupleBuffer, or NULL if empty */
+	TupleBuffer *
+	get(void) {
+		Record rec;
+		TupleBuffer *tb;
+
+		if (this->length == 0)
+			return NULL;
+
+		this->seek(this->read_fileno, this->read_offset);
+		this->read(&rec, sizeof(rec));
+		tb = TupleBuffer::constructor(rec.buffer_size);
+		this->read(tb->reserve(rec.content_size), rec.content_size);
+		tb->commit(rec.content_size, rec.nrows);
+		tb->setSealedSizes(rec.var_size, rec.null_size, rec.hash_size);
+		tb->setHint(rec.hint.est_rows, rec.hint.est_bytes);
+		tb->setRadixBits(rec.hint.radix_bits, rec.hint.key_column);
+		tb->setInputFlags(rec.hint.flags);
+		tb->setJoin(rec.hint.join_type, 0);
+		tb->setFirst(rec.first);
+		tb->setLast(rec.last);
+		if (rec.filter_requested)
+			tb->setFilterRequest(&rec.filter);
+		BufFileTell(this->file, &this->read_fileno, &this->read_offset);
+
+		this->head_size = 0;
+		/* drained: give the disk space back instead of growing the file forever */
+		if (--this->length == 0) {
+			uint64_t spilled = this->spilled_bytes;
+
+			this->fini();
+			this->init();
+			this->spilled_bytes = spilled;
+		}
+		return tb;
+	}
+
+	/* buffer size the next get() will need, 0 if empty */
+	std::size_t
+	getHeadSize(void) {
+		Record rec;
+
+		if (this->length == 0)
+			return 0;
+		if (this->head_size == 0) {
+			this->seek(this->read_fileno, this->read_offset);
+			this->read(&rec, sizeof(rec));
+			this->head_size = rec.buffer_size;
+		}
+		return this->head_size;
+	}
+
+	bool
+	isEmpty(void) const {
+		return (this->length == 0);
+	}
+
+	int
+	getLength(void) const {
+		return this->length;
+	}
+
+	uint64_t
+	getSpilledBytes(void) const {
+		return this->spilled_bytes;
+	}
+
+private:
+	void
+	seek(int fileno, off_t offset) {
+		if (BufFileSeek(this->file, fileno, offset, SEEK_SET) != 0) {
+			ereport(ERROR, (errcode_for_file_access(),
+					errmsg("could not seek in external join spill file\n")));
+		}
+	}
+
+	void
+	write(void *data, std::size_t size) {
+		if (BufFileWrite(this->file, data, size) != size) {
+			ereport(ERROR, (errcode_for_file_access(),
+					errmsg("could not write to external join spill file\n")));
+		}
+	}
+
+	void
+	read(void *data, std::size_t size) {
+		if (BufFileRead(this->file, data, size) != size) {
+			ereport(ERROR, (errcode_for_file_access(),
+					errmsg("could not read from external join spill file\n")));
+		}
+	}
+};
+
+#endif //CHUNKSPILL_HEAD_
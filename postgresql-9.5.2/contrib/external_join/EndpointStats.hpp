@@ -0,0 +1,215 @@
+#ifndef ENDPOINTSTATS_HEAD_
+#define ENDPOINTSTATS_HEAD_
+
+/*
+ * Cumulative statistics per external process endpoint, kept in a shared
+ * memory hash table (only when the module is in shared_preload_libraries)
+ * and shown by the pg_stat_external_join view.
+ *
+ * The hash table is protected by an LWLock, counters of an entry by its
+ * spinlock. Sessions replaying a cached result are counted under "cache".
+ */
+#define ENDPOINT_LEN 64
+
+/* counters of one session, added to its endpoint entry when the session ends */
+struct EndpointCounters {
+	int64 queries;
+	int64 cancellations;
+	int64 connection_failures;
+	int64 bytes_sent;
+	int64 bytes_received;
+	double total_time;
+};
+
+class EndpointStats {
+public:
+	/* upper bounds of latency histogram buckets in ms, the last bucket is unbounded */
+	static constexpr int NBUCKETS = 7;
+
+private:
+	struct Entry {
+		char endpoint[ENDPOINT_LEN];
+		slock_t mutex;
+		EndpointCounters counters;
+		int64 latency[NBUCKETS];
+	};
+	struct Shared {
+		LWLock *lock;
+	};
+
+	Shared *shared;
+	HTAB *hash;
+
+public:
+	EndpointStats(void) { this->init(); }
+	~EndpointStats(void) { this->fini(); }
+
+	/* per backend handle of the shared state */
+	static EndpointStats *
+	instance(void) {
+		static EndpointStats stats;
+		return &stats;
+	}
+
+	void init(void) {
+		this->shared = NULL;
+		this->hash = NULL;
+	}
+	void fini(void) {
+	}
+
+	static
+	Size
+	shmemSize(int max) {
+		return add_size(MAXALIGN(sizeof(Shared)), hash_estimate_size(max, sizeof(Entry)));
+	}
+
+	/* reserve shared memory; must be called from _PG_init of a preloaded library */
+	static
+	void
+	request(int max) {
+		RequestAddinShmemSpace(EndpointStats::shmemSize(max));
+		RequestAddinLWLocks(1);
+	}
+
+	/* create or attach to the shared state, called from shmem_startup_hook */
+	void
+	startup(int max) {
+		HASHCTL info;
+		bool found;
+
+		this->shared = NULL;
+		this->hash = NULL;
+
+		LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+		this->shared = static_cast<Shared *>(ShmemInitStruct("external_join", sizeof(Shared), &found));
+		if (!found)
+			this->shared->lock = LWLockAssign();
+
+		std::memset(static_cast<void *>(&info), 0, sizeof(info));
+		info.keysize = ENDPOINT_LEN;
+		info.entrysize = sizeof(Entry);
+		this->hash = ShmemInitHash("external_join endpoint stats", max, max, &info, HASH_ELEM);
+		LWLockRelease(AddinShmemInitLock);
+	}
+
+	bool
+	isEnabled(void) const {
+		return (this->shared != NULL && this->hash != NULL);
+	}
+
+	/*
+	 * Add counters and latency (ms) of a session to its endpoint.
+	 * With create false, an endpoint not seen before is not counted; that is
+	 * used from memory context reset callbacks, which must not throw.
+	 */
+	void
+	record(const char *endpoint, const EndpointCounters *delta, double latency, bool create) {
+		char key[ENDPOINT_LEN];
+		Entry *entry;
+		int bucket = 0;
+
+		if (!this->isEnabled())
+			return ;
+		std::memset(key, 0, sizeof(key));
+		strlcpy(key, endpoint, sizeof(key));
+
+		LWLockAcquire(this->shared->lock, LW_SHARED);
+		entry = static_cast<Entry *>(hash_search(this->hash, key, HASH_FIND, NULL));
+		if (entry == NULL && create) {
+			bool found;
+
+			/* need exclusive lock to make a new entry */
+			LWLockRelease(this->shared->lock);
+			LWLockAcquire(this->shared->lock, LW_EXCLUSIVE);
+			entry = static_cast<Entry *>(hash_search(this->hash, key, HASH_ENTER_NULL, &found));
+			if (entry != NULL && !found) {
+				SpinLockInit(&entry->mutex);
+				std::memset(static_cast<void *>(&entry->counters), 0, sizeof(entry->counters));
+				std::memset(static_cast<void *>(entry->latency), 0, sizeof(entry->latency));
+			}
+		}
+		if (entry == NULL) {
+			/* table is full */
+			LWLockRelease(this->shared->lock);
+			return ;
+		}
+
+		for (double bound = 1.0; bucket < NBUCKETS - 1 && latency >= bound; bound *= 10.0)
+			bucket++;
+		SpinLockAcquire(&entry->mutex);
+		entry->counters.queries += delta->queries;
+		entry->counters.cancellations += delta->cancellations;
+		entry->counters.connection_failures += delta->connection_failures;
+		entry->counters.bytes_sent += delta->bytes_sent;
+		entry->counters.bytes_received += delta->bytes_received;
+		entry->counters.total_time += delta->total_time;
+		if (delta->queries > 0)
+			entry->latency[bucket]++;
+		SpinLockRelease(&entry->mutex);
+		LWLockRelease(this->shared->lock);
+	}
+
+	void
+	reset(void) {
+		HASH_SEQ_STATUS status;
+		Entry *entry;
+
+		this->checkEnabled();
+		LWLockAcquire(this->shared->lock, LW_EXCLUSIVE);
+		hash_seq_init(&status, this->hash);
+		while ((entry = static_cast<Entry *>(hash_seq_search(&status))) != NULL)
+			hash_search(this->hash, entry->endpoint, HASH_REMOVE, NULL);
+		LWLockRelease(this->shared->lock);
+	}
+
+	/* put one row per endpoint into tupstore */
+	void
+	report(Tuplestorestate *tupstore, TupleDesc tupdesc) {
+		HASH_SEQ_STATUS status;
+		Entry *entry;
+
+		this->checkEnabled();
+		LWLockAcquire(this->shared->lock, LW_SHARED);
+		hash_seq_init(&status, this->hash);
+		while ((entry = static_cast<Entry *>(hash_seq_search(&status))) != NULL) {
+			EndpointCounters counters;
+			int64 latency[NBUCKETS];
+			Datum buckets[NBUCKETS];
+			Datum values[8];
+			bool nulls[8];
+			int i = 0;
+
+			SpinLockAcquire(&entry->mutex);
+			counters = entry->counters;
+			std::memcpy(latency, entry->latency, sizeof(latency));
+			SpinLockRelease(&entry->mutex);
+
+			for (int b = 0; b < NBUCKETS; b++)
+				buckets[b] = Int64GetDatum(latency[b]);
+			std::memset(nulls, 0, sizeof(nulls));
+			values[i++] = CStringGetTextDatum(entry->endpoint);
+			values[i++] = Int64GetDatum(counters.queries);
+			values[i++] = Int64GetDatum(counters.cancellations);
+			values[i++] = Int64GetDatum(counters.connection_failures);
+			values[i++] = Int64GetDatum(counters.bytes_sent);
+			values[i++] = Int64GetDatum(counters.bytes_received);
+			values[i++] = Float8GetDatum(counters.total_time);
+			values[i++] = PointerGetDatum(construct_array(buckets, NBUCKETS, INT8OID, sizeof(int64),
+								      FLOAT8PASSBYVAL, 'd'));
+			tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+		}
+		LWLockRelease(this->shared->lock);
+	}
+
+private:
+	void
+	checkEnabled(void) {
+		if (!this->isEnabled()) {
+			ereport(ERROR, (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+					errmsg("external_join must be loaded via shared_preload_libraries\n")));
+		}
+	}
+};
+
+#endif //ENDPOINTSTATS_HEAD_
@@ -0,0 +1,351 @@
+#ifndef EXTERNALPROTOCOL_HEAD_
+#define EXTERNALPROTOCOL_HEAD_
+
+/*
+ * Wire format between external_join and an external join engine.
+ * This header is also used by external_sample, so it must not depend on
+ * PostgreSQL headers.
+ *
+ * For each input (scan node, in the order ScanTuple() visits them)
+ * PostgreSQL sends
+ *	InputHeader	planner estimates of the input
+ * followed by any number of chunks
+ *	ChunkHeader	size and row count of the chunk
+ *	char[size]	tuple data areas (heap tuple without header)
+ *	char[var_size]	variable length area, only for inputs with varlena columns
+ *	char[null_size]	null bitmaps, only if a row of the chunk has a NULL
+ *	char[hash_size]	join key hashes, only for inputs with radix_bits
+ * terminated by a ChunkHeader whose size is 0.
+ * If that terminator has CHUNK_FILTER_REQUEST, a FilterRequest follows it and
+ * PostgreSQL waits for a FilterReply before it scans the next input, so the
+ * engine must answer it right after reading the input. Requests are only
+ * sent with external_join.runtime_filter on.
+ * Rows of one input may arrive in any order across chunks.
+ * Every row has all its columns; a NULL column is filled with zeros.
+ *
+ * Null bitmaps hold one bitmap per column, in column order. A bitmap is
+ * (nrows + 63) / 64 uint64_t words; bit (row % 64) of word (row / 64) is set
+ * if the column of that row is not NULL, like t_bits of a heap tuple. Bits
+ * beyond nrows are 0.
+ *
+ * Rows of an input with varlena columns (text, numeric, bytea, ...) are
+ * encoded instead: columns are aligned like a C struct, and each varlena
+ * column is a VarlenaRef pointing into the variable length areas of the
+ * input. Offsets count from the start of the first chunk's area, so the
+ * areas of all chunks concatenated in order form one array of bytes.
+ * Values are detoasted, without varlena header.
+ *
+ * With external_join.radix_bits set, PostgreSQL hashes the join key of both
+ * inputs of an equi-join with the hash function of the join operator, so the
+ * hashes of the two inputs agree. The rows of each chunk are then grouped by
+ * radix partition, the top radix_bits bits of the hash, in partition order.
+ * The hash area is uint32_t[1 << radix_bits] row counts of the partitions
+ * followed by uint32_t[nrows] hashes of the rows; a NULL key hashes to 0.
+ * The area follows the null bitmaps unaligned.
+ *
+ * The engine sends back results in batches, each
+ *	ResultBatchHeader	row count of the batch, aligned to 8 bytes
+ *	uint64_t[]		validity bitmaps, only with RESULT_HAS_NULLS
+ *	rows			nrows result rows
+ * until it closes the connection. Validity bitmaps are laid out like the
+ * null bitmaps of input chunks. Result rows are C structs, each column
+ * aligned to its own size from the start of the stream; a NULL column is
+ * present but its value is ignored. A varlena result column is a uint32_t
+ * length followed by that many bytes of the value (without varlena header);
+ * the next column is aligned as usual.
+ *
+ * With external_join.keep_sessions on, a node that takes parameters (the
+ * inner side of a nested loop, a correlated subquery) keeps its connections
+ * between rescans and only ships again the inputs whose scans depend on a
+ * changed parameter. Every InputHeader of such a run has INPUT_KEEP_SESSION,
+ * and the engine then sends its result stream in segments, each a uint64_t
+ * size followed by that many bytes of the stream, terminated by a size of 0.
+ * Afterwards it waits on the same connection for the next run, which is sent
+ * like the first, or for the connection to close. An input with INPUT_REUSE
+ * has no chunks, only the terminator: the engine joins the rows it received
+ * for that input in the previous run instead.
+ *
+ * Through the gateway worker (external_join.gateway_connections) every run
+ * has INPUT_KEEP_SESSION, and the runs on one connection may come from
+ * different backends; a run without INPUT_REUSE never depends on an
+ * earlier one. An engine that closes the connection after a run instead
+ * still works, without the reuse of connections.
+ *
+ * With external_join.plan_templates on, every run on a connection starts
+ * with a RunHeader, before the first InputHeader. The plan template is text
+ * describing the inputs (relation, shipped columns, filter of the scan) and
+ * the join clauses, deparsed like EXPLAIN VERBOSE with parameters as $n; it
+ * follows the header on the first run of a connection only. Then come
+ * nparams ParamValues, each followed by size bytes of the value in its text
+ * form. Equal template ids stand for equal templates across connections, so
+ * an engine may keep what it derived from a template. Kept sessions of a
+ * finished statement go to a pool of the backend, and a later execution of
+ * the same template takes them over, reusing inputs whose relations and
+ * parameters are unchanged.
+ *
+ * Every InputHeader tells the join the input is below: join_type is that
+ * of the lowest join above the input, and INPUT_OUTER or INPUT_INNER the
+ * side of it (neither for a plan without join). Result rows are those of
+ * the offloaded plan, so a semi or anti join (EXISTS, NOT EXISTS, IN)
+ * returns columns of its outer side only, each outer row at most once, and
+ * a batch with rows an outer join NULL-extends has RESULT_HAS_NULLS.
+ * external_join.join_types lists the join types the engines can run; a plan
+ * with a join of another type is not offloaded as a whole, only the
+ * subtrees below that join are.
+ *
+ * With external_join.join_graph on, every run has a RunHeader and
+ * graph_size bytes of join graph follow its OrderKeys: a JoinGraphHeader,
+ * a JoinInput per input, and a JoinNode per join of the plan, each followed
+ * by its JoinClauses. Joins come in the order PostgreSQL runs them, the
+ * children of a join before it, so the last one is the top join and the
+ * order is the planner's join order. Clauses compare columns of two inputs,
+ * equalities give the keys of star and chain joins and other comparisons
+ * band joins; a join with conditions beyond its clauses, or with nodes other
+ * than Hash, Sort or Material above a child, has JOIN_NODE_PARTIAL, and the
+ * template text tells the rest.
+ *
+ * When the offloaded plan returns its rows in an order (a Sort on top, or
+ * the order a MergeAppend wants from it), external_join.sorted_results
+ * sends a RunHeader on every run even without plan templates, and norder
+ * OrderKeys follow the template text, major key first. Every engine then
+ * returns its partition sorted that way and the backend merges the streams
+ * of the sessions; a sorted stream is required whether or not the engine is
+ * told, since the Sort is part of the plan it runs.
+ */
+
+#include <cstdint>
+
+struct InputHeader {
+	/* estimated number of rows, 0 if unknown; lets the engine pre-size its hash table */
+	uint64_t est_rows;
+	/* estimated size of tuple data in bytes, 0 if unknown */
+	uint64_t est_bytes;
+	/* chunks are grouped into 1 << radix_bits partitions, 0 if not hashed */
+	uint32_t radix_bits;
+	/* column of the join key that is hashed */
+	uint32_t key_column;
+	/* INPUT_KEEP_SESSION, INPUT_REUSE, INPUT_OUTER, INPUT_INNER */
+	uint32_t flags;
+	/* JOIN_TYPE_* of the lowest join above the input */
+	uint32_t join_type;
+};
+
+/* results are sent in segments and the connection stays open for the next run */
+static constexpr uint32_t INPUT_KEEP_SESSION = 0x1;
+/* the rows of this input are those of the previous run of the session */
+static constexpr uint32_t INPUT_REUSE = 0x2;
+/* the input is below the outer (probe) side of its join */
+static constexpr uint32_t INPUT_OUTER = 0x4;
+/* the input is below the inner (build) side of its join */
+static constexpr uint32_t INPUT_INNER = 0x8;
+
+/* join types, with the values of PostgreSQL's JoinType */
+static constexpr uint32_t JOIN_TYPE_INNER = 0;
+/* every outer row, NULL-extended if it has no match */
+static constexpr uint32_t JOIN_TYPE_LEFT = 1;
+/* every row of both sides */
+static constexpr uint32_t JOIN_TYPE_FULL = 2;
+/* every inner row, NULL-extended if it has no match */
+static constexpr uint32_t JOIN_TYPE_RIGHT = 3;
+/* outer rows with a match, each once */
+static constexpr uint32_t JOIN_TYPE_SEMI = 4;
+/* outer rows without a match */
+static constexpr uint32_t JOIN_TYPE_ANTI = 5;
+
+struct ChunkHeader {
+	/* size of tuple data following this header, 0 terminates the input */
+	uint64_t size;
+	/* number of tuples in the chunk */
+	uint32_t nrows;
+	/* CHUNK_FILTER_REQUEST on a terminator, otherwise 0 */
+	uint32_t flags;
+	/* size of variable length area following the tuple data */
+	uint64_t var_size;
+	/* size of null bitmaps following the variable length area, 0 if no row has a NULL */
+	uint64_t null_size;
+	/* size of the hash area following the null bitmaps */
+	uint64_t hash_size;
+};
+
+struct RunHeader {
+	/* hash of the template and of the settings that shape the inputs */
+	uint64_t template_id;
+	/* size of the template text following, 0 if sent on this connection before */
+	uint32_t template_size;
+	/* ParamValues following the join graph */
+	uint32_t nparams;
+	/* OrderKeys following the template, 0 if the results are unordered */
+	uint32_t norder;
+	/* bytes of the join graph following the OrderKeys, 0 if none */
+	uint32_t graph_size;
+};
+
+/* descending order */
+static constexpr uint32_t ORDER_DESC = 0x1;
+/* NULLs come before other values */
+static constexpr uint32_t ORDER_NULLS_FIRST = 0x2;
+
+struct OrderKey {
+	/* 0-based column of the result row */
+	uint32_t column;
+	/* type oid of the column */
+	uint32_t type;
+	/* collation oid to compare by, 0 for byte order */
+	uint32_t collation;
+	/* ORDER_DESC, ORDER_NULLS_FIRST */
+	uint32_t flags;
+};
+
+struct JoinGraphHeader {
+	/* JoinInputs following, one per input in scan order */
+	uint32_t ninputs;
+	/* JoinNodes following the JoinInputs, each followed by its JoinClauses */
+	uint32_t njoins;
+};
+
+struct JoinInput {
+	/* oid of the relation scanned, 0 if none */
+	uint32_t relation;
+	/* columns of an input row */
+	uint32_t ncolumns;
+};
+
+/* how PostgreSQL planned a join, a hint only */
+static constexpr uint32_t JOIN_METHOD_NESTLOOP = 0;
+static constexpr uint32_t JOIN_METHOD_MERGE = 1;
+static constexpr uint32_t JOIN_METHOD_HASH = 2;
+
+/* the join has conditions or nodes the graph does not describe, see the template */
+static constexpr uint32_t JOIN_NODE_PARTIAL = 0x1;
+
+/* a child that is neither an input nor a join */
+static constexpr int32_t JOIN_CHILD_OTHER = INT32_MIN;
+
+struct JoinNode {
+	/* JOIN_TYPE_* */
+	uint32_t join_type;
+	/* JOIN_METHOD_* */
+	uint32_t method;
+	/* input n as n, the join k of the graph as -1 - k, or JOIN_CHILD_OTHER */
+	int32_t outer;
+	int32_t inner;
+	/* JoinClauses following */
+	uint32_t nclauses;
+	/* JOIN_NODE_PARTIAL */
+	uint32_t flags;
+	/* planner estimate of the rows the join returns */
+	uint64_t est_rows;
+};
+
+/* comparisons of a clause, with the values of btree strategies */
+static constexpr uint32_t JOIN_CLAUSE_LT = 1;
+static constexpr uint32_t JOIN_CLAUSE_LE = 2;
+static constexpr uint32_t JOIN_CLAUSE_EQ = 3;
+static constexpr uint32_t JOIN_CLAUSE_GE = 4;
+static constexpr uint32_t JOIN_CLAUSE_GT = 5;
+
+/* left column compared with right column; an equality is an equi-join key, others form band joins */
+struct JoinClause {
+	/* JOIN_CLAUSE_* */
+	uint32_t compare;
+	/* oid of the operator */
+	uint32_t op;
+	/* input and 0-based column of either side */
+	uint32_t left_input;
+	uint32_t left_column;
+	uint32_t right_input;
+	uint32_t right_column;
+};
+
+/* the value is NULL */
+static constexpr uint32_t PARAM_VALUE_NULL = 0x1;
+/* a parameter set by the executor ($n of a nested loop or subquery), not by the client */
+static constexpr uint32_t PARAM_VALUE_EXEC = 0x2;
+/* the value is not known when the run starts */
+static constexpr uint32_t PARAM_VALUE_UNKNOWN = 0x4;
+
+struct ParamValue {
+	/* n of $n */
+	uint32_t paramid;
+	/* type oid of the value */
+	uint32_t type;
+	/* PARAM_VALUE_NULL, PARAM_VALUE_EXEC, PARAM_VALUE_UNKNOWN */
+	uint32_t flags;
+	/* bytes of the text form following */
+	uint32_t size;
+};
+
+/* varlena column of an encoded input row */
+struct VarlenaRef {
+	/* offset of the value in the variable length areas of the input */
+	uint64_t offset;
+	/* length of the value in bytes */
+	uint32_t length;
+	/* reserved, 0 */
+	uint32_t flags;
+};
+
+/* a FilterRequest follows the terminating ChunkHeader */
+static constexpr uint32_t CHUNK_FILTER_REQUEST = 0x1;
+
+/*
+ * Request for the join keys of the input just sent. PostgreSQL drops rows of
+ * a later input whose key is outside the reply, so the engine must only
+ * answer for keys it actually received.
+ */
+struct FilterRequest {
+	/* column of the input rows holding the join key, an integer of its width */
+	uint32_t column;
+	/* most keys the reply may list, 0 for a range only */
+	uint32_t max_values;
+};
+
+/* min and max are set */
+static constexpr uint32_t FILTER_RANGE = 0x1;
+/* int64_t[nvalues] distinct keys follow the reply */
+static constexpr uint32_t FILTER_VALUES = 0x2;
+/* no row had a non-NULL key */
+static constexpr uint32_t FILTER_EMPTY = 0x4;
+
+/* answer to a FilterRequest; flags 0 means no filter */
+struct FilterReply {
+	uint32_t flags;
+	uint32_t nvalues;
+	int64_t min;
+	int64_t max;
+};
+
+/* validity bitmaps follow the batch header */
+static constexpr uint32_t RESULT_HAS_NULLS = 0x1;
+
+struct ResultBatchHeader {
+	/* number of rows in the batch */
+	uint32_t nrows;
+	/* RESULT_HAS_NULLS */
+	uint32_t flags;
+};
+
+/*
+ * With external_join.capture on, every connection PostgreSQL opens to an
+ * engine is also written to a file in pg_external_join_capture: a
+ * CaptureHeader, then exactly the bytes sent on the connection, run after
+ * run, until it is closed. Sending those bytes to an engine reproduces the
+ * workload without a database (see replay in external_sample).
+ */
+static constexpr uint32_t CAPTURE_MAGIC = 0x314A4543;	/* "CEJ1" */
+
+struct CaptureHeader {
+	uint32_t magic;
+	/* process id of the backend */
+	uint32_t pid;
+	/* connections opened together for a run of a node, numbered per backend */
+	uint32_t group;
+	/* session of the connection in its group */
+	uint32_t session;
+	/* microseconds since the epoch when the connection was opened */
+	uint64_t started;
+	/* host:port of the engine, NUL terminated */
+	char endpoint[64];
+};
+
+#endif //EXTERNALPROTOCOL_HEAD_
@@ -0,0 +1,525 @@
+#ifndef GATEWAY_HEAD_
+#define GATEWAY_HEAD_
+
+/*
+ * Gateway worker holding the engine connections of all backends.
+ *
+ * With external_join.gateway_connections set, a background worker started
+ * by the postmaster keeps up to that many connections per endpoint open
+ * and backends reach the engines through it, so the engines see a flat
+ * number of connections however many backends run offloaded queries.
+ * A backend creates a GatewayChannel per session and registers it in a
+ * slot of the shared table below; the worker attaches the channel and
+ * binds it to an idle connection of its endpoint, connecting another one
+ * below the limit. Channels that find none wait in arrival order, except
+ * those of a backend which already holds a connection, since the sessions
+ * of one query cannot finish one after another; these get one beyond the
+ * limit. The worker moves bytes between rings and sockets in one poll
+ * loop and follows the result segments of kept sessions (see
+ * ExternalProtocol.hpp), which are what runs through the gateway use:
+ * after the terminating segment the engine waits for the next run, and a
+ * connection released there goes back to the idle ones. A connection
+ * released in the middle of a run is closed.
+ */
+class Gateway {
+public:
+	static constexpr int MAX_CHANNELS = 512;
+	static constexpr int MAX_CONNECTIONS = 256;
+
+private:
+	struct Slot {
+		bool used;
+		dsm_handle handle;
+	};
+	struct Shared {
+		slock_t mutex;
+		/* 0 while no worker runs */
+		pid_t pid;
+		Latch *latch;
+		Slot slots[MAX_CHANNELS];
+	};
+
+	/* channel attached by the worker, indexed by its slot */
+	struct Link {
+		bool used;
+		dsm_segment *seg;
+		GatewayChannelShared *gcs;
+		/* bound connection, or -1 */
+		int conn;
+		/* arrival order of waiting channels */
+		uint64 seq;
+		/* the engine got bytes after the last terminating segment */
+		bool pending;
+		/* position in the result segments the engine sends */
+		uint64 segment_left;
+		int header_len;
+		char header[sizeof(uint64)];
+	};
+	struct Connection {
+		bool used;
+		int sock;
+		char endpoint[ENDPOINT_LEN];
+		/* bound channel, or -1 if idle */
+		int link;
+	};
+
+	Shared *shared;
+	/* worker side */
+	Link *links;
+	Connection *conns;
+	uint64 next_seq;
+	int max_connections;
+
+public:
+	Gateway(void) { this->init(); }
+	~Gateway(void) { this->fini(); }
+
+	/* per process handle of the shared state */
+	static Gateway *
+	instance(void) {
+		static Gateway gateway;
+		return &gateway;
+	}
+
+	void init(void) {
+		this->shared = NULL;
+		this->links = NULL;
+		this->conns = NULL;
+		this->next_seq = 0;
+		this->max_connections = 0;
+	}
+	void fini(void) {
+	}
+
+	/* reserve shared memory; must be called from _PG_init of a preloaded library */
+	static
+	void
+	request(void) {
+		RequestAddinShmemSpace(MAXALIGN(sizeof(Shared)));
+	}
+
+	/* create or attach to the shared state, called from shmem_startup_hook */
+	void
+	startup(void) {
+		bool found;
+
+		LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+		this->shared = static_cast<Shared *>(ShmemInitStruct("external_join gateway", sizeof(Shared), &found));
+		if (!found) {
+			std::memset(static_cast<void *>(this->shared), 0, sizeof(Shared));
+			SpinLockInit(&this->shared->mutex);
+		}
+		LWLockRelease(AddinShmemInitLock);
+	}
+
+	/* a worker runs and takes channels */
+	bool
+	isRunning(void) const {
+		return (this->shared != NULL && this->shared->pid != 0);
+	}
+
+	/* backend: register a created channel, false if there is no worker or no free slot */
+	bool
+	submit(GatewayChannel *gc) {
+		GatewayChannelShared *gcs = gc->getShared();
+		Latch *latch;
+		int slot = -1;
+
+		if (!this->isRunning())
+			return false;
+		SpinLockAcquire(&this->shared->mutex);
+		latch = this->shared->latch;
+		for (int i = 0; latch != NULL && i < MAX_CHANNELS; i++) {
+			if (!this->shared->slots[i].used) {
+				slot = i;
+				break;
+			}
+		}
+		if (slot >= 0) {
+			/* the worker reads the channel only once it has seen its handle */
+			gcs->slot = slot;
+			gcs->gateway_latch = latch;
+			this->shared->slots[slot].handle = gc->getHandle();
+			this->shared->slots[slot].used = true;
+		}
+		SpinLockRelease(&this->shared->mutex);
+		if (slot < 0)
+			return false;
+		SetLatch(latch);
+		return true;
+	}
+
+	/* backend: wait until the channel got a connection, false if it will not get one */
+	bool
+	waitBound(GatewayChannel *gc) {
+		for (;;) {
+			uint32 state = gc->getState();
+
+			if (state == CHANNEL_BOUND)
+				return true;
+			if (state == CHANNEL_FAILED || !this->isRunning())
+				return false;
+			CHECK_FOR_INTERRUPTS();
+			::usleep(100);
+		}
+	}
+
+	/* worker: serve channels until terminate is set */
+	void
+	run(int max_connections, volatile sig_atomic_t *terminate) {
+		this->max_connections = max_connections;
+		this->links = static_cast<Link *>(MemoryContextAllocZero(TopMemoryContext, sizeof(Link) * MAX_CHANNELS));
+		this->conns = static_cast<Connection *>(MemoryContextAllocZero(TopMemoryContext, sizeof(Connection) * MAX_CONNECTIONS));
+		/* slots of an earlier worker belong to channels that failed with it */
+		SpinLockAcquire(&this->shared->mutex);
+		std::memset(static_cast<void *>(this->shared->slots), 0, sizeof(this->shared->slots));
+		this->shared->latch = MyLatch;
+		this->shared->pid = MyProcPid;
+		SpinLockRelease(&this->shared->mutex);
+		before_shmem_exit(Gateway::onExit, 0);
+		elog(LOG, "external_join gateway started with %d connections per endpoint", max_connections);
+
+		while (!*terminate) {
+			bool progress;
+
+			ResetLatch(MyLatch);
+			this->attachRequested();
+			this->bindWaiting();
+			progress = this->forward();
+			this->releaseClosed();
+			if (!progress)
+				this->waitForWork();
+			if (!PostmasterIsAlive())
+				proc_exit(1);
+		}
+	}
+
+private:
+	/* attach channels registered since the last round */
+	void
+	attachRequested(void) {
+		for (int i = 0; i < MAX_CHANNELS; i++) {
+			Link *link = &this->links[i];
+			dsm_handle handle;
+			bool used;
+
+			if (link->used)
+				continue;
+			SpinLockAcquire(&this->shared->mutex);
+			used = this->shared->slots[i].used;
+			handle = this->shared->slots[i].handle;
+			SpinLockRelease(&this->shared->mutex);
+			if (!used)
+				continue;
+			std::memset(static_cast<void *>(link), 0, sizeof(*link));
+			link->seg = dsm_attach(handle);
+			/* the backend closed the channel before it was taken up */
+			if (link->seg == NULL) {
+				this->freeSlot(i);
+				continue;
+			}
+			link->used = true;
+			link->gcs = static_cast<GatewayChannelShared *>(dsm_segment_address(link->seg));
+			link->conn = -1;
+			link->seq = this->next_seq++;
+		}
+	}
+
+	/* give waiting channels a connection, oldest first */
+	void
+	bindWaiting(void) {
+		for (;;) {
+			Link *next = NULL;
+			int conn;
+
+			for (int i = 0; i < MAX_CHANNELS; i++) {
+				Link *link = &this->links[i];
+
+				if (link->used && link->conn < 0 && !this->isDone(link) &&
+				    pg_atomic_read_u32(&link->gcs->state) == CHANNEL_WAITING &&
+				    (next == NULL || link->seq < next->seq) && this->canBind(link))
+					next = link;
+			}
+			if (next == NULL)
+				return ;
+			conn = this->findIdle(next->gcs->endpoint);
+			if (conn < 0)
+				conn = this->connect(next->gcs);
+			if (conn < 0) {
+				pg_atomic_write_u32(&next->gcs->state, CHANNEL_FAILED);
+				continue;
+			}
+			this->conns[conn].link = next - this->links;
+			next->conn = conn;
+			next->pending = false;
+			next->segment_left = 0;
+			next->header_len = 0;
+			pg_atomic_write_u32(&next->gcs->state, CHANNEL_BOUND);
+		}
+	}
+
+	/* an idle connection, room for a new one, or a backend that must not wait */
+	bool
+	canBind(Link *link) {
+		int n = 0;
+
+		if (this->findIdle(link->gcs->endpoint) >= 0)
+			return true;
+		for (int i = 0; i < MAX_CONNECTIONS; i++) {
+			if (this->conns[i].used && std::strcmp(this->conns[i].endpoint, link->gcs->endpoint) == 0)
+				n++;
+		}
+		if (n < this->max_connections)
+			return this->findFree() >= 0;
+		for (int i = 0; i < MAX_CHANNELS; i++) {
+			Link *other = &this->links[i];
+
+			if (other->used && other->conn >= 0 && other->gcs->pid == link->gcs->pid)
+				return this->findFree() >= 0;
+		}
+		return false;
+	}
+
+	int
+	findIdle(const char *endpoint) {
+		for (int i = 0; i < MAX_CONNECTIONS; i++) {
+			if (this->conns[i].used && this->conns[i].link < 0 && std::strcmp(this->conns[i].endpoint, endpoint) == 0)
+				return i;
+		}
+		return -1;
+	}
+
+	int
+	findFree(void) {
+		for (int i = 0; i < MAX_CONNECTIONS; i++) {
+			if (!this->conns[i].used)
+				return i;
+		}
+		return -1;
+	}
+
+	/* open a connection for a channel, -1 if the endpoint does not answer */
+	int
+	connect(GatewayChannelShared *gcs) {
+		int i = this->findFree();
+		int sock;
+
+		if (i < 0)
+			return -1;
+		sock = connectSock(gcs->host, gcs->port);
+		if (sock < 0) {
+			elog(LOG, "external_join gateway failed to connect %s", gcs->endpoint);
+			return -1;
+		}
+		::fcntl(sock, F_SETFL, ::fcntl(sock, F_GETFL) | O_NONBLOCK);
+		this->conns[i].used = true;
+		this->conns[i].sock = sock;
+		this->conns[i].link = -1;
+		strlcpy(this->conns[i].endpoint, gcs->endpoint, ENDPOINT_LEN);
+		return i;
+	}
+
+	/* move bytes of bound channels, true if any moved */
+	bool
+	forward(void) {
+		bool progress = false;
+
+		for (int i = 0; i < MAX_CHANNELS; i++) {
+			Link *link = &this->links[i];
+			GatewayChannelShared *gcs = link->gcs;
+			char *ptr;
+			uint32 n;
+			ssize_t r;
+
+			if (!link->used || link->conn < 0 || this->isDone(link))
+				continue;
+			/* backend to engine */
+			n = GatewayChannel::peek(&gcs->to_engine, &ptr);
+			if (n > 0) {
+				r = ::send(this->conns[link->conn].sock, ptr, n, MSG_DONTWAIT | MSG_NOSIGNAL);
+				if (r > 0) {
+					GatewayChannel::consume(&gcs->to_engine, r);
+					link->pending = true;
+					progress = true;
+				}
+				else if (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+					this->drop(link);
+					continue;
+				}
+			}
+			/* engine to backend */
+			n = GatewayChannel::reserve(&gcs->to_backend, &ptr);
+			if (n > 0) {
+				r = ::recv(this->conns[link->conn].sock, ptr, n, MSG_DONTWAIT);
+				if (r > 0) {
+					this->follow(link, ptr, r);
+					GatewayChannel::commit(&gcs->to_backend, r);
+					progress = true;
+				}
+				else if (r == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+					this->drop(link);
+			}
+		}
+		return progress;
+	}
+
+	/* track the result segments, so that the end of a run is known */
+	void
+	follow(Link *link, const char *data, std::size_t size) {
+		while (size > 0) {
+			std::size_t n;
+
+			if (link->segment_left > 0) {
+				n = Min(static_cast<uint64>(size), link->segment_left);
+				link->segment_left -= n;
+				data += n;
+				size -= n;
+				continue;
+			}
+			n = Min(size, sizeof(link->header) - link->header_len);
+			std::memcpy(link->header + link->header_len, data, n);
+			link->header_len += n;
+			data += n;
+			size -= n;
+			if (link->header_len == sizeof(link->header)) {
+				uint64 len;
+
+				std::memcpy(&len, link->header, sizeof(len));
+				link->header_len = 0;
+				/* the terminating segment */
+				if (len == 0)
+					link->pending = false;
+				link->segment_left = len;
+			}
+		}
+	}
+
+	/* the connection is gone; the backend reads what was stored before it sees that */
+	void
+	drop(Link *link) {
+		this->closeConnection(link->conn);
+		link->conn = -1;
+		pg_atomic_write_u32(&link->gcs->state, CHANNEL_FAILED);
+	}
+
+	bool
+	isDone(Link *link) {
+		return pg_atomic_read_u32(&link->gcs->closed) != 0;
+	}
+
+	/* detach channels the backends closed, keeping connections that are between runs */
+	void
+	releaseClosed(void) {
+		for (int i = 0; i < MAX_CHANNELS; i++) {
+			Link *link = &this->links[i];
+
+			if (!link->used || !this->isDone(link))
+				continue;
+			if (link->conn >= 0) {
+				Connection *conn = &this->conns[link->conn];
+				int n = 0;
+
+				for (int j = 0; j < MAX_CONNECTIONS; j++) {
+					if (this->conns[j].used && std::strcmp(this->conns[j].endpoint, conn->endpoint) == 0)
+						n++;
+				}
+				if (!link->pending && link->segment_left == 0 && link->header_len == 0 && n <= this->max_connections)
+					conn->link = -1;
+				else
+					this->closeConnection(link->conn);
+			}
+			dsm_detach(link->seg);
+			link->used = false;
+			this->freeSlot(i);
+		}
+	}
+
+	/*
+	 * Sleep until a socket is ready or a backend sets the latch. WaitLatch()
+	 * of 9.5 takes one socket, so the sockets are polled with SIGUSR1, which
+	 * SetLatch() sends, blocked until ppoll() unblocks it; a latch set after
+	 * the check below interrupts ppoll() then.
+	 */
+	void
+	waitForWork(void) {
+		struct pollfd pfds[MAX_CONNECTIONS];
+		int index[MAX_CONNECTIONS];
+		int n = 0;
+		int ready;
+		sigset_t block, unblocked;
+		struct timespec timeout = { 1, 0 };
+
+		sigemptyset(&block);
+		sigaddset(&block, SIGUSR1);
+		sigprocmask(SIG_BLOCK, &block, &unblocked);
+		/* the fill levels the backends left after setting or before checking the latch */
+		pg_memory_barrier();
+		if (MyLatch->is_set) {
+			sigprocmask(SIG_SETMASK, &unblocked, NULL);
+			return ;
+		}
+		for (int i = 0; i < MAX_CONNECTIONS; i++) {
+			Connection *conn = &this->conns[i];
+			short events = POLLIN;
+
+			if (!conn->used)
+				continue;
+			if (conn->link >= 0) {
+				GatewayChannelShared *gcs = this->links[conn->link].gcs;
+
+				events = 0;
+				if (GatewayChannel::getFill(&gcs->to_backend) < GatewayChannel::RING_SIZE)
+					events |= POLLIN;
+				if (GatewayChannel::getFill(&gcs->to_engine) > 0)
+					events |= POLLOUT;
+			}
+			pfds[n].fd = conn->sock;
+			pfds[n].events = events;
+			pfds[n].revents = 0;
+			index[n++] = i;
+		}
+		ready = ::ppoll(pfds, n, &timeout, &unblocked);
+		sigprocmask(SIG_SETMASK, &unblocked, NULL);
+		if (ready <= 0)
+			return ;
+		for (int i = 0; i < n; i++) {
+			Connection *conn = &this->conns[index[i]];
+
+			/* an engine closing an idle connection */
+			if (conn->link < 0 && pfds[i].revents != 0)
+				this->closeConnection(index[i]);
+		}
+	}
+
+	void
+	closeConnection(int i) {
+		::close(this->conns[i].sock);
+		this->conns[i].used = false;
+		this->conns[i].link = -1;
+	}
+
+	void
+	freeSlot(int i) {
+		SpinLockAcquire(&this->shared->mutex);
+		this->shared->slots[i].used = false;
+		SpinLockRelease(&this->shared->mutex);
+	}
+
+	/* backends waiting on channels of this worker must not wait forever */
+	static
+	void
+	onExit(int code, Datum arg) {
+		Gateway *gw = Gateway::instance();
+
+		SpinLockAcquire(&gw->shared->mutex);
+		gw->shared->pid = 0;
+		gw->shared->latch = NULL;
+		SpinLockRelease(&gw->shared->mutex);
+		for (int i = 0; gw->links != NULL && i < MAX_CHANNELS; i++) {
+			if (gw->links[i].used)
+				pg_atomic_write_u32(&gw->links[i].gcs->state, CHANNEL_FAILED);
+		}
+	}
+};
+
+#endif //GATEWAY_HEAD_
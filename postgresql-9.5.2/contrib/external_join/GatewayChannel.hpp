@@ -0,0 +1,296 @@
+#ifndef GATEWAYCHANNEL_HEAD_
+#define GATEWAYCHANNEL_HEAD_
+
+/*
+ * Byte streams between a session of a backend and the gateway worker.
+ *
+ * A channel is a dynamic shared memory segment holding one ring per
+ * direction, each written by one side and read by the other. The session
+ * threads of the backend use it like their socket: send() and receive()
+ * behave like sendStrong() and receiveStrong() of socket_lapper.hpp, spin
+ * while the ring is full or empty and neither allocate nor report errors.
+ * (shm_mq cannot be driven from those threads, since it allocates for
+ * messages wrapping around its ring and waits on the process latch.) Ring
+ * positions are byte counters that wrap around at 2^32, so their
+ * difference is the fill level. The gateway sleeps on its latch and the
+ * sockets, so the backend sets the latch when a ring the gateway reads may
+ * have been empty and when a ring the gateway writes may have been full;
+ * the backend polls, as it does for its result buffers.
+ */
+struct GatewayRing {
+	/* bytes written and read since the channel was created, modulo 2^32 */
+	pg_atomic_uint32 written;
+	pg_atomic_uint32 read;
+	char data[1024 * 1024];
+};
+
+/* the channel waits for an engine connection of the gateway */
+static constexpr uint32 CHANNEL_WAITING = 0;
+/* the channel is bound to a connection until the backend closes it */
+static constexpr uint32 CHANNEL_BOUND = 1;
+/* the gateway could not connect, or the connection is gone */
+static constexpr uint32 CHANNEL_FAILED = 2;
+
+struct GatewayChannelShared {
+	pg_atomic_uint32 state;
+	/* the backend closed the channel */
+	pg_atomic_uint32 closed;
+	/* slot of the gateway the channel is registered in */
+	int slot;
+	pid_t pid;
+	/* latch to set when the backend wrote to an empty ring or read from a full one */
+	Latch *gateway_latch;
+	char endpoint[ENDPOINT_LEN];
+	char host[ENDPOINT_LEN];
+	int port;
+	/* backend to engine and engine to backend */
+	GatewayRing to_engine;
+	GatewayRing to_backend;
+};
+
+class GatewayChannel {
+public:
+	static constexpr uint32 RING_SIZE = sizeof(GatewayRing::data);
+
+private:
+	dsm_segment *seg;
+	GatewayChannelShared *shared;
+
+public:
+	GatewayChannel(void) { this->init(); }
+	~GatewayChannel(void) { this->fini(); }
+
+	static GatewayChannel *constructor(void) {
+		GatewayChannel *gc = static_cast<GatewayChannel *>(palloc(sizeof(*gc)));
+		gc->init();
+		return gc;
+	}
+	static void destructor(GatewayChannel *gc) {
+		gc->fini();
+		pfree(gc);
+	}
+
+	void init(void) {
+		this->seg = NULL;
+		this->shared = NULL;
+	}
+	void fini(void) {
+		this->close();
+	}
+
+	/* create the segment of a channel to host:port; it lives until close(), not until the query ends */
+	void
+	create(const char *host, int port) {
+		GatewayChannelShared *gcs;
+
+		this->seg = dsm_create(sizeof(GatewayChannelShared), 0);
+		dsm_pin_mapping(this->seg);
+		gcs = static_cast<GatewayChannelShared *>(dsm_segment_address(this->seg));
+		pg_atomic_init_u32(&gcs->state, CHANNEL_WAITING);
+		pg_atomic_init_u32(&gcs->closed, 0);
+		gcs->slot = -1;
+		gcs->pid = MyProcPid;
+		gcs->gateway_latch = NULL;
+		snprintf(gcs->endpoint, ENDPOINT_LEN, "%s:%d", host, port);
+		strlcpy(gcs->host, host, ENDPOINT_LEN);
+		gcs->port = port;
+		GatewayChannel::initRing(&gcs->to_engine);
+		GatewayChannel::initRing(&gcs->to_backend);
+		this->shared = gcs;
+	}
+
+	dsm_handle
+	getHandle(void) const {
+		return dsm_segment_handle(this->seg);
+	}
+
+	GatewayChannelShared *
+	getShared(void) const {
+		return this->shared;
+	}
+
+	/* state of the channel, CHANNEL_WAITING until the gateway took it up */
+	uint32
+	getState(void) const {
+		return pg_atomic_read_u32(&this->shared->state);
+	}
+
+	/* thread safe: like sendStrong(), -1 if the connection is gone */
+	long
+	send(const void *data, long size) {
+		GatewayRing *ring = &this->shared->to_engine;
+		const char *src = static_cast<const char *>(data);
+		long done = 0;
+
+		while (done < size) {
+			uint32 n;
+
+			pthread_testcancel();
+			if (pg_atomic_read_u32(&this->shared->state) == CHANNEL_FAILED)
+				return (done > 0) ? done : -1;
+			n = GatewayChannel::put(ring, src + done, size - done);
+			if (n == 0) {
+				::usleep(1);
+				continue;
+			}
+			done += n;
+			/* no more than n bytes in the ring now: it may have been empty when the gateway looked */
+			pg_memory_barrier();
+			if (GatewayChannel::getFill(ring) <= n)
+				this->wakeGateway();
+		}
+		return done;
+	}
+
+	/* thread safe: like receiveStrong(), 0 once the connection is gone and everything was read */
+	long
+	receive(void *buf, long size) {
+		GatewayRing *ring = &this->shared->to_backend;
+		char *dst = static_cast<char *>(buf);
+		long done = 0;
+
+		while (done < size) {
+			uint32 n;
+
+			pthread_testcancel();
+			n = GatewayChannel::get(ring, dst + done, size - done);
+			if (n > 0) {
+				done += n;
+				/* the ring held RING_SIZE bytes with these n: the gateway may have stopped reading its socket */
+				pg_memory_barrier();
+				if (GatewayChannel::getFill(ring) + n >= RING_SIZE)
+					this->wakeGateway();
+				continue;
+			}
+			/* the gateway stores all the engine sent before it marks the connection gone */
+			if (pg_atomic_read_u32(&this->shared->state) == CHANNEL_FAILED) {
+				pg_memory_barrier();
+				if (GatewayChannel::getFill(ring) == 0)
+					break;
+				continue;
+			}
+			::usleep(1);
+		}
+		return done;
+	}
+
+	/* SetLatch() only signals, so the session threads may call it */
+	void
+	wakeGateway(void) {
+		if (this->shared->gateway_latch != NULL)
+			SetLatch(this->shared->gateway_latch);
+	}
+
+	/* tell the gateway the channel is done with, and unmap it */
+	void
+	close(void) {
+		if (this->seg == NULL)
+			return ;
+		pg_atomic_write_u32(&this->shared->closed, 1);
+		if (this->shared->gateway_latch != NULL)
+			SetLatch(this->shared->gateway_latch);
+		dsm_detach(this->seg);
+		this->seg = NULL;
+		this->shared = NULL;
+	}
+
+	/* ring primitives, used by both sides */
+	static
+	void
+	initRing(GatewayRing *ring) {
+		pg_atomic_init_u32(&ring->written, 0);
+		pg_atomic_init_u32(&ring->read, 0);
+	}
+
+	static
+	uint32
+	getFill(GatewayRing *ring) {
+		return pg_atomic_read_u32(&ring->written) - pg_atomic_read_u32(&ring->read);
+	}
+
+	/* contiguous bytes the reader may take, at *ptr */
+	static
+	uint32
+	peek(GatewayRing *ring, char **ptr) {
+		uint32 read = pg_atomic_read_u32(&ring->read);
+		uint32 fill = pg_atomic_read_u32(&ring->written) - read;
+		uint32 offset = read % RING_SIZE;
+
+		/* the data must not be read before the counter that publishes it */
+		pg_read_barrier();
+		*ptr = &ring->data[offset];
+		return Min(fill, RING_SIZE - offset);
+	}
+
+	static
+	void
+	consume(GatewayRing *ring, uint32 n) {
+		/* the data must be read before the writer may overwrite it */
+		pg_memory_barrier();
+		pg_atomic_write_u32(&ring->read, pg_atomic_read_u32(&ring->read) + n);
+	}
+
+	/* contiguous bytes the writer may fill, at *ptr */
+	static
+	uint32
+	reserve(GatewayRing *ring, char **ptr) {
+		uint32 written = pg_atomic_read_u32(&ring->written);
+		uint32 space = RING_SIZE - (written - pg_atomic_read_u32(&ring->read));
+		uint32 offset = written % RING_SIZE;
+
+		pg_memory_barrier();
+		*ptr = &ring->data[offset];
+		return Min(space, RING_SIZE - offset);
+	}
+
+	static
+	void
+	commit(GatewayRing *ring, uint32 n) {
+		/* the data must be visible before the counter that publishes it */
+		pg_write_barrier();
+		pg_atomic_write_u32(&ring->written, pg_atomic_read_u32(&ring->written) + n);
+	}
+
+private:
+	static
+	uint32
+	put(GatewayRing *ring, const char *src, long size) {
+		uint32 done = 0;
+
+		while (size > 0) {
+			char *ptr;
+			uint32 n = GatewayChannel::reserve(ring, &ptr);
+
+			n = Min(static_cast<long>(n), size);
+			if (n == 0)
+				break;
+			std::memcpy(ptr, src + done, n);
+			GatewayChannel::commit(ring, n);
+			done += n;
+			size -= n;
+		}
+		return done;
+	}
+
+	static
+	uint32
+	get(GatewayRing *ring, char *dst, long size) {
+		uint32 done = 0;
+
+		while (size > 0) {
+			char *ptr;
+			uint32 n = GatewayChannel::peek(ring, &ptr);
+
+			n = Min(static_cast<long>(n), size);
+			if (n == 0)
+				break;
+			std::memcpy(dst + done, ptr, n);
+			GatewayChannel::consume(ring, n);
+			done += n;
+			size -= n;
+		}
+		return done;
+	}
+};
+
+#endif //GATEWAYCHANNEL_HEAD_
@@ -0,0 +1,248 @@
+#ifndef INPUTPARTITIONER_HEAD_
+#define INPUTPARTITIONER_HEAD_
+
+/*
+ * Hash partitioning of join inputs across several external engines.
+ *
+ * An equi-join of two inputs can be split into independent joins of
+ * partitions with the same hash value of the join key. The key of each input
+ * is taken from the first hashable equality clause of the join node directly
+ * below the external join and traced down to a column of the scan node that
+ * produces the input. Keys are hashed with the hash function of the operator's
+ * hash opfamily, so the two sides agree even for cross-type operators.
+ *
+ * The same hashes let the engine skip hashing: with radix bits set, every
+ * row is shipped with its hash and chunks are grouped into radix partitions
+ * (see TupleBuffer::seal()). That also works with a single session.
+ */
+class InputPartitioner {
+private:
+	int ninputs;
+	int nparts;
+	/* rows are shipped with hashes in 1 << radix_bits partitions, 0 if not */
+	int radix_bits;
+	/* per input, column of the scan output slot holding the join key */
+	AttrNumber *attnos;
+	/* per input, hash function of the key type */
+	FmgrInfo *hashfns;
+	Oid collation;
+
+public:
+	InputPartitioner(void) { this->init(); }
+	~InputPartitioner(void) { this->fini(); }
+
+	static InputPartitioner *constructor(void) {
+		InputPartitioner *ip = static_cast<InputPartitioner *>(palloc(sizeof(*ip)));
+		ip->init();
+		return ip;
+	}
+	static void destructor(InputPartitioner *ip) {
+		ip->fini();
+		pfree(ip);
+	}
+
+	void init(void) {
+		this->ninputs = 0;
+		this->nparts = 1;
+		this->radix_bits = 0;
+		this->attnos = NULL;
+		this->hashfns = NULL;
+		this->collation = InvalidOid;
+	}
+	void fini(void) {
+		if (this->attnos != NULL)
+			pfree(this->attnos);
+		if (this->hashfns != NULL)
+			pfree(this->hashfns);
+		this->init();
+	}
+
+	/*
+	 * Set up partitioning of inputs (scan nodes below join) into nparts
+	 * sessions and 1 << radix_bits radix partitions.
+	 * Returns false if the join cannot be partitioned on a key of both inputs.
+	 */
+	bool
+	build(PlanState *join, List *inputs, int nparts, int radix_bits) {
+		ListCell *lc;
+
+		this->fini();
+		if ((nparts <= 1 && radix_bits <= 0) || list_length(inputs) != 2)
+			return false;
+
+		foreach(lc, InputPartitioner::getJoinClauses(join)) {
+			OpExpr *op = static_cast<OpExpr *>(lfirst(lc));
+			PlanState *scan[2];
+			AttrNumber attno[2];
+			RegProcedure hashproc[2];
+			int index[2];
+
+			if (!IsA(op, OpExpr) || list_length(op->args) != 2)
+				continue;
+			if (!op_hashjoinable(op->opno, exprType(static_cast<Node *>(linitial(op->args)))))
+				continue;
+			if (!get_op_hash_functions(op->opno, &hashproc[0], &hashproc[1]))
+				continue;
+			for (int i = 0; i < 2; i++) {
+				Var *var = InputPartitioner::stripVar(static_cast<Node *>(list_nth(op->args, i)));
+
+				scan[i] = NULL;
+				attno[i] = InvalidAttrNumber;
+				if (var == NULL)
+					break;
+				if (var->varno == OUTER_VAR)
+					attno[i] = InputPartitioner::resolve(outerPlanState(join), var->varattno, &scan[i]);
+				else if (var->varno == INNER_VAR)
+					attno[i] = InputPartitioner::resolve(innerPlanState(join), var->varattno, &scan[i]);
+			}
+			if (attno[0] == InvalidAttrNumber || attno[1] == InvalidAttrNumber)
+				continue;
+			index[0] = InputPartitioner::indexOf(inputs, scan[0]);
+			index[1] = InputPartitioner::indexOf(inputs, scan[1]);
+			if (index[0] < 0 || index[1] < 0 || index[0] == index[1])
+				continue;
+
+			this->ninputs = 2;
+			this->nparts = Max(nparts, 1);
+			this->radix_bits = Max(radix_bits, 0);
+			this->attnos = static_cast<AttrNumber *>(palloc(sizeof(AttrNumber) * 2));
+			this->hashfns = static_cast<FmgrInfo *>(palloc(sizeof(FmgrInfo) * 2));
+			this->collation = op->inputcollid;
+			for (int i = 0; i < 2; i++) {
+				this->attnos[index[i]] = attno[i];
+				fmgr_info(hashproc[i], &this->hashfns[index[i]]);
+			}
+			elog(DEBUG2, ":: inputs partitioned into %d (%d radix bits) on attributes %d and %d",
+			     this->nparts, this->radix_bits, this->attnos[0], this->attnos[1]);
+			return true;
+		}
+		return false;
+	}
+
+	/* inputs are split among sessions */
+	bool
+	isPartitioned(void) const {
+		return (this->ninputs > 0 && this->nparts > 1);
+	}
+
+	/* rows are shipped with their hashes */
+	bool
+	isHashed(void) const {
+		return (this->ninputs > 0 && this->radix_bits > 0);
+	}
+
+	int
+	getRadixBits(void) const {
+		return this->radix_bits;
+	}
+
+	/* column of the scan output slot holding the key of the input */
+	AttrNumber
+	getKeyAttno(int input) const {
+		return this->attnos[input];
+	}
+
+	/* what a parallel scan worker needs to hash the input */
+	void
+	getHashKey(int input, ScanHashKey *key) const {
+		key->attno = this->attnos[input];
+		key->hashproc = this->hashfns[input].fn_oid;
+		key->collation = this->collation;
+	}
+
+	int
+	getPartitionCount(void) const {
+		return this->nparts;
+	}
+
+	/* hash of the key of a tuple of the input, 0 for a NULL key */
+	uint32
+	getHash(int input, TupleTableSlot *tts) {
+		bool isnull;
+		Datum key = slot_getattr(tts, this->attnos[input], &isnull);
+
+		return this->hashKey(input, key, isnull);
+	}
+
+	uint32
+	hashKey(int input, Datum key, bool isnull) {
+		if (isnull)
+			return 0;
+		return DatumGetUInt32(FunctionCall1Coll(&this->hashfns[input], this->collation, key));
+	}
+
+	/* session of a hash; tuples with NULL key go to partition 0 */
+	int
+	getPartition(uint32 hash) const {
+		return hash % this->nparts;
+	}
+
+	/* helpers shared with RuntimeFilter */
+	static
+	List *
+	getJoinClauses(PlanState *join) {
+		switch (nodeTag(join->plan)) {
+		case T_HashJoin:
+			return reinterpret_cast<HashJoin *>(join->plan)->hashclauses;
+		case T_MergeJoin:
+			return reinterpret_cast<MergeJoin *>(join->plan)->mergeclauses;
+		case T_NestLoop:
+			return reinterpret_cast<Join *>(join->plan)->joinqual;
+		default:
+			return NIL;
+		}
+	}
+
+	static
+	Var *
+	stripVar(Node *node) {
+		while (node != NULL && IsA(node, RelabelType))
+			node = reinterpret_cast<Node *>(reinterpret_cast<RelabelType *>(node)->arg);
+		if (node == NULL || !IsA(node, Var))
+			return NULL;
+		return reinterpret_cast<Var *>(node);
+	}
+
+	/* follow column attno of ps down to the scan node producing it */
+	static
+	AttrNumber
+	resolve(PlanState *ps, AttrNumber attno, PlanState **scan) {
+		while (ps != NULL && attno > 0) {
+			TargetEntry *tle;
+			Var *var;
+
+			/* output slot of a scan has its target list columns (or the heap columns without projection) */
+			if (ps->type >= T_ScanState && ps->type <= T_CustomScanState) {
+				*scan = ps;
+				return attno;
+			}
+			tle = get_tle_by_resno(ps->plan->targetlist, attno);
+			if (tle == NULL || (var = InputPartitioner::stripVar(reinterpret_cast<Node *>(tle->expr))) == NULL)
+				break;
+			if (var->varno == OUTER_VAR)
+				ps = outerPlanState(ps);
+			else if (var->varno == INNER_VAR)
+				ps = innerPlanState(ps);
+			else
+				break;
+			attno = var->varattno;
+		}
+		return InvalidAttrNumber;
+	}
+
+	static
+	int
+	indexOf(List *inputs, PlanState *ps) {
+		ListCell *lc;
+		int i = 0;
+
+		foreach(lc, inputs) {
+			if (lfirst(lc) == ps)
+				return i;
+			i++;
+		}
+		return -1;
+	}
+};
+
+#endif //INPUTPARTITIONER_HEAD_
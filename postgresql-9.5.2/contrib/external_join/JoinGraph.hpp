@@ -0,0 +1,243 @@
+#ifndef JOINGRAPH_HEAD_
+#define JOINGRAPH_HEAD_
+
+/*
+ * Join graph of an offloaded plan, sent to engines ahead of the inputs of
+ * a run (see JoinGraphHeader in ExternalProtocol.hpp).
+ *
+ * The plan template describes the joins as text; the graph gives an engine
+ * what it needs to run all joins of the plan in one pass without parsing
+ * it: which inputs and joins each join takes, its type, and its clauses as
+ * comparisons between columns of the inputs. Join clause Vars are traced
+ * down to the scan nodes producing them like the partitioning keys are, so
+ * a clause of an upper join names the input the column comes from, not the
+ * join below that passes it on. The graph depends on the plan only and is
+ * built once per node.
+ */
+class JoinGraph {
+private:
+	/* JoinGraphHeader, JoinInputs, JoinNodes and JoinClauses */
+	StringInfoData data;
+	bool built;
+	int njoins;
+
+public:
+	JoinGraph(void) { this->init(); }
+	~JoinGraph(void) { this->fini(); }
+
+	static JoinGraph *constructor(void) {
+		JoinGraph *jg = static_cast<JoinGraph *>(palloc(sizeof(*jg)));
+		jg->init();
+		return jg;
+	}
+	static void destructor(JoinGraph *jg) {
+		jg->fini();
+		pfree(jg);
+	}
+
+	void init(void) {
+		this->built = false;
+		this->njoins = 0;
+	}
+	void fini(void) {
+		if (this->built)
+			pfree(this->data.data);
+		this->init();
+	}
+
+	bool
+	isBuilt(void) const {
+		return this->built;
+	}
+
+	/* describe the joins of the subtree below top, whose inputs are inputs */
+	void
+	build(PlanState *top, List *inputs) {
+		JoinGraphHeader header;
+		StringInfoData joins;
+		ListCell *lc;
+
+		this->fini();
+		initStringInfo(&this->data);
+		initStringInfo(&joins);
+		this->built = true;
+		(void) JoinGraph::addNode(top, inputs, &joins, &this->njoins);
+
+		header.ninputs = list_length(inputs);
+		header.njoins = this->njoins;
+		appendBinaryStringInfo(&this->data, reinterpret_cast<char *>(&header), sizeof(header));
+		foreach(lc, inputs) {
+			ScanState *ss = static_cast<ScanState *>(lfirst(lc));
+			JoinInput input;
+
+			input.relation = (ss->ss_currentRelation != NULL) ? RelationGetRelid(ss->ss_currentRelation) : InvalidOid;
+			input.ncolumns = ss->ps.ps_ResultTupleSlot->tts_tupleDescriptor->natts;
+			appendBinaryStringInfo(&this->data, reinterpret_cast<char *>(&input), sizeof(input));
+		}
+		appendBinaryStringInfo(&this->data, joins.data, joins.len);
+		pfree(joins.data);
+		elog(DEBUG2, ":: join graph of %d inputs and %d joins (%d bytes)", header.ninputs, this->njoins, this->data.len);
+	}
+
+	int
+	getNumJoins(void) const {
+		return this->njoins;
+	}
+
+	const char *
+	getData(void) const {
+		return this->data.data;
+	}
+
+	std::size_t
+	getSize(void) const {
+		return this->built ? this->data.len : 0;
+	}
+
+private:
+	/* append the joins below ps in post order, returns what ps is as a child */
+	static
+	int32_t
+	addNode(PlanState *ps, List *inputs, StringInfo joins, int *njoins) {
+		Plan *plan;
+		JoinNode node;
+		StringInfoData clauses;
+		List *quals;
+		ListCell *lc;
+		bool partial = false;
+
+		if (ps == NULL)
+			return JOIN_CHILD_OTHER;
+		if (ps->type >= T_ScanState && ps->type <= T_CustomScanState) {
+			int input = InputPartitioner::indexOf(inputs, ps);
+
+			return (input >= 0) ? input : JOIN_CHILD_OTHER;
+		}
+		plan = ps->plan;
+		switch (nodeTag(plan)) {
+		case T_NestLoop:
+			node.method = JOIN_METHOD_NESTLOOP;
+			quals = list_copy(reinterpret_cast<Join *>(plan)->joinqual);
+			/* the inner side takes its key from the outer row as a parameter */
+			if (reinterpret_cast<NestLoop *>(plan)->nestParams != NIL)
+				partial = true;
+			break;
+		case T_MergeJoin:
+			node.method = JOIN_METHOD_MERGE;
+			quals = list_concat(list_copy(reinterpret_cast<MergeJoin *>(plan)->mergeclauses),
+					    list_copy(reinterpret_cast<Join *>(plan)->joinqual));
+			break;
+		case T_HashJoin:
+			node.method = JOIN_METHOD_HASH;
+			quals = list_concat(list_copy(reinterpret_cast<HashJoin *>(plan)->hashclauses),
+					    list_copy(reinterpret_cast<Join *>(plan)->joinqual));
+			break;
+		default:
+			/* a node above one join or input stands for it, passesRows() tells if it changes the rows */
+			if (innerPlanState(ps) == NULL)
+				return JoinGraph::addNode(outerPlanState(ps), inputs, joins, njoins);
+			(void) JoinGraph::addNode(outerPlanState(ps), inputs, joins, njoins);
+			(void) JoinGraph::addNode(innerPlanState(ps), inputs, joins, njoins);
+			return JOIN_CHILD_OTHER;
+		}
+
+		node.join_type = reinterpret_cast<Join *>(plan)->jointype;
+		node.outer = JoinGraph::addNode(outerPlanState(ps), inputs, joins, njoins);
+		node.inner = JoinGraph::addNode(innerPlanState(ps), inputs, joins, njoins);
+		node.nclauses = 0;
+		node.est_rows = static_cast<uint64_t>(Max(plan->plan_rows, 0.0));
+		if (plan->qual != NIL)
+			partial = true;
+		initStringInfo(&clauses);
+		foreach(lc, quals) {
+			JoinClause clause;
+
+			if (JoinGraph::makeClause(ps, static_cast<Node *>(lfirst(lc)), inputs, &clause)) {
+				appendBinaryStringInfo(&clauses, reinterpret_cast<char *>(&clause), sizeof(clause));
+				node.nclauses++;
+			}
+			else
+				partial = true;
+		}
+		/* a child whose rows pass through an aggregate, say, is not what the clauses name */
+		if (node.outer == JOIN_CHILD_OTHER || node.inner == JOIN_CHILD_OTHER ||
+		    !JoinGraph::passesRows(outerPlanState(ps)) || !JoinGraph::passesRows(innerPlanState(ps)))
+			partial = true;
+		node.flags = partial ? JOIN_NODE_PARTIAL : 0;
+		appendBinaryStringInfo(joins, reinterpret_cast<char *>(&node), sizeof(node));
+		appendBinaryStringInfo(joins, clauses.data, clauses.len);
+		pfree(clauses.data);
+		list_free(quals);
+		return -1 - (*njoins)++;
+	}
+
+	/* clause as a comparison of two input columns; false if it is anything else */
+	static
+	bool
+	makeClause(PlanState *join, Node *qual, List *inputs, JoinClause *clause) {
+		OpExpr *op = reinterpret_cast<OpExpr *>(qual);
+		List *interpretations;
+		ListCell *lc;
+		uint32_t *input[2] = { &clause->left_input, &clause->right_input };
+		uint32_t *column[2] = { &clause->left_column, &clause->right_column };
+
+		if (!IsA(qual, OpExpr) || list_length(op->args) != 2)
+			return false;
+		clause->compare = 0;
+		interpretations = get_op_btree_interpretation(op->opno);
+		foreach(lc, interpretations) {
+			OpBtreeInterpretation *oi = static_cast<OpBtreeInterpretation *>(lfirst(lc));
+
+			if (oi->strategy >= BTLessStrategyNumber && oi->strategy <= BTGreaterStrategyNumber) {
+				clause->compare = oi->strategy;
+				break;
+			}
+		}
+		list_free_deep(interpretations);
+		if (clause->compare == 0)
+			return false;
+		clause->op = op->opno;
+		for (int i = 0; i < 2; i++) {
+			Var *var = InputPartitioner::stripVar(static_cast<Node *>(list_nth(op->args, i)));
+			PlanState *scan = NULL;
+			AttrNumber attno = InvalidAttrNumber;
+			int index;
+
+			if (var == NULL)
+				return false;
+			if (var->varno == OUTER_VAR)
+				attno = InputPartitioner::resolve(outerPlanState(join), var->varattno, &scan);
+			else if (var->varno == INNER_VAR)
+				attno = InputPartitioner::resolve(innerPlanState(join), var->varattno, &scan);
+			if (attno == InvalidAttrNumber || (index = InputPartitioner::indexOf(inputs, scan)) < 0)
+				return false;
+			*input[i] = index;
+			*column[i] = attno - 1;
+		}
+		return true;
+	}
+
+	/* the subtree below a join child gives the rows of its join or input as they are */
+	static
+	bool
+	passesRows(PlanState *ps) {
+		while (ps != NULL && !(ps->type >= T_ScanState && ps->type <= T_CustomScanState)) {
+			switch (nodeTag(ps->plan)) {
+			case T_NestLoop:
+			case T_MergeJoin:
+			case T_HashJoin:
+				return true;
+			case T_Hash:
+			case T_Sort:
+			case T_Material:
+				ps = outerPlanState(ps);
+				break;
+			default:
+				return false;
+			}
+		}
+		return true;
+	}
+};
+
+#endif //JOINGRAPH_HEAD_
@@ -0,0 +1,269 @@
+#ifndef JOININSTRUMENTATION_HEAD_
+#define JOININSTRUMENTATION_HEAD_
+
+/*
+ * Counters and timings of one external join node, shown by EXPLAIN ANALYZE.
+ *
+ * Byte and row counters are always maintained (they are cheap); timings are
+ * taken only when the node is instrumented with timing. Counters of the
+ * sending and receiving threads are atomics, everything else is updated by
+ * the backend only. Values accumulate over rescans.
+ */
+class JoinInstrumentation {
+public:
+	static constexpr int MAX_INPUTS = 64;
+
+private:
+	bool timing;
+
+	/* per input, as shipped by the backend */
+	int ninputs;
+	uint64_t input_rows[MAX_INPUTS];
+	uint64_t input_bytes[MAX_INPUTS];
+	uint64_t input_chunks[MAX_INPUTS];
+	uint64_t spilled_bytes;
+
+	/* sessions started, and how many runs replayed a cached result */
+	uint64_t sessions;
+	uint64_t cache_hits;
+	/* runs left to PostgreSQL because admission timed out */
+	uint64_t native_runs;
+
+	/* backend timings */
+	instr_time start;
+	bool waiting_first;
+	instr_time first_result;
+	instr_time scan_time;
+	instr_time drain_wait;
+	instr_time result_wait;
+	instr_time admission_wait;
+
+	/* result decoding */
+	uint64_t buffer_switches;
+	uint64_t straddle_merges;
+
+	/* thread side */
+	std::atomic<uint64_t> sent_bytes;
+	std::atomic<uint64_t> send_usec;
+	std::atomic<uint64_t> received_bytes;
+	std::atomic<uint64_t> receive_usec;
+
+	/* per-chunk events, with external_join.trace */
+	PipelineTrace trace;
+
+public:
+	JoinInstrumentation(void) { this->init(false); }
+	~JoinInstrumentation(void) { this->fini(); }
+
+	static JoinInstrumentation *constructor(bool timing) {
+		JoinInstrumentation *ji = static_cast<JoinInstrumentation *>(palloc(sizeof(*ji)));
+		ji->init(timing);
+		return ji;
+	}
+	static void destructor(JoinInstrumentation *ji) {
+		ji->fini();
+		pfree(ji);
+	}
+
+	void init(bool timing) {
+		this->timing = timing;
+		this->ninputs = 0;
+		std::memset(static_cast<void *>(this->input_rows), 0, sizeof(this->input_rows));
+		std::memset(static_cast<void *>(this->input_bytes), 0, sizeof(this->input_bytes));
+		std::memset(static_cast<void *>(this->input_chunks), 0, sizeof(this->input_chunks));
+		this->spilled_bytes = 0;
+		this->sessions = 0;
+		this->cache_hits = 0;
+		this->native_runs = 0;
+		this->waiting_first = false;
+		this->buffer_switches = 0;
+		this->straddle_merges = 0;
+		INSTR_TIME_SET_ZERO(this->start);
+		INSTR_TIME_SET_ZERO(this->first_result);
+		INSTR_TIME_SET_ZERO(this->scan_time);
+		INSTR_TIME_SET_ZERO(this->drain_wait);
+		INSTR_TIME_SET_ZERO(this->result_wait);
+		INSTR_TIME_SET_ZERO(this->admission_wait);
+		this->sent_bytes.store(0, std::memory_order_relaxed);
+		this->send_usec.store(0, std::memory_order_relaxed);
+		this->received_bytes.store(0, std::memory_order_relaxed);
+		this->receive_usec.store(0, std::memory_order_relaxed);
+		this->trace.init();
+	}
+	void fini(void) {
+		this->trace.fini();
+	}
+
+	bool
+	isTiming(void) const {
+		return this->timing;
+	}
+
+	/* shared by the threads of the node, records nothing unless begun */
+	PipelineTrace *
+	getTrace(void) {
+		return &this->trace;
+	}
+
+	/* a run with nsessions sessions is started, or a cached result is replayed */
+	void
+	beginSession(int nsessions, bool cached) {
+		this->sessions += nsessions;
+		if (cached)
+			this->cache_hits++;
+		this->waiting_first = true;
+		if (this->timing)
+			INSTR_TIME_SET_CURRENT(this->start);
+	}
+
+	/* the first result buffer of the session has arrived */
+	void
+	markFirstResult(void) {
+		instr_time now;
+
+		if (!this->waiting_first)
+			return ;
+		this->waiting_first = false;
+		if (!this->timing)
+			return ;
+		INSTR_TIME_SET_CURRENT(now);
+		INSTR_TIME_ACCUM_DIFF(this->first_result, now, this->start);
+	}
+
+	void
+	countChunk(int input, uint64_t rows, uint64_t bytes) {
+		if (input >= MAX_INPUTS)
+			input = MAX_INPUTS - 1;
+		if (input >= this->ninputs)
+			this->ninputs = input + 1;
+		this->input_rows[input] += rows;
+		this->input_bytes[input] += bytes;
+		if (bytes > 0)
+			this->input_chunks[input]++;
+	}
+
+	void
+	countFallback(void) {
+		this->native_runs++;
+	}
+
+	void
+	countSpill(uint64_t bytes) {
+		this->spilled_bytes += bytes;
+	}
+
+	void
+	countSwitch(bool straddle) {
+		this->buffer_switches++;
+		if (straddle)
+			this->straddle_merges++;
+	}
+
+	/* start and stop of a measured interval; start is left zero without timing */
+	void
+	startTimer(instr_time *t) const {
+		if (this->timing)
+			INSTR_TIME_SET_CURRENT(*t);
+		else
+			INSTR_TIME_SET_ZERO(*t);
+	}
+	void
+	stopScan(const instr_time *t) {
+		JoinInstrumentation::accum(&this->scan_time, t);
+	}
+	void
+	stopDrainWait(const instr_time *t) {
+		JoinInstrumentation::accum(&this->drain_wait, t);
+	}
+	void
+	stopResultWait(const instr_time *t) {
+		JoinInstrumentation::accum(&this->result_wait, t);
+	}
+	void
+	stopAdmissionWait(const instr_time *t) {
+		JoinInstrumentation::accum(&this->admission_wait, t);
+	}
+
+	/* called by sending and receiving threads */
+	void
+	countSend(uint64_t bytes, const instr_time *t) {
+		this->sent_bytes += bytes;
+		this->send_usec += JoinInstrumentation::elapsedUsec(t);
+	}
+	void
+	countReceive(uint64_t bytes, const instr_time *t) {
+		this->received_bytes += bytes;
+		this->receive_usec += JoinInstrumentation::elapsedUsec(t);
+	}
+
+	uint64_t
+	getSentBytes(void) const {
+		return this->sent_bytes.load(std::memory_order_relaxed);
+	}
+	uint64_t
+	getReceivedBytes(void) const {
+		return this->received_bytes.load(std::memory_order_relaxed);
+	}
+
+	void
+	explain(ExplainState *es) const {
+		ExplainPropertyLong("Sessions", this->sessions, es);
+		ExplainPropertyLong("Result Cache Hits", this->cache_hits, es);
+		ExplainPropertyLong("Native Runs", this->native_runs, es);
+		for (int i = 0; i < this->ninputs; i++) {
+			char label[32];
+
+			snprintf(label, sizeof(label), "Input %d", i + 1);
+			ExplainPropertyText(label, psprintf("rows=" UINT64_FORMAT " bytes=" UINT64_FORMAT " chunks=" UINT64_FORMAT,
+							    this->input_rows[i], this->input_bytes[i], this->input_chunks[i]), es);
+		}
+		ExplainPropertyLong("Spilled Bytes", this->spilled_bytes, es);
+		ExplainPropertyLong("Bytes Sent", this->getSentBytes(), es);
+		ExplainPropertyLong("Bytes Received", this->getReceivedBytes(), es);
+		ExplainPropertyLong("Buffer Switches", this->buffer_switches, es);
+		ExplainPropertyLong("Straddle Merges", this->straddle_merges, es);
+		if (!this->timing)
+			return ;
+		ExplainPropertyFloat("Send Throughput MB/s",
+				     JoinInstrumentation::throughput(this->getSentBytes(), this->send_usec.load()), 1, es);
+		ExplainPropertyFloat("Receive Throughput MB/s",
+				     JoinInstrumentation::throughput(this->getReceivedBytes(), this->receive_usec.load()), 1, es);
+		ExplainPropertyFloat("Time To First Result", INSTR_TIME_GET_MILLISEC(this->first_result), 3, es);
+		ExplainPropertyFloat("Scan Time", INSTR_TIME_GET_MILLISEC(this->scan_time), 3, es);
+		ExplainPropertyFloat("Send Wait Time", INSTR_TIME_GET_MILLISEC(this->drain_wait), 3, es);
+		ExplainPropertyFloat("Result Wait Time", INSTR_TIME_GET_MILLISEC(this->result_wait), 3, es);
+		ExplainPropertyFloat("Admission Wait Time", INSTR_TIME_GET_MILLISEC(this->admission_wait), 3, es);
+	}
+
+private:
+	static
+	void
+	accum(instr_time *total, const instr_time *t) {
+		instr_time now;
+
+		if (INSTR_TIME_IS_ZERO(*t))
+			return ;
+		INSTR_TIME_SET_CURRENT(now);
+		INSTR_TIME_ACCUM_DIFF(*total, now, *t);
+	}
+
+	static
+	uint64_t
+	elapsedUsec(const instr_time *t) {
+		instr_time now;
+
+		if (INSTR_TIME_IS_ZERO(*t))
+			return 0;
+		INSTR_TIME_SET_CURRENT(now);
+		INSTR_TIME_SUBTRACT(now, *t);
+		return INSTR_TIME_GET_MICROSEC(now);
+	}
+
+	static
+	double
+	throughput(uint64_t bytes, uint64_t usec) {
+		return (usec > 0) ? (static_cast<double>(bytes) / usec) : 0.0;
+	}
+};
+
+#endif //JOININSTRUMENTATION_HEAD_
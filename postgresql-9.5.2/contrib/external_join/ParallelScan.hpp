@@ -0,0 +1,707 @@
+#ifndef PARALLELSCAN_HEAD_
+#define PARALLELSCAN_HEAD_
+
+/*
+ * Input scanning by parallel workers.
+ *
+ * Plain sequential scans of large heaps are cut into block ranges (work items).
+ * Dynamic background workers take work items from a shared counter, copy the
+ * tuple data areas of qualifying tuples into messages and send them to the
+ * backend through one shm_mq per worker. Data areas lacking columns are
+ * rebuilt with all of them, and their NULLs are listed at the end of the
+ * message. For hashed inputs (see InputPartitioner) workers also compute the
+ * join key hash of every row. The backend routes each message into
+ * a TupleBuffer of its input; full buffers are handed to the sender as chunks.
+ * Full buffers of inputs whose turn has not come yet are held in memory up to
+ * a limit and spilled to a temporary file beyond it.
+ */
+
+/* shm_toc keys */
+#define EJ_KEY_SCAN_SHARED	UINT64CONST(0xE700000000000001)
+#define EJ_KEY_QUAL		UINT64CONST(0xE700000000010000)
+#define EJ_KEY_TUPLE_QUEUE	UINT64CONST(0xE700000000020000)
+#define EJ_KEY_HASH		UINT64CONST(0xE700000000030000)
+
+struct ScanWorkItem {
+	Oid relid;
+	/* index of the input in ScanTuple() order */
+	int input;
+	BlockNumber start;
+	BlockNumber nblocks;
+};
+
+struct ScanShared {
+	pg_atomic_uint32 next_item;
+	uint32 nitems;
+	ScanWorkItem items[FLEXIBLE_ARRAY_MEMBER];
+};
+
+/* join key of an input whose rows are shipped with their hashes */
+struct ScanHashKey {
+	/* heap column of the key, InvalidAttrNumber if the input is not hashed */
+	AttrNumber attno;
+	Oid hashproc;
+	Oid collation;
+};
+
+/* message from a worker, followed by tuple data areas, nhashes uint32 hashes and nnulls ScanNull */
+struct ScanChunkMessage {
+	int32 input;
+	uint32 nrows;
+	/* the work item is finished, no tuple data follows */
+	uint32 done;
+	uint32 nnulls;
+	/* nrows for a hashed input, otherwise 0 */
+	uint32 nhashes;
+};
+
+/* NULL column of a row in a message */
+struct ScanNull {
+	uint32 row;
+	uint32 col;
+};
+
+class ParallelScan {
+public:
+	static constexpr Size QUEUE_SIZE = 1024UL * 1024UL * 4;
+	static constexpr Size MESSAGE_SIZE = 1024UL * 1024UL;
+	static constexpr BlockNumber BLOCKS_PER_ITEM = 1024 * 4;
+	/* smaller heaps are scanned by the backend itself */
+	static constexpr BlockNumber MIN_BLOCKS = 1024;
+
+private:
+	ParallelContext *pcxt;
+	shm_mq_handle **mqh;
+	int nworkers;
+	int next_worker;
+
+	int ninputs;
+	bool *parallel;
+	/* work items not finished yet, per input */
+	int *remaining;
+	/* buffer being filled, per input */
+	TupleBuffer **open;
+	/* full buffers waiting for their input's turn, per input */
+	List **full;
+	/* full buffers beyond memory_limit, per input */
+	ChunkSpill *spill;
+	std::size_t held_bytes;
+	std::size_t memory_limit;
+
+public:
+	ParallelScan(void) { this->init(); }
+	~ParallelScan(void) { this->fini(); }
+
+	static ParallelScan *constructor(void) {
+		ParallelScan *pscan = static_cast<ParallelScan *>(palloc(sizeof(*pscan)));
+		pscan->init();
+		return pscan;
+	}
+	static void destructor(ParallelScan *pscan) {
+		pscan->fini();
+		pfree(pscan);
+	}
+
+	void init(void) {
+		this->pcxt = NULL;
+		this->mqh = NULL;
+		this->nworkers = 0;
+		this->next_worker = 0;
+		this->ninputs = 0;
+		this->parallel = NULL;
+		this->remaining = NULL;
+		this->open = NULL;
+		this->full = NULL;
+		this->spill = NULL;
+		this->held_bytes = 0;
+		this->memory_limit = SIZE_MAX;
+	}
+	void fini(void) {
+		for (int i = 0; this->spill != NULL && i < this->ninputs; i++)
+			this->spill[i].fini();
+		if (this->pcxt == NULL)
+			return ;
+		WaitForParallelWorkersToFinish(this->pcxt);
+		DestroyParallelContext(this->pcxt);
+		this->pcxt = NULL;
+		ExitParallelMode();
+	}
+
+	/*
+	 * Launch workers for eligible inputs other than input local (-1 for none),
+	 * which the backend must scan itself. keys holds the hash key per input,
+	 * or is NULL if no input is hashed.
+	 * Returns false if no input is scanned in parallel.
+	 */
+	bool
+	begin(List *inputs, int nworkers, Snapshot snapshot, int local, const ScanHashKey *keys) {
+		ListCell *lc;
+		BlockNumber *nblocks;
+		Oid *relids;
+		char **quals;
+		uint32 nitems = 0;
+		int launched = 0;
+		int i;
+
+		if (nworkers <= 0 || IsInParallelMode() || IsolationIsSerializable())
+			return false;
+		/* the backend scans the other inputs in parallel mode too */
+		foreach(lc, inputs) {
+			if (!ParallelScan::isParallelSafe(static_cast<PlanState *>(lfirst(lc))->plan))
+				return false;
+		}
+		for (i = 0; keys != NULL && i < list_length(inputs); i++) {
+			if (keys[i].attno != InvalidAttrNumber && keys[i].hashproc >= FirstNormalObjectId)
+				return false;
+		}
+
+		this->ninputs = list_length(inputs);
+		this->parallel = static_cast<bool *>(palloc0(sizeof(bool) * this->ninputs));
+		this->remaining = static_cast<int *>(palloc0(sizeof(int) * this->ninputs));
+		this->open = static_cast<TupleBuffer **>(palloc0(sizeof(TupleBuffer *) * this->ninputs));
+		this->full = static_cast<List **>(palloc0(sizeof(List *) * this->ninputs));
+		this->spill = static_cast<ChunkSpill *>(palloc(sizeof(ChunkSpill) * this->ninputs));
+		for (i = 0; i < this->ninputs; i++)
+			this->spill[i].init();
+		nblocks = static_cast<BlockNumber *>(palloc0(sizeof(BlockNumber) * this->ninputs));
+		relids = static_cast<Oid *>(palloc0(sizeof(Oid) * this->ninputs));
+		quals = static_cast<char **>(palloc0(sizeof(char *) * this->ninputs));
+
+		i = 0;
+		foreach(lc, inputs) {
+			PlanState *ps = static_cast<PlanState *>(lfirst(lc));
+
+			if (i != local && ParallelScan::isEligible(ps)) {
+				Relation rel = reinterpret_cast<ScanState *>(ps)->ss_currentRelation;
+
+				nblocks[i] = RelationGetNumberOfBlocks(rel);
+				if (nblocks[i] >= ParallelScan::MIN_BLOCKS) {
+					this->parallel[i] = true;
+					this->remaining[i] = (nblocks[i] + BLOCKS_PER_ITEM - 1) / BLOCKS_PER_ITEM;
+					relids[i] = RelationGetRelid(rel);
+					if (ps->plan->qual != NIL)
+						quals[i] = nodeToString(ps->plan->qual);
+					nitems += this->remaining[i];
+				}
+			}
+			i++;
+		}
+		if (nitems == 0)
+			return false;
+
+		EnterParallelMode();
+		this->pcxt = CreateParallelContextForExternalFunction(const_cast<char *>("external_join"),
+								      const_cast<char *>("ExternalJoinScanWorkerMain"),
+								      nworkers);
+		shm_toc_estimate_chunk(&this->pcxt->estimator, offsetof(ScanShared, items) + sizeof(ScanWorkItem) * nitems);
+		shm_toc_estimate_keys(&this->pcxt->estimator, 1);
+		for (i = 0; i < this->ninputs; i++) {
+			if (quals[i] != NULL) {
+				shm_toc_estimate_chunk(&this->pcxt->estimator, std::strlen(quals[i]) + 1);
+				shm_toc_estimate_keys(&this->pcxt->estimator, 1);
+			}
+			if (this->parallel[i] && keys != NULL && keys[i].attno != InvalidAttrNumber) {
+				shm_toc_estimate_chunk(&this->pcxt->estimator, sizeof(ScanHashKey));
+				shm_toc_estimate_keys(&this->pcxt->estimator, 1);
+			}
+		}
+		for (i = 0; i < nworkers; i++)
+			shm_toc_estimate_chunk(&this->pcxt->estimator, QUEUE_SIZE);
+		shm_toc_estimate_keys(&this->pcxt->estimator, nworkers);
+
+		/* workers see the snapshot of the query */
+		PushActiveSnapshot(snapshot);
+		InitializeParallelDSM(this->pcxt);
+		PopActiveSnapshot();
+		if (this->pcxt->nworkers == 0) {
+			this->fini();
+			std::memset(static_cast<void *>(this->parallel), 0, sizeof(bool) * this->ninputs);
+			return false;
+		}
+
+		/* work items, in input order so that earlier inputs finish first */
+		ScanShared *shared = static_cast<ScanShared *>(shm_toc_allocate(this->pcxt->toc, offsetof(ScanShared, items) + sizeof(ScanWorkItem) * nitems));
+		shared->nitems = 0;
+		pg_atomic_init_u32(&shared->next_item, 0);
+		for (i = 0; i < this->ninputs; i++) {
+			if (!this->parallel[i])
+				continue;
+			for (BlockNumber start = 0; start < nblocks[i]; start += BLOCKS_PER_ITEM) {
+				ScanWorkItem *item = &shared->items[shared->nitems++];
+
+				item->relid = relids[i];
+				item->input = i;
+				item->start = start;
+				item->nblocks = Min(BLOCKS_PER_ITEM, nblocks[i] - start);
+			}
+			if (quals[i] != NULL) {
+				char *qual = static_cast<char *>(shm_toc_allocate(this->pcxt->toc, std::strlen(quals[i]) + 1));
+
+				std::strcpy(qual, quals[i]);
+				shm_toc_insert(this->pcxt->toc, EJ_KEY_QUAL + i, qual);
+			}
+			if (keys != NULL && keys[i].attno != InvalidAttrNumber) {
+				ScanHashKey *key = static_cast<ScanHashKey *>(shm_toc_allocate(this->pcxt->toc, sizeof(ScanHashKey)));
+
+				*key = keys[i];
+				shm_toc_insert(this->pcxt->toc, EJ_KEY_HASH + i, key);
+			}
+		}
+		shm_toc_insert(this->pcxt->toc, EJ_KEY_SCAN_SHARED, shared);
+
+		this->nworkers = this->pcxt->nworkers;
+		this->mqh = static_cast<shm_mq_handle **>(palloc0(sizeof(shm_mq_handle *) * this->nworkers));
+		for (i = 0; i < this->nworkers; i++) {
+			shm_mq *mq = shm_mq_create(shm_toc_allocate(this->pcxt->toc, QUEUE_SIZE), QUEUE_SIZE);
+
+			shm_mq_set_receiver(mq, MyProc);
+			shm_toc_insert(this->pcxt->toc, EJ_KEY_TUPLE_QUEUE + i, mq);
+			this->mqh[i] = shm_mq_attach(mq, this->pcxt->seg, NULL);
+		}
+
+		LaunchParallelWorkers(this->pcxt);
+		for (i = 0; i < this->nworkers; i++) {
+			/* nobody will ever attach to the queue of a worker that was not registered */
+			if (this->pcxt->worker[i].bgwhandle == NULL) {
+				this->mqh[i] = NULL;
+				continue;
+			}
+			shm_mq_set_handle(this->mqh[i], this->pcxt->worker[i].bgwhandle);
+			launched++;
+		}
+		if (launched == 0) {
+			this->fini();
+			std::memset(static_cast<void *>(this->parallel), 0, sizeof(bool) * this->ninputs);
+			return false;
+		}
+		elog(DEBUG2, ":: ParallelScan launched %d workers for %u work items", launched, nitems);
+		return true;
+	}
+
+	bool
+	isParallel(int input) const {
+		return (this->parallel != NULL && this->parallel[input]);
+	}
+
+	/* all work items of the input are finished */
+	bool
+	isDone(int input) const {
+		return (this->remaining[input] == 0);
+	}
+
+	void
+	setOpenBuffer(int input, TupleBuffer *tb) {
+		this->open[input] = tb;
+	}
+
+	TupleBuffer *
+	takeOpenBuffer(int input) {
+		TupleBuffer *tb = this->open[input];
+
+		this->open[input] = NULL;
+		return tb;
+	}
+
+	/* bytes of full buffers held in memory before spilling */
+	void
+	setMemoryLimit(std::size_t limit) {
+		this->memory_limit = limit;
+	}
+
+	/* next full buffer of the input, or NULL */
+	TupleBuffer *
+	popFull(int input) {
+		TupleBuffer *tb;
+
+		/* rows of one input may be sent in any order, so spilled chunks just go last */
+		if (this->full[input] == NIL)
+			return this->spill[input].get();
+		tb = static_cast<TupleBuffer *>(linitial(this->full[input]));
+		this->full[input] = list_delete_first(this->full[input]);
+		this->held_bytes -= tb->getBufferSize();
+		return tb;
+	}
+
+	/* wait for one message from any worker and route it to its input */
+	void
+	receive(void) {
+		for (;;) {
+			int nalive = 0;
+
+			for (int k = 0; k < this->nworkers; k++) {
+				int w = (this->next_worker + k) % this->nworkers;
+				shm_mq_result res;
+				Size nbytes;
+				void *data;
+
+				if (this->mqh[w] == NULL)
+					continue;
+				nalive++;
+				res = shm_mq_receive(this->mqh[w], &nbytes, &data, true);
+				if (res == SHM_MQ_WOULD_BLOCK)
+					continue;
+				if (res == SHM_MQ_DETACHED) {
+					this->mqh[w] = NULL;
+					continue;
+				}
+				this->next_worker = (w + 1) % this->nworkers;
+				this->route(static_cast<ScanChunkMessage *>(data), nbytes);
+				return ;
+			}
+			/* errors of workers are thrown from here */
+			CHECK_FOR_INTERRUPTS();
+			if (nalive == 0) {
+				ereport(ERROR, (errcode(ERRCODE_EXTERNAL_ROUTINE_INVOCATION_EXCEPTION),
+						errmsg("parallel scan workers exited before finishing their work\n")));
+			}
+			WaitLatch(MyLatch, WL_LATCH_SET, 0);
+			ResetLatch(MyLatch);
+		}
+	}
+
+	static
+	bool
+	isEligible(PlanState *ps) {
+		Relation rel;
+
+		/* tuples must come straight from the heap without projection */
+		if (!IsA(ps, SeqScanState) || ps->ps_ProjInfo != NULL)
+			return false;
+		rel = reinterpret_cast<ScanState *>(ps)->ss_currentRelation;
+		/* workers cannot see local buffers */
+		if (rel == NULL || RelationUsesLocalBuffers(rel))
+			return false;
+		/* varlena values are detoasted and encoded by the backend */
+		if (TupleBuffer::hasVarlena(RelationGetDescr(rel)))
+			return false;
+		/* workers evaluate the qual on their own */
+		if (ParallelScan::containsParam(reinterpret_cast<Node *>(ps->plan->qual), NULL) ||
+		    !ParallelScan::isParallelSafeExpr(reinterpret_cast<Node *>(ps->plan->qual)))
+			return false;
+		return true;
+	}
+
+	/*
+	 * Parallel mode forbids writes, XID assignment and subtransactions, in
+	 * the backend as in the workers. 9.5 does not mark functions parallel
+	 * safe, so only non-volatile built-in functions are trusted.
+	 */
+	static
+	bool
+	isParallelSafeExpr(Node *node) {
+		return !contain_volatile_functions(node) && !ParallelScan::containsUnsafe(node, NULL);
+	}
+
+	/* the scan node plan can run in parallel mode, with all of its expressions */
+	static
+	bool
+	isParallelSafe(Plan *plan) {
+		List *exprs = list_make2(plan->qual, plan->targetlist);
+		ListCell *lc;
+		bool safe = true;
+
+		switch (nodeTag(plan)) {
+		case T_SeqScan:
+			break;
+		case T_IndexScan:
+			exprs = lappend(exprs, reinterpret_cast<IndexScan *>(plan)->indexqual);
+			exprs = lappend(exprs, reinterpret_cast<IndexScan *>(plan)->indexorderby);
+			break;
+		case T_IndexOnlyScan:
+			exprs = lappend(exprs, reinterpret_cast<IndexOnlyScan *>(plan)->indexqual);
+			break;
+		case T_BitmapIndexScan:
+			exprs = lappend(exprs, reinterpret_cast<BitmapIndexScan *>(plan)->indexqual);
+			break;
+		case T_BitmapHeapScan:
+			exprs = lappend(exprs, reinterpret_cast<BitmapHeapScan *>(plan)->bitmapqualorig);
+			safe = ParallelScan::isParallelSafe(outerPlan(plan));
+			break;
+		case T_BitmapAnd:
+			foreach(lc, reinterpret_cast<BitmapAnd *>(plan)->bitmapplans)
+				safe = safe && ParallelScan::isParallelSafe(static_cast<Plan *>(lfirst(lc)));
+			break;
+		case T_BitmapOr:
+			foreach(lc, reinterpret_cast<BitmapOr *>(plan)->bitmapplans)
+				safe = safe && ParallelScan::isParallelSafe(static_cast<Plan *>(lfirst(lc)));
+			break;
+		case T_FunctionScan:
+			exprs = lappend(exprs, reinterpret_cast<FunctionScan *>(plan)->functions);
+			break;
+		case T_ValuesScan:
+			exprs = lappend(exprs, reinterpret_cast<ValuesScan *>(plan)->values_lists);
+			break;
+		default:
+			/* subqueries, CTEs and foreign or custom scans run code we cannot check */
+			safe = false;
+			break;
+		}
+		safe = safe && ParallelScan::isParallelSafeExpr(reinterpret_cast<Node *>(exprs));
+		list_free(exprs);
+		return safe;
+	}
+
+	/* entry point of a scan worker */
+	static
+	void
+	workerMain(dsm_segment *seg, shm_toc *toc) {
+		ScanShared *shared = static_cast<ScanShared *>(shm_toc_lookup(toc, EJ_KEY_SCAN_SHARED));
+		shm_mq *mq = static_cast<shm_mq *>(shm_toc_lookup(toc, EJ_KEY_TUPLE_QUEUE + ParallelWorkerNumber));
+		shm_mq_handle *mqh;
+		char *message = static_cast<char *>(palloc(MESSAGE_SIZE));
+		ScanNull *nulls = static_cast<ScanNull *>(palloc(MESSAGE_SIZE));
+		uint32 *hashes = static_cast<uint32 *>(palloc(MESSAGE_SIZE));
+
+		shm_mq_set_sender(mq, MyProc);
+		mqh = shm_mq_attach(mq, seg, NULL);
+		for (;;) {
+			uint32 index = pg_atomic_fetch_add_u32(&shared->next_item, 1);
+
+			if (index >= shared->nitems)
+				break;
+			ParallelScan::scanItem(toc, &shared->items[index], mqh, message, nulls, hashes);
+		}
+		shm_mq_detach(mq);
+	}
+
+private:
+	void
+	route(ScanChunkMessage *msg, Size nbytes) {
+		TupleBuffer *tb = this->open[msg->input];
+		Size size = nbytes - sizeof(*msg) - msg->nhashes * sizeof(uint32) - msg->nnulls * sizeof(ScanNull);
+		uint32 *hashes = reinterpret_cast<uint32 *>(reinterpret_cast<char *>(msg) + sizeof(*msg) + size);
+		ScanNull *nulls = reinterpret_cast<ScanNull *>(hashes + msg->nhashes);
+		uint32 base;
+
+		if (msg->done) {
+			this->remaining[msg->input]--;
+			return ;
+		}
+		if (tb->isFull(size)) {
+			TupleBuffer *prev = tb;
+			std::size_t bufsize = prev->getBufferSize();
+
+			tb = this->open[msg->input] = TupleBuffer::constructor(bufsize);
+			tb->follow(prev);
+			if (this->held_bytes > 0 && this->held_bytes + bufsize > this->memory_limit)
+				this->spill[msg->input].put(prev);
+			else {
+				this->full[msg->input] = lappend(this->full[msg->input], prev);
+				this->held_bytes += bufsize;
+			}
+		}
+		base = tb->getRowCount();
+		tb->putData(reinterpret_cast<char *>(msg) + sizeof(*msg), size, msg->nrows);
+		for (uint32 i = 0; i < msg->nhashes; i++)
+			tb->setHash(base + i, hashes[i]);
+		for (uint32 i = 0; i < msg->nnulls; i++)
+			tb->setNull(base + nulls[i].row, nulls[i].col);
+	}
+
+	static
+	bool
+	containsParam(Node *node, void *context) {
+		if (node == NULL)
+			return false;
+		if (IsA(node, Param) || IsA(node, SubPlan) || IsA(node, AlternativeSubPlan))
+			return true;
+		return expression_tree_walker(node, reinterpret_cast<bool (*)()>(ParallelScan::containsParam), context);
+	}
+
+	/* expression walker for functions not known to be safe in parallel mode */
+	static
+	bool
+	containsUnsafe(Node *node, void *context) {
+		if (node == NULL)
+			return false;
+		switch (nodeTag(node)) {
+		case T_FuncExpr:
+			if (reinterpret_cast<FuncExpr *>(node)->funcid >= FirstNormalObjectId)
+				return true;
+			break;
+		case T_OpExpr:
+		case T_DistinctExpr:
+		case T_NullIfExpr:
+			set_opfuncid(reinterpret_cast<OpExpr *>(node));
+			if (reinterpret_cast<OpExpr *>(node)->opfuncid >= FirstNormalObjectId)
+				return true;
+			break;
+		case T_ScalarArrayOpExpr:
+			set_sa_opfuncid(reinterpret_cast<ScalarArrayOpExpr *>(node));
+			if (reinterpret_cast<ScalarArrayOpExpr *>(node)->opfuncid >= FirstNormalObjectId)
+				return true;
+			break;
+		case T_ArrayCoerceExpr:
+			if (reinterpret_cast<ArrayCoerceExpr *>(node)->elemfuncid >= FirstNormalObjectId)
+				return true;
+			break;
+		case T_CoerceViaIO:
+			/* the I/O functions of the types */
+			if (reinterpret_cast<CoerceViaIO *>(node)->resulttype >= FirstNormalObjectId ||
+			    exprType(reinterpret_cast<Node *>(reinterpret_cast<CoerceViaIO *>(node)->arg)) >= FirstNormalObjectId)
+				return true;
+			break;
+		case T_RowCompareExpr:
+		{
+			ListCell *lc;
+
+			foreach(lc, reinterpret_cast<RowCompareExpr *>(node)->opnos) {
+				if (get_opcode(lfirst_oid(lc)) >= FirstNormalObjectId)
+					return true;
+			}
+			break;
+		}
+		case T_MinMaxExpr:
+			/* compared by the btree opclass of the type */
+			if (reinterpret_cast<MinMaxExpr *>(node)->minmaxtype >= FirstNormalObjectId)
+				return true;
+			break;
+		case T_SubPlan:
+		case T_AlternativeSubPlan:
+		case T_SubLink:
+			return true;
+		default:
+			break;
+		}
+		return expression_tree_walker(node, reinterpret_cast<bool (*)()>(ParallelScan::containsUnsafe), context);
+	}
+
+	/* send the message with its hashes and NULLs and start an empty one */
+	static
+	void
+	sendChunk(shm_mq_handle *mqh, char *message, Size size, ScanNull *nulls, uint32 *hashes) {
+		ScanChunkMessage *header = reinterpret_cast<ScanChunkMessage *>(message);
+		shm_mq_iovec iov[3];
+
+		iov[0].data = message;
+		iov[0].len = size;
+		iov[1].data = reinterpret_cast<char *>(hashes);
+		iov[1].len = header->nhashes * sizeof(uint32);
+		iov[2].data = reinterpret_cast<char *>(nulls);
+		iov[2].len = header->nnulls * sizeof(ScanNull);
+		if (shm_mq_sendv(mqh, iov, 3, false) == SHM_MQ_DETACHED) {
+			ereport(ERROR, (errcode(ERRCODE_EXTERNAL_ROUTINE_INVOCATION_EXCEPTION),
+					errmsg("backend detached from parallel scan queue\n")));
+		}
+		header->nrows = 0;
+		header->nnulls = 0;
+		header->nhashes = 0;
+	}
+
+	static
+	void
+	scanItem(shm_toc *toc, ScanWorkItem *item, shm_mq_handle *mqh, char *message, ScanNull *nulls, uint32 *hashes) {
+		ScanChunkMessage *header = reinterpret_cast<ScanChunkMessage *>(message);
+		char *qualstr = static_cast<char *>(shm_toc_lookup(toc, EJ_KEY_QUAL + item->input));
+		ScanHashKey *key = static_cast<ScanHashKey *>(shm_toc_lookup(toc, EJ_KEY_HASH + item->input));
+		FmgrInfo hashfn;
+		List *qual = NIL;
+		ExprContext *econtext = NULL;
+		TupleTableSlot *slot = NULL;
+		Relation rel;
+		TupleDesc desc;
+		Datum *values;
+		bool *isnull;
+		Size width;
+		HeapScanDesc scan;
+		BulkHeapScan bulk;
+		HeapTupleData page_tuple;
+		HeapTuple tuple;
+		Size used = sizeof(*header);
+
+		/*
+		 * The backend holds AccessShareLock during the whole scan. Locking again
+		 * could wait forever behind a lock request queued after the backend's,
+		 * because workers and backend do not form a lock group.
+		 */
+		rel = heap_open(item->relid, NoLock);
+		desc = RelationGetDescr(rel);
+		values = static_cast<Datum *>(palloc(sizeof(Datum) * desc->natts));
+		isnull = static_cast<bool *>(palloc(sizeof(bool) * desc->natts));
+		/* eligible relations have no varlena column, so every row has this width */
+		width = TupleBuffer::getRowWidth(desc, false);
+		scan = heap_beginscan_strat(rel, GetActiveSnapshot(), 0, NULL, true, false);
+		heap_setscanlimits(scan, item->start, item->nblocks);
+		if (qualstr != NULL) {
+			qual = reinterpret_cast<List *>(ExecInitExpr(static_cast<Expr *>(stringToNode(qualstr)), NULL));
+			econtext = CreateStandaloneExprContext();
+			slot = MakeSingleTupleTableSlot(desc);
+		}
+		if (key != NULL)
+			fmgr_info(key->hashproc, &hashfn);
+
+		header->input = item->input;
+		header->done = 0;
+		header->nnulls = 0;
+		header->nrows = 0;
+		header->nhashes = 0;
+		/* without a qual tuples are read off the pages directly */
+		if (qual == NIL && scan->rs_pageatatime)
+			bulk.begin(scan);
+		for (;;) {
+			if (qual == NIL && scan->rs_pageatatime) {
+				if (!bulk.next(&page_tuple))
+					break;
+				tuple = &page_tuple;
+			}
+			else if ((tuple = heap_getnext(scan, ForwardScanDirection)) == NULL)
+				break;
+			CHECK_FOR_INTERRUPTS();
+			if (qual != NIL) {
+				bool pass;
+
+				ExecStoreTuple(tuple, slot, scan->rs_cbuf, false);
+				econtext->ecxt_scantuple = slot;
+				pass = ExecQual(qual, econtext, false);
+				ResetExprContext(econtext);
+				if (!pass)
+					continue;
+			}
+			/* a heap tuple of fixed width columns always fits in a message */
+			if (used + width + (header->nnulls + desc->natts) * sizeof(ScanNull) > MESSAGE_SIZE ||
+			    (header->nhashes + 1) * sizeof(uint32) > MESSAGE_SIZE) {
+				ParallelScan::sendChunk(mqh, message, used, nulls, hashes);
+				used = sizeof(*header);
+			}
+			if (key != NULL) {
+				bool keynull;
+				Datum value = heap_getattr(tuple, key->attno, desc, &keynull);
+
+				hashes[header->nhashes++] = keynull ? 0 : DatumGetUInt32(FunctionCall1Coll(&hashfn, key->collation, value));
+			}
+			if (TupleBuffer::hasMissing(tuple, desc)) {
+				heap_deform_tuple(tuple, desc, values, isnull);
+				TupleBuffer::fillRow(desc, values, isnull, message + used);
+				for (int i = 0; i < desc->natts; i++) {
+					if (!isnull[i])
+						continue;
+					nulls[header->nnulls].row = header->nrows;
+					nulls[header->nnulls].col = i;
+					header->nnulls++;
+				}
+			}
+			else
+				std::memcpy(message + used, reinterpret_cast<char *>(tuple->t_data) + tuple->t_data->t_hoff, width);
+			used += width;
+			header->nrows++;
+		}
+		if (header->nrows > 0)
+			ParallelScan::sendChunk(mqh, message, used, nulls, hashes);
+
+		/* tell the backend that this work item is finished */
+		header->done = 1;
+		ParallelScan::sendChunk(mqh, message, sizeof(*header), nulls, hashes);
+
+		if (slot != NULL) {
+			ExecDropSingleTupleTableSlot(slot);
+			FreeExprContext(econtext, true);
+		}
+		pfree(values);
+		pfree(isnull);
+		bulk.end();
+		heap_endscan(scan);
+		heap_close(rel, NoLock);
+	}
+};
+
+#endif //PARALLELSCAN_HEAD_
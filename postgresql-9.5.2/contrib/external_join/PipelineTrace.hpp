@@ -0,0 +1,218 @@
+#ifndef PIPELINETRACE_HEAD_
+#define PIPELINETRACE_HEAD_
+
+/*
+ * Per-chunk trace of the pipeline of one external join node, with
+ * external_join.trace on.
+ *
+ * The backend (scan, drain and decode), the sending thread and the result
+ * receiving thread of every session append events to a ring of fixed size,
+ * with CLOCK_MONOTONIC timestamps, so a full ring keeps the latest events.
+ * Appending claims a slot with one atomic increment and neither allocates
+ * nor reports errors, so the threads may do it. When the node ends, the
+ * backend writes the ring to DIRECTORY as Chrome trace-event JSON (open in
+ * chrome://tracing or Perfetto): one process per backend, one thread per
+ * lane, spans for sending, receiving and waiting and instants for chunks
+ * filled, engine replies and result buffers decoded, which shows where the
+ * stages wait for each other. With the trace off, record() is a test of a
+ * NULL pointer.
+ */
+class PipelineTrace {
+public:
+	static constexpr const char *DIRECTORY = "pg_external_join_trace";
+
+	/* what an event is about */
+	enum Kind : uint16_t {
+		/* span: the backend scans the inputs */
+		SCAN = 0,
+		/* instant: a chunk is handed to a sender, arg0 input, arg1 bytes */
+		CHUNK_FILLED,
+		/* span: a sender ships a chunk, arg1 bytes */
+		SEND,
+		/* span: the backend waits for the senders to ship what was scanned */
+		DRAIN_WAIT,
+		/* instant: the engine answered, with a runtime filter or its first result bytes */
+		ENGINE_ACK,
+		/* span: a receiver fills a result buffer, arg1 bytes */
+		RECEIVE,
+		/* span: the backend waits for a result buffer */
+		RESULT_WAIT,
+		/* instant: the backend decoded a result buffer and hands it back, arg1 bytes */
+		DECODE_DONE,
+		NUM_KINDS
+	};
+
+	/* phases of Chrome trace events */
+	static constexpr char BEGIN = 'B';
+	static constexpr char END = 'E';
+	static constexpr char INSTANT = 'i';
+
+	/* lanes: the backend, then the senders and the receivers of up to MAX_LANES sessions */
+	static constexpr int BACKEND = 0;
+	static constexpr int MAX_LANES = 64;
+
+private:
+	struct Event {
+		uint64_t ts;
+		uint16_t kind;
+		char phase;
+		int32_t lane;
+		uint64_t arg0;
+		uint64_t arg1;
+	};
+
+	Event *events;
+	uint64_t capacity;
+	std::atomic<uint64_t> next;
+
+public:
+	PipelineTrace(void) { this->init(); }
+	~PipelineTrace(void) { this->fini(); }
+
+	static PipelineTrace *constructor(void) {
+		PipelineTrace *pt = static_cast<PipelineTrace *>(palloc(sizeof(*pt)));
+		pt->init();
+		return pt;
+	}
+	static void destructor(PipelineTrace *pt) {
+		pt->fini();
+		pfree(pt);
+	}
+
+	void init(void) {
+		this->events = NULL;
+		this->capacity = 0;
+		this->next.store(0, std::memory_order_relaxed);
+	}
+	void fini(void) {
+		if (this->events != NULL)
+			pfree(this->events);
+		this->init();
+	}
+
+	/* start recording into a ring of capacity events */
+	void
+	begin(int capacity) {
+		this->fini();
+		if (capacity <= 0)
+			return ;
+		this->events = static_cast<Event *>(palloc(sizeof(Event) * capacity));
+		this->capacity = capacity;
+	}
+
+	bool
+	isEnabled(void) const {
+		return this->events != NULL;
+	}
+
+	static
+	int
+	senderLane(int session) {
+		return 1 + session;
+	}
+
+	static
+	int
+	receiverLane(int session) {
+		return 1 + MAX_LANES + session;
+	}
+
+	/* thread safe */
+	void
+	record(Kind kind, char phase, int lane, uint64_t arg0 = 0, uint64_t arg1 = 0) {
+		struct timespec now;
+		Event *e;
+
+		if (this->events == NULL)
+			return ;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		e = &this->events[this->next.fetch_add(1, std::memory_order_relaxed) % this->capacity];
+		e->ts = static_cast<uint64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+		e->kind = kind;
+		e->phase = phase;
+		e->lane = lane;
+		e->arg0 = arg0;
+		e->arg1 = arg1;
+	}
+
+	/* write the events to DIRECTORY once the threads are gone, the path is returned; NULL if nothing was recorded */
+	char *
+	dump(void) {
+		static int ndumps = 0;
+		uint64_t n = this->next.load(std::memory_order_relaxed);
+		uint64_t first = (n > this->capacity) ? n - this->capacity : 0;
+		int nsessions = 0;
+		char *path;
+		FILE *fp;
+
+		if (this->events == NULL || n == 0)
+			return NULL;
+		for (uint64_t i = first; i < n; i++) {
+			int lane = this->events[i % this->capacity].lane;
+
+			if (lane != BACKEND)
+				nsessions = Max(nsessions, (lane - 1) % MAX_LANES + 1);
+		}
+		if (::mkdir(DIRECTORY, S_IRWXU) != 0 && errno != EEXIST)
+			ereport(ERROR, (errcode_for_file_access(),
+					errmsg("could not create directory \"%s\": %m\n", DIRECTORY)));
+		path = psprintf("%s/%d_%d.json", DIRECTORY, MyProcPid, ndumps++);
+		if ((fp = AllocateFile(path, PG_BINARY_W)) == NULL)
+			ereport(ERROR, (errcode_for_file_access(),
+					errmsg("could not create external join trace \"%s\": %m\n", path)));
+
+		std::fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+		/* lane names */
+		PipelineTrace::writeLaneName(fp, BACKEND, "backend");
+		for (int i = 0; i < Min(nsessions, MAX_LANES); i++) {
+			char name[32];
+
+			snprintf(name, sizeof(name), "sender %d", i);
+			PipelineTrace::writeLaneName(fp, PipelineTrace::senderLane(i), name);
+			snprintf(name, sizeof(name), "receiver %d", i);
+			PipelineTrace::writeLaneName(fp, PipelineTrace::receiverLane(i), name);
+		}
+		for (uint64_t i = first; i < n; i++) {
+			Event *e = &this->events[i % this->capacity];
+
+			/* timestamps are in microseconds */
+			std::fprintf(fp, ",{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%llu.%03u,\"pid\":%d,\"tid\":%d",
+				     PipelineTrace::kindName(e->kind), e->phase,
+				     static_cast<unsigned long long>(e->ts / 1000), static_cast<unsigned>(e->ts % 1000),
+				     MyProcPid, e->lane);
+			if (e->phase == INSTANT)
+				std::fprintf(fp, ",\"s\":\"t\"");
+			if (e->phase != BEGIN)
+				std::fprintf(fp, ",\"args\":{\"input\":%llu,\"bytes\":%llu}",
+					     static_cast<unsigned long long>(e->arg0), static_cast<unsigned long long>(e->arg1));
+			std::fprintf(fp, "}\n");
+		}
+		std::fprintf(fp, "]}\n");
+		if (FreeFile(fp) != 0)
+			ereport(ERROR, (errcode_for_file_access(),
+					errmsg("could not write external join trace \"%s\": %m\n", path)));
+		/* the ring starts over for the next execution of the node */
+		this->next.store(0, std::memory_order_relaxed);
+		return path;
+	}
+
+private:
+	static
+	void
+	writeLaneName(FILE *fp, int lane, const char *name) {
+		std::fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}\n",
+			     (lane == BACKEND) ? "" : ",", MyProcPid, lane, name);
+	}
+
+	static
+	const char *
+	kindName(uint16_t kind) {
+		static const char *names[NUM_KINDS] = {
+			"scan", "chunk filled", "send", "drain wait", "engine ack", "receive", "result wait", "decode done"
+		};
+
+		return (kind < NUM_KINDS) ? names[kind] : "unknown";
+	}
+};
+
+#endif //PIPELINETRACE_HEAD_
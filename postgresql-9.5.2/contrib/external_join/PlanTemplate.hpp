@@ -0,0 +1,453 @@
+#ifndef PLANTEMPLATE_HEAD_
+#define PLANTEMPLATE_HEAD_
+
+/*
+ * Plan template of an offloaded join, sent to engines ahead of the inputs of
+ * a run (see RunHeader in ExternalProtocol.hpp).
+ *
+ * The template is text deparsed like EXPLAIN VERBOSE: one block per input
+ * in scan order, with its relation, the columns it ships and the quals its
+ * scan applies, followed by the clauses of every join node. Parameters stay
+ * $n, their values are sent with every run. A prepared statement executed
+ * with a generic plan thus has the same template, and the same id, each
+ * time, so an engine can keep what it derived from the template, and the
+ * session pool the engine's sessions, across executions.
+ *
+ * Every input also gets a fingerprint of what its rows depend on: the
+ * modification state of its relation, as the result cache keys it, and the
+ * values of the parameters its scan refers to. An engine session that holds
+ * an input with the same fingerprint need not be sent that input again.
+ * Inputs whose rows depend on anything else get fingerprint 0, and so do all
+ * inputs of a transaction using one snapshot for all of its statements.
+ */
+class PlanTemplate {
+private:
+	/* parameter referenced by the template */
+	struct TemplateParam {
+		int paramid;
+		ParamKind kind;
+		Oid type;
+	};
+
+	uint64_t id;
+	char *text;
+	std::size_t text_size;
+	int nparams;
+	TemplateParam *params;
+	/* per input, 0 if the input must always be shipped */
+	int ninputs;
+	uint64_t *fingerprints;
+	/* RunHeader, template text and parameter values of the current run */
+	StringInfoData message;
+	bool has_message;
+
+public:
+	PlanTemplate(void) { this->init(); }
+	~PlanTemplate(void) { this->fini(); }
+
+	static PlanTemplate *constructor(void) {
+		PlanTemplate *pt = static_cast<PlanTemplate *>(palloc(sizeof(*pt)));
+		pt->init();
+		return pt;
+	}
+	static void destructor(PlanTemplate *pt) {
+		pt->fini();
+		pfree(pt);
+	}
+
+	void init(void) {
+		this->id = 0;
+		this->text = NULL;
+		this->text_size = 0;
+		this->nparams = 0;
+		this->params = NULL;
+		this->ninputs = 0;
+		this->fingerprints = NULL;
+		this->has_message = false;
+	}
+	void fini(void) {
+		if (this->text != NULL)
+			pfree(this->text);
+		if (this->params != NULL)
+			pfree(this->params);
+		if (this->fingerprints != NULL)
+			pfree(this->fingerprints);
+		if (this->has_message)
+			pfree(this->message.data);
+		this->init();
+	}
+
+	bool
+	isBuilt(void) const {
+		return this->text != NULL;
+	}
+
+	/* deparse the subtree below join; key also goes into the id, so that it tells apart what the text does not show */
+	void
+	build(PlanState *join, List *inputs, const char *key) {
+		EState *estate = join->state;
+		List *context = deparse_context_for_plan_rtable(estate->es_range_table,
+								select_rtable_names_for_explain(estate->es_range_table, NULL));
+		StringInfoData buf;
+		int input = 0;
+
+		this->fini();
+		initStringInfo(&buf);
+		PlanTemplate::deparseNode(&buf, join, NIL, context, &input);
+		this->text = buf.data;
+		this->text_size = buf.len;
+		this->id = PlanTemplate::hash64(this->text, this->text_size, key);
+		this->ninputs = list_length(inputs);
+		this->fingerprints = static_cast<uint64_t *>(palloc0(sizeof(uint64_t) * Max(this->ninputs, 1)));
+		this->params = static_cast<TemplateParam *>(palloc(sizeof(TemplateParam) * 8));
+		this->nparams = 0;
+		PlanTemplate::collectParams(reinterpret_cast<Node *>(join->plan), this);
+		elog(DEBUG2, ":: plan template %016llx (%zu bytes, %d parameters)\n%s",
+		     static_cast<unsigned long long>(this->id), this->text_size, this->nparams, this->text);
+	}
+
+	/* fingerprint the inputs against the current parameter values and relation states */
+	void
+	fingerprint(List *inputs) {
+		ListCell *lc;
+		int i = 0;
+
+		foreach(lc, inputs) {
+			this->fingerprints[i++] = PlanTemplate::fingerprintInput(static_cast<ScanState *>(lfirst(lc)));
+		}
+	}
+
+	uint64_t
+	getId(void) const {
+		return this->id;
+	}
+
+	int
+	getNumInputs(void) const {
+		return this->ninputs;
+	}
+
+	const uint64_t *
+	getFingerprints(void) const {
+		return this->fingerprints;
+	}
+
+	/*
+	 * RunHeader of a run, with the template text unless the session has it,
+	 * the order of the results, the join graph if not NULL and the parameter
+	 * values; an unbuilt template sends the order and the graph only
+	 */
+	const StringInfoData *
+	makeMessage(PlanState *join, bool with_text, const OrderKey *order, int norder, const JoinGraph *graph) {
+		RunHeader header;
+
+		if (this->has_message)
+			resetStringInfo(&this->message);
+		else
+			initStringInfo(&this->message);
+		this->has_message = true;
+		std::memset(static_cast<void *>(&header), 0, sizeof(header));
+		header.template_id = this->id;
+		header.template_size = with_text ? this->text_size : 0;
+		header.nparams = this->nparams;
+		header.norder = norder;
+		header.graph_size = (graph != NULL) ? graph->getSize() : 0;
+		appendBinaryStringInfo(&this->message, reinterpret_cast<char *>(&header), sizeof(header));
+		if (header.template_size > 0)
+			appendBinaryStringInfo(&this->message, this->text, this->text_size);
+		if (norder > 0)
+			appendBinaryStringInfo(&this->message, reinterpret_cast<const char *>(order), sizeof(OrderKey) * norder);
+		if (header.graph_size > 0)
+			appendBinaryStringInfo(&this->message, graph->getData(), header.graph_size);
+		for (int i = 0; i < this->nparams; i++) {
+			TemplateParam *tp = &this->params[i];
+			ParamValue pv;
+			Datum value;
+			bool isnull;
+			char *str = NULL;
+
+			pv.paramid = tp->paramid;
+			pv.type = tp->type;
+			pv.flags = (tp->kind == PARAM_EXEC) ? PARAM_VALUE_EXEC : 0;
+			if (!PlanTemplate::fetchParam(join->state, tp, &value, &isnull))
+				pv.flags |= PARAM_VALUE_UNKNOWN;
+			else if (isnull)
+				pv.flags |= PARAM_VALUE_NULL;
+			else {
+				Oid output;
+				bool varlena;
+
+				getTypeOutputInfo(tp->type, &output, &varlena);
+				str = OidOutputFunctionCall(output, value);
+			}
+			pv.size = (str != NULL) ? std::strlen(str) : 0;
+			appendBinaryStringInfo(&this->message, reinterpret_cast<char *>(&pv), sizeof(pv));
+			if (str != NULL) {
+				appendBinaryStringInfo(&this->message, str, pv.size);
+				pfree(str);
+			}
+		}
+		return &this->message;
+	}
+
+private:
+	static
+	uint64_t
+	hash64(const char *text, std::size_t size, const char *key) {
+		StringInfoData buf;
+		uint64_t id;
+
+		initStringInfo(&buf);
+		appendStringInfo(&buf, "%s\n", key);
+		appendBinaryStringInfo(&buf, text, size);
+		id = (static_cast<uint64_t>(DatumGetUInt32(hash_any(reinterpret_cast<unsigned char *>(buf.data), buf.len))) << 32) |
+			DatumGetUInt32(hash_any(reinterpret_cast<unsigned char *>(buf.data), buf.len / 2));
+		pfree(buf.data);
+		return id;
+	}
+
+	static
+	void
+	deparseList(StringInfo buf, const char *label, List *exprs, PlanState *ps, List *ancestors, List *context) {
+		Node *node;
+
+		if (exprs == NIL)
+			return ;
+		node = (list_length(exprs) > 1) ? reinterpret_cast<Node *>(make_ands_explicit(exprs)) :
+			static_cast<Node *>(linitial(exprs));
+		context = set_deparse_context_planstate(context, reinterpret_cast<Node *>(ps), ancestors);
+		appendStringInfo(buf, "\t%s %s\n", label, deparse_expression(node, context, true, false));
+	}
+
+	/* the scan quals of an input, as its rows depend on them */
+	static
+	List *
+	scanQuals(Plan *plan) {
+		switch (nodeTag(plan)) {
+		case T_IndexScan:
+			return list_concat(list_copy(reinterpret_cast<IndexScan *>(plan)->indexqualorig), list_copy(plan->qual));
+		case T_IndexOnlyScan:
+			return list_concat(list_copy(reinterpret_cast<IndexOnlyScan *>(plan)->indexqual), list_copy(plan->qual));
+		case T_BitmapHeapScan:
+			return list_concat(list_copy(reinterpret_cast<BitmapHeapScan *>(plan)->bitmapqualorig), list_copy(plan->qual));
+		default:
+			return list_copy(plan->qual);
+		}
+	}
+
+	static
+	void
+	deparseNode(StringInfo buf, PlanState *ps, List *ancestors, List *context, int *input) {
+		Plan *plan = ps->plan;
+
+		if (ps->type >= T_ScanState && ps->type <= T_CustomScanState) {
+			Relation rel = reinterpret_cast<ScanState *>(ps)->ss_currentRelation;
+			List *output = NIL;
+			ListCell *lc;
+
+			if (rel != NULL)
+				appendStringInfo(buf, "input %d %s.%s\n", (*input)++,
+						 quote_identifier(get_namespace_name(RelationGetNamespace(rel))),
+						 quote_identifier(RelationGetRelationName(rel)));
+			else
+				appendStringInfo(buf, "input %d -\n", (*input)++);
+			foreach(lc, plan->targetlist) {
+				output = lappend(output, reinterpret_cast<TargetEntry *>(lfirst(lc))->expr);
+			}
+			/* a list of columns, not a conjunction */
+			if (output != NIL) {
+				List *cxt = set_deparse_context_planstate(context, reinterpret_cast<Node *>(ps), ancestors);
+
+				appendStringInfoString(buf, "\toutput");
+				foreach(lc, output) {
+					appendStringInfo(buf, "%s%s", (lc == list_head(output)) ? " " : ", ",
+							 deparse_expression(static_cast<Node *>(lfirst(lc)), cxt, true, false));
+				}
+				appendStringInfoChar(buf, '\n');
+			}
+			PlanTemplate::deparseList(buf, "filter", PlanTemplate::scanQuals(plan), ps, ancestors, context);
+			return ;
+		}
+		ancestors = lcons(ps, ancestors);
+		if (outerPlanState(ps) != NULL)
+			PlanTemplate::deparseNode(buf, outerPlanState(ps), ancestors, context, input);
+		if (innerPlanState(ps) != NULL)
+			PlanTemplate::deparseNode(buf, innerPlanState(ps), ancestors, context, input);
+		ancestors = list_delete_first(ancestors);
+
+		switch (nodeTag(plan)) {
+		case T_NestLoop:
+		case T_MergeJoin:
+		case T_HashJoin: {
+			Join *join = reinterpret_cast<Join *>(plan);
+			List *clauses = NIL;
+
+			appendStringInfo(buf, "join %s\n", PlanTemplate::joinTypeName(join->jointype));
+			if (IsA(plan, HashJoin))
+				clauses = list_copy(reinterpret_cast<HashJoin *>(plan)->hashclauses);
+			else if (IsA(plan, MergeJoin))
+				clauses = list_copy(reinterpret_cast<MergeJoin *>(plan)->mergeclauses);
+			PlanTemplate::deparseList(buf, "clause", list_concat(clauses, list_copy(join->joinqual)), ps, ancestors, context);
+			PlanTemplate::deparseList(buf, "filter", plan->qual, ps, ancestors, context);
+			break;
+		}
+		default:
+			break;
+		}
+	}
+
+	static
+	const char *
+	joinTypeName(JoinType jointype) {
+		switch (jointype) {
+		case JOIN_INNER: return "inner";
+		case JOIN_LEFT: return "left";
+		case JOIN_FULL: return "full";
+		case JOIN_RIGHT: return "right";
+		case JOIN_SEMI: return "semi";
+		case JOIN_ANTI: return "anti";
+		default: return "other";
+		}
+	}
+
+	/* Param nodes of the expressions of plan and its children, each once */
+	static
+	void
+	collectParams(Node *plan, PlanTemplate *pt) {
+		Plan *p = reinterpret_cast<Plan *>(plan);
+
+		if (p == NULL)
+			return ;
+		PlanTemplate::addParams(reinterpret_cast<Node *>(p->targetlist), pt);
+		PlanTemplate::addParams(reinterpret_cast<Node *>(PlanTemplate::scanQuals(p)), pt);
+		if (IsA(p, HashJoin))
+			PlanTemplate::addParams(reinterpret_cast<Node *>(reinterpret_cast<HashJoin *>(p)->hashclauses), pt);
+		else if (IsA(p, MergeJoin))
+			PlanTemplate::addParams(reinterpret_cast<Node *>(reinterpret_cast<MergeJoin *>(p)->mergeclauses), pt);
+		if (IsA(p, HashJoin) || IsA(p, MergeJoin) || IsA(p, NestLoop))
+			PlanTemplate::addParams(reinterpret_cast<Node *>(reinterpret_cast<Join *>(p)->joinqual), pt);
+		PlanTemplate::collectParams(reinterpret_cast<Node *>(p->lefttree), pt);
+		PlanTemplate::collectParams(reinterpret_cast<Node *>(p->righttree), pt);
+	}
+
+	static
+	bool
+	addParams(Node *node, void *context) {
+		PlanTemplate *pt = static_cast<PlanTemplate *>(context);
+
+		if (node == NULL)
+			return false;
+		if (IsA(node, Param)) {
+			Param *param = reinterpret_cast<Param *>(node);
+
+			for (int i = 0; i < pt->nparams; i++) {
+				if (pt->params[i].paramid == param->paramid && pt->params[i].kind == param->paramkind)
+					return false;
+			}
+			if (param->paramkind != PARAM_EXTERN && param->paramkind != PARAM_EXEC)
+				return false;
+			if (pt->nparams % 8 == 0 && pt->nparams > 0)
+				pt->params = static_cast<TemplateParam *>(repalloc(pt->params, sizeof(TemplateParam) * (pt->nparams + 8)));
+			pt->params[pt->nparams].paramid = param->paramid;
+			pt->params[pt->nparams].kind = param->paramkind;
+			pt->params[pt->nparams].type = param->paramtype;
+			pt->nparams++;
+			return false;
+		}
+		return expression_tree_walker(node, reinterpret_cast<bool (*)()>(PlanTemplate::addParams), context);
+	}
+
+	/* current value of a parameter; false if an executor parameter has not been computed */
+	static
+	bool
+	fetchParam(EState *estate, TemplateParam *tp, Datum *value, bool *isnull) {
+		if (tp->kind == PARAM_EXTERN) {
+			ParamListInfo params = estate->es_param_list_info;
+			ParamExternData *prm;
+
+			if (params == NULL || tp->paramid <= 0 || tp->paramid > params->numParams)
+				return false;
+			prm = &params->params[tp->paramid - 1];
+			if (params->paramFetch != NULL && !OidIsValid(prm->ptype))
+				(*params->paramFetch) (params, tp->paramid);
+			*value = prm->value;
+			*isnull = prm->isnull || !OidIsValid(prm->ptype);
+			return true;
+		}
+		else {
+			ParamExecData *prm;
+
+			if (estate->es_param_exec_vals == NULL)
+				return false;
+			prm = &estate->es_param_exec_vals[tp->paramid];
+			/* an initplan not run yet */
+			if (prm->execPlan != NULL)
+				return false;
+			*value = prm->value;
+			*isnull = prm->isnull;
+			return true;
+		}
+	}
+
+	/* rows of the input depend on its relation and on external parameters only */
+	static
+	uint64_t
+	fingerprintInput(ScanState *ss) {
+		Plan *plan = ss->ps.plan;
+		Relation rel = ss->ss_currentRelation;
+		List *quals;
+		PlanTemplate params;
+		StringInfoData buf;
+		uint64_t fp;
+
+		if (rel == NULL || !pgstat_track_counts || !bms_is_empty(plan->allParam))
+			return 0;
+		switch (nodeTag(plan)) {
+		case T_SeqScan:
+		case T_IndexScan:
+		case T_IndexOnlyScan:
+		case T_BitmapHeapScan:
+			break;
+		default:
+			return 0;
+		}
+		quals = PlanTemplate::scanQuals(plan);
+		if (contain_mutable_functions(reinterpret_cast<Node *>(quals)) ||
+		    contain_mutable_functions(reinterpret_cast<Node *>(plan->targetlist)))
+			return 0;
+		initStringInfo(&buf);
+		if (!ResultCache::appendRelationState(&buf, rel)) {
+			pfree(buf.data);
+			return 0;
+		}
+		/* values of the parameters of the scan */
+		params.params = static_cast<TemplateParam *>(palloc(sizeof(TemplateParam) * 8));
+		PlanTemplate::addParams(reinterpret_cast<Node *>(quals), &params);
+		PlanTemplate::addParams(reinterpret_cast<Node *>(plan->targetlist), &params);
+		for (int i = 0; i < params.nparams; i++) {
+			TemplateParam *tp = &params.params[i];
+			Datum value;
+			bool isnull;
+
+			if (!PlanTemplate::fetchParam(ss->ps.state, tp, &value, &isnull))
+				return 0;
+			appendStringInfo(&buf, "\nparam %d %u ", tp->paramid, tp->type);
+			if (isnull)
+				appendStringInfoString(&buf, "null");
+			else {
+				Oid output;
+				bool varlena;
+
+				getTypeOutputInfo(tp->type, &output, &varlena);
+				appendStringInfoString(&buf, OidOutputFunctionCall(output, value));
+			}
+		}
+		params.fini();
+		fp = PlanTemplate::hash64(buf.data, buf.len, nodeToString(plan));
+		pfree(buf.data);
+		/* 0 means not reusable */
+		return (fp != 0) ? fp : 1;
+	}
+};
+
+#endif //PLANTEMPLATE_HEAD_
@@ -5,6 +5,9 @@ class ResultBuffer {
 public: 
 	static constexpr std::size_t BUFSIZE = 1024UL * 1024UL * 128;
 	// static constexpr std::size_t BUFSIZE = 30UL;
+	/* content sizes that are not sizes: the stream ended, or the connection broke before it did */
+	static constexpr long END = -1;
+	static constexpr long FAILED = -2;
 private: 
 	void *buffer;
 	std::atomic_long content_size;
@@ -24,11 +27,11 @@ public:
         }
 	
 	void init(void) {
-                this->buffer = palloc(ResultBuffer::BUFSIZE);
+                this->buffer = BufferPool::instance()->acquire(ResultBuffer::BUFSIZE);
                 this->content_size.store(0, std::memory_order_relaxed);
 	}
         void fini(void) {
-                pfree(this->buffer);
+                BufferPool::instance()->release(this->buffer);
 		this->content_size.store(0, std::memory_order_relaxed);
 	}
 	
@@ -0,0 +1,403 @@
+#ifndef RESULTCACHE_HEAD_
+#define RESULTCACHE_HEAD_
+
+/*
+ * Disk-backed cache of result streams, shared by all backends of the cluster.
+ *
+ * An entry is keyed on the text of the offloaded plan, the values of external
+ * parameters, the endpoints and the modification state (relfilenode, size and
+ * insert/update/delete counters) of every input relation. It consists of one
+ * stream file per session, holding exactly the bytes the external process
+ * sent, and a header file written last that makes the entry visible.
+ * A cache hit replays the stream files through the result receiving threads,
+ * so ExecExternalJoin() decodes them exactly like a live result.
+ *
+ * Counters of other backends reach the statistics collector with a delay,
+ * so entries also expire after external_join.result_cache_ttl; a hit may miss
+ * changes committed within that time. Transactions using one snapshot for
+ * all of their statements do not use the cache, since an entry recorded
+ * under another snapshot may hold rows they must not see.
+ *
+ * append() and finish() are called from result receiving threads and must not
+ * use palloc or elog.
+ */
+class ResultCache {
+public:
+	static constexpr const char *DIRECTORY = "pg_external_join_cache";
+	static constexpr uint32_t MAGIC = 0x324A4545;	/* "EEJ2": result streams in batches */
+	static constexpr int MAX_STREAMS = 16;
+
+private:
+	/* first bytes of the header file, followed by the key */
+	struct Header {
+		uint32_t magic;
+		uint32_t nsessions;
+		uint64_t keylen;
+	};
+	enum Stream { UNUSED = 0, RECORDING, COMPLETE, FAILED };
+
+	char *key;
+	/* entry path without suffix, DIRECTORY/<16 hex digits> */
+	char path[64];
+	int nsessions;
+	int fds[MAX_STREAMS];
+	std::atomic_int streams[MAX_STREAMS];
+	std::atomic<uint64_t> recorded[MAX_STREAMS];
+	uint64_t max_size;
+
+public:
+	ResultCache(void) { this->init(); }
+	~ResultCache(void) { this->fini(); }
+
+	static ResultCache *constructor(void) {
+		ResultCache *rc = static_cast<ResultCache *>(palloc(sizeof(*rc)));
+		rc->init();
+		return rc;
+	}
+	static void destructor(ResultCache *rc) {
+		rc->fini();
+		pfree(rc);
+	}
+
+	void init(void) {
+		this->key = NULL;
+		this->path[0] = '\0';
+		this->nsessions = 0;
+		this->max_size = 0;
+		for (int i = 0; i < MAX_STREAMS; i++) {
+			this->fds[i] = -1;
+			this->streams[i].store(UNUSED, std::memory_order_relaxed);
+			this->recorded[i].store(0, std::memory_order_relaxed);
+		}
+	}
+	/* drop an unfinished recording; safe to call from a memory context reset callback */
+	void fini(void) {
+		for (int i = 0; i < this->nsessions; i++) {
+			if (this->fds[i] >= 0)
+				::close(this->fds[i]);
+			if (this->streams[i].load() != UNUSED) {
+				char tmp[MAXPGPATH];
+
+				this->streamPath(tmp, i, true);
+				::unlink(tmp);
+			}
+		}
+		this->init();
+	}
+
+	/* set up for the plan below node; returns false if its result must not be cached */
+	bool
+	begin(PlanState *node, List *inputs, const char *endpoints) {
+		StringInfoData buf;
+		ParamListInfo params = node->state->es_param_list_info;
+		ListCell *lc;
+
+		this->fini();
+		if (!pgstat_track_counts || IsolationUsesXactSnapshot() || !bms_is_empty(node->plan->extParam) ||
+		    !ResultCache::isCacheable(node->plan))
+			return false;
+
+		initStringInfo(&buf);
+		appendStringInfo(&buf, "db %u endpoints %s\n", MyDatabaseId, endpoints);
+		appendStringInfoString(&buf, nodeToString(node->plan));
+
+		/* values of external parameters */
+		for (int i = 0; params != NULL && i < params->numParams; i++) {
+			ParamExternData *prm = &params->params[i];
+
+			if (params->paramFetch != NULL)
+				(*params->paramFetch) (params, i + 1);
+			appendStringInfo(&buf, "\nparam %d %u ", i + 1, prm->ptype);
+			if (prm->isnull || !OidIsValid(prm->ptype))
+				appendStringInfoString(&buf, "null");
+			else {
+				Oid output;
+				bool varlena;
+
+				getTypeOutputInfo(prm->ptype, &output, &varlena);
+				appendStringInfoString(&buf, OidOutputFunctionCall(output, prm->value));
+			}
+		}
+
+		/* modification state of input relations */
+		foreach(lc, inputs) {
+			Relation rel = reinterpret_cast<ScanState *>(lfirst(lc))->ss_currentRelation;
+
+			appendStringInfoChar(&buf, '\n');
+			if (rel == NULL || !ResultCache::appendRelationState(&buf, rel))
+				return false;
+		}
+
+		this->key = buf.data;
+		snprintf(this->path, sizeof(this->path), "%s/%08x%08x", DIRECTORY,
+			 DatumGetUInt32(hash_any(reinterpret_cast<unsigned char *>(buf.data), buf.len)),
+			 DatumGetUInt32(hash_any(reinterpret_cast<unsigned char *>(buf.data), buf.len / 2)));
+		return true;
+	}
+
+	/*
+	 * Append the modification state of rel to buf: relfilenode, size and
+	 * insert/update/delete counters. Returns false if the state cannot tell
+	 * whether rows of rel changed, that is if this transaction changed rel,
+	 * which other backends do not see, or uses one snapshot for all of its
+	 * statements, which may not see rows committed since.
+	 */
+	static
+	bool
+	appendRelationState(StringInfo buf, Relation rel) {
+		PgStat_StatTabEntry *tabentry;
+		PgStat_TableStatus *tabstat;
+		PgStat_Counter changes = 0;
+
+		if (IsolationUsesXactSnapshot())
+			return false;
+		tabstat = find_tabstat_entry(RelationGetRelid(rel));
+		if (tabstat != NULL && tabstat->trans != NULL)
+			return false;
+		if (tabstat != NULL)
+			changes += tabstat->t_counts.t_tuples_inserted + tabstat->t_counts.t_tuples_updated +
+				tabstat->t_counts.t_tuples_deleted;
+		tabentry = pgstat_fetch_stat_tabentry(RelationGetRelid(rel));
+		if (tabentry != NULL)
+			changes += tabentry->tuples_inserted + tabentry->tuples_updated + tabentry->tuples_deleted;
+		appendStringInfo(buf, "rel %u %u %u " INT64_FORMAT, RelationGetRelid(rel),
+				 rel->rd_node.relNode, RelationGetNumberOfBlocks(rel), changes);
+		return true;
+	}
+
+	/*
+	 * Open the stream files of a valid entry into fds.
+	 * Returns the number of sessions, or 0 on a cache miss.
+	 */
+	int
+	lookup(int *fds, int ttl) {
+		Header header;
+		struct stat st;
+		char *stored;
+		char tmp[MAXPGPATH];
+		int fd;
+		int n = 0;
+
+		if (this->key == NULL || (fd = ::open(this->path, O_RDONLY | PG_BINARY)) < 0)
+			return 0;
+		if (::fstat(fd, &st) != 0 || st.st_mtime + ttl < ::time(NULL) ||
+		    ::read(fd, &header, sizeof(header)) != sizeof(header) || header.magic != MAGIC ||
+		    header.keylen != std::strlen(this->key) || header.nsessions > MAX_STREAMS) {
+			::close(fd);
+			return 0;
+		}
+		stored = static_cast<char *>(palloc(header.keylen));
+		if (::read(fd, stored, header.keylen) != static_cast<ssize_t>(header.keylen) ||
+		    std::memcmp(stored, this->key, header.keylen) != 0) {
+			pfree(stored);
+			::close(fd);
+			return 0;
+		}
+		pfree(stored);
+		::close(fd);
+
+		for (n = 0; n < static_cast<int>(header.nsessions); n++) {
+			this->streamPath(tmp, n, false);
+			if ((fds[n] = ::open(tmp, O_RDONLY | PG_BINARY)) < 0) {
+				while (--n >= 0)
+					::close(fds[n]);
+				return 0;
+			}
+		}
+		elog(DEBUG2, ":: result cache hit %s", this->path);
+		return n;
+	}
+
+	/* start recording nsessions result streams of at most max_size bytes in total */
+	void
+	record(int nsessions, uint64_t max_size) {
+		char tmp[MAXPGPATH];
+
+		if (this->key == NULL || nsessions > MAX_STREAMS)
+			return ;
+		if (::mkdir(DIRECTORY, S_IRWXU) != 0 && errno != EEXIST)
+			return ;
+		this->nsessions = nsessions;
+		this->max_size = max_size;
+		for (int i = 0; i < nsessions; i++) {
+			this->streamPath(tmp, i, true);
+			this->fds[i] = ::open(tmp, O_WRONLY | O_CREAT | O_TRUNC | PG_BINARY, S_IRUSR | S_IWUSR);
+			this->streams[i].store(this->fds[i] < 0 ? FAILED : RECORDING);
+		}
+	}
+
+	/* called by the receiving thread of session i for every block received */
+	void
+	append(int i, const void *data, std::size_t size) {
+		uint64_t total = 0;
+
+		if (i >= this->nsessions || this->streams[i].load() != RECORDING)
+			return ;
+		this->recorded[i] += size;
+		for (int j = 0; j < this->nsessions; j++)
+			total += this->recorded[j].load();
+		if (total > this->max_size || ::write(this->fds[i], data, size) != static_cast<ssize_t>(size))
+			this->streams[i].store(FAILED);
+	}
+
+	/* called by the receiving thread of session i at the end of its stream */
+	void
+	finish(int i) {
+		int expected = RECORDING;
+
+		if (i < this->nsessions)
+			this->streams[i].compare_exchange_strong(expected, COMPLETE);
+	}
+
+	/* publish the entry if every stream was recorded completely, otherwise drop it */
+	void
+	commit(void) {
+		Header header;
+		char tmp[MAXPGPATH];
+		char dst[MAXPGPATH];
+		int fd;
+		bool complete = (this->nsessions > 0);
+
+		for (int i = 0; i < this->nsessions; i++) {
+			if (this->streams[i].load() != COMPLETE)
+				complete = false;
+		}
+		if (!complete) {
+			this->fini();
+			return ;
+		}
+		for (int i = 0; i < this->nsessions; i++) {
+			::close(this->fds[i]);
+			this->fds[i] = -1;
+			this->streamPath(tmp, i, true);
+			this->streamPath(dst, i, false);
+			if (::rename(tmp, dst) != 0)
+				complete = false;
+			this->streams[i].store(UNUSED);
+		}
+
+		/* header goes last, readers never see an entry with missing streams */
+		header.magic = MAGIC;
+		header.nsessions = this->nsessions;
+		header.keylen = std::strlen(this->key);
+		snprintf(tmp, sizeof(tmp), "%s.%d.tmp", this->path, MyProcPid);
+		if (complete && (fd = ::open(tmp, O_WRONLY | O_CREAT | O_TRUNC | PG_BINARY, S_IRUSR | S_IWUSR)) >= 0) {
+			if (::write(fd, &header, sizeof(header)) == sizeof(header) &&
+			    ::write(fd, this->key, header.keylen) == static_cast<ssize_t>(header.keylen) &&
+			    ::close(fd) == 0)
+				::rename(tmp, this->path);
+			else
+				::unlink(tmp);
+			elog(DEBUG2, ":: result cache stored %s", this->path);
+		}
+		this->fini();
+	}
+
+	/* read like receiveStrong(), used by receiving threads to replay a stream file */
+	static
+	long
+	readStream(int fd, void *buf, long size) {
+		long cumulative = 0;
+
+		while (cumulative < size) {
+			ssize_t n = ::read(fd, static_cast<char *>(buf) + cumulative, size - cumulative);
+
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				return (cumulative > 0) ? cumulative : n;
+			cumulative += n;
+		}
+		return cumulative;
+	}
+
+	bool
+	isRecording(void) const {
+		return (this->nsessions > 0);
+	}
+
+	/* remove entries older than ttl seconds */
+	static
+	void
+	expire(int ttl) {
+		DIR *dir = AllocateDir(DIRECTORY);
+		struct dirent *de;
+		time_t now = ::time(NULL);
+
+		if (dir == NULL)
+			return ;
+		while ((de = ReadDir(dir, DIRECTORY)) != NULL) {
+			char file[MAXPGPATH];
+			struct stat st;
+
+			if (de->d_name[0] == '.')
+				continue;
+			snprintf(file, sizeof(file), "%s/%s", DIRECTORY, de->d_name);
+			/* leave some slack for recordings still in progress */
+			if (::stat(file, &st) == 0 && st.st_mtime + ttl * 2 < now)
+				::unlink(file);
+		}
+		FreeDir(dir);
+	}
+
+private:
+	void
+	streamPath(char *buf, int i, bool temporary) const {
+		if (temporary)
+			snprintf(buf, MAXPGPATH, "%s.%d.%d.tmp", this->path, i, MyProcPid);
+		else
+			snprintf(buf, MAXPGPATH, "%s.%d", this->path, i);
+	}
+
+	/* plans whose result depends only on their text, parameters and input relations */
+	static
+	bool
+	isCacheable(Plan *plan) {
+		if (plan == NULL)
+			return true;
+		if (plan->initPlan != NIL ||
+		    contain_mutable_functions(reinterpret_cast<Node *>(plan->targetlist)) ||
+		    contain_mutable_functions(reinterpret_cast<Node *>(plan->qual)))
+			return false;
+		switch (nodeTag(plan)) {
+		case T_SeqScan:
+			break;
+		case T_IndexScan:
+			if (contain_mutable_functions(reinterpret_cast<Node *>(reinterpret_cast<IndexScan *>(plan)->indexqualorig)))
+				return false;
+			break;
+		case T_IndexOnlyScan:
+			if (contain_mutable_functions(reinterpret_cast<Node *>(reinterpret_cast<IndexOnlyScan *>(plan)->indexqual)))
+				return false;
+			break;
+		case T_BitmapHeapScan:
+			if (contain_mutable_functions(reinterpret_cast<Node *>(reinterpret_cast<BitmapHeapScan *>(plan)->bitmapqualorig)))
+				return false;
+			/* bitmap index scans below repeat bitmapqualorig */
+			return true;
+		case T_HashJoin:
+			if (contain_mutable_functions(reinterpret_cast<Node *>(reinterpret_cast<HashJoin *>(plan)->hashclauses)))
+				return false;
+			/* fall through */
+		case T_MergeJoin:
+			if (IsA(plan, MergeJoin) &&
+			    contain_mutable_functions(reinterpret_cast<Node *>(reinterpret_cast<MergeJoin *>(plan)->mergeclauses)))
+				return false;
+			/* fall through */
+		case T_NestLoop:
+			if (contain_mutable_functions(reinterpret_cast<Node *>(reinterpret_cast<Join *>(plan)->joinqual)))
+				return false;
+			break;
+		case T_Hash:
+		case T_Sort:
+		case T_Material:
+			break;
+		default:
+			/* other scans (functions, CTEs, ...) are not keyed on a relation */
+			return false;
+		}
+		return ResultCache::isCacheable(plan->lefttree) && ResultCache::isCacheable(plan->righttree);
+	}
+};
+
+#endif //RESULTCACHE_HEAD_
@@ -0,0 +1,293 @@
+#ifndef RESULTDECODER_HEAD_
+#define RESULTDECODER_HEAD_
+
+/*
+ * Decoding of result rows from the double buffered result stream.
+ *
+ * Rows arrive in batches and are laid out as C structs: each column aligned
+ * to its own size and packed in target list order (see ExternalProtocol.hpp).
+ * Batches without NULL skip null checks entirely; otherwise the validity
+ * bitmaps are ANDed 64 rows at a time, so rows without NULL skip them too.
+ * Result buffers are filled completely except for the last one, so an
+ * aligned column never straddles two buffers; only varlena values are
+ * copied across the switch. Kept apart from the executor node so that it
+ * can be driven by micro-benchmarks with synthetic buffers.
+ */
+
+/* cursor over the result stream of one session */
+struct ResultCursor {
+	/* result buffer: double buffered */
+	DoubleResultBuffer drb;
+	/* result buffer which result processing thread currently handles */
+	ResultBuffer *prb;
+	/* offset(cursor) to scan result buffer */
+	std::size_t poffset; 
+	/* size of content in result buffer */
+	long psize;
+	/* varlena values of the current row, reset for every row */
+	MemoryContext rowcxt;
+	/* context of the validity bitmaps */
+	MemoryContext cxt;
+	
+	/* rows of the current batch not decoded yet, and index of the next one */
+	uint32_t batch_rows;
+	uint32_t batch_row;
+	/* the batch has validity bitmaps */
+	bool has_nulls;
+	/* validity bitmaps of the batch, valid_words words per column */
+	uint64_t *valid;
+	std::size_t valid_words;
+	std::size_t valid_capacity;
+	/* AND of the words of all columns for the 64 rows around batch_row */
+	uint64_t rows_valid;
+};
+
+class ResultDecoder {
+public:
+	/* decode the next row into tts, NULL at the end of the stream */
+	static 
+	TupleTableSlot *
+	decode(ResultCursor *rc, TupleTableSlot *tts, JoinInstrumentation *instr)
+	{
+		TupleDesc td = tts->tts_tupleDescriptor;
+		uint32_t row;
+		bool row_has_nulls;
+	
+		/* next batch, NULL at the end of the stream */
+		while (rc->batch_rows == 0) {
+			if (!ResultDecoder::readBatch(rc, td->natts, instr))
+				return NULL;
+		}
+		/* wait until result buffer will be filled */
+		if (rc->poffset == ResultBuffer::BUFSIZE) {
+			elog(DEBUG2, ":: ResultBuffer FULL switch");
+			/* the batch has more rows */
+			if (!ResultDecoder::nextBuffer(rc, instr, false))
+				ResultDecoder::reportTruncated();
+		}
+		row = rc->batch_row++;
+		rc->batch_rows--;
+		if (rc->has_nulls && row % 64 == 0) {
+			rc->rows_valid = ~UINT64CONST(0);
+			for (int col = 0; col < td->natts; col++)
+				rc->rows_valid &= rc->valid[col * rc->valid_words + row / 64];
+		}
+		row_has_nulls = rc->has_nulls && !(rc->rows_valid & (UINT64CONST(1) << (row % 64)));
+	
+		/* check cancel request */
+		CHECK_FOR_INTERRUPTS();
+	
+		/* fill result tuple */
+		ExecClearTuple(tts);
+		MemoryContextReset(rc->rowcxt);
+		for (int col = 0; col < td->natts; col++) {
+			std::size_t size;
+			void *ptr;
+		
+			switch (td->attrs[col]->atttypid) {
+			case INT8OID:
+			case FLOAT8OID:
+				size = sizeof(double);
+				break;
+			case INT4OID:
+	                case FLOAT4OID:
+			case OIDOID:
+				size = sizeof(float);
+				break;
+	                case INT2OID:
+				size = sizeof(short);
+				break;
+			case BOOLOID: 
+				size = sizeof(bool);
+				break;
+			default: 
+				/* length of a varlena value */
+				if (td->attrs[col]->attlen == -1) {
+					size = sizeof(uint32_t);
+					break;
+				}
+				ereport(ERROR, (errcode(ERRCODE_EXTERNAL_ROUTINE_INVOCATION_EXCEPTION), 
+						errmsg("unsupported result type %d.\n", td->attrs[col]->atttypid)));
+			};
+			rc->poffset = ResultDecoder::getAlignedOffset(rc->poffset, size);
+			
+			/* the row continues in the other buffer */
+			if (rc->poffset == ResultBuffer::BUFSIZE) {
+				elog(DEBUG2, ":: ResultBuffer HUNGRY switch");
+				if (!ResultDecoder::nextBuffer(rc, instr, true))
+					ResultDecoder::reportTruncated();
+			}
+			if (rc->poffset + size > static_cast<std::size_t>(rc->psize))
+				ResultDecoder::reportTruncated();
+			ptr = (*rc->prb)[rc->poffset];
+			rc->poffset += size;
+			
+			if (row_has_nulls) {
+				tts->tts_isnull[col] = !(rc->valid[col * rc->valid_words + row / 64] & (UINT64CONST(1) << (row % 64)));
+				/* skip the value, a NULL varlena may still carry bytes */
+				if (tts->tts_isnull[col]) {
+					tts->tts_values[col] = (Datum) 0;
+					if (td->attrs[col]->attlen == -1)
+						ResultDecoder::readBytes(rc, NULL, *reinterpret_cast<uint32_t *>(ptr), instr);
+					continue;
+				}
+			}
+		
+			/* put column data to result tuple */
+			switch (td->attrs[col]->atttypid) {
+			case BOOLOID: 
+				tts->tts_values[col] = BoolGetDatum(*reinterpret_cast<bool *>(ptr));
+				break;
+	                case INT8OID:
+				tts->tts_values[col] = Int64GetDatum(*reinterpret_cast<int64_t *>(ptr));
+				break;
+	                case INT2OID:
+				tts->tts_values[col] = Int16GetDatum(*reinterpret_cast<int16_t *>(ptr));
+				break;
+			case INT4OID:
+				tts->tts_values[col] = Int32GetDatum(*reinterpret_cast<int32_t *>(ptr));
+				break;
+	                case FLOAT4OID:
+				tts->tts_values[col] = Float4GetDatum(*reinterpret_cast<float *>(ptr));
+				break;
+			case FLOAT8OID:
+				tts->tts_values[col] = Float8GetDatum(*reinterpret_cast<double *>(ptr));
+				break;
+			case OIDOID:
+				tts->tts_values[col] = ObjectIdGetDatum(*reinterpret_cast<uint32_t *>(ptr));
+				break;
+			default:
+				tts->tts_values[col] = PointerGetDatum(ResultDecoder::readVarlena(rc, *reinterpret_cast<uint32_t *>(ptr), instr));
+				break;
+			};
+		}
+		/* set null flags to false */
+		if (!row_has_nulls)
+			::bzero(static_cast<void *>(tts->tts_isnull), sizeof(bool) * td->natts);
+	
+		return ExecStoreVirtualTuple(tts);
+	}
+
+
+private:
+	static inline
+	std::size_t 
+	getAlignedOffset(std::size_t prev, std::size_t size)
+	{
+		return (prev % size) ? (prev / size + 1) * size : prev;
+	}
+	
+	/* hand the current buffer back to the receiver and wait for the other one, false at EOF */
+	static 
+	bool 
+	nextBuffer(ResultCursor *rc, JoinInstrumentation *instr, bool straddle)
+	{
+		instr_time wait;
+		
+		instr->countSwitch(straddle);
+		instr->getTrace()->record(PipelineTrace::DECODE_DONE, PipelineTrace::INSTANT, PipelineTrace::BACKEND, 0, rc->psize);
+		rc->prb->setContentSize(0);
+		rc->drb.switchResultBuffer();
+		rc->prb = rc->drb.getCurrentResultBuffer();
+		rc->poffset = 0;
+		instr->startTimer(&wait);
+		instr->getTrace()->record(PipelineTrace::RESULT_WAIT, PipelineTrace::BEGIN, PipelineTrace::BACKEND);
+		while ((rc->psize = rc->prb->getContentSize()) == 0)
+			::usleep(1);
+		instr->getTrace()->record(PipelineTrace::RESULT_WAIT, PipelineTrace::END, PipelineTrace::BACKEND);
+		instr->stopResultWait(&wait);
+		if (rc->psize == ResultBuffer::FAILED)
+			ResultDecoder::reportTruncated();
+		return (rc->psize > 0);
+	}
+	
+	/* read the header and validity bitmaps of the next batch, false at the end of the stream */
+	static 
+	bool 
+	readBatch(ResultCursor *rc, int natts, JoinInstrumentation *instr)
+	{
+		ResultBatchHeader batch;
+		
+		rc->poffset = ResultDecoder::getAlignedOffset(rc->poffset, sizeof(uint64_t));
+		if (rc->poffset == ResultBuffer::BUFSIZE) {
+			elog(DEBUG2, ":: ResultBuffer FULL switch");
+			/* EOF */
+			if (!ResultDecoder::nextBuffer(rc, instr, false))
+				return false;
+		}
+		else if (rc->poffset >= static_cast<std::size_t>(rc->psize))
+			return false;
+		if (rc->poffset + sizeof(batch) > static_cast<std::size_t>(rc->psize))
+			ResultDecoder::reportTruncated();
+		std::memcpy(&batch, (*rc->prb)[rc->poffset], sizeof(batch));
+		rc->poffset += sizeof(batch);
+		
+		rc->batch_rows = batch.nrows;
+		rc->batch_row = 0;
+		rc->has_nulls = (batch.flags & RESULT_HAS_NULLS) != 0;
+		if (rc->has_nulls) {
+			std::size_t size;
+			
+			rc->valid_words = (batch.nrows + 63) / 64;
+			size = natts * rc->valid_words * sizeof(uint64_t);
+			if (size > rc->valid_capacity) {
+				if (rc->valid != NULL)
+					pfree(rc->valid);
+				rc->valid = static_cast<uint64_t *>(MemoryContextAlloc(rc->cxt, size));
+				rc->valid_capacity = size;
+			}
+			/* words are 8 byte aligned in the stream, but may continue in the other buffer */
+			ResultDecoder::readBytes(rc, reinterpret_cast<char *>(rc->valid), size, instr);
+		}
+		return true;
+	}
+	
+	/* copy a varlena value of length bytes */
+	static 
+	struct varlena *
+	readVarlena(ResultCursor *rc, uint32_t length, JoinInstrumentation *instr)
+	{
+		struct varlena *v;
+		
+		if (!AllocSizeIsValid(static_cast<std::size_t>(length) + VARHDRSZ)) {
+			ereport(ERROR, (errcode(ERRCODE_EXTERNAL_ROUTINE_INVOCATION_EXCEPTION), 
+					errmsg("invalid result value length %u\n", length)));
+		}
+		v = static_cast<struct varlena *>(MemoryContextAlloc(rc->rowcxt, length + VARHDRSZ));
+		SET_VARSIZE(v, length + VARHDRSZ);
+		ResultDecoder::readBytes(rc, VARDATA(v), length, instr);
+		return v;
+	}
+	
+	/* copy (or skip if dst is NULL) size bytes, which may continue in the other buffer */
+	static 
+	void 
+	readBytes(ResultCursor *rc, char *dst, std::size_t size, JoinInstrumentation *instr)
+	{
+		while (size > 0) {
+			std::size_t n;
+			
+			if (rc->poffset == ResultBuffer::BUFSIZE && !ResultDecoder::nextBuffer(rc, instr, true))
+				ResultDecoder::reportTruncated();
+			if (rc->poffset >= static_cast<std::size_t>(rc->psize))
+				ResultDecoder::reportTruncated();
+			n = Min(size, rc->psize - rc->poffset);
+			if (dst != NULL) {
+				std::memcpy(dst, (*rc->prb)[rc->poffset], n);
+				dst += n;
+			}
+			rc->poffset += n;
+			size -= n;
+		}
+	}
+	
+	static 
+	void 
+	reportTruncated(void)
+	{
+		ereport(ERROR, (errcode(ERRCODE_EXTERNAL_ROUTINE_INVOCATION_EXCEPTION), 
+				errmsg("unexpected connection shutdown\n")));
+	}
+};
+
+#endif //RESULTDECODER_HEAD_
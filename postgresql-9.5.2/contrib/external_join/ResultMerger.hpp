@@ -0,0 +1,268 @@
+#ifndef RESULTMERGER_HEAD_
+#define RESULTMERGER_HEAD_
+
+/*
+ * Order of the results of an offloaded plan, and merge of the sorted
+ * result streams of its sessions.
+ *
+ * An engine runs the whole offloaded plan, so a Sort on top of it (under
+ * Limit, Unique or Material) is carried out by the engine and its stream
+ * arrives sorted. Inputs are partitioned by the clauses of the root join
+ * only, so such a plan runs on one engine and needs no merge. Streams are
+ * merged when the root is a join whose order a parent MergeAppend wants:
+ * then every engine sorts its own partition only, and returning the
+ * streams one after another would break the order. They are merged like
+ * MergeAppend merges its children: the head row of every stream is
+ * decoded into a slot of its own and a binary heap picks the least one. A
+ * row stays valid until its stream is decoded again, which is not before
+ * the next fetch.
+ */
+class ResultMerger {
+private:
+	/* sort keys, columns are 1-based in the result row */
+	int nkeys;
+	AttrNumber *columns;
+	Oid *operators;
+	Oid *collations;
+	bool *nulls_first;
+	SortSupport sortkeys;
+
+	/* streams being merged, each with the slot of its head row */
+	int nstreams;
+	ResultCursor **cursors;
+	TupleTableSlot **slots;
+	binaryheap *heap;
+	bool started;
+
+public:
+	ResultMerger(void) { this->init(); }
+	~ResultMerger(void) { this->fini(); }
+
+	static ResultMerger *constructor(void) {
+		ResultMerger *rm = static_cast<ResultMerger *>(palloc(sizeof(*rm)));
+		rm->init();
+		return rm;
+	}
+	static void destructor(ResultMerger *rm) {
+		rm->fini();
+		pfree(rm);
+	}
+
+	void init(void) {
+		this->nkeys = 0;
+		this->columns = NULL;
+		this->operators = NULL;
+		this->collations = NULL;
+		this->nulls_first = NULL;
+		this->sortkeys = NULL;
+		this->nstreams = 0;
+		this->cursors = NULL;
+		this->slots = NULL;
+		this->heap = NULL;
+		this->started = false;
+	}
+	void fini(void) {
+		this->end();
+		if (this->nkeys > 0) {
+			pfree(this->columns);
+			pfree(this->operators);
+			pfree(this->collations);
+			pfree(this->nulls_first);
+			pfree(this->sortkeys);
+		}
+		this->init();
+	}
+
+	/*
+	 * order the results of plan are in, as a list of the column, operator,
+	 * collation and nulls first lists of its Sort, or NIL if unordered
+	 */
+	static
+	List *
+	planOrder(Plan *plan) {
+		Sort *sort;
+
+		/* these pass rows through in the order they get them */
+		while (plan != NULL && (IsA(plan, Limit) || IsA(plan, Unique) || IsA(plan, Material)))
+			plan = outerPlan(plan);
+		if (plan == NULL || !IsA(plan, Sort))
+			return NIL;
+		sort = reinterpret_cast<Sort *>(plan);
+		return ResultMerger::makeOrder(sort->numCols, sort->sortColIdx, sort->sortOperators,
+					       sort->collations, sort->nullsFirst);
+	}
+
+	/* order list of sort keys as a Sort or MergeAppend node has them */
+	static
+	List *
+	makeOrder(int n, const AttrNumber *columns, const Oid *operators, const Oid *collations, const bool *nulls_first) {
+		List *cols = NIL;
+		List *ops = NIL;
+		List *colls = NIL;
+		List *nulls = NIL;
+
+		if (n == 0)
+			return NIL;
+		for (int i = 0; i < n; i++) {
+			cols = lappend_int(cols, columns[i]);
+			ops = lappend_oid(ops, operators[i]);
+			colls = lappend_oid(colls, collations[i]);
+			nulls = lappend_int(nulls, nulls_first[i]);
+		}
+		return list_make4(cols, ops, colls, nulls);
+	}
+
+	/* sort keys from an order list of the plan */
+	void
+	build(List *order) {
+		List *cols;
+		List *ops;
+		List *colls;
+		List *nulls;
+
+		this->fini();
+		if (order == NIL)
+			return ;
+		cols = static_cast<List *>(linitial(order));
+		ops = static_cast<List *>(lsecond(order));
+		colls = static_cast<List *>(lthird(order));
+		nulls = static_cast<List *>(lfourth(order));
+		this->nkeys = list_length(cols);
+		this->columns = static_cast<AttrNumber *>(palloc(sizeof(AttrNumber) * this->nkeys));
+		this->operators = static_cast<Oid *>(palloc(sizeof(Oid) * this->nkeys));
+		this->collations = static_cast<Oid *>(palloc(sizeof(Oid) * this->nkeys));
+		this->nulls_first = static_cast<bool *>(palloc(sizeof(bool) * this->nkeys));
+		this->sortkeys = static_cast<SortSupport>(palloc0(sizeof(SortSupportData) * this->nkeys));
+		for (int i = 0; i < this->nkeys; i++) {
+			SortSupport ssup = &this->sortkeys[i];
+
+			this->columns[i] = list_nth_int(cols, i);
+			this->operators[i] = list_nth_oid(ops, i);
+			this->collations[i] = list_nth_oid(colls, i);
+			this->nulls_first[i] = list_nth_int(nulls, i);
+			ssup->ssup_cxt = CurrentMemoryContext;
+			ssup->ssup_collation = this->collations[i];
+			ssup->ssup_nulls_first = this->nulls_first[i];
+			ssup->ssup_attno = this->columns[i];
+			/* rows are compared once each, abbreviation would not pay off */
+			ssup->abbreviate = false;
+			PrepareSortSupportFromOrderingOp(this->operators[i], ssup);
+		}
+	}
+
+	bool
+	isOrdered(void) const {
+		return this->nkeys > 0;
+	}
+
+	int
+	getNumKeys(void) const {
+		return this->nkeys;
+	}
+
+	/* OrderKeys telling an engine the order, columns of desc are the result columns */
+	void
+	getOrderKeys(TupleDesc desc, OrderKey *keys) const {
+		for (int i = 0; i < this->nkeys; i++) {
+			Form_pg_attribute attr = desc->attrs[this->columns[i] - 1];
+
+			keys[i].column = this->columns[i] - 1;
+			keys[i].type = attr->atttypid;
+			keys[i].collation = OidIsValid(this->collations[i]) && !lc_collate_is_c(this->collations[i]) ?
+				this->collations[i] : InvalidOid;
+			keys[i].flags = 0;
+			if (this->sortkeys[i].ssup_reverse)
+				keys[i].flags |= ORDER_DESC;
+			if (this->nulls_first[i])
+				keys[i].flags |= ORDER_NULLS_FIRST;
+		}
+	}
+
+	/* merge n streams whose first buffers have arrived, rows have the shape of desc */
+	void
+	begin(ResultCursor **cursors, int n, TupleDesc desc) {
+		this->end();
+		this->nstreams = n;
+		this->cursors = static_cast<ResultCursor **>(palloc(sizeof(ResultCursor *) * n));
+		this->slots = static_cast<TupleTableSlot **>(palloc(sizeof(TupleTableSlot *) * n));
+		for (int i = 0; i < n; i++) {
+			this->cursors[i] = cursors[i];
+			this->slots[i] = MakeSingleTupleTableSlot(desc);
+		}
+		this->heap = binaryheap_allocate(n, ResultMerger::compare, static_cast<void *>(this));
+		this->started = false;
+	}
+
+	/* least head row of the streams, NULL once all of them ended */
+	TupleTableSlot *
+	next(JoinInstrumentation *instr) {
+		if (this->heap == NULL)
+			return NULL;
+		if (!this->started) {
+			for (int i = 0; i < this->nstreams; i++) {
+				if (ResultDecoder::decode(this->cursors[i], this->slots[i], instr) != NULL)
+					binaryheap_add_unordered(this->heap, Int32GetDatum(i));
+			}
+			binaryheap_build(this->heap);
+			this->started = true;
+		}
+		else if (!binaryheap_empty(this->heap)) {
+			/* the row returned last is consumed, replace it by the next of its stream */
+			int i = DatumGetInt32(binaryheap_first(this->heap));
+
+			if (ResultDecoder::decode(this->cursors[i], this->slots[i], instr) != NULL)
+				binaryheap_replace_first(this->heap, Int32GetDatum(i));
+			else
+				(void) binaryheap_remove_first(this->heap);
+		}
+		if (binaryheap_empty(this->heap))
+			return NULL;
+		return this->slots[DatumGetInt32(binaryheap_first(this->heap))];
+	}
+
+	bool
+	isMerging(void) const {
+		return this->heap != NULL;
+	}
+
+	/* drop the head rows; the streams belong to the caller */
+	void
+	end(void) {
+		if (this->heap == NULL)
+			return ;
+		for (int i = 0; i < this->nstreams; i++)
+			ExecDropSingleTupleTableSlot(this->slots[i]);
+		pfree(this->slots);
+		pfree(this->cursors);
+		binaryheap_free(this->heap);
+		this->heap = NULL;
+		this->slots = NULL;
+		this->cursors = NULL;
+		this->nstreams = 0;
+		this->started = false;
+	}
+
+private:
+	/* binaryheap keeps the greatest on top, so the comparison is inverted */
+	static
+	int
+	compare(Datum a, Datum b, void *arg) {
+		ResultMerger *rm = static_cast<ResultMerger *>(arg);
+		TupleTableSlot *s1 = rm->slots[DatumGetInt32(a)];
+		TupleTableSlot *s2 = rm->slots[DatumGetInt32(b)];
+
+		for (int i = 0; i < rm->nkeys; i++) {
+			SortSupport ssup = &rm->sortkeys[i];
+			AttrNumber attno = ssup->ssup_attno - 1;
+			int c;
+
+			c = ApplySortComparator(s1->tts_values[attno], s1->tts_isnull[attno],
+						s2->tts_values[attno], s2->tts_isnull[attno], ssup);
+			if (c != 0)
+				return -c;
+		}
+		return 0;
+	}
+};
+
+#endif //RESULTMERGER_HEAD_
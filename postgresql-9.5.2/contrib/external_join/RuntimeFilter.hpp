@@ -0,0 +1,510 @@
+#ifndef RUNTIMEFILTER_HEAD_
+#define RUNTIMEFILTER_HEAD_
+
+/*
+ * Runtime filter from the keys of one join input to a later one.
+ *
+ * The key of each input is found like InputPartitioner does, from the first
+ * equality clause on integer columns of the join node directly below the
+ * external join. After the earlier (build) input is sent, the engine is asked
+ * for the range of its keys, and optionally the keys themselves; the later
+ * (probe) input is then scanned with extra quals dropping rows outside of it.
+ * If the probe is a btree index scan on the key, the range also becomes index
+ * scan keys so that only the matching part of the index is read. A heap scan
+ * still reads every page (heap pages carry no key ranges in this release),
+ * but filtered rows are never copied or sent.
+ *
+ * A filter is only used where dropping the rows cannot change the result:
+ * the probe must not be the preserved side of an outer join, and every node
+ * between the join and the probe scan must pass rows through unchanged.
+ */
+class RuntimeFilter {
+private:
+	/* inputs the filter is taken from and applied to, -1 if none */
+	int build_input;
+	int probe_input;
+	PlanState *probe;
+	FilterRequest request;
+	/* key of the probe as an expression over its scan tuple */
+	Expr *key;
+	Oid key_type;
+	/* btree opfamily of the key type, compares it with int8 */
+	Oid opfamily;
+
+	/* replies of all sessions merged */
+	int replies;
+	uint32_t flags;
+	int64_t min;
+	int64_t max;
+	int64_t *values;
+	uint32_t nvalues;
+
+	/* probe state before apply() */
+	bool applied;
+	List *saved_qual;
+	ScanKey saved_keys;
+	int saved_nkeys;
+	/* the range was also given to the probe's index scan */
+	bool index_keys;
+	/* replies were received, for EXPLAIN */
+	bool explained;
+
+public:
+	RuntimeFilter(void) { this->init(); }
+	~RuntimeFilter(void) { this->fini(); }
+
+	static RuntimeFilter *constructor(void) {
+		RuntimeFilter *rf = static_cast<RuntimeFilter *>(palloc(sizeof(*rf)));
+		rf->init();
+		return rf;
+	}
+	static void destructor(RuntimeFilter *rf) {
+		rf->fini();
+		pfree(rf);
+	}
+
+	void init(void) {
+		this->build_input = -1;
+		this->probe_input = -1;
+		this->probe = NULL;
+		this->key = NULL;
+		this->key_type = InvalidOid;
+		this->opfamily = InvalidOid;
+		this->replies = 0;
+		this->flags = 0;
+		this->min = 0;
+		this->max = 0;
+		this->values = NULL;
+		this->nvalues = 0;
+		this->applied = false;
+		this->saved_qual = NIL;
+		this->saved_keys = NULL;
+		this->saved_nkeys = 0;
+		this->index_keys = false;
+		this->explained = false;
+	}
+	void fini(void) {
+		this->restore();
+		if (this->values != NULL)
+			pfree(this->values);
+		this->init();
+	}
+
+	/*
+	 * Set up a filter between two of inputs (scan nodes below join).
+	 * Returns false if no key of the join can filter a later input.
+	 */
+	bool
+	build(PlanState *join, List *inputs, int max_values) {
+		JoinType jointype;
+		ListCell *lc;
+
+		this->fini();
+		switch (nodeTag(join->plan)) {
+		case T_HashJoin:
+		case T_MergeJoin:
+		case T_NestLoop:
+			jointype = reinterpret_cast<Join *>(join->plan)->jointype;
+			break;
+		default:
+			return false;
+		}
+
+		foreach(lc, InputPartitioner::getJoinClauses(join)) {
+			OpExpr *op = static_cast<OpExpr *>(lfirst(lc));
+			PlanState *side[2];
+			PlanState *scan[2];
+			AttrNumber attno[2];
+			int index[2];
+			int b, p;
+			TargetEntry *tle;
+			Oid opclass;
+
+			if (!IsA(op, OpExpr) || list_length(op->args) != 2)
+				continue;
+			if (!op_strict(op->opno) || !op_mergejoinable(op->opno, exprType(static_cast<Node *>(linitial(op->args)))))
+				continue;
+			for (int i = 0; i < 2; i++) {
+				Var *var = InputPartitioner::stripVar(static_cast<Node *>(list_nth(op->args, i)));
+
+				side[i] = NULL;
+				scan[i] = NULL;
+				attno[i] = InvalidAttrNumber;
+				if (var == NULL || !RuntimeFilter::isInteger(var->vartype))
+					break;
+				if (var->varno == OUTER_VAR)
+					side[i] = outerPlanState(join);
+				else if (var->varno == INNER_VAR)
+					side[i] = innerPlanState(join);
+				else
+					break;
+				attno[i] = InputPartitioner::resolve(side[i], var->varattno, &scan[i]);
+			}
+			if (attno[0] == InvalidAttrNumber || attno[1] == InvalidAttrNumber)
+				continue;
+			index[0] = InputPartitioner::indexOf(inputs, scan[0]);
+			index[1] = InputPartitioner::indexOf(inputs, scan[1]);
+			if (index[0] < 0 || index[1] < 0 || index[0] == index[1])
+				continue;
+
+			/* inputs are sent in order, so the later one is filtered */
+			b = (index[0] < index[1]) ? 0 : 1;
+			p = 1 - b;
+			if (!RuntimeFilter::canFilter(jointype, side[p] == outerPlanState(join)))
+				continue;
+			if (!RuntimeFilter::isFilterableScan(scan[p]) || !RuntimeFilter::passesRows(side[p], scan[p]))
+				continue;
+			/* the engine reads the build key as an integer of its width */
+			tle = get_tle_by_resno(scan[b]->plan->targetlist, attno[b]);
+			if (tle == NULL || !RuntimeFilter::isInteger(exprType(reinterpret_cast<Node *>(tle->expr))))
+				continue;
+			tle = get_tle_by_resno(scan[p]->plan->targetlist, attno[p]);
+			if (tle == NULL || !RuntimeFilter::isInteger(exprType(reinterpret_cast<Node *>(tle->expr))))
+				continue;
+			this->key_type = exprType(reinterpret_cast<Node *>(tle->expr));
+			opclass = GetDefaultOpClass(this->key_type, BTREE_AM_OID);
+			if (!OidIsValid(opclass))
+				continue;
+
+			this->build_input = index[b];
+			this->probe_input = index[p];
+			this->probe = scan[p];
+			this->key = tle->expr;
+			this->opfamily = get_opclass_family(opclass);
+			this->request.column = attno[b] - 1;
+			this->request.max_values = max_values;
+			elog(DEBUG2, ":: runtime filter from input %d attribute %d to input %d attribute %d",
+			     index[b] + 1, attno[b], index[p] + 1, attno[p]);
+			return true;
+		}
+		return false;
+	}
+
+	bool
+	isBuildInput(int input) const {
+		return (input == this->build_input);
+	}
+
+	bool
+	isProbeInput(int input) const {
+		return (input == this->probe_input);
+	}
+
+	/* input scanned by the backend itself, -1 if none */
+	int
+	getProbeInput(void) const {
+		return this->probe_input;
+	}
+
+	const FilterRequest *
+	getRequest(void) const {
+		return &this->request;
+	}
+
+	/* read the reply of one session to the request and merge it */
+	void
+	receive(int sock) {
+		FilterReply reply;
+		int64_t *values = NULL;
+
+		RuntimeFilter::readReply(sock, &reply, sizeof(reply));
+		if (reply.nvalues > this->request.max_values) {
+			ereport(ERROR, (errcode(ERRCODE_PROTOCOL_VIOLATION),
+					errmsg("external process sent %u keys for a runtime filter of at most %u\n",
+					       reply.nvalues, this->request.max_values)));
+		}
+		if (reply.nvalues > 0) {
+			values = static_cast<int64_t *>(palloc(sizeof(int64_t) * reply.nvalues));
+			RuntimeFilter::readReply(sock, values, sizeof(int64_t) * reply.nvalues);
+		}
+
+		/* sessions hold partitions of the build input: empty ones add nothing, unknown ones spoil all */
+		if (this->replies++ == 0)
+			this->flags = FILTER_EMPTY | FILTER_VALUES;
+		if ((reply.flags & FILTER_EMPTY) == 0 && this->flags != 0)
+			this->merge(&reply, values);
+		if (values != NULL)
+			pfree(values);
+	}
+
+	/* the build input had no key, so no probe row can join */
+	bool
+	isEmpty(void) const {
+		return ((this->flags & FILTER_EMPTY) != 0);
+	}
+
+	/* add the merged replies to the probe scan */
+	void
+	apply(void) {
+		List *quals = NIL;
+
+		this->explained = true;
+		if ((this->flags & FILTER_RANGE) == 0 || this->applied)
+			return ;
+
+		quals = lappend(quals, this->makeCompare(BTGreaterEqualStrategyNumber, this->min));
+		quals = lappend(quals, this->makeCompare(BTLessEqualStrategyNumber, this->max));
+		if ((this->flags & FILTER_VALUES) != 0 && this->nvalues > 0)
+			quals = lappend(quals, this->makeValueList());
+
+		this->applied = true;
+		this->saved_qual = this->probe->qual;
+		this->probe->qual = list_concat(list_copy(this->probe->qual),
+						reinterpret_cast<List *>(ExecInitExpr(reinterpret_cast<Expr *>(quals), this->probe)));
+		if (IsA(this->probe, IndexScanState))
+			this->addIndexKeys(reinterpret_cast<IndexScanState *>(this->probe));
+	}
+
+	/* take the filter off the probe scan, so that a rescan reads all of it; keeps what EXPLAIN shows */
+	void
+	restore(void) {
+		if (!this->applied)
+			return ;
+		this->probe->qual = this->saved_qual;
+		if (this->index_keys) {
+			IndexScanState *iss = reinterpret_cast<IndexScanState *>(this->probe);
+
+			iss->iss_ScanKeys = this->saved_keys;
+			iss->iss_NumScanKeys = this->saved_nkeys;
+			RuntimeFilter::restartIndexScan(iss);
+		}
+		this->applied = false;
+	}
+
+	void
+	explain(ExplainState *es) const {
+		if (this->probe_input < 0)
+			return ;
+		if (!this->explained)
+			ExplainPropertyText("Runtime Filter", psprintf("input %d by input %d", this->probe_input + 1, this->build_input + 1), es);
+		else if (this->isEmpty())
+			ExplainPropertyText("Runtime Filter", psprintf("input %d by input %d: empty", this->probe_input + 1, this->build_input + 1), es);
+		else if ((this->flags & FILTER_RANGE) == 0)
+			ExplainPropertyText("Runtime Filter", psprintf("input %d by input %d: none", this->probe_input + 1, this->build_input + 1), es);
+		else
+			ExplainPropertyText("Runtime Filter",
+					    psprintf("input %d by input %d: [" INT64_FORMAT ", " INT64_FORMAT "]%s%s",
+						     this->probe_input + 1, this->build_input + 1, this->min, this->max,
+						     ((this->flags & FILTER_VALUES) != 0) ? psprintf(", %u keys", this->nvalues) : "",
+						     this->index_keys ? ", index" : ""), es);
+	}
+
+private:
+	static
+	bool
+	isInteger(Oid type) {
+		return (type == INT2OID || type == INT4OID || type == INT8OID);
+	}
+
+	/* dropping probe rows without a partner is invisible unless the probe side is preserved */
+	static
+	bool
+	canFilter(JoinType jointype, bool outer) {
+		switch (jointype) {
+		case JOIN_INNER:
+		case JOIN_SEMI:
+			return true;
+		case JOIN_LEFT:
+		case JOIN_ANTI:
+			return !outer;
+		case JOIN_RIGHT:
+			return outer;
+		default:
+			return false;
+		}
+	}
+
+	/* scans whose qual is evaluated on the tuple their target list is computed from */
+	static
+	bool
+	isFilterableScan(PlanState *ps) {
+		switch (nodeTag(ps)) {
+		case T_SeqScanState:
+		case T_IndexScanState:
+		case T_IndexOnlyScanState:
+		case T_BitmapHeapScanState:
+			return true;
+		default:
+			return false;
+		}
+	}
+
+	/* true if the path from ps down to scan has only joins and nodes that keep every row */
+	static
+	bool
+	passesRows(PlanState *ps, PlanState *scan) {
+		if (ps == NULL)
+			return false;
+		if (ps == scan)
+			return true;
+		switch (nodeTag(ps)) {
+		case T_HashJoinState:
+		case T_MergeJoinState:
+		case T_NestLoopState:
+		case T_HashState:
+		case T_MaterialState:
+		case T_SortState:
+			break;
+		default:
+			return false;
+		}
+		return (RuntimeFilter::passesRows(outerPlanState(ps), scan) ||
+			RuntimeFilter::passesRows(innerPlanState(ps), scan));
+	}
+
+	/* the sender thread may still be writing to sock, reading it is fine */
+	static
+	void
+	readReply(int sock, void *dst, std::size_t size) {
+		char *p = static_cast<char *>(dst);
+
+		while (size > 0) {
+			struct pollfd pfd;
+			ssize_t n;
+
+			CHECK_FOR_INTERRUPTS();
+			pfd.fd = sock;
+			pfd.events = POLLIN;
+			pfd.revents = 0;
+			n = ::poll(&pfd, 1, 100);
+			if (n == 0 || (n < 0 && errno == EINTR))
+				continue;
+			n = ::recv(sock, p, size, 0);
+			if (n < 0 && (errno == EINTR || errno == EAGAIN))
+				continue;
+			if (n <= 0) {
+				ereport(ERROR, (errcode(ERRCODE_CONNECTION_FAILURE),
+						errmsg("external process closed the connection before answering a runtime filter request\n")));
+			}
+			p += n;
+			size -= n;
+		}
+	}
+
+	void
+	merge(const FilterReply *reply, const int64_t *values) {
+		if ((reply->flags & FILTER_RANGE) == 0) {
+			this->flags = 0;
+			return ;
+		}
+		if ((this->flags & FILTER_EMPTY) != 0) {
+			this->min = reply->min;
+			this->max = reply->max;
+		}
+		else {
+			this->min = Min(this->min, reply->min);
+			this->max = Max(this->max, reply->max);
+		}
+		this->flags = (this->flags & ~FILTER_EMPTY) | FILTER_RANGE;
+		/* a key list is only exact if every session sent one */
+		if ((reply->flags & FILTER_VALUES) != 0 && (this->flags & FILTER_VALUES) != 0 &&
+		    this->nvalues + reply->nvalues <= this->request.max_values)
+			this->addValues(values, reply->nvalues);
+		else
+			this->flags &= ~FILTER_VALUES;
+	}
+
+	void
+	addValues(const int64_t *values, uint32_t nvalues) {
+		if (nvalues == 0)
+			return ;
+		if (this->values == NULL)
+			this->values = static_cast<int64_t *>(palloc(sizeof(int64_t) * this->request.max_values));
+		std::memcpy(this->values + this->nvalues, values, sizeof(int64_t) * nvalues);
+		this->nvalues += nvalues;
+	}
+
+	Const *
+	makeInt8(int64_t value) const {
+		return makeConst(INT8OID, -1, InvalidOid, sizeof(int64), Int64GetDatum(value), false, FLOAT8PASSBYVAL);
+	}
+
+	/* key <op> value, with the cross-type operator of the key's opfamily */
+	Expr *
+	makeCompare(StrategyNumber strategy, int64_t value) const {
+		Oid opno = get_opfamily_member(this->opfamily, this->key_type, INT8OID, strategy);
+		Expr *expr;
+
+		if (!OidIsValid(opno))
+			elog(ERROR, "missing operator %d(%u,%u) in opfamily %u", strategy, this->key_type, INT8OID, this->opfamily);
+		expr = make_opclause(opno, BOOLOID, false, static_cast<Expr *>(copyObject(this->key)),
+				     reinterpret_cast<Expr *>(this->makeInt8(value)), InvalidOid, InvalidOid);
+		set_opfuncid(reinterpret_cast<OpExpr *>(expr));
+		return expr;
+	}
+
+	/* key = ANY(values), checked linearly per row, hence external_join.runtime_filter_max_values */
+	Expr *
+	makeValueList(void) const {
+		ScalarArrayOpExpr *saop = makeNode(ScalarArrayOpExpr);
+		Datum *datums = static_cast<Datum *>(palloc(sizeof(Datum) * this->nvalues));
+		ArrayType *array;
+
+		for (uint32_t i = 0; i < this->nvalues; i++)
+			datums[i] = Int64GetDatum(this->values[i]);
+		array = construct_array(datums, this->nvalues, INT8OID, sizeof(int64), FLOAT8PASSBYVAL, 'd');
+		saop->opno = get_opfamily_member(this->opfamily, this->key_type, INT8OID, BTEqualStrategyNumber);
+		if (!OidIsValid(saop->opno))
+			elog(ERROR, "missing operator %d(%u,%u) in opfamily %u", BTEqualStrategyNumber, this->key_type, INT8OID, this->opfamily);
+		saop->opfuncid = get_opcode(saop->opno);
+		saop->useOr = true;
+		saop->inputcollid = InvalidOid;
+		saop->args = list_make2(copyObject(this->key),
+					makeConst(get_array_type(INT8OID), -1, InvalidOid, -1, PointerGetDatum(array), false, false));
+		saop->location = -1;
+		return reinterpret_cast<Expr *>(saop);
+	}
+
+	/* read only the key range of a btree index led by the key column */
+	void
+	addIndexKeys(IndexScanState *iss) {
+		Relation index = iss->iss_RelationDesc;
+		Var *var = InputPartitioner::stripVar(reinterpret_cast<Node *>(this->key));
+		Oid family;
+		ScanKey keys;
+		int nkeys;
+
+		/* runtime keys point into iss_ScanKeys, ordered scans keep their own queue */
+		if (var == NULL || index == NULL || iss->iss_NumRuntimeKeys != 0 ||
+		    iss->iss_NumOrderByKeys != 0 || index->rd_rel->relam != BTREE_AM_OID ||
+		    index->rd_index->indkey.values[0] != var->varattno)
+			return ;
+		family = index->rd_opfamily[0];
+		if (!OidIsValid(get_opfamily_member(family, index->rd_opcintype[0], INT8OID, BTGreaterEqualStrategyNumber)) ||
+		    !OidIsValid(get_opfamily_member(family, index->rd_opcintype[0], INT8OID, BTLessEqualStrategyNumber)))
+			return ;
+
+		/* btree wants keys ordered by attribute, the new ones are on the first */
+		nkeys = iss->iss_NumScanKeys + 2;
+		keys = static_cast<ScanKey>(palloc(sizeof(ScanKeyData) * nkeys));
+		ScanKeyEntryInitialize(&keys[0], 0, 1, BTGreaterEqualStrategyNumber, INT8OID, index->rd_indcollation[0],
+				       get_opcode(get_opfamily_member(family, index->rd_opcintype[0], INT8OID, BTGreaterEqualStrategyNumber)),
+				       Int64GetDatum(this->min));
+		ScanKeyEntryInitialize(&keys[1], 0, 1, BTLessEqualStrategyNumber, INT8OID, index->rd_indcollation[0],
+				       get_opcode(get_opfamily_member(family, index->rd_opcintype[0], INT8OID, BTLessEqualStrategyNumber)),
+				       Int64GetDatum(this->max));
+		if (iss->iss_NumScanKeys > 0)
+			std::memcpy(&keys[2], iss->iss_ScanKeys, sizeof(ScanKeyData) * iss->iss_NumScanKeys);
+
+		this->saved_keys = iss->iss_ScanKeys;
+		this->saved_nkeys = iss->iss_NumScanKeys;
+		iss->iss_ScanKeys = keys;
+		iss->iss_NumScanKeys = nkeys;
+		RuntimeFilter::restartIndexScan(iss);
+		this->index_keys = true;
+	}
+
+	/* the number of keys is fixed when an index scan begins */
+	static
+	void
+	restartIndexScan(IndexScanState *iss) {
+		if (iss->iss_ScanDesc != NULL)
+			index_endscan(iss->iss_ScanDesc);
+		iss->iss_ScanDesc = index_beginscan(iss->ss.ss_currentRelation, iss->iss_RelationDesc,
+						    iss->ss.ps.state->es_snapshot, iss->iss_NumScanKeys, iss->iss_NumOrderByKeys);
+		index_rescan(iss->iss_ScanDesc, iss->iss_ScanKeys, iss->iss_NumScanKeys,
+			     iss->iss_OrderByKeys, iss->iss_NumOrderByKeys);
+	}
+};
+
+#endif //RUNTIMEFILTER_HEAD_
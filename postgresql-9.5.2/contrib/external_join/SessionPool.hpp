@@ -0,0 +1,145 @@
+#ifndef SESSIONPOOL_HEAD_
+#define SESSIONPOOL_HEAD_
+
+/*
+ * Idle engine sessions of finished statements, kept per backend for later
+ * executions of the same plan template.
+ *
+ * A node that ran with kept sessions hands them over at its end together
+ * with the fingerprints of the inputs the engines hold (see PlanTemplate).
+ * A later node with the same template takes them over instead of
+ * connecting, and does not ship inputs whose fingerprint is unchanged.
+ * Sessions idle longer than external_join.session_pool_ttl are closed, also
+ * because counters of other backends reach the statistics collector late.
+ * Sockets are plain file descriptors of the backend, closed at its exit.
+ */
+class SessionPool {
+public:
+	static constexpr int MAX_ENTRIES = 8;
+	static constexpr int MAX_SESSIONS = 16;
+	/* inputs beyond this are always shipped */
+	static constexpr int MAX_INPUTS = 32;
+
+private:
+	struct Entry {
+		bool used;
+		uint64_t template_id;
+		int nsessions;
+		int socks[MAX_SESSIONS];
+		char endpoints[MAX_SESSIONS][ENDPOINT_LEN];
+		int ninputs;
+		uint64_t fingerprints[MAX_INPUTS];
+		TimestampTz since;
+	};
+
+	Entry entries[MAX_ENTRIES];
+
+public:
+	SessionPool(void) { this->init(); }
+	~SessionPool(void) { this->fini(); }
+
+	/* pool of the backend */
+	static SessionPool *
+	instance(void) {
+		static SessionPool pool;
+		return &pool;
+	}
+
+	void init(void) {
+		std::memset(static_cast<void *>(this->entries), 0, sizeof(this->entries));
+	}
+	void fini(void) {
+		for (int i = 0; i < MAX_ENTRIES; i++) {
+			if (this->entries[i].used)
+				this->release(&this->entries[i]);
+		}
+	}
+
+	/* keep the idle sessions of a finished run of template id, the oldest entry makes room */
+	void
+	put(uint64_t id, int nsessions, const int *socks, const char (*endpoints)[ENDPOINT_LEN],
+	    int ninputs, const uint64_t *fingerprints) {
+		Entry *entry = NULL;
+
+		if (nsessions > MAX_SESSIONS) {
+			for (int i = 0; i < nsessions; i++)
+				::close(socks[i]);
+			return ;
+		}
+		for (int i = 0; i < MAX_ENTRIES; i++) {
+			Entry *e = &this->entries[i];
+
+			if (!e->used) {
+				entry = e;
+				break;
+			}
+			if (entry == NULL || e->since < entry->since)
+				entry = e;
+		}
+		if (entry->used) {
+			elog(DEBUG2, ":: session pool full, closing sessions of template %016llx",
+			     static_cast<unsigned long long>(entry->template_id));
+			this->release(entry);
+		}
+		entry->used = true;
+		entry->template_id = id;
+		entry->nsessions = nsessions;
+		for (int i = 0; i < nsessions; i++) {
+			entry->socks[i] = socks[i];
+			strlcpy(entry->endpoints[i], endpoints[i], ENDPOINT_LEN);
+		}
+		entry->ninputs = Min(ninputs, MAX_INPUTS);
+		for (int i = 0; i < entry->ninputs; i++)
+			entry->fingerprints[i] = fingerprints[i];
+		entry->since = GetCurrentTimestamp();
+	}
+
+	/*
+	 * take over sessions of template id idle for at most ttl seconds; returns
+	 * their number, or 0 if there are none. fingerprints gets those of the
+	 * inputs the engines hold, 0 for the others.
+	 */
+	int
+	take(uint64_t id, int ttl, int *socks, char (*endpoints)[ENDPOINT_LEN], int ninputs, uint64_t *fingerprints) {
+		this->expire(ttl);
+		for (int i = 0; i < MAX_ENTRIES; i++) {
+			Entry *entry = &this->entries[i];
+			int n = entry->nsessions;
+
+			if (!entry->used || entry->template_id != id)
+				continue;
+			for (int j = 0; j < n; j++) {
+				socks[j] = entry->socks[j];
+				strlcpy(endpoints[j], entry->endpoints[j], ENDPOINT_LEN);
+			}
+			for (int j = 0; j < ninputs; j++)
+				fingerprints[j] = (j < entry->ninputs) ? entry->fingerprints[j] : 0;
+			entry->used = false;
+			return n;
+		}
+		return 0;
+	}
+
+	/* close sessions idle for more than ttl seconds */
+	void
+	expire(int ttl) {
+		TimestampTz now = GetCurrentTimestamp();
+
+		for (int i = 0; i < MAX_ENTRIES; i++) {
+			Entry *entry = &this->entries[i];
+
+			if (entry->used && TimestampDifferenceExceeds(entry->since, now, ttl * 1000))
+				this->release(entry);
+		}
+	}
+
+private:
+	void
+	release(Entry *entry) {
+		for (int i = 0; i < entry->nsessions; i++)
+			::close(entry->socks[i]);
+		entry->used = false;
+	}
+};
+
+#endif //SESSIONPOOL_HEAD_
@@ -0,0 +1,104 @@
+#ifndef STREAMCAPTURE_HEAD_
+#define STREAMCAPTURE_HEAD_
+
+/*
+ * Capture of the byte stream sent to an engine on one connection, with
+ * external_join.capture on (see CaptureHeader in ExternalProtocol.hpp).
+ *
+ * The file is opened with the connection and closed with it, so the runs
+ * of a kept session follow each other in one file as they did on the
+ * connection. Connections taken from the session pool were opened by an
+ * earlier statement and are not captured, since the engine would miss the
+ * template and the inputs it received before. write() is called from the
+ * sending threads and must not use palloc or elog; a failed write closes
+ * the capture and keeps the run going.
+ */
+class StreamCapture {
+public:
+	static constexpr const char *DIRECTORY = "pg_external_join_capture";
+
+private:
+	int fd;
+
+public:
+	StreamCapture(void) { this->init(); }
+	~StreamCapture(void) { this->fini(); }
+
+	static StreamCapture *constructor(void) {
+		StreamCapture *sc = static_cast<StreamCapture *>(palloc(sizeof(*sc)));
+		sc->init();
+		return sc;
+	}
+	static void destructor(StreamCapture *sc) {
+		sc->fini();
+		pfree(sc);
+	}
+
+	void init(void) {
+		this->fd = -1;
+	}
+	void fini(void) {
+		this->close();
+	}
+
+	/* start capturing session of group, connected to endpoint */
+	void
+	open(uint32_t group, uint32_t session, const char *endpoint) {
+		CaptureHeader header;
+		struct timeval now;
+		char path[MAXPGPATH];
+
+		this->close();
+		if (::mkdir(DIRECTORY, S_IRWXU) != 0 && errno != EEXIST)
+			ereport(ERROR, (errcode_for_file_access(),
+					errmsg("could not create directory \"%s\": %m\n", DIRECTORY)));
+		snprintf(path, sizeof(path), "%s/%d_%u_%u.cap", DIRECTORY, MyProcPid, group, session);
+		this->fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | PG_BINARY, S_IRUSR | S_IWUSR);
+		if (this->fd < 0)
+			ereport(ERROR, (errcode_for_file_access(),
+					errmsg("could not create external join capture \"%s\": %m\n", path)));
+		std::memset(static_cast<void *>(&header), 0, sizeof(header));
+		header.magic = CAPTURE_MAGIC;
+		header.pid = MyProcPid;
+		header.group = group;
+		header.session = session;
+		gettimeofday(&now, NULL);
+		header.started = static_cast<uint64_t>(now.tv_sec) * 1000000 + now.tv_usec;
+		strlcpy(header.endpoint, endpoint, sizeof(header.endpoint));
+		this->write(&header, sizeof(header));
+		elog(DEBUG2, ":: capturing the stream to %s in %s", endpoint, path);
+	}
+
+	bool
+	isOpen(void) const {
+		return this->fd >= 0;
+	}
+
+	/* thread safe for one writer */
+	void
+	write(const void *data, long size) {
+		const char *p = static_cast<const char *>(data);
+
+		while (this->fd >= 0 && size > 0) {
+			ssize_t n = ::write(this->fd, p, size);
+
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0) {
+				this->close();
+				break;
+			}
+			p += n;
+			size -= n;
+		}
+	}
+
+	void
+	close(void) {
+		if (this->fd >= 0)
+			::close(this->fd);
+		this->fd = -1;
+	}
+};
+
+#endif //STREAMCAPTURE_HEAD_
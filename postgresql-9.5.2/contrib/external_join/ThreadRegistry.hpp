@@ -0,0 +1,69 @@
+#ifndef THREADREGISTRY_HEAD_
+#define THREADREGISTRY_HEAD_
+
+/*
+ * Threads started on behalf of one external join node.
+ * Every node owns its registry, so cancelling one node never touches the
+ * threads of another node running in the same query or backend.
+ */
+class ThreadRegistry {
+private:
+	static constexpr int MAX_THREADS = 16;
+	pthread_t threads[MAX_THREADS];
+	int nthreads;
+
+public:
+	ThreadRegistry(void) { this->init(); }
+	~ThreadRegistry(void) { this->fini(); }
+
+	static ThreadRegistry *constructor(void) {
+		ThreadRegistry *tr = static_cast<ThreadRegistry *>(palloc(sizeof(*tr)));
+		tr->init();
+		return tr;
+	}
+	static void destructor(ThreadRegistry *tr) {
+		tr->fini();
+		pfree(tr);
+	}
+
+	void init(void) {
+		this->nthreads = 0;
+	}
+	void fini(void) {
+		this->cancelAll();
+	}
+
+	/* returns false if no thread was created */
+	bool
+	create(void *(*routine)(void *), void *arg) {
+		if (this->nthreads >= MAX_THREADS)
+			return false;
+		if (::pthread_create(&this->threads[this->nthreads], NULL, routine, arg) != 0)
+			return false;
+		this->nthreads++;
+		return true;
+	}
+
+	/* wait for all threads to finish */
+	void
+	joinAll(void) {
+		for (int i = 0; i < this->nthreads; i++)
+			::pthread_join(this->threads[i], NULL);
+		this->nthreads = 0;
+	}
+
+	/* stop all threads at their next cancellation point and reap them */
+	void
+	cancelAll(void) {
+		for (int i = 0; i < this->nthreads; i++)
+			::pthread_cancel(this->threads[i]);
+		this->joinAll();
+	}
+
+	int
+	getLength(void) const {
+		return this->nthreads;
+	}
+};
+
+#endif //THREADREGISTRY_HEAD_
@@ -3,13 +3,50 @@
 
 class TupleBuffer {
 private:
-	static constexpr std::size_t INITIAL_BUFSIZE = 1024UL * 1024UL * 32;
-	
 	void *buffer;
 	std::size_t content_size;
 	std::size_t buffer_size;
+	/* number of tuples in the buffer */
+	uint32_t nrows;
+	/* planner estimates sent ahead of the payload */
+	InputHeader hint;
+	/* first and last chunk of an input */
+	bool first;
+	bool last;
+	/* the last chunk asks the engine for a runtime filter */
+	bool filter_requested;
+	FilterRequest filter;
+	/* descriptor of the input, NULL to copy tuple data areas as they are */
+	TupleDesc desc;
+	/* rows are encoded because of varlena columns */
+	bool encoded;
+	/* width of a row with all its columns */
+	std::size_t row_size;
+	/* variable length area of encoded rows, moved behind the rows by seal() */
+	void *var_buffer;
+	std::size_t var_size;
+	std::size_t var_buffer_size;
+	/* offset of this chunk's area in the variable length areas of the input */
+	uint64_t var_base;
+	/* null bitmaps, allocated on the first NULL and moved behind the rows by seal() */
+	uint64_t *null_buffer;
+	/* rows each bitmap of null_buffer can hold, a multiple of 64 */
+	uint32_t null_capacity;
+	std::size_t null_size;
+	/* rows are grouped into 1 << radix_bits partitions by seal(), 0 if not hashed */
+	int radix_bits;
+	/* join key hash per row, palloc()ed like null_buffer and moved behind the bitmaps by seal() */
+	uint32_t *hashes;
+	uint32_t hash_capacity;
+	std::size_t hash_size;
 	
 public:
+	static constexpr std::size_t INITIAL_BUFSIZE = 1024UL * 1024UL * 32;
+	/* bounds for buffers pre-sized from planner estimates */
+	static constexpr std::size_t MIN_BUFSIZE = 1024UL * 1024UL * 2;
+	/* a buffer is handed to the sender as one chunk once it is full */
+	static constexpr std::size_t CHUNK_SIZE = 1024UL * 1024UL * 32;
+	
 	TupleBuffer(void) { this->init(); }
 	~TupleBuffer(void) { this->fini(); }
 	
@@ -18,18 +55,137 @@ public:
 		tb->init();
 		return tb;
 	}
+	static TupleBuffer *constructor(std::size_t size) {
+		TupleBuffer *tb = static_cast<TupleBuffer *>(palloc(sizeof(*tb)));
+		tb->init(size);
+		return tb;
+	}
 	static void destructor(TupleBuffer *tb) {
 		tb->fini();
 		pfree(tb);
 	}
 	
 	void init(void) {
-		this->buffer = palloc(TupleBuffer::INITIAL_BUFSIZE);
-		this->buffer_size = TupleBuffer::INITIAL_BUFSIZE;
+		this->init(TupleBuffer::INITIAL_BUFSIZE);
+	}
+	void init(std::size_t size) {
+		if (size < TupleBuffer::MIN_BUFSIZE)
+			size = TupleBuffer::MIN_BUFSIZE;
+		else if (size > TupleBuffer::CHUNK_SIZE)
+			size = TupleBuffer::CHUNK_SIZE;
+		this->buffer = BufferPool::instance()->acquire(size);
+		this->buffer_size = size;
 		this->content_size = 0;
+		this->nrows = 0;
+		this->hint.est_rows = 0;
+		this->hint.est_bytes = 0;
+		this->hint.radix_bits = 0;
+		this->hint.key_column = 0;
+		this->hint.flags = 0;
+		this->hint.join_type = JOIN_TYPE_INNER;
+		this->first = false;
+		this->last = false;
+		this->filter_requested = false;
+		this->desc = NULL;
+		this->encoded = false;
+		this->row_size = 0;
+		this->var_buffer = NULL;
+		this->var_size = 0;
+		this->var_buffer_size = 0;
+		this->var_base = 0;
+		this->null_buffer = NULL;
+		this->null_capacity = 0;
+		this->null_size = 0;
+		this->radix_bits = 0;
+		this->hashes = NULL;
+		this->hash_capacity = 0;
+		this->hash_size = 0;
 	}
+	/* null_buffer and hashes are palloc()ed, they are freed by seal() or with the query memory context */
 	void fini(void) {
-		pfree(this->buffer);
+		BufferPool::instance()->release(this->buffer);
+		if (this->var_buffer != NULL)
+			BufferPool::instance()->release(this->var_buffer);
+		this->var_buffer = NULL;
+	}
+	
+	/* true if rows of desc cannot be shipped as raw tuple data areas */
+	static 
+	bool 
+	hasVarlena(TupleDesc desc) {
+		for (int i = 0; i < desc->natts; i++) {
+			if (desc->attrs[i]->attlen == -1)
+				return true;
+		}
+		return false;
+	}
+	
+	/* rows of desc keep all their columns and get null bitmaps; varlena columns are encoded */
+	void 
+	setDescriptor(TupleDesc desc) {
+		this->desc = desc;
+		this->encoded = TupleBuffer::hasVarlena(desc);
+		this->row_size = TupleBuffer::getRowWidth(desc, this->encoded);
+	}
+	
+	/* width of a row with all columns: a heap tuple data area, or an encoded row */
+	static 
+	std::size_t 
+	getRowWidth(TupleDesc desc, bool encoded) {
+		std::size_t off = 0;
+		std::size_t align = 1;
+		
+		for (int i = 0; i < desc->natts; i++) {
+			Form_pg_attribute att = desc->attrs[i];
+			
+			if (att->attlen == -1) {
+				off = TYPEALIGN(alignof(VarlenaRef), off) + sizeof(VarlenaRef);
+				align = Max(align, alignof(VarlenaRef));
+			}
+			else {
+				off = att_align_nominal(off, att->attalign) + att->attlen;
+				align = Max(align, static_cast<std::size_t>(att_align_nominal(1, att->attalign)));
+			}
+		}
+		/* encoded rows are padded like C structs, tuple data areas are not */
+		return encoded ? TYPEALIGN(align, off) : off;
+	}
+	
+	/* true if the data area of tuple lacks columns of desc */
+	static 
+	bool 
+	hasMissing(HeapTuple tuple, TupleDesc desc) {
+		return (HeapTupleHasNulls(tuple) || HeapTupleHeaderGetNatts(tuple->t_data) < desc->natts);
+	}
+	
+	/* write a tuple data area with all columns of desc, NULLs as zeros; no varlena columns */
+	static 
+	void 
+	fillRow(TupleDesc desc, Datum *values, bool *isnull, char *row) {
+		std::size_t off = 0;
+		
+		for (int i = 0; i < desc->natts; i++) {
+			Form_pg_attribute att = desc->attrs[i];
+			
+			off = att_align_nominal(off, att->attalign);
+			if (isnull[i])
+				std::memset(row + off, 0, att->attlen);
+			else if (att->attbyval)
+				store_att_byval(row + off, values[i], att->attlen);
+			else
+				std::memcpy(row + off, DatumGetPointer(values[i]), att->attlen);
+			off += att->attlen;
+		}
+	}
+	
+	/* next chunk of the same input: same encoding, variable length area continues */
+	void 
+	follow(const TupleBuffer *prev) {
+		this->desc = prev->desc;
+		this->encoded = prev->encoded;
+		this->row_size = prev->row_size;
+		this->var_base = prev->var_base + prev->var_size;
+		this->radix_bits = prev->radix_bits;
 	}
 		
 	bool 
@@ -37,22 +193,237 @@ public:
 		return (this->content_size + data_size >= this->buffer_size);
 	}
 	
+	/* true if data_size more bytes do not fit and this buffer should be sent as a chunk */
+	bool 
+	isFull(std::size_t data_size) const {
+		return (this->content_size > 0 && this->checkOverflow(this->getTrailerSize() + data_size));
+	}
+	
+	/* bytes seal() will add behind the rows if one more row is put */
+	std::size_t 
+	getTrailerSize(void) const {
+		std::size_t size = this->var_size;
+		
+		if (this->null_buffer != NULL)
+			size += this->desc->natts * ((this->nrows + 64) / 64) * sizeof(uint64_t);
+		if (this->isHashed())
+			size += ((static_cast<std::size_t>(1) << this->radix_bits) + this->nrows + 1) * sizeof(uint32_t);
+		return size;
+	}
+	
 	void 
 	extendBuffer(void) {
+		void *prev = this->buffer;
+		
 		this->buffer_size *= 2;
 		/* may cause memory shortage */
-		this->buffer = repalloc_huge(this->buffer, this->buffer_size);
+		this->buffer = BufferPool::instance()->acquire(this->buffer_size);
+		std::memcpy(this->buffer, prev, this->content_size);
+		BufferPool::instance()->release(prev);
 	}
 	
 	void 
 	putTuple(TupleTableSlot *tts) {
-		std::size_t tuple_size = TupleBuffer::getTupleSize(tts);
+		std::size_t tuple_size;
 		
+		if (this->encoded) {
+			this->putEncodedTuple(tts);
+			return ;
+		}
+		/* a data area lacking columns is rebuilt with all of them */
+		if (this->desc != NULL && (tts->tts_tuple == NULL || TupleBuffer::hasMissing(tts->tts_tuple, this->desc))) {
+			this->putFilledTuple(tts);
+			return ;
+		}
+		tuple_size = TupleBuffer::getTupleSize(tts);
 		while (this->checkOverflow(tuple_size))
 			this->extendBuffer();
 		
 		std::memcpy(this->getWritePointer(), TupleBuffer::getTupleDataPointer(tts), tuple_size);
 		this->content_size += tuple_size;
+		this->nrows++;
+	}
+	
+	/* put a tuple read straight from a heap page; desc is set and has no varlena column */
+	void 
+	putHeapTuple(HeapTuple tuple, Datum *values, bool *isnull) {
+		std::size_t tuple_size;
+		
+		if (TupleBuffer::hasMissing(tuple, this->desc)) {
+			heap_deform_tuple(tuple, this->desc, values, isnull);
+			this->putRow(values, isnull);
+			return ;
+		}
+		tuple_size = tuple->t_len - tuple->t_data->t_hoff;
+		std::memcpy(this->reserve(tuple_size), reinterpret_cast<char *>(tuple->t_data) + tuple->t_data->t_hoff, tuple_size);
+		this->content_size += tuple_size;
+		this->nrows++;
+	}
+	
+	/* width of a row with all its columns, once a descriptor is set */
+	std::size_t 
+	getRowSize(void) const {
+		return this->row_size;
+	}
+	
+	/* bytes putTuple() will add, approximate for encoded rows with compressed values */
+	std::size_t 
+	getPutSize(TupleTableSlot *tts) const {
+		std::size_t size = this->row_size;
+		
+		if (this->desc == NULL)
+			return TupleBuffer::getTupleSize(tts);
+		if (!this->encoded)
+			return size;
+		slot_getallattrs(tts);
+		for (int i = 0; i < this->desc->natts; i++) {
+			if (this->desc->attrs[i]->attlen == -1 && !tts->tts_isnull[i])
+				size += toast_raw_datum_size(tts->tts_values[i]);
+		}
+		return size;
+	}
+	
+	/* mark column col of row as NULL */
+	void 
+	setNull(uint32_t row, int col) {
+		if (row >= this->null_capacity)
+			this->extendNulls(row + 1);
+		this->null_buffer[col * (this->null_capacity / 64) + row / 64] &= ~(UINT64CONST(1) << (row % 64));
+	}
+	
+	/* hash the rows of this input into 1 << bits radix partitions on column key_column */
+	void 
+	setRadixBits(int bits, uint32_t key_column) {
+		this->radix_bits = bits;
+		this->hint.radix_bits = bits;
+		this->hint.key_column = key_column;
+	}
+	
+	bool 
+	isHashed(void) const {
+		return (this->radix_bits > 0);
+	}
+	
+	/* join key hash of row */
+	void 
+	setHash(uint32_t row, uint32_t hash) {
+		if (row >= this->hash_capacity) {
+			uint32_t capacity = (this->hash_capacity > 0) ? this->hash_capacity * 2 : 4096;
+			uint32_t *prev = this->hashes;
+			
+			while (capacity <= row)
+				capacity *= 2;
+			this->hashes = static_cast<uint32_t *>(palloc0(capacity * sizeof(uint32_t)));
+			if (prev != NULL) {
+				std::memcpy(this->hashes, prev, this->hash_capacity * sizeof(uint32_t));
+				pfree(prev);
+			}
+			this->hash_capacity = capacity;
+		}
+		this->hashes[row] = hash;
+	}
+	
+	/*
+	 * Move the variable length area, null bitmaps and hashes behind the rows,
+	 * the buffer then holds the whole chunk; rows of a hashed input are grouped
+	 * by radix partition first. Must be called by the backend, more than once
+	 * is harmless.
+	 */
+	void 
+	seal(void) {
+		uint32_t *counts = NULL;
+		
+		if (this->isHashed() && this->hash_size == 0)
+			counts = this->partitionRows();
+		if (this->var_buffer != NULL) {
+			std::memcpy(this->reserve(this->var_size), this->var_buffer, this->var_size);
+			this->content_size += this->var_size;
+			BufferPool::instance()->release(this->var_buffer);
+			this->var_buffer = NULL;
+		}
+		if (this->null_buffer != NULL) {
+			std::size_t words = (this->nrows + 63) / 64;
+			uint64_t *dst;
+			
+			this->null_size = this->desc->natts * words * sizeof(uint64_t);
+			dst = static_cast<uint64_t *>(this->reserve(this->null_size));
+			for (int i = 0; i < this->desc->natts; i++) {
+				std::memcpy(dst, this->null_buffer + i * (this->null_capacity / 64), words * sizeof(uint64_t));
+				/* bits beyond nrows are 0 */
+				if (this->nrows % 64 != 0)
+					dst[words - 1] &= (UINT64CONST(1) << (this->nrows % 64)) - 1;
+				dst += words;
+			}
+			this->content_size += this->null_size;
+			pfree(this->null_buffer);
+			this->null_buffer = NULL;
+		}
+		if (counts != NULL) {
+			std::size_t nparts = static_cast<std::size_t>(1) << this->radix_bits;
+			char *dst;
+			
+			this->hash_size = (nparts + this->nrows) * sizeof(uint32_t);
+			dst = static_cast<char *>(this->reserve(this->hash_size));
+			std::memcpy(dst, counts, nparts * sizeof(uint32_t));
+			if (this->nrows > 0)
+				std::memcpy(dst + nparts * sizeof(uint32_t), this->hashes, this->nrows * sizeof(uint32_t));
+			this->content_size += this->hash_size;
+			pfree(counts);
+			if (this->hashes != NULL)
+				pfree(this->hashes);
+			this->hashes = NULL;
+		}
+	}
+	
+	/* size of the variable length area in a sealed buffer */
+	std::size_t 
+	getVarSize(void) const {
+		return this->var_size;
+	}
+	
+	/* size of the null bitmaps at the end of a sealed buffer */
+	std::size_t 
+	getNullSize(void) const {
+		return this->null_size;
+	}
+	
+	/* size of the hash area at the end of a sealed buffer */
+	std::size_t 
+	getHashSize(void) const {
+		return this->hash_size;
+	}
+	
+	/* restore a sealed buffer read back from disk */
+	void 
+	setSealedSizes(std::size_t var_size, std::size_t null_size, std::size_t hash_size) {
+		this->var_size = var_size;
+		this->null_size = null_size;
+		this->hash_size = hash_size;
+	}
+	
+	/* append tuple data areas copied by a scan worker */
+	void 
+	putData(const void *data, std::size_t size, uint32_t rows) {
+		while (this->checkOverflow(size))
+			this->extendBuffer();
+		
+		std::memcpy(this->getWritePointer(), data, size);
+		this->content_size += size;
+		this->nrows += rows;
+	}
+	
+	/* make room for size bytes and return where to write them; commit() adds them */
+	void * 
+	reserve(std::size_t size) {
+		while (this->checkOverflow(size))
+			this->extendBuffer();
+		return this->getWritePointer();
+	}
+	
+	void 
+	commit(std::size_t size, uint32_t rows) {
+		this->content_size += size;
+		this->nrows += rows;
 	}
 	
 	void * 
@@ -70,6 +441,232 @@ public:
 		return this->content_size;
 	}
 	
+	std::size_t 
+	getBufferSize(void) const {
+		return this->buffer_size;
+	}
+	
+	void 
+	setHint(uint64_t rows, uint64_t bytes) {
+		this->hint.est_rows = rows;
+		this->hint.est_bytes = bytes;
+	}
+	
+	/* INPUT_KEEP_SESSION and INPUT_REUSE of the InputHeader */
+	void 
+	setInputFlags(uint32_t flags) {
+		this->hint.flags = flags;
+	}
+	
+	/* JOIN_TYPE_* of the join above this input, and INPUT_OUTER or INPUT_INNER for its side */
+	void 
+	setJoin(uint32_t join_type, uint32_t side) {
+		this->hint.join_type = join_type;
+		this->hint.flags |= side;
+	}
+	
+	const InputHeader * 
+	getHint(void) const {
+		return &this->hint;
+	}
+	
+	uint32_t 
+	getRowCount(void) const {
+		return this->nrows;
+	}
+	
+	void 
+	setFirst(bool first) {
+		this->first = first;
+	}
+	
+	bool 
+	isFirst(void) const {
+		return this->first;
+	}
+	
+	void 
+	setLast(bool last) {
+		this->last = last;
+	}
+	
+	bool 
+	isLast(void) const {
+		return this->last;
+	}
+	
+	void 
+	setFilterRequest(const FilterRequest *req) {
+		this->filter_requested = true;
+		this->filter = *req;
+	}
+	
+	/* request sent behind the terminator, NULL if none */
+	const FilterRequest * 
+	getFilterRequest(void) const {
+		return this->filter_requested ? &this->filter : NULL;
+	}
+	
+private:
+	void 
+	putEncodedTuple(TupleTableSlot *tts) {
+		char *row = static_cast<char *>(this->reserve(this->row_size));
+		std::size_t off = 0;
+		
+		slot_getallattrs(tts);
+		std::memset(row, 0, this->row_size);
+		for (int i = 0; i < this->desc->natts; i++) {
+			Form_pg_attribute att = this->desc->attrs[i];
+			Datum value = tts->tts_values[i];
+			
+			if (tts->tts_isnull[i])
+				this->setNull(this->nrows, i);
+			if (att->attlen == -1) {
+				off = TYPEALIGN(alignof(VarlenaRef), off);
+				if (!tts->tts_isnull[i]) {
+					VarlenaRef *ref = reinterpret_cast<VarlenaRef *>(row + off);
+					struct varlena *v = PG_DETOAST_DATUM_PACKED(value);
+					
+					ref->offset = this->var_base + this->var_size;
+					ref->length = VARSIZE_ANY_EXHDR(v);
+					this->putVar(VARDATA_ANY(v), ref->length);
+					if (v != reinterpret_cast<struct varlena *>(DatumGetPointer(value)))
+						pfree(v);
+				}
+				off += sizeof(VarlenaRef);
+			}
+			else {
+				off = att_align_nominal(off, att->attalign);
+				if (!tts->tts_isnull[i]) {
+					if (att->attbyval)
+						store_att_byval(row + off, value, att->attlen);
+					else
+						std::memcpy(row + off, DatumGetPointer(value), att->attlen);
+				}
+				off += att->attlen;
+			}
+		}
+		this->content_size += this->row_size;
+		this->nrows++;
+	}
+	
+	void 
+	putFilledTuple(TupleTableSlot *tts) {
+		slot_getallattrs(tts);
+		this->putRow(tts->tts_values, tts->tts_isnull);
+	}
+	
+	/* a row of fixed width columns with NULLs filled with zeros */
+	void 
+	putRow(Datum *values, bool *isnull) {
+		char *row = static_cast<char *>(this->reserve(this->row_size));
+		
+		TupleBuffer::fillRow(this->desc, values, isnull, row);
+		for (int i = 0; i < this->desc->natts; i++) {
+			if (isnull[i])
+				this->setNull(this->nrows, i);
+		}
+		this->content_size += this->row_size;
+		this->nrows++;
+	}
+	
+	/*
+	 * Reorder the rows by radix partition (top radix_bits bits of their hash)
+	 * with a counting sort into a new buffer; hashes and null bitmaps follow
+	 * their rows. Returns palloc()ed row counts of the partitions.
+	 */
+	uint32_t * 
+	partitionRows(void) {
+		std::size_t nparts = static_cast<std::size_t>(1) << this->radix_bits;
+		int shift = 32 - this->radix_bits;
+		uint32_t *counts = static_cast<uint32_t *>(palloc0(nparts * sizeof(uint32_t)));
+		uint32_t *next = static_cast<uint32_t *>(palloc(nparts * sizeof(uint32_t)));
+		uint32_t *hashes;
+		uint64_t *nulls = NULL;
+		char *rows;
+		
+		if (this->content_size != this->nrows * this->row_size)
+			elog(ERROR, "rows of a hashed chunk must all be %zu bytes wide", this->row_size);
+		/* rows put without a hash get 0 from palloc0() */
+		if (this->nrows > this->hash_capacity)
+			this->setHash(this->nrows - 1, 0);
+		for (uint32_t r = 0; r < this->nrows; r++)
+			counts[this->hashes[r] >> shift]++;
+		next[0] = 0;
+		for (std::size_t p = 1; p < nparts; p++)
+			next[p] = next[p - 1] + counts[p - 1];
+		
+		rows = static_cast<char *>(BufferPool::instance()->acquire(this->buffer_size));
+		hashes = static_cast<uint32_t *>(palloc(Max(this->nrows, 1) * sizeof(uint32_t)));
+		if (this->null_buffer != NULL) {
+			nulls = static_cast<uint64_t *>(palloc(this->desc->natts * (this->null_capacity / 64) * sizeof(uint64_t)));
+			std::memset(nulls, 0xFF, this->desc->natts * (this->null_capacity / 64) * sizeof(uint64_t));
+		}
+		for (uint32_t r = 0; r < this->nrows; r++) {
+			uint32_t dst = next[this->hashes[r] >> shift]++;
+			
+			std::memcpy(rows + dst * this->row_size, static_cast<char *>(this->buffer) + r * this->row_size, this->row_size);
+			hashes[dst] = this->hashes[r];
+			for (int i = 0; nulls != NULL && i < this->desc->natts; i++) {
+				uint64_t *src = this->null_buffer + i * (this->null_capacity / 64);
+				
+				if (!(src[r / 64] & (UINT64CONST(1) << (r % 64))))
+					nulls[i * (this->null_capacity / 64) + dst / 64] &= ~(UINT64CONST(1) << (dst % 64));
+			}
+		}
+		
+		BufferPool::instance()->release(this->buffer);
+		this->buffer = rows;
+		if (this->hashes != NULL)
+			pfree(this->hashes);
+		this->hashes = hashes;
+		if (nulls != NULL) {
+			pfree(this->null_buffer);
+			this->null_buffer = nulls;
+		}
+		pfree(next);
+		return counts;
+	}
+	
+	/* grow the bitmaps to hold rows, new rows are not NULL */
+	void 
+	extendNulls(uint32_t rows) {
+		uint32_t capacity = (this->null_capacity > 0) ? this->null_capacity : 4096;
+		uint64_t *prev = this->null_buffer;
+		
+		while (capacity < rows)
+			capacity *= 2;
+		this->null_buffer = static_cast<uint64_t *>(palloc(this->desc->natts * (capacity / 64) * sizeof(uint64_t)));
+		std::memset(this->null_buffer, 0xFF, this->desc->natts * (capacity / 64) * sizeof(uint64_t));
+		if (prev != NULL) {
+			for (int i = 0; i < this->desc->natts; i++) {
+				std::memcpy(this->null_buffer + i * (capacity / 64), prev + i * (this->null_capacity / 64),
+					    (this->null_capacity / 64) * sizeof(uint64_t));
+			}
+			pfree(prev);
+		}
+		this->null_capacity = capacity;
+	}
+	
+	void 
+	putVar(const void *data, std::size_t size) {
+		if (this->var_buffer == NULL) {
+			this->var_buffer_size = TupleBuffer::MIN_BUFSIZE;
+			this->var_buffer = BufferPool::instance()->acquire(this->var_buffer_size);
+		}
+		while (this->var_size + size > this->var_buffer_size) {
+			void *prev = this->var_buffer;
+			
+			this->var_buffer_size *= 2;
+			this->var_buffer = BufferPool::instance()->acquire(this->var_buffer_size);
+			std::memcpy(this->var_buffer, prev, this->var_size);
+			BufferPool::instance()->release(prev);
+		}
+		std::memcpy(static_cast<char *>(this->var_buffer) + this->var_size, data, size);
+		this->var_size += size;
+	}
+	
+public:
 	static 
 	std::size_t 
 	getTupleSize(TupleTableSlot *tts) {
@@ -5,11 +5,13 @@
 
 class TupleBufferQueue {
 private: 
-	static constexpr int QUEUE_LENGTH = 10;
+	static constexpr int QUEUE_LENGTH = 64;
 	TupleBuffer *queue[QUEUE_LENGTH];
 	std::atomic_int head;
 	std::atomic_int tail;
 	std::atomic_int length;
+	/* buffer bytes pushed and not released by the sender yet */
+	std::atomic<std::size_t> bytes;
 	
 public: 
 	TupleBufferQueue(void) { this->init(); }
@@ -29,6 +31,7 @@ public:
 		this->head.store(-1, std::memory_order_relaxed);
 		this->tail.store(-1, std::memory_order_relaxed);
 		this->length.store(0, std::memory_order_relaxed);
+		this->bytes.store(0, std::memory_order_relaxed);
 		std::atomic_thread_fence(std::memory_order_release);
 		// this->head = this->length = -1;
 		// this->length = 0;
@@ -37,15 +40,17 @@ public:
 		this->length.store(-1, std::memory_order_release);
 	}
 	
+	/* single producer (scanning backend) / single consumer (sender thread) ring */
 	int 
 	push(TupleBuffer *tb) {
-		int offset = ++(this->head);
+		int offset;
 		
-		if (offset > QUEUE_LENGTH) {
-			--(this->head);
+		if (this->length.load(std::memory_order_acquire) >= QUEUE_LENGTH)
 			return -1;
-		}
+		offset = (this->head.load(std::memory_order_relaxed) + 1) % QUEUE_LENGTH;
+		this->head.store(offset, std::memory_order_relaxed);
 		queue[offset] = tb;
+		this->bytes += tb->getBufferSize();
 		++(this->length);
 		return offset;		
 	}
@@ -54,11 +59,35 @@ public:
 	pop(void) {
 		int offset;
 		
-		if (this->length.load(std::memory_order_relaxed) < 1)
+		if (this->length.load(std::memory_order_acquire) < 1)
 			return NULL;
-		offset = ++(this->tail);
+		offset = (this->tail.load(std::memory_order_relaxed) + 1) % QUEUE_LENGTH;
+		this->tail.store(offset, std::memory_order_relaxed);
+		TupleBuffer *tb = queue[offset];
 		--(this->length);
-		return queue[offset];			
+		return tb;			
+	}
+	
+	/* called by the consumer after the buffer of a popped TupleBuffer is freed */
+	void 
+	release(std::size_t size) {
+		this->bytes -= size;
+	}
+	
+	/* true if a buffer of size bytes can be pushed without exceeding limit bytes */
+	bool 
+	hasRoom(std::size_t size, std::size_t limit) const {
+		std::size_t used = this->bytes.load(std::memory_order_acquire);
+		
+		if (this->length.load(std::memory_order_acquire) >= QUEUE_LENGTH)
+			return false;
+		/* a single buffer is always accepted so that sending makes progress */
+		return (used == 0 || used + size <= limit);
+	}
+	
+	std::size_t 
+	getBytes(void) const {
+		return this->bytes.load(std::memory_order_relaxed);
 	}
 	
 	int 
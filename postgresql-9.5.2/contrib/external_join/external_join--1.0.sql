@@ -0,0 +1,34 @@
+/* contrib/external_join/external_join--1.0.sql */
+
+-- complain if script is sourced in psql, rather than via CREATE EXTENSION
+\echo Use "CREATE EXTENSION external_join" to load this file. \quit
+
+-- Register functions.
+CREATE FUNCTION pg_stat_external_join_reset()
+RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
+CREATE FUNCTION pg_stat_external_join(
+    OUT endpoint text,
+    OUT queries int8,
+    OUT cancellations int8,
+    OUT connection_failures int8,
+    OUT bytes_sent int8,
+    OUT bytes_received int8,
+    OUT total_time float8,
+    -- sessions finished in <1ms, <10ms, ... <100s, and longer
+    OUT latency_histogram int8[]
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+-- Register a view on the function for ease of use.
+CREATE VIEW pg_stat_external_join AS
+  SELECT * FROM pg_stat_external_join();
+
+GRANT SELECT ON pg_stat_external_join TO PUBLIC;
+
+-- Don't want this to be available to non-superusers.
+REVOKE ALL ON FUNCTION pg_stat_external_join_reset() FROM PUBLIC;
@@ -19,6 +19,7 @@
 // #include <thread>
 #include <atomic>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 
 BEGIN_C_SPACE 
@@ -27,6 +28,11 @@ BEGIN_C_SPACE
 #include <unistd.h>
 #include <strings.h>
 #include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
 
 #include <errno.h>
 
@@ -34,27 +40,100 @@ BEGIN_C_SPACE
 
 #include <limits.h>
 #include "executor/executor.h"
+#include "executor/instrument.h"
+#include "commands/explain.h"
 #include "utils/guc.h"
+#include "funcapi.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/hsearch.h"
+#include "utils/timestamp.h"
+#include "utils/tuplestore.h"
 
 #include "access/htup_details.h"
 #include "utils/memutils.h"
 #include "miscadmin.h"
+#include "catalog/pg_am.h"
 #include "catalog/pg_type.h"
+#include "commands/defrem.h"
 #include "nodes/print.h"
+#include "nodes/makefuncs.h"
+#include "nodes/nodeFuncs.h"
+#include "optimizer/clauses.h"
+#include "optimizer/planner.h"
+#include "optimizer/planmain.h"
+#include "parser/parsetree.h"
+#include "access/genam.h"
+#include "access/hash.h"
+#include "access/heapam.h"
+#include "access/parallel.h"
+#include "access/relscan.h"
+#include "access/stratnum.h"
+#include "access/tuptoaster.h"
+#include "access/xact.h"
+#include "storage/backendid.h"
+#include "storage/buffile.h"
+#include "storage/bufmgr.h"
+#include "storage/fd.h"
+#include "storage/pmsignal.h"
+#include "storage/proc.h"
+#include "storage/shm_mq.h"
+#include "storage/shm_toc.h"
+#include "lib/binaryheap.h"
+#include "lib/stringinfo.h"
+#include "pgstat.h"
+#include "postmaster/autovacuum.h"
+#include "postmaster/bgworker.h"
+#include "utils/lsyscache.h"
+#include "utils/pg_locale.h"
+#include "utils/rel.h"
+#include "utils/resowner.h"
+#include "utils/ruleutils.h"
+#include "utils/snapmgr.h"
+#include "utils/sortsupport.h"
 
 
+#include "ExternalProtocol.hpp"
+#include "BufferPool.hpp"
+#include "ThreadRegistry.hpp"
 #include "TupleBuffer.hpp"
 #include "TupleBufferQueue.hpp"
+#include "ChunkSpill.hpp"
+#include "BulkHeapScan.hpp"
 #include "ResultBuffer.hpp"
+#include "ParallelScan.hpp"
+#include "InputPartitioner.hpp"
+#include "RuntimeFilter.hpp"
+#include "ResultCache.hpp"
+#include "JoinGraph.hpp"
+#include "PlanTemplate.hpp"
+#include "PipelineTrace.hpp"
+#include "JoinInstrumentation.hpp"
+#include "ResultDecoder.hpp"
+#include "ResultMerger.hpp"
+#include "EndpointStats.hpp"
+#include "SessionPool.hpp"
 #include "socket_lapper.hpp"
+#include "GatewayChannel.hpp"
+#include "Gateway.hpp"
+#include "AdmissionControl.hpp"
+#include "StreamCapture.hpp"
 
 PG_MODULE_MAGIC;
 
 void _PG_init(void);
 void _PG_fini(void);
 
+PG_FUNCTION_INFO_V1(pg_stat_external_join);
+PG_FUNCTION_INFO_V1(pg_stat_external_join_reset);
+
 /* Saved hook values in case of unload */
-static ExecProcNode_hook_type prev_ExecProcNode = NULL;
+static planner_hook_type prev_planner = NULL;
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
 
 /* GUC variables */
 /* Flag to use external join module */
@@ -62,66 +141,251 @@ static bool EnableExternalJoin = false;
 /* Address for External Process */
 static char *ExternalAddress = const_cast<char *>("127.0.0.1");
 static int ExternalPort = 59999;
-
-/* Initialized pthread_t */
-static pthread_t InitialThread;
-/* Holds currently running pthread_t, this is used when a query is cancelled */
-static pthread_t PreviousThread;
+/* Comma separated host[:port] list of external processes, empty to use addr and port */
+static char *ExternalEndpoints = NULL;
+/* Buffer pool settings */
+static bool UseHugePages = true;
+static int BufferPoolSize = 1024 * 512;
+/* Number of background workers scanning inputs */
+static int ScanWorkers = 0;
+/* Input chunks held in memory before spilling to disk, in kB */
+static int MaxBufferMemory = 1024 * 1024;
+/* Result cache settings */
+static bool UseResultCache = false;
+static int ResultCacheTTL = 300;
+static int ResultCacheMaxSize = 1024 * 1024;
+/* Number of endpoints tracked in pg_stat_external_join */
+static int StatsMax = 256;
+/* Radix partitions of hashed inputs, as 2^RadixBits, 0 to send rows unpartitioned */
+static int RadixBits = 0;
+/* Filter the probe input by the keys of the build input, up to a number of values */
+static bool UseRuntimeFilter = false;
+static int RuntimeFilterMaxValues = 64;
+/* Keep connections of parameterized nodes for their rescans */
+static bool KeepSessions = false;
+/* Start runs with a plan template and parameter values, pool sessions across executions */
+static bool UsePlanTemplates = false;
+static int SessionPoolTTL = 60;
+/* Tell engines the order of the results in a RunHeader */
+static bool SortedResults = false;
+/* Describe the joins of the offloaded plan in a RunHeader */
+static bool SendJoinGraph = false;
+/* Trace chunks through the pipeline, in a ring of a number of events */
+static bool TracePipeline = false;
+static int TraceEvents = 65536;
+/* Capture the bytes sent to external processes, numbering connection groups of this backend */
+static bool CaptureStreams = false;
+static uint32 CaptureGroups = 0;
+/* Join types external processes support, as a list and as bits of JoinType */
+static char *JoinTypes = const_cast<char *>("inner, left, full, right, semi, anti");
+static int JoinTypeMask = 0x3f;
+/* Engine connections per endpoint held by the gateway worker, 0 to connect from every backend */
+static int GatewayConnections = 0;
+/* Admission control: runs and kB in flight per endpoint, wait in ms, native execution on timeout */
+static int MaxConcurrency = 0;
+static int MaxBytesInFlight = 0;
+static int AdmissionTimeout = 10000;
+static bool AdmissionFallback = true;
 
 /* State for external join */
-/* ExternalExecProcNode() uses PlanState->initPlan field to hold execution state. This is scamped design. */
-/* If initPlan is used by original query process, ExternalExecProcNode() cannot work fine. */
-static constexpr NodeTag T_ExternalJoin = static_cast<NodeTag>(65535);
-enum State { INIT = 0, EXEC, FINI };
-struct ExternalJoinState {
-	NodeTag type;
-	State state;
-	
-	/* socket to communicate with external process */
+/* Every offloaded subtree is wrapped in its own CustomScan node, which owns its state and threads. */
+enum State { INIT = 0, SENT, EXEC, FINI, BYPASS, REPLAY, MERGE };
+/* external processes one node can talk to */
+static constexpr int MAX_ENGINES = 16;
+
+/* one external process of external_join.endpoints */
+struct Endpoint {
+	char host[ENDPOINT_LEN];
+	int port;
+	/* "host:port", as sessions, statistics and admission control name it */
+	char name[ENDPOINT_LEN];
+};
+
+/* join an input is below, for its InputHeader */
+struct InputJoin {
+	/* JOIN_TYPE_* */
+	uint32 type;
+	/* INPUT_OUTER, INPUT_INNER or 0 */
+	uint32 side;
+};
+
+/* connection to one external process; its result stream is read through ResultCursor */
+struct ExternalSession : public ResultCursor {
+	/* socket to communicate with external process, or stream file of a cached result */
 	int sock;
-	/* tuple sendeng or result receiving thread */
-	pthread_t thread;
+	/* channel through the gateway worker instead of sock, or NULL */
+	GatewayChannel *channel;
+	/* results are replayed from the result cache */
+	bool replay;
+	/* cache recording the results, or NULL */
+	ResultCache *cache;
+	/* index of the session in ExternalJoinState */
+	int index;
+	/* host:port of the external process, "cache" for a replayed result */
+	char endpoint[ENDPOINT_LEN];
+	/* RunHeader, template and parameter values to send ahead of the inputs, or NULL */
+	const char *run_message;
+	std::size_t run_message_size;
+	/* the result stream was read to its end */
+	bool finished;
+	/* the engine keeps the session for the next run and sends results in segments */
+	bool keep;
+	/* bytes left of the current segment */
+	uint64_t segment_left;
+	/* the terminating segment was read */
+	bool run_end;
+	/* a send of this run failed, the engine did not get all of its inputs */
+	std::atomic<bool> send_failed;
+	/* copy of the bytes sent on the connection, with external_join.capture */
+	StreamCapture capture;
+	/* bytes of this session, for pg_stat_external_join */
+	std::atomic<uint64_t> bytes_sent;
+	std::atomic<uint64_t> bytes_received;
+	/* instrumentation of the node, shared by its sessions */
+	JoinInstrumentation *instr;
 	
 	/* send buffer queue */
 	TupleBufferQueue tbq;
+	/* chunks waiting on disk while tbq is over external_join.max_buffer_memory */
+	ChunkSpill spill;
+};
+
+struct ExternalJoinState {
+	CustomScanState css;
+	State state;
+	/* start the session in BeginCustomScan instead of on the first fetch */
+	bool eager;
 	
-	/* result buffer: double buffered */
-	DoubleResultBuffer drb;
-	/* result buffer which result processing thread currently handles */
-	ResultBuffer *prb;
-	/* offset(cursor) to scan result buffer */
-	std::size_t poffset; 
-	/* base offset when an attribute sticks out of buffer */
-	std::size_t pbase;
-		
-	/* size of content in result buffer */
-	long psize;
+	/* tuple sending and result receiving threads of this node */
+	ThreadRegistry threads;
+	/* one session per external process, inputs are hash partitioned among them; 0 if no session */
+	int nsessions;
+	ExternalSession sessions[MAX_ENGINES];
+	/* session whose results are being returned */
+	int current;
+	/* start of the sessions */
+	TimestampTz started;
+	InputPartitioner partitioner;
+	/* filter of a later input by the keys of an earlier one */
+	RuntimeFilter filter;
+	ResultCache cache;
+	/* sessions stay connected between runs of a parameterized node */
+	bool keep;
+	/* the sessions finished the last run and wait for the next one */
+	bool kept;
+	/* inputs the engines still hold from the last run, indexes in scan order */
+	Bitmapset *reuse;
+	/* join each input is below, while the inputs are scanned */
+	InputJoin *joins;
+	/* results recorded for rescans without parameter change, NULL if not rewindable */
+	bool materialize;
+	Tuplestorestate *results;
+	/* state to go on with once the recorded results are replayed */
+	State resume;
+	/* plan template, and whether the sessions have received it */
+	PlanTemplate tmpl;
+	bool template_sent;
+	/* joins of the plan for the engines, built on the first run */
+	JoinGraph graph;
+	/* order of the results, merges the streams of several sessions */
+	ResultMerger merger;
+	/* admission of the current run to its endpoints */
+	AdmissionControl::Admission admission;
+	/* shown by EXPLAIN ANALYZE */
+	JoinInstrumentation instr;
+	
+	/* stops session threads when query memory context is reset */
+	MemoryContextCallback reset_cb;
 };
 
-static ExternalJoinState *makeExternalJoinState(void);
-static void FreeExternalJoinState(ExternalJoinState *ejs);
-static ExternalJoinState *GetExternalJoinState(List *initPlan);
-static ExternalJoinState *SetExternalJoinState(List **initPlan, ExternalJoinState *ejs);
+/* planner integration */
+static PlannedStmt *ExternalPlanner(Query *parse, int cursorOptions, ParamListInfo boundParams);
+static Plan *PlanExternalJoin(Plan *plan, bool eager, List *order);
+static Plan *MakeExternalJoinPlan(Plan *plan, bool eager, List *order);
+static Plan *PlanExternalSubtrees(Plan *plan, bool eager);
+static bool PlanHasScan(Plan *plan);
+static bool PlanHasJoin(Plan *plan, bool unsupported);
+
+/* custom scan callbacks */
+static Node *CreateExternalJoinState(CustomScan *cscan);
+static void BeginExternalJoinScan(CustomScanState *node, EState *estate, int eflags);
+static void EndExternalJoinScan(CustomScanState *node);
+static void ReScanExternalJoinScan(CustomScanState *node);
+static void ExplainExternalJoinScan(CustomScanState *node, List *ancestors, ExplainState *es);
+static void ExternalJoinStateResetCallback(void *arg);
 
 /* main function to be called */
-static TupleTableSlot *ExternalExecProcNode(PlanState *ps);
+static TupleTableSlot *ExternalExecProcNode(CustomScanState *node);
 
 /* external join executor */
-static ExternalJoinState *InitExternalJoin(PlanState *ps);
-static void EndExternalJoin(PlanState *ps);
-static TupleTableSlot *ExecExternalJoin(PlanState *ps);
+static bool InitExternalJoin(ExternalJoinState *ejs);
+static void EndExternalJoin(ExternalJoinState *ejs, bool keep);
+static TupleTableSlot *ExecExternalJoin(ExternalJoinState *ejs, ExternalSession *es);
+static bool WaitFirstResult(ExternalJoinState *ejs, ExternalSession *es);
+static void BeginMerge(ExternalJoinState *ejs);
+static int ConnectEndpoints(ExternalJoinState *ejs, int max);
+static bool AdmitRun(ExternalJoinState *ejs, List *inputs);
+static int ParseEndpoints(Endpoint *endpoints, int max);
+static bool ConnectSession(ExternalSession *es, char *host, int port);
+static long SessionSend(ExternalSession *es, void *data, long size);
+static long SessionReceive(ExternalSession *es, void *buf, long size);
+static void CloseSession(ExternalSession *es);
+static bool HasGatewaySessions(ExternalJoinState *ejs);
+static void StartReceivers(ExternalJoinState *ejs);
+static long ReceiveSegments(ExternalSession *es, void *buf, long size);
+static void SendToEngine(ExternalSession *es, void *data, long size);
+static void RecordEndpointStats(ExternalJoinState *ejs, bool create);
+static void RecordConnectionFailure(const char *endpoint);
+static int TakePooledSessions(ExternalJoinState *ejs);
+static void ReleaseSessions(ExternalJoinState *ejs);
 
 /* tuple scanner */
 static void ScanTuple(PlanState *node, ExternalJoinState *ejs);
+static void ScanTupleLocal(PlanState *node, int input, ExternalJoinState *ejs);
+static void ScanTupleBulk(ScanState *node, int input, ExternalJoinState *ejs);
+static void ScanTupleParallel(ParallelScan *pscan, int input, ExternalJoinState *ejs);
+static void ReuseInput(PlanState *node, int input, ExternalJoinState *ejs);
+static void CollectScanNode(PlanState *node, List **inputs);
+static void CollectInputJoins(PlanState *node, uint32 type, uint32 side, InputJoin *joins, int *n);
+static void PushTupleBuffer(ExternalJoinState *ejs, ExternalSession *es, int input, TupleBuffer *tb);
+static void ReloadSpilledChunks(ExternalJoinState *ejs, ExternalSession *es);
+static void DrainSessions(ExternalJoinState *ejs);
+static void ReceiveRuntimeFilter(ExternalJoinState *ejs);
+static TupleBuffer *MakeTupleBufferForPlan(Plan *plan, int nparts);
+/* entry point of parallel scan workers */
+void ExternalJoinScanWorkerMain(dsm_segment *seg, shm_toc *toc);
+/* entry point of the gateway worker */
+void ExternalJoinGatewayMain(Datum arg);
 /* tuple sender */
 static void *SendTupleToExternal(void *arg);
 /* result receiver */
 static void *ReceiveResultFromExternal(void *arg);
 
-static uint64_t bytesExtract(uint64_t x, int n);
-/* thread cancelling function */
-static void CancelPreviousSessionThread(void);
-static void SetCurrentSessionThread(pthread_t thread);
+/* GUC assign hooks */
+static void AssignUseHugePages(bool newval, void *extra);
+static void AssignBufferPoolSize(int newval, void *extra);
+static bool CheckJoinTypes(char **newval, void **extra, GucSource source);
+static void AssignJoinTypes(const char *newval, void *extra);
+
+/* shared memory */
+static void ExternalJoinShmemStartup(void);
+
+static CustomScanMethods ExternalJoinScanMethods = {
+	"ExternalJoin",
+	CreateExternalJoinState,
+	NULL
+};
+
+static CustomExecMethods ExternalJoinExecMethods = {
+	"ExternalJoin",
+	BeginExternalJoinScan,
+	ExternalExecProcNode,
+	EndExternalJoinScan,
+	ReScanExternalJoinScan,
+	NULL,
+	NULL,
+	ExplainExternalJoinScan
+};
 
 
 /*
@@ -142,6 +406,17 @@ _PG_init(void)
 				 NULL,
                                  NULL);
 	
+	DefineCustomStringVariable("external_join.endpoints",
+				   "Sets the external processes as a comma separated list of host[:port].",
+				   "With more than one, inputs of an equi-join are hash partitioned among them. Empty uses external_join.addr and external_join.port.",
+				   &ExternalEndpoints,
+				   "",
+				   PGC_USERSET,
+				   0,
+				   NULL,
+				   NULL,
+				   NULL);
+	
 	DefineCustomIntVariable("external_join.port",
 				"Selects what port external join connects to.",
 				NULL,
@@ -166,12 +441,344 @@ _PG_init(void)
 				   NULL,
 				   NULL);
 	
-        EmitWarningsOnPlaceholders("external_join");
+	DefineCustomBoolVariable("external_join.use_huge_pages",
+				 "Selects whether external join buffers are backed by huge pages.",
+				 "Falls back to transparent huge pages when MAP_HUGETLB is unavailable.",
+				 &UseHugePages,
+				 true,
+				 PGC_USERSET,
+				 0,
+				 NULL,
+				 AssignUseHugePages,
+				 NULL);
+	
+	DefineCustomIntVariable("external_join.scan_workers",
+				"Sets the number of background workers scanning large sequential inputs.",
+				"Zero scans all inputs in the backend.",
+				&ScanWorkers,
+				0,
+				0,
+				64,
+				PGC_USERSET,
+				0,
+				NULL,
+				NULL,
+				NULL);
+	
+	DefineCustomIntVariable("external_join.max_buffer_memory",
+				"Sets the maximum memory for input chunks not sent yet.",
+				"Chunks beyond this are spilled to temporary files until the external process catches up.",
+				&MaxBufferMemory,
+				1024 * 1024,
+				1024 * 64,
+				MAX_KILOBYTES,
+				PGC_USERSET,
+				GUC_UNIT_KB,
+				NULL,
+				NULL,
+				NULL);
+	
+	DefineCustomBoolVariable("external_join.result_cache",
+				 "Selects whether results of external joins are cached on disk.",
+				 "A cached result is reused while the plan, parameters and input relations are unchanged. "
+				 "It may miss changes committed up to external_join.result_cache_ttl ago, and is not used "
+				 "in REPEATABLE READ or SERIALIZABLE transactions.",
+				 &UseResultCache,
+				 false,
+				 PGC_USERSET,
+				 0,
+				 NULL,
+				 NULL,
+				 NULL);
+	
+	DefineCustomIntVariable("external_join.result_cache_ttl",
+				"Sets the maximum age of a cached result.",
+				"Cached results may be stale by up to this time, from changes not yet reported to the statistics collector.",
+				&ResultCacheTTL,
+				300,
+				0,
+				INT_MAX,
+				PGC_USERSET,
+				GUC_UNIT_S,
+				NULL,
+				NULL,
+				NULL);
+	
+	DefineCustomIntVariable("external_join.result_cache_max_size",
+				"Sets the maximum size of one cached result.",
+				NULL,
+				&ResultCacheMaxSize,
+				1024 * 1024,
+				0,
+				MAX_KILOBYTES,
+				PGC_USERSET,
+				GUC_UNIT_KB,
+				NULL,
+				NULL,
+				NULL);
+	
+	DefineCustomIntVariable("external_join.radix_bits",
+				"Sets the number of radix bits inputs are partitioned by before shipping.",
+				"Join keys are hashed by PostgreSQL and rows are sent in 2^radix_bits partitions with their hashes; 0 disables.",
+				&RadixBits,
+				0,
+				0,
+				12,
+				PGC_USERSET,
+				0,
+				NULL,
+				NULL,
+				NULL);
+	
+	DefineCustomBoolVariable("external_join.runtime_filter",
+				 "Selects whether a later join input is filtered by the keys of an earlier one.",
+				 "The external process must answer filter requests; see ExternalProtocol.hpp.",
+				 &UseRuntimeFilter,
+				 false,
+				 PGC_USERSET,
+				 0,
+				 NULL,
+				 NULL,
+				 NULL);
+	
+	DefineCustomBoolVariable("external_join.keep_sessions",
+				 "Selects whether a parameterized external join keeps its sessions for rescans.",
+				 "Inputs that do not depend on a changed parameter are not shipped again. "
+				 "The external process must support kept sessions; see ExternalProtocol.hpp.",
+				 &KeepSessions,
+				 false,
+				 PGC_USERSET,
+				 0,
+				 NULL,
+				 NULL,
+				 NULL);
+	
+	DefineCustomBoolVariable("external_join.plan_templates",
+				 "Selects whether runs start with a plan template and the values of its parameters.",
+				 "With external_join.keep_sessions, sessions of a finished statement are pooled for later executions of its template. "
+				 "The external process must read run headers; see ExternalProtocol.hpp.",
+				 &UsePlanTemplates,
+				 false,
+				 PGC_USERSET,
+				 0,
+				 NULL,
+				 NULL,
+				 NULL);
+	
+	DefineCustomIntVariable("external_join.session_pool_ttl",
+				"Sets the time pooled sessions are kept for later executions of a plan template.",
+				"0 disables the session pool.",
+				&SessionPoolTTL,
+				60,
+				0,
+				86400,
+				PGC_USERSET,
+				GUC_UNIT_S,
+				NULL,
+				NULL,
+				NULL);
+	
+	DefineCustomBoolVariable("external_join.sorted_results",
+				 "Selects whether runs of an ordered plan start with a run header telling its order.",
+				 "The external process must read run headers; see ExternalProtocol.hpp.",
+				 &SortedResults,
+				 false,
+				 PGC_USERSET,
+				 0,
+				 NULL,
+				 NULL,
+				 NULL);
+	
+	DefineCustomBoolVariable("external_join.join_graph",
+				 "Selects whether runs start with a run header describing the joins of the plan.",
+				 "Lets an engine run joins of three or more inputs in one pass. "
+				 "The external process must read run headers; see ExternalProtocol.hpp.",
+				 &SendJoinGraph,
+				 false,
+				 PGC_USERSET,
+				 0,
+				 NULL,
+				 NULL,
+				 NULL);
+	
+	DefineCustomStringVariable("external_join.join_types",
+				   "Sets the join types the external processes can run, as a comma separated list.",
+				   "Any of inner, left, full, right, semi and anti. A plan with a join of another type "
+				   "is not offloaded as a whole, only the subtrees below that join are.",
+				   &JoinTypes,
+				   "inner, left, full, right, semi, anti",
+				   PGC_USERSET,
+				   GUC_LIST_INPUT,
+				   CheckJoinTypes,
+				   AssignJoinTypes,
+				   NULL);
+	
+	DefineCustomIntVariable("external_join.runtime_filter_max_values",
+				"Sets the maximum number of keys a runtime filter may list.",
+				"Keys are checked one by one for every row of the filtered input, 0 filters by key range only.",
+				&RuntimeFilterMaxValues,
+				64,
+				0,
+				65536,
+				PGC_USERSET,
+				0,
+				NULL,
+				NULL,
+				NULL);
+	
+	DefineCustomBoolVariable("external_join.trace",
+				 "Selects whether external join nodes trace every chunk through their pipeline.",
+				 "Each node writes its trace to pg_external_join_trace as Chrome trace-event JSON when it ends.",
+				 &TracePipeline,
+				 false,
+				 PGC_SUSET,
+				 0,
+				 NULL,
+				 NULL,
+				 NULL);
+	
+	DefineCustomIntVariable("external_join.trace_events",
+				"Sets the number of events a node keeps for its trace.",
+				"The latest events are kept when there are more.",
+				&TraceEvents,
+				65536,
+				1024,
+				INT_MAX / 64,
+				PGC_SUSET,
+				0,
+				NULL,
+				NULL,
+				NULL);
+	
+	DefineCustomBoolVariable("external_join.capture",
+				 "Selects whether the bytes sent to external processes are captured to files.",
+				 "Each new connection is written to pg_external_join_capture, to be replayed without a database.",
+				 &CaptureStreams,
+				 false,
+				 PGC_SUSET,
+				 0,
+				 NULL,
+				 NULL,
+				 NULL);
+	
+	DefineCustomIntVariable("external_join.buffer_pool_size",
+				"Sets the amount of idle buffer memory kept for reuse across queries.",
+				NULL,
+				&BufferPoolSize,
+				1024 * 512,
+				0,
+				INT_MAX,
+				PGC_USERSET,
+				GUC_UNIT_KB,
+				NULL,
+				AssignBufferPoolSize,
+				NULL);
+	
+	/* endpoint statistics live in shared memory, which only preloaded libraries get */
+	if (process_shared_preload_libraries_in_progress) {
+		DefineCustomIntVariable("external_join.stats_max",
+					"Sets the maximum number of endpoints tracked by pg_stat_external_join.",
+					NULL,
+					&StatsMax,
+					256,
+					16,
+					INT_MAX,
+					PGC_POSTMASTER,
+					0,
+					NULL,
+					NULL,
+					NULL);
+		EndpointStats::request(StatsMax);
+		
+		DefineCustomIntVariable("external_join.gateway_connections",
+					"Sets the connections per external process a gateway worker holds for all backends.",
+					"0 starts no gateway worker; every backend connects on its own.",
+					&GatewayConnections,
+					0,
+					0,
+					Gateway::MAX_CONNECTIONS,
+					PGC_POSTMASTER,
+					0,
+					NULL,
+					NULL,
+					NULL);
+		Gateway::request();
+		
+		DefineCustomIntVariable("external_join.max_concurrency",
+					"Sets the maximum number of runs an external process is given at once by all backends.",
+					"Further runs wait in line. 0 sets no limit.",
+					&MaxConcurrency,
+					0,
+					0,
+					INT_MAX,
+					PGC_SIGHUP,
+					0,
+					NULL,
+					NULL,
+					NULL);
+		
+		DefineCustomIntVariable("external_join.max_bytes_in_flight",
+					"Sets the maximum estimated input size of the runs an external process is given at once.",
+					"Further runs wait in line. 0 sets no limit.",
+					&MaxBytesInFlight,
+					0,
+					0,
+					INT_MAX,
+					PGC_SIGHUP,
+					GUC_UNIT_KB,
+					NULL,
+					NULL,
+					NULL);
+		
+		DefineCustomIntVariable("external_join.admission_timeout",
+					"Sets the maximum time a run waits for admission.",
+					"0 waits as long as it takes.",
+					&AdmissionTimeout,
+					10000,
+					0,
+					INT_MAX,
+					PGC_USERSET,
+					GUC_UNIT_MS,
+					NULL,
+					NULL,
+					NULL);
+		
+		DefineCustomBoolVariable("external_join.admission_fallback",
+					 "Selects whether a run not admitted in time is executed natively instead of failing.",
+					 NULL,
+					 &AdmissionFallback,
+					 true,
+					 PGC_USERSET,
+					 0,
+					 NULL,
+					 NULL,
+					 NULL);
+		AdmissionControl::request();
+		if (GatewayConnections > 0) {
+			BackgroundWorker worker;
+			
+			std::memset(static_cast<void *>(&worker), 0, sizeof(worker));
+			snprintf(worker.bgw_name, BGW_MAXLEN, "external_join gateway");
+			worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+			worker.bgw_start_time = BgWorkerStart_ConsistentState;
+			worker.bgw_restart_time = 10;
+			worker.bgw_main = NULL;
+			snprintf(worker.bgw_library_name, BGW_MAXLEN, "external_join");
+			snprintf(worker.bgw_function_name, BGW_MAXLEN, "ExternalJoinGatewayMain");
+			RegisterBackgroundWorker(&worker);
+		}
+	}
 	
 	elog(DEBUG1, "----- external join module loaded -----");
 	/* Install hooks. */
-	prev_ExecProcNode = ExecProcNode_hook;
-	ExecProcNode_hook = ExternalExecProcNode;
+	prev_planner = planner_hook;
+	planner_hook = ExternalPlanner;
+	if (process_shared_preload_libraries_in_progress) {
+		prev_shmem_startup_hook = shmem_startup_hook;
+		shmem_startup_hook = ExternalJoinShmemStartup;
+	}
+	/* after every variable, including those defined only when preloaded */
+	EmitWarningsOnPlaceholders("external_join");
 }
 
 /*
@@ -182,324 +789,1128 @@ _PG_fini(void)
 {
 	elog(DEBUG1, "-----external join module unloaded-----"); 
 	/* Uninstall hooks. */
-	ExecProcNode_hook = prev_ExecProcNode;
+	planner_hook = prev_planner;
+	if (shmem_startup_hook == ExternalJoinShmemStartup)
+		shmem_startup_hook = prev_shmem_startup_hook;
 }
 
-static inline 
-ExternalJoinState *
-makeExternalJoinState(void)
+static 
+void 
+ExternalJoinShmemStartup(void)
 {
-	ExternalJoinState *ejs;
-	
-	ejs = static_cast<ExternalJoinState *>(palloc(sizeof(*ejs)));
-	ejs->type = T_ExternalJoin;
-	ejs->state = State::INIT;
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+	EndpointStats::instance()->startup(StatsMax);
+	Gateway::instance()->startup();
+	AdmissionControl::instance()->startup();
+}
+
+/*
+ * Report cumulative statistics per endpoint
+ */
+Datum
+pg_stat_external_join(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = reinterpret_cast<ReturnSetInfo *>(fcinfo->resultinfo);
+	MemoryContext oldcontext;
+	TupleDesc tupdesc;
+	Tuplestorestate *tupstore;
 	
-	ejs->tbq.init();
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo)) {
+		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				errmsg("set-valued function called in context that cannot accept a set\n")));
+	}
+	if (!(rsinfo->allowedModes & SFRM_Materialize)) {
+		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				errmsg("materialize mode required, but it is not allowed in this context\n")));
+	}
 	
-	ejs->drb.init();
-	ejs->prb = ejs->drb.getCurrentResultBuffer();
-	ejs->poffset = ResultBuffer::BUFSIZE;
-	ejs->pbase = 0;
+	oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+	MemoryContextSwitchTo(oldcontext);
 	
-	ejs->psize = 0;
+	EndpointStats::instance()->report(tupstore, tupdesc);
+	tuplestore_donestoring(tupstore);
 	
-	return ejs;
+	return (Datum) 0;
 }
 
-static inline 
-void 
-FreeExternalJoinState(ExternalJoinState *ejs)
+/*
+ * Discard all statistics of pg_stat_external_join
+ */
+Datum
+pg_stat_external_join_reset(PG_FUNCTION_ARGS)
 {
-	ejs->tbq.fini();
-	ejs->drb.fini();
-	pfree(ejs);
+	EndpointStats::instance()->reset();
+	PG_RETURN_VOID();
 }
 
-static inline 
-ExternalJoinState *
-GetExternalJoinState(List *initPlan)
+
+/*
+ * Planner hook: wrap offloadable subtrees in ExternalJoin custom scan nodes
+ */
+static 
+PlannedStmt *
+ExternalPlanner(Query *parse, int cursorOptions, ParamListInfo boundParams)
 {
-	return reinterpret_cast<ExternalJoinState *>(initPlan);
+	PlannedStmt *stmt;
+	Plan **top;
+	ListCell *lc;
+	
+	if (prev_planner)
+		stmt = prev_planner(parse, cursorOptions, boundParams);
+	else
+		stmt = standard_planner(parse, cursorOptions, boundParams);
+	
+	if (EnableExternalJoin == false || stmt->commandType != CMD_SELECT || stmt->rowMarks != NIL)
+		return stmt;
+	
+	/* keep the Materialize node added for scrollable cursors on top */
+	top = &stmt->planTree;
+	if ((cursorOptions & CURSOR_OPT_SCROLL) && IsA(*top, Material))
+		top = &outerPlan(*top);
+	*top = PlanExternalJoin(*top, true, NIL);
+	if ((cursorOptions & CURSOR_OPT_SCROLL) && !ExecSupportsBackwardScan(stmt->planTree))
+		stmt->planTree = materialize_finished_plan(stmt->planTree);
+	
+	/* uncorrelated subqueries are offloaded by their own nodes */
+	foreach(lc, stmt->subplans) {
+		Plan *subplan = static_cast<Plan *>(lfirst(lc));
+		
+		if (subplan != NULL && bms_is_empty(subplan->extParam))
+			lfirst(lc) = PlanExternalJoin(subplan, false, NIL);
+	}
+	return stmt;
 }
 
-static inline 
-ExternalJoinState *
-SetExternalJoinState(List **initPlan, ExternalJoinState *ejs)
+/* order is that the parent wants the results in, NIL for the order of plan itself */
+static 
+Plan *
+PlanExternalJoin(Plan *plan, bool eager, List *order)
 {
-	*reinterpret_cast<ExternalJoinState **>(initPlan) = ejs;
-	return ejs;
+	if (plan == NULL)
+		return NULL;
+	
+	/* each branch of UNION ALL is offloaded separately */
+	if (IsA(plan, Append)) {
+		ListCell *lc;
+		
+		foreach(lc, reinterpret_cast<Append *>(plan)->appendplans)
+			lfirst(lc) = PlanExternalJoin(static_cast<Plan *>(lfirst(lc)), eager, NIL);
+		return plan;
+	}
+	/* and of an ordered one, whose branches must keep returning their rows in its order */
+	if (IsA(plan, MergeAppend)) {
+		MergeAppend *ma = reinterpret_cast<MergeAppend *>(plan);
+		ListCell *lc;
+		
+		foreach(lc, ma->mergeplans) {
+			List *ma_order = ResultMerger::makeOrder(ma->numCols, ma->sortColIdx, ma->sortOperators, 
+								 ma->collations, ma->nullsFirst);
+			
+			lfirst(lc) = PlanExternalJoin(static_cast<Plan *>(lfirst(lc)), eager, ma_order);
+		}
+		return plan;
+	}
+	if (!PlanHasScan(plan))
+		return plan;
+	/* the external processes cannot run a join of plan */
+	if (PlanHasJoin(plan, true))
+		return PlanExternalSubtrees(plan, eager);
+	/* params set above this node may not be computable at BeginCustomScan() */
+	return MakeExternalJoinPlan(plan, eager && bms_is_empty(plan->extParam), 
+				    (order != NIL) ? order : ResultMerger::planOrder(plan));
 }
 
-
-/* main */
-TupleTableSlot *
-ExternalExecProcNode(PlanState *ps)
+static 
+Plan *
+MakeExternalJoinPlan(Plan *plan, bool eager, List *order)
 {
-	TupleTableSlot *tts = NULL;
-	ExternalJoinState *ejs = GetExternalJoinState(ps->initPlan);
-	
-	elog(DEBUG5, "*****ExternalExecProcNode()*****");
-	if (EnableExternalJoin == false)
-                return ExecProcNode(ps);
+	CustomScan *cscan = makeNode(CustomScan);
+	List *tlist = NIL;
+	List *scan_tlist = NIL;
+	ListCell *lc;
 	
-	if (!(ejs == NULL || (ejs->state >= State::INIT && ejs->state <= State::FINI))) {
-		ereport(ERROR, (errcode(ERRCODE_EXTERNAL_ROUTINE_INVOCATION_EXCEPTION),
-				errmsg("PlanState->initPlan is set, cannot apply external join to this query.")));
+	/* scan tuple has the same shape as output of the offloaded subtree */
+	foreach(lc, plan->targetlist) {
+		TargetEntry *tle = static_cast<TargetEntry *>(lfirst(lc));
+		TargetEntry *scan_tle = flatCopyTargetEntry(tle);
+		TargetEntry *out_tle = flatCopyTargetEntry(tle);
+		
+		scan_tle->expr = reinterpret_cast<Expr *>(makeVarFromTargetEntry(OUTER_VAR, tle));
+		out_tle->expr = reinterpret_cast<Expr *>(makeVarFromTargetEntry(INDEX_VAR, tle));
+		scan_tlist = lappend(scan_tlist, scan_tle);
+		tlist = lappend(tlist, out_tle);
 	}
 	
-	for (;;) {
-		if (ejs == NULL) {
-			elog(DEBUG5, "BEGIN: Init");
-			ejs = InitExternalJoin(ps);
-			
-			/* create result receiving thread */
-			CancelPreviousSessionThread();
-			if (::pthread_create(&ejs->thread, NULL, ReceiveResultFromExternal, static_cast<void *>(ejs)) < 0) {
-				ereport(ERROR, (errcode(ERRCODE_EXTERNAL_ROUTINE_INVOCATION_EXCEPTION),
-						errmsg("cannot create thread in ::pthread_create()\n")));
-			}
-			SetCurrentSessionThread(ejs->thread);
-			
-			/* wait for first filling result buffer */
-			ejs->poffset = 0;
-			while ((ejs->psize = ejs->prb->getContentSize()) == 0)
-				::usleep(1);
-			
-			ejs->state = State::EXEC;
-			elog(DEBUG5, "END: Init");
-		}
-		else if (ejs->state == State::EXEC) {
-			elog(DEBUG5, "BEGIN: Exec");
-			
-			tts = ExecExternalJoin(ps);
-			if (tts == NULL) {
-				ejs->state = State::FINI;
-				continue;
-			}
-			
-			elog(DEBUG5, "END: Exec");
-			break;
-		}
-		else if (ejs->state == State::FINI) {
-			elog(DEBUG5, "END: Begin");
-			
-			/* join result receiving thread */
-			::pthread_join(ejs->thread, NULL);
-			CancelPreviousSessionThread();
-			EndExternalJoin(ps);
-			
-			elog(DEBUG5, "END: End");
-			break;
-		}
-		else {
-			ereport(FATAL, (errcode(ERRCODE_UNDEFINED_PSTATEMENT), 
-					errmsg("unknown state in ExternalExecProcNode()\n")));
-			break;
-		}
-	};
+	cscan->scan.plan.startup_cost = plan->startup_cost;
+	cscan->scan.plan.total_cost = plan->total_cost;
+	cscan->scan.plan.plan_rows = plan->plan_rows;
+	cscan->scan.plan.plan_width = plan->plan_width;
+	cscan->scan.plan.targetlist = tlist;
+	cscan->scan.plan.qual = NIL;
+	/* offloaded subtree is kept as outer plan, so that EXPLAIN shows it */
+	cscan->scan.plan.lefttree = plan;
+	cscan->scan.plan.righttree = NULL;
+	cscan->scan.plan.extParam = bms_copy(plan->extParam);
+	cscan->scan.plan.allParam = bms_copy(plan->allParam);
+	cscan->scan.scanrelid = 0;
+	cscan->flags = 0;
+	cscan->custom_plans = NIL;
+	cscan->custom_exprs = NIL;
+	/* the order is needed to merge the streams of several sessions, told to engines or not */
+	cscan->custom_private = list_make2(makeInteger(eager), order);
+	cscan->custom_scan_tlist = scan_tlist;
+	cscan->custom_relids = NULL;
+	cscan->methods = &ExternalJoinScanMethods;
 	
-	return tts;
+	return &cscan->scan.plan;
 }
 
-static inline 
-ExternalJoinState *
-InitExternalJoin(PlanState *ps)
+/*
+ * offload the subtrees below the joins of plan the external processes
+ * cannot run; the joins and the nodes above them stay native
+ */
+static 
+Plan *
+PlanExternalSubtrees(Plan *plan, bool eager)
 {
-	ExternalJoinState *ejs = SetExternalJoinState(&ps->initPlan, makeExternalJoinState());
+	Plan **children[2] = { &plan->lefttree, &plan->righttree };
 	
-	/* connect to external process */
-	ejs->sock = connectSock(ExternalAddress, ExternalPort);
-	if (ejs->sock < 0) {
-		ereport(ERROR, (errcode(ERRCODE_CONNECTION_FAILURE), 
-				errmsg("failed to connect %s:%d\n", ExternalAddress, ExternalPort)));
+	for (int i = 0; i < 2; i++) {
+		Plan **child = children[i];
+		
+		if (*child == NULL)
+			continue;
+		/* a HashJoin needs its Hash node, which takes the subtree below */
+		if (IsA(*child, Hash))
+			child = &outerPlan(*child);
+		if (PlanHasJoin(*child, true)) {
+			*child = PlanExternalSubtrees(*child, eager);
+			continue;
+		}
+		/* a lone scan is not worth a trip to the engine */
+		if (!PlanHasJoin(*child, false))
+			continue;
+		/* a MergeJoin needs sorted inputs, which only a Sort the engine runs keeps across sessions */
+		if (IsA(plan, MergeJoin) && ResultMerger::planOrder(*child) == NIL)
+			continue;
+		*child = PlanExternalJoin(*child, eager, NIL);
+		/* the inner of a MergeJoin is marked and restored, which a Material does for the CustomScan */
+		if (IsA(plan, MergeJoin) && child == &plan->righttree && IsA(*child, CustomScan))
+			*child = materialize_finished_plan(*child);
 	}
-	
-	CancelPreviousSessionThread();
-	/* create tuple sending thread */
-	if (::pthread_create(&ejs->thread, NULL, SendTupleToExternal, static_cast<void *>(ejs)) < 0) {
-		ereport(ERROR, (errcode(ERRCODE_EXTERNAL_ROUTINE_INVOCATION_EXCEPTION),
-				errmsg("cannot create thread in ::pthread_create()\n")));
+	return plan;
+}
+
+static 
+bool 
+PlanHasScan(Plan *plan)
+{
+	if (plan == NULL)
+		return false;
+	if (nodeTag(plan) >= T_Scan && nodeTag(plan) <= T_CustomScan)
+		return true;
+	return PlanHasScan(outerPlan(plan)) || PlanHasScan(innerPlan(plan));
+}
+
+/* plan has a join, or one of a type not in external_join.join_types */
+static 
+bool 
+PlanHasJoin(Plan *plan, bool unsupported)
+{
+	if (plan == NULL)
+		return false;
+	switch (nodeTag(plan)) {
+	case T_NestLoop:
+	case T_MergeJoin:
+	case T_HashJoin:
+		if (!unsupported || (JoinTypeMask & (1 << reinterpret_cast<Join *>(plan)->jointype)) == 0)
+			return true;
+		break;
+	default:
+		break;
 	}
-	SetCurrentSessionThread(ejs->thread);
-	
-	/* "tuple scan" and "tuple send" are executed concurrently */
-	ScanTuple(ps, ejs);
-	while (ejs->tbq.getLength() > 0)
-		::usleep(1);
-	ejs->tbq.fini();
+	return PlanHasJoin(outerPlan(plan), unsupported) || PlanHasJoin(innerPlan(plan), unsupported);
+}
+
+
+/*
+ * Custom scan callbacks
+ */
+static 
+Node *
+CreateExternalJoinState(CustomScan *cscan)
+{
+	ExternalJoinState *ejs = static_cast<ExternalJoinState *>(palloc0(sizeof(*ejs)));
 	
-       	ExecAssignExprContext(ps->state, ps);
-	/* init result tuple */
-	ExecInitResultTupleSlot(ps->state, ps);
-	ExecAssignResultTypeFromTL(ps);
-	ExecAssignProjectionInfo(ps, NULL);
-	ps->ps_TupFromTlist = false;
+	NodeSetTag(ejs, T_CustomScanState);
+	ejs->css.methods = &ExternalJoinExecMethods;
+	ejs->state = State::INIT;
+	ejs->eager = intVal(linitial(cscan->custom_private));
+	ejs->nsessions = 0;
+	for (int i = 0; i < MAX_ENGINES; i++)
+		ejs->sessions[i].capture.init();
+	ejs->kept = false;
+	ejs->reuse = NULL;
+	ejs->joins = NULL;
+	ejs->results = NULL;
+	ejs->tmpl.init();
+	ejs->template_sent = false;
+	ejs->graph.init();
+	ejs->merger.init();
+	ejs->merger.build(static_cast<List *>(lsecond(cscan->custom_private)));
+	ejs->threads.init();
+	ejs->filter.init();
+	ejs->instr.init(false);
 	
-	::pthread_join(ejs->thread, NULL);
-	CancelPreviousSessionThread();
-	return ejs;
+	return reinterpret_cast<Node *>(ejs);
 }
 
-static inline 
+static 
 void 
-EndExternalJoin(PlanState *ps)
+BeginExternalJoinScan(CustomScanState *node, EState *estate, int eflags)
 {
-	ExternalJoinState *ejs = GetExternalJoinState(ps->initPlan);
+	ExternalJoinState *ejs = reinterpret_cast<ExternalJoinState *>(node);
+	
+	outerPlanState(node) = ExecInitNode(outerPlan(node->ss.ps.plan), estate, eflags);
+	ejs->instr.init(node->ss.ps.instrument != NULL && node->ss.ps.instrument->need_timer);
+	if (TracePipeline)
+		ejs->instr.getTrace()->begin(TraceEvents);
+	/* rescans without parameter change are answered from the recorded results */
+	ejs->materialize = (eflags & EXEC_FLAG_REWIND) != 0;
+	/* only a node that takes parameters is rescanned with different inputs, other ones may be pooled */
+	ejs->keep = KeepSessions && 
+		(!bms_is_empty(node->ss.ps.plan->allParam) || (UsePlanTemplates && SessionPoolTTL > 0));
 	
-	ExecFreeExprContext(ps);
-	ExecClearTuple(ps->ps_ResultTupleSlot);
-	::close(ejs->sock);
-	FreeExternalJoinState(ejs);
+	ejs->reset_cb.func = ExternalJoinStateResetCallback;
+	ejs->reset_cb.arg = static_cast<void *>(ejs);
+	MemoryContextRegisterResetCallback(CurrentMemoryContext, &ejs->reset_cb);
+	
+	/* let engines of sibling nodes work while earlier siblings are consumed */
+	if (ejs->eager && EnableExternalJoin && !(eflags & EXEC_FLAG_EXPLAIN_ONLY)) {
+		if (ejs->materialize)
+			ejs->results = tuplestore_begin_heap(false, false, work_mem);
+		ejs->state = InitExternalJoin(ejs) ? State::SENT : State::BYPASS;
+	}
 }
 
-
-static inline
-std::size_t 
-GetAlignedOffset(std::size_t prev, std::size_t size)
+static 
+void 
+EndExternalJoinScan(CustomScanState *node)
 {
-	return (prev % size) ? (prev / size + 1) * size : prev;
+	ExternalJoinState *ejs = reinterpret_cast<ExternalJoinState *>(node);
+	
+	EndExternalJoin(ejs, false);
+	/* the threads are gone, so nobody records any more */
+	if (ejs->instr.getTrace()->isEnabled()) {
+		char *path = ejs->instr.getTrace()->dump();
+		
+		if (path != NULL)
+			elog(LOG, ":: external join pipeline trace written to %s", path);
+		ejs->instr.getTrace()->fini();
+	}
+	ejs->merger.fini();
+	if (ejs->results != NULL) {
+		tuplestore_end(ejs->results);
+		ejs->results = NULL;
+	}
+	ExecEndNode(outerPlanState(node));
 }
 
-static inline 
-TupleTableSlot *
-ExecExternalJoin(PlanState *ps)
-{
-	ExternalJoinState *ejs = GetExternalJoinState(ps->initPlan);
-	TupleTableSlot *tts = ps->ps_ProjInfo->pi_slot;
-	TupleDesc td = tts->tts_tupleDescriptor;
-	/* if data sticks out of buffer, use this buffer to merge splitted data */
-	uint64_t ovf = 0;
-	
-	/* wait until result buffer will be filled */
-	if (ejs->poffset == ResultBuffer::BUFSIZE) {
-		elog(DEBUG2, ":: ResultBuffer FULL switch");
-		ejs->prb->setContentSize(0);
-		ejs->drb.switchResultBuffer();
-		
-		ejs->poffset = 0;
-		ejs->pbase = 0;
-		ejs->prb = ejs->drb.getCurrentResultBuffer();
-		while ((ejs->psize = ejs->prb->getContentSize()) == 0)
-			::usleep(1);
-		/* EOF */
-		if (ejs->psize < 0)
-			return NULL;
-	}
-	else if (ejs->poffset >= static_cast<std::size_t>(ejs->psize))
-		return NULL;
+static 
+void 
+ReScanExternalJoinScan(CustomScanState *node)
+{
+	ExternalJoinState *ejs = reinterpret_cast<ExternalJoinState *>(node);
+	PlanState *outer = outerPlanState(node);
+	Bitmapset *changed = node->ss.ps.chgParam;
 	
-	/* check cancel request */
-	CHECK_FOR_INTERRUPTS();
+	/* same parameters, same result: replay what was recorded, then go on with the sessions */
+	if (changed == NULL && ejs->results != NULL) {
+		tuplestore_rescan(ejs->results);
+		if (ejs->state != State::REPLAY)
+			ejs->resume = ejs->state;
+		ejs->state = State::REPLAY;
+		return ;
+	}
+	if (ejs->results != NULL)
+		tuplestore_clear(ejs->results);
 	
-	/* fill result tuple */
-	ExecClearTuple(tts);
-	for (int col = 0; col < td->natts; col++) {
-		void *ptr;
+	/* start over: inputs are scanned and shipped again on the next fetch */
+	EndExternalJoin(ejs, true);
+	bms_free(ejs->reuse);
+	ejs->reuse = NULL;
+	if (ejs->kept) {
+		List *inputs = NIL;
+		ListCell *lc;
+		int i = 0;
 		
-		switch (td->attrs[col]->atttypid) {
-		case INT8OID:
-		case FLOAT8OID:
-			ejs->poffset = GetAlignedOffset(ejs->poffset, sizeof(double));
-			ptr = (*ejs->prb)[ejs->poffset + ejs->pbase];
-			ejs->poffset += sizeof(double);
-			break;
-		case INT4OID:
-                case FLOAT4OID:
-		case OIDOID:
-			ejs->poffset = GetAlignedOffset(ejs->poffset, sizeof(float));
-			ptr = (*ejs->prb)[ejs->poffset + ejs->pbase];
-			ejs->poffset += sizeof(float);
-			break;
-                case INT2OID:
-			ejs->poffset = GetAlignedOffset(ejs->poffset, sizeof(short));
-			ptr = (*ejs->prb)[ejs->poffset + ejs->pbase];
-			ejs->poffset += sizeof(short);
-			break;
-		case BOOLOID: 
-			ejs->poffset = GetAlignedOffset(ejs->poffset, sizeof(bool));
-			ptr = (*ejs->prb)[ejs->poffset + ejs->pbase];
-			ejs->poffset += sizeof(bool);
-			break;
-		default: 
-			ereport(ERROR, (errcode(ERRCODE_EXTERNAL_ROUTINE_INVOCATION_EXCEPTION), 
-					errmsg("unsupported result type %d.\n", td->attrs[col]->atttypid)));
-		};
-		
-		
-		/* an attribute sticks out of buffer */
-		if (ejs->poffset + td->attrs[col]->attlen > ResultBuffer::BUFSIZE) {
-			elog(DEBUG2, ":: ResultBuffer HUNGRY switch");
-			int held_size = ResultBuffer::BUFSIZE - ejs->poffset;
-			int remain_size = td->attrs[col]->attlen - held_size;
-			uint64_t held, remain;
+		/* engines still hold the rows of scans the changed parameters do not reach */
+		CollectScanNode(outer, &inputs);
+		foreach(lc, inputs) {
+			PlanState *ps = static_cast<PlanState *>(lfirst(lc));
 			
-			/* get the first part of this attribute */
-			held = bytesExtract(*(static_cast<uint64_t *>(ptr)), held_size - 1);
+			if (!bms_overlap(ps->plan->allParam, changed))
+				ejs->reuse = bms_add_member(ejs->reuse, i);
+			i++;
+		}
+		list_free(inputs);
+	}
+	ejs->state = State::INIT;
+	/* 
+	 * Input scans are fetched directly rather than through the join nodes
+	 * above them, which would rescan them lazily, so rescan the subtree now;
+	 * changed parameters still reach every scan that depends on them.
+	 */
+	ExecReScan(outer);
+}
+
+static 
+void 
+ExternalJoinStateResetCallback(void *arg)
+{
+	ExternalJoinState *ejs = static_cast<ExternalJoinState *>(arg);
+	
+	/* session threads must not touch pooled buffers after the query is gone */
+	ejs->threads.cancelAll();
+	/* drop a half recorded cache entry */
+	ejs->cache.fini();
+	AdmissionControl::instance()->release(&ejs->admission);
+	/* query was cancelled or failed while sessions were running, kept ones were recorded */
+	if (ejs->nsessions > 0) {
+		if (!ejs->kept)
+			RecordEndpointStats(ejs, false);
+		for (int i = 0; i < ejs->nsessions; i++)
+			CloseSession(&ejs->sessions[i]);
+		ejs->nsessions = 0;
+	}
+}
+
+static 
+void 
+ExplainExternalJoinScan(CustomScanState *node, List *ancestors, ExplainState *es)
+{
+	ExternalJoinState *ejs = reinterpret_cast<ExternalJoinState *>(node);
+	
+	/* counters mean nothing without execution */
+	if (es->analyze) {
+		ejs->instr.explain(es);
+		ejs->filter.explain(es);
+	}
+}
+
+
+/* main */
+TupleTableSlot *
+ExternalExecProcNode(CustomScanState *node)
+{
+	TupleTableSlot *tts = NULL;
+	ExternalJoinState *ejs = reinterpret_cast<ExternalJoinState *>(node);
+	
+	elog(DEBUG5, "*****ExternalExecProcNode()*****");
+	
+	for (;;) {
+		if (ejs->state == State::INIT) {
+			/* plan was cached while external join was enabled */
+			if (EnableExternalJoin == false) {
+				ejs->state = State::BYPASS;
+				continue;
+			}
+			elog(DEBUG5, "BEGIN: Init");
+			if (ejs->materialize && ejs->results == NULL)
+				ejs->results = tuplestore_begin_heap(false, false, work_mem);
+			ejs->state = InitExternalJoin(ejs) ? State::SENT : State::BYPASS;
+			elog(DEBUG5, "END: Init");
+		}
+		else if (ejs->state == State::SENT) {
+			ExternalSession *es = &ejs->sessions[ejs->current];
 			
-			/* switch buffer to get the remaining part of the attribute */
-			ejs->prb->setContentSize(0);
-			ejs->drb.switchResultBuffer();
-			ejs->prb = ejs->drb.getCurrentResultBuffer();
-			ejs->poffset = 0;
-			ejs->pbase = remain_size;
-			while ((ejs->psize = ejs->prb->getContentSize()) == 0)
-				usleep(1);
-			if (ejs->psize < 0) {
-				perror("sock 1");
-				ereport(ERROR, (errcode(ERRCODE_EXTERNAL_ROUTINE_INVOCATION_EXCEPTION), 
-						errmsg("unexpected connection shutdown\n")));
+			/* sorted partitions are merged rather than returned one after another */
+			if (ejs->merger.isOrdered() && ejs->nsessions > 1) {
+				BeginMerge(ejs);
+				ejs->state = State::MERGE;
+				continue;
+			}
+			/* EOF without any result */
+			ejs->state = WaitFirstResult(ejs, es) ? State::EXEC : State::FINI;
+			if (ejs->state == State::FINI) {
+				/* results of partitions are returned one session after another */
+				if (++ejs->current < ejs->nsessions) {
+					ejs->state = State::SENT;
+					continue;
+				}
+				EndExternalJoin(ejs, true);
 			}
+		}
+		else if (ejs->state == State::EXEC) {
+			elog(DEBUG5, "BEGIN: Exec");
 			
-			/* get the last part of the attribute */
-			remain = bytesExtract(*static_cast<uint64_t *>((*ejs->prb)[0]), remain_size - 1);
-			remain <<= held_size * 8;
+			tts = ExecExternalJoin(ejs, &ejs->sessions[ejs->current]);
+			if (tts == NULL) {
+				ejs->sessions[ejs->current].finished = true;
+				if (++ejs->current < ejs->nsessions) {
+					ejs->state = State::SENT;
+					continue;
+				}
+				elog(DEBUG5, "BEGIN: End");
+				ejs->state = State::FINI;
+				EndExternalJoin(ejs, true);
+				elog(DEBUG5, "END: End");
+				break;
+			}
+			/* the read pointer is at the end, so it stays behind the new row */
+			if (ejs->results != NULL)
+				tuplestore_puttupleslot(ejs->results, tts);
 			
-			/* merge first and last part of the attribute */
-			ovf = held | remain;
-			ptr = static_cast<void *>(&ovf);
-		}
-		
-		/* put column data to result tuple */
-		switch (td->attrs[col]->atttypid) {
-		case BOOLOID: 
-			tts->tts_values[col] = BoolGetDatum(*reinterpret_cast<bool *>(ptr));
-			break;
-                case INT8OID:
-			tts->tts_values[col] = Int64GetDatum(*reinterpret_cast<int64_t *>(ptr));
-			break;
-                case INT2OID:
-			tts->tts_values[col] = Int16GetDatum(*reinterpret_cast<int16_t *>(ptr));
+			elog(DEBUG5, "END: Exec");
 			break;
-		case INT4OID:
-			tts->tts_values[col] = Int32GetDatum(*reinterpret_cast<int32_t *>(ptr));
+		}
+		else if (ejs->state == State::MERGE) {
+			tts = ejs->merger.next(&ejs->instr);
+			if (tts == NULL) {
+				for (int i = 0; i < ejs->nsessions; i++)
+					ejs->sessions[i].finished = true;
+				ejs->state = State::FINI;
+				EndExternalJoin(ejs, true);
+				break;
+			}
+			if (ejs->results != NULL)
+				tuplestore_puttupleslot(ejs->results, tts);
 			break;
-                case FLOAT4OID:
-			tts->tts_values[col] = Float4GetDatum(*reinterpret_cast<float *>(ptr));
+		}
+		else if (ejs->state == State::REPLAY) {
+			tts = ejs->css.ss.ss_ScanTupleSlot;
+			if (tuplestore_gettupleslot(ejs->results, true, false, tts))
+				break;
+			/* rows not recorded yet are still to come from the sessions */
+			ejs->state = ejs->resume;
+			tts = NULL;
+		}
+		else if (ejs->state == State::FINI) {
 			break;
-		case FLOAT8OID:
-			tts->tts_values[col] = Float8GetDatum(*reinterpret_cast<double *>(ptr));
+		}
+		else if (ejs->state == State::BYPASS) {
+			tts = ExecProcNode(outerPlanState(node));
 			break;
-		case OIDOID:
-			tts->tts_values[col] = ObjectIdGetDatum(*reinterpret_cast<uint32_t *>(ptr));
+		}
+		else {
+			ereport(FATAL, (errcode(ERRCODE_UNDEFINED_PSTATEMENT), 
+					errmsg("unknown state in ExternalExecProcNode()\n")));
 			break;
-		};
+		}
+	};
+	
+	return tts;
+}
+
+/* start a run, false if it is left to PostgreSQL */
+static inline 
+bool 
+InitExternalJoin(ExternalJoinState *ejs)
+{
+	List *inputs = NIL;
+	bool cacheable = false;
+	const StringInfoData *message = NULL;
+	char *endpoints = (ExternalEndpoints != NULL && ExternalEndpoints[0] != '\0') ? 
+		ExternalEndpoints : psprintf("%s:%d", ExternalAddress, ExternalPort);
+	instr_time t;
+	
+	ejs->current = 0;
+	ejs->started = GetCurrentTimestamp();
+	ejs->filter.fini();
+	CollectScanNode(outerPlanState(ejs), &inputs);
+	if (UsePlanTemplates) {
+		/* the same for every run of the node, parameter values are sent apart */
+		if (!ejs->tmpl.isBuilt())
+			ejs->tmpl.build(outerPlanState(ejs), inputs, 
+					psprintf("db %u endpoints %s radix_bits %d", MyDatabaseId, endpoints, RadixBits));
+		ejs->tmpl.fingerprint(inputs);
+	}
+	if (SendJoinGraph && !ejs->graph.isBuilt())
+		ejs->graph.build(outerPlanState(ejs), inputs);
+	/* kept sessions run the join again on what they hold */
+	if (UseResultCache && !ejs->kept) {
+		int fds[ResultCache::MAX_STREAMS];
+		
+		cacheable = ejs->cache.begin(outerPlanState(ejs), inputs, endpoints);
+		/* replay the cached result instead of running the join */
+		if (cacheable && (ejs->nsessions = ejs->cache.lookup(fds, ResultCacheTTL)) > 0) {
+			for (int i = 0; i < ejs->nsessions; i++) {
+				ejs->sessions[i].sock = fds[i];
+				ejs->sessions[i].channel = NULL;
+				ejs->sessions[i].replay = true;
+				ejs->sessions[i].keep = false;
+				strlcpy(ejs->sessions[i].endpoint, "cache", ENDPOINT_LEN);
+			}
+			list_free(inputs);
+			ejs->instr.beginSession(ejs->nsessions, true);
+			StartReceivers(ejs);
+			return true;
+		}
+	}
+	
+	/* wait for room at the external processes, or run the subtree natively */
+	if (!AdmitRun(ejs, inputs)) {
+		list_free(inputs);
+		ejs->cache.fini();
+		/* the engines would not hold what a rescan expects them to */
+		if (ejs->kept) {
+			for (int i = 0; i < ejs->nsessions; i++)
+				CloseSession(&ejs->sessions[i]);
+			ejs->nsessions = 0;
+			ejs->kept = false;
+		}
+		/* rows of a native run are not recorded for replay */
+		if (ejs->results != NULL) {
+			tuplestore_end(ejs->results);
+			ejs->results = NULL;
+		}
+		ejs->instr.countFallback();
+		return false;
+	}
+	
+	/* connect to external processes, unless the sessions of the last run wait for this one */
+	if (!ejs->kept) {
+		ejs->nsessions = 0;
+		/* or those of an earlier execution of the same template */
+		if (ejs->keep && UsePlanTemplates && SessionPoolTTL > 0 && GatewayConnections == 0)
+			ejs->nsessions = TakePooledSessions(ejs);
+		if (ejs->nsessions == 0) {
+			ejs->nsessions = ConnectEndpoints(ejs, MAX_ENGINES);
+			ejs->template_sent = false;
+		}
+	}
+	ejs->kept = false;
+	if (ejs->nsessions > 1 || RadixBits > 0)
+		ejs->partitioner.build(outerPlanState(ejs), inputs, ejs->nsessions, RadixBits);
+	if (ejs->nsessions > 1 && !ejs->partitioner.isPartitioned()) {
+		/* join cannot be partitioned, use the first external process only */
+		elog(DEBUG2, ":: join is not partitionable, using one of %d external processes", ejs->nsessions);
+		for (int i = 1; i < ejs->nsessions; i++)
+			CloseSession(&ejs->sessions[i]);
+		ejs->nsessions = 1;
+	}
+	/* 
+	 * a probe input filtered by the keys of one run could not be reused by
+	 * the next, and the gateway forwards the result stream only
+	 */
+	if (UseRuntimeFilter && ejs->nsessions > 0 && !ejs->keep && !HasGatewaySessions(ejs))
+		ejs->filter.build(outerPlanState(ejs), inputs, RuntimeFilterMaxValues);
+	list_free(inputs);
+	ejs->instr.beginSession(ejs->nsessions, false);
+	if (cacheable)
+		ejs->cache.record(ejs->nsessions, static_cast<uint64_t>(ResultCacheMaxSize) * 1024);
+	if (UsePlanTemplates || (SortedResults && ejs->merger.isOrdered()) || SendJoinGraph) {
+		int norder = SortedResults ? ejs->merger.getNumKeys() : 0;
+		OrderKey *order = static_cast<OrderKey *>(palloc(sizeof(OrderKey) * Max(norder, 1)));
+		
+		ejs->merger.getOrderKeys(ejs->css.ss.ss_ScanTupleSlot->tts_tupleDescriptor, order);
+		message = ejs->tmpl.makeMessage(outerPlanState(ejs), !ejs->template_sent, order, norder, 
+						SendJoinGraph ? &ejs->graph : NULL);
+		ejs->template_sent = ejs->tmpl.isBuilt();
+		pfree(order);
+	}
+	
+	for (int i = 0; i < ejs->nsessions; i++) {
+		ExternalSession *es = &ejs->sessions[i];
+		
+		es->index = i;
+		es->run_message = (message != NULL) ? message->data : NULL;
+		es->run_message_size = (message != NULL) ? message->len : 0;
+		es->replay = false;
+		/* the gateway knows from the result segments when a connection is free again */
+		es->keep = ejs->keep || es->channel != NULL;
+		es->instr = &ejs->instr;
+		es->bytes_sent.store(0, std::memory_order_relaxed);
+		es->bytes_received.store(0, std::memory_order_relaxed);
+		es->send_failed.store(false, std::memory_order_relaxed);
+		es->tbq.init();
+		es->spill.init();
+		
+		/* create tuple sending thread */
+		if (!ejs->threads.create(SendTupleToExternal, static_cast<void *>(es))) {
+			ereport(ERROR, (errcode(ERRCODE_EXTERNAL_ROUTINE_INVOCATION_EXCEPTION),
+					errmsg("cannot create thread in ::pthread_create()\n")));
+		}
+	}
+	
+	/* "tuple scan" and "tuple send" are executed concurrently */
+	ejs->instr.startTimer(&t);
+	ejs->instr.getTrace()->record(PipelineTrace::SCAN, PipelineTrace::BEGIN, PipelineTrace::BACKEND);
+	ScanTuple(outerPlanState(ejs), ejs);
+	ejs->instr.getTrace()->record(PipelineTrace::SCAN, PipelineTrace::END, PipelineTrace::BACKEND);
+	ejs->instr.stopScan(&t);
+	ejs->instr.startTimer(&t);
+	ejs->instr.getTrace()->record(PipelineTrace::DRAIN_WAIT, PipelineTrace::BEGIN, PipelineTrace::BACKEND);
+	DrainSessions(ejs);
+	ejs->instr.getTrace()->record(PipelineTrace::DRAIN_WAIT, PipelineTrace::END, PipelineTrace::BACKEND);
+	ejs->instr.stopDrainWait(&t);
+	for (int i = 0; i < ejs->nsessions; i++)
+		ejs->sessions[i].tbq.fini();
+	ejs->threads.joinAll();
+	/* a kept or pooled connection the engine closed fails here, its inputs are gone with the scan */
+	for (int i = 0; i < ejs->nsessions; i++) {
+		if (ejs->sessions[i].send_failed.load(std::memory_order_relaxed)) {
+			ejs->sessions[i].keep = false;
+			ereport(ERROR, (errcode(ERRCODE_EXTERNAL_ROUTINE_INVOCATION_EXCEPTION), 
+					errmsg("unexpected connection shutdown\n"),
+					errdetail("Sending to %s failed.", ejs->sessions[i].endpoint)));
+		}
+	}
+	
+	StartReceivers(ejs);
+	return true;
+}
+
+static 
+void 
+StartReceivers(ExternalJoinState *ejs)
+{
+	for (int i = 0; i < ejs->nsessions; i++) {
+		ExternalSession *es = &ejs->sessions[i];
+		
+		es->index = i;
+		es->instr = &ejs->instr;
+		es->finished = false;
+		es->segment_left = 0;
+		es->run_end = false;
+		es->cache = ejs->cache.isRecording() ? &ejs->cache : NULL;
+		es->drb.init();
+		es->prb = es->drb.getCurrentResultBuffer();
+		es->poffset = ResultBuffer::BUFSIZE;
+		es->psize = 0;
+		es->rowcxt = AllocSetContextCreate(CurrentMemoryContext, "ExternalJoin result row",
+						   ALLOCSET_SMALL_MINSIZE, ALLOCSET_SMALL_INITSIZE, ALLOCSET_SMALL_MAXSIZE);
+		es->cxt = CurrentMemoryContext;
+		es->batch_rows = 0;
+		es->batch_row = 0;
+		es->has_nulls = false;
+		es->valid = NULL;
+		es->valid_words = 0;
+		es->valid_capacity = 0;
+		
+		/* create result receiving thread */
+		if (!ejs->threads.create(ReceiveResultFromExternal, static_cast<void *>(es))) {
+			ereport(ERROR, (errcode(ERRCODE_EXTERNAL_ROUTINE_INVOCATION_EXCEPTION),
+					errmsg("cannot create thread in ::pthread_create()\n")));
+		}
+	}
+}
+
+/* end the run, and keep the sessions for the next one if keep and every engine read its end */
+static inline 
+void 
+EndExternalJoin(ExternalJoinState *ejs, bool keep)
+{
+	/* no session is running */
+	if (ejs->nsessions == 0)
+		return ;
+	/* the run has ended already, the sessions wait for the next one */
+	if (ejs->kept) {
+		if (keep)
+			return ;
+		ReleaseSessions(ejs);
+		return ;
+	}
+	
+	ejs->threads.cancelAll();
+	RecordEndpointStats(ejs, true);
+	AdmissionControl::instance()->release(&ejs->admission);
+	/* stored only if every stream was received to its end */
+	if (ejs->cache.isRecording()) {
+		ejs->cache.commit();
+		ResultCache::expire(ResultCacheTTL);
+	}
+	ExecClearTuple(ejs->css.ss.ss_ScanTupleSlot);
+	/* head rows of the merge point into the streams */
+	ejs->merger.end();
+	/* sessions through the gateway send segments whether or not the node keeps them */
+	keep = keep && ejs->keep;
+	for (int i = 0; i < ejs->nsessions; i++) {
+		ExternalSession *es = &ejs->sessions[i];
+		
+		/* a session cut off mid-run, or whose engine closed it, cannot take another */
+		keep = keep && es->keep && es->run_end && es->finished;
+		ejs->instr.countSpill(es->spill.getSpilledBytes());
+		es->spill.fini();
+		es->drb.fini();
+		MemoryContextDelete(es->rowcxt);
+		if (es->valid != NULL)
+			pfree(es->valid);
+	}
+	ejs->kept = keep;
+	if (!keep) {
+		for (int i = 0; i < ejs->nsessions; i++)
+			CloseSession(&ejs->sessions[i]);
+		ejs->nsessions = 0;
+	}
+	ejs->partitioner.fini();
+	/* the filter stays for EXPLAIN, but the probe scan must not keep it */
+	ejs->filter.restore();
+}
+
+/* admit the run to the endpoints it will use; false if it is to run natively */
+static 
+bool 
+AdmitRun(ExternalJoinState *ejs, List *inputs)
+{
+	char endpoints[MAX_ENGINES][ENDPOINT_LEN];
+	Endpoint parsed[MAX_ENGINES];
+	int n = 0;
+	double bytes = 0.0;
+	ListCell *lc;
+	instr_time t;
+	bool admitted;
+	
+	if (ejs->kept) {
+		for (n = 0; n < ejs->nsessions; n++)
+			strlcpy(endpoints[n], ejs->sessions[n].endpoint, ENDPOINT_LEN);
+	}
+	else {
+		/* the endpoints ConnectEndpoints() will connect */
+		n = ParseEndpoints(parsed, MAX_ENGINES);
+		for (int i = 0; i < n; i++)
+			strlcpy(endpoints[i], parsed[i].name, ENDPOINT_LEN);
+	}
+	if (n == 0)
+		return true;
+	/* inputs are partitioned among the endpoints, estimated like MakeTupleBufferForPlan() */
+	foreach(lc, inputs) {
+		Plan *plan = static_cast<PlanState *>(lfirst(lc))->plan;
+		
+		bytes += plan->plan_rows * MAXALIGN(plan->plan_width);
+	}
+	ejs->instr.startTimer(&t);
+	admitted = AdmissionControl::instance()->admit(endpoints, n, static_cast<int64>(bytes / n), MaxConcurrency, 
+						       static_cast<int64>(MaxBytesInFlight) * 1024, AdmissionTimeout, 
+						       &ejs->admission);
+	ejs->instr.stopAdmissionWait(&t);
+	if (!admitted && !AdmissionFallback) {
+		ereport(ERROR, (errcode(ERRCODE_QUERY_CANCELED), 
+				errmsg("external processes did not admit the run within external_join.admission_timeout\n")));
+	}
+	if (!admitted)
+		elog(DEBUG1, ":: run not admitted within %d ms, executing natively", AdmissionTimeout);
+	return admitted;
+}
+
+/* external processes of external_join.endpoints (or addr and port), returns their number */
+static 
+int 
+ParseEndpoints(Endpoint *endpoints, int max)
+{
+	char *list;
+	char *saveptr = NULL;
+	int n = 0;
+	
+	if (ExternalEndpoints == NULL || ExternalEndpoints[0] == '\0') {
+		strlcpy(endpoints[0].host, ExternalAddress, ENDPOINT_LEN);
+		endpoints[0].port = ExternalPort;
+		snprintf(endpoints[0].name, ENDPOINT_LEN, "%s:%d", ExternalAddress, ExternalPort);
+		return 1;
+	}
+	
+	list = pstrdup(ExternalEndpoints);
+	for (char *tok = strtok_r(list, ", ", &saveptr); tok != NULL; tok = strtok_r(NULL, ", ", &saveptr)) {
+		char *colon = std::strchr(tok, ':');
+		
+		if (n >= max) {
+			ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					errmsg("external_join.endpoints lists more than %d external processes\n", max)));
+		}
+		endpoints[n].port = ExternalPort;
+		if (colon != NULL) {
+			*colon = '\0';
+			endpoints[n].port = std::atoi(colon + 1);
+		}
+		strlcpy(endpoints[n].host, tok, ENDPOINT_LEN);
+		/* the name ConnectSession() gives the session */
+		snprintf(endpoints[n].name, ENDPOINT_LEN, "%s:%d", tok, endpoints[n].port);
+		n++;
+	}
+	pfree(list);
+	
+	if (n == 0) {
+		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				errmsg("external_join.endpoints has no external process\n")));
+	}
+	return n;
+}
+
+/* connect to external_join.endpoints (or addr and port), returns number of sessions */
+static 
+int 
+ConnectEndpoints(ExternalJoinState *ejs, int max)
+{
+	Endpoint endpoints[MAX_ENGINES];
+	int n = ParseEndpoints(endpoints, Min(max, MAX_ENGINES));
+	
+	for (int i = 0; i < n; i++) {
+		if (!ConnectSession(&ejs->sessions[i], endpoints[i].host, endpoints[i].port)) {
+			RecordConnectionFailure(ejs->sessions[i].endpoint);
+			/* do not leak sockets of earlier endpoints */
+			for (int j = 0; j < i; j++)
+				CloseSession(&ejs->sessions[j]);
+			ereport(ERROR, (errcode(ERRCODE_CONNECTION_FAILURE), 
+					errmsg("failed to connect %s\n", endpoints[i].name)));
+		}
+	}
+	if (CaptureStreams) {
+		for (int i = 0; i < n; i++)
+			ejs->sessions[i].capture.open(CaptureGroups, i, ejs->sessions[i].endpoint);
+		CaptureGroups++;
+	}
+	return n;
+}
+
+/* 
+ * connect a session to host:port, through the gateway worker if one runs;
+ * without a free channel slot the backend connects itself
+ */
+static 
+bool 
+ConnectSession(ExternalSession *es, char *host, int port)
+{
+	snprintf(es->endpoint, ENDPOINT_LEN, "%s:%d", host, port);
+	es->sock = -1;
+	es->channel = NULL;
+	if (GatewayConnections > 0 && Gateway::instance()->isRunning()) {
+		GatewayChannel *gc = GatewayChannel::constructor();
+		
+		gc->create(host, port);
+		if (Gateway::instance()->submit(gc)) {
+			/* waits in line while the connections of the endpoint are busy */
+			if (!Gateway::instance()->waitBound(gc)) {
+				GatewayChannel::destructor(gc);
+				return false;
+			}
+			es->channel = gc;
+			return true;
+		}
+		GatewayChannel::destructor(gc);
+	}
+	es->sock = connectSock(host, port);
+	return (es->sock >= 0);
+}
+
+/* sendStrong() on the socket or channel of a session, thread safe */
+static 
+long 
+SessionSend(ExternalSession *es, void *data, long size)
+{
+	long sent;
+	
+	if (es->channel != NULL)
+		sent = es->channel->send(data, size);
+	else
+		sent = sendStrong(es->sock, data, size);
+	if (sent > 0 && es->capture.isOpen())
+		es->capture.write(data, sent);
+	return sent;
+}
+
+/* receiveStrong() on the socket or channel of a session, thread safe */
+static 
+long 
+SessionReceive(ExternalSession *es, void *buf, long size)
+{
+	if (es->channel != NULL)
+		return es->channel->receive(buf, size);
+	return receiveStrong(es->sock, buf, size);
+}
+
+static 
+void 
+CloseSession(ExternalSession *es)
+{
+	es->capture.close();
+	if (es->channel != NULL) {
+		GatewayChannel::destructor(es->channel);
+		es->channel = NULL;
+	}
+	else if (es->sock >= 0)
+		::close(es->sock);
+	es->sock = -1;
+}
+
+static 
+bool 
+HasGatewaySessions(ExternalJoinState *ejs)
+{
+	for (int i = 0; i < ejs->nsessions; i++) {
+		if (ejs->sessions[i].channel != NULL)
+			return true;
+	}
+	return false;
+}
+
+/* add counters of the sessions to pg_stat_external_join */
+static 
+void 
+RecordEndpointStats(ExternalJoinState *ejs, bool create)
+{
+	double latency = 0.0;
+	long secs;
+	int usecs;
+	
+	TimestampDifference(ejs->started, GetCurrentTimestamp(), &secs, &usecs);
+	latency = secs * 1000.0 + usecs / 1000.0;
+	for (int i = 0; i < ejs->nsessions; i++) {
+		ExternalSession *es = &ejs->sessions[i];
+		EndpointCounters delta;
+		
+		std::memset(static_cast<void *>(&delta), 0, sizeof(delta));
+		delta.queries = 1;
+		delta.cancellations = es->finished ? 0 : 1;
+		delta.bytes_sent = es->bytes_sent.load();
+		delta.bytes_received = es->bytes_received.load();
+		delta.total_time = latency;
+		EndpointStats::instance()->record(es->endpoint, &delta, latency, create);
+	}
+}
+
+static 
+void 
+RecordConnectionFailure(const char *endpoint)
+{
+	EndpointCounters delta;
+	
+	std::memset(static_cast<void *>(&delta), 0, sizeof(delta));
+	delta.connection_failures = 1;
+	EndpointStats::instance()->record(endpoint, &delta, 0.0, true);
+}
+
+
+/* take over pooled sessions of the template, returns their number; inputs they hold are reused */
+static 
+int 
+TakePooledSessions(ExternalJoinState *ejs)
+{
+	int socks[MAX_ENGINES];
+	char endpoints[MAX_ENGINES][ENDPOINT_LEN];
+	int ninputs = ejs->tmpl.getNumInputs();
+	const uint64_t *fingerprints = ejs->tmpl.getFingerprints();
+	uint64_t *held = static_cast<uint64_t *>(palloc0(sizeof(uint64_t) * Max(ninputs, 1)));
+	int n;
+	
+	n = SessionPool::instance()->take(ejs->tmpl.getId(), SessionPoolTTL, socks, endpoints, ninputs, held);
+	for (int i = 0; i < n; i++) {
+		ejs->sessions[i].sock = socks[i];
+		ejs->sessions[i].channel = NULL;
+		strlcpy(ejs->sessions[i].endpoint, endpoints[i], ENDPOINT_LEN);
 	}
-	/* set null flags to false */
-	::bzero(static_cast<void *>(tts->tts_isnull), sizeof(bool) * td->natts);
+	bms_free(ejs->reuse);
+	ejs->reuse = NULL;
+	for (int i = 0; n > 0 && i < ninputs; i++) {
+		if (held[i] != 0 && held[i] == fingerprints[i])
+			ejs->reuse = bms_add_member(ejs->reuse, i);
+	}
+	pfree(held);
+	if (n > 0) {
+		ejs->template_sent = true;
+		elog(DEBUG2, ":: %d pooled sessions of template %016llx, %d of %d inputs reused", n,
+		     static_cast<unsigned long long>(ejs->tmpl.getId()), bms_num_members(ejs->reuse), ninputs);
+	}
+	return n;
+}
+
+/* close kept sessions, or leave them to a later execution of the template */
+static 
+void 
+ReleaseSessions(ExternalJoinState *ejs)
+{
+	/* the gateway keeps the connections of channels itself */
+	if (UsePlanTemplates && SessionPoolTTL > 0 && ejs->tmpl.isBuilt() && !HasGatewaySessions(ejs)) {
+		int socks[MAX_ENGINES];
+		char endpoints[MAX_ENGINES][ENDPOINT_LEN];
+		
+		for (int i = 0; i < ejs->nsessions; i++) {
+			socks[i] = ejs->sessions[i].sock;
+			strlcpy(endpoints[i], ejs->sessions[i].endpoint, ENDPOINT_LEN);
+			/* the next statement taking the connection is not captured */
+			ejs->sessions[i].capture.close();
+		}
+		SessionPool::instance()->put(ejs->tmpl.getId(), ejs->nsessions, socks, endpoints, 
+					     ejs->tmpl.getNumInputs(), ejs->tmpl.getFingerprints());
+	}
+	else {
+		for (int i = 0; i < ejs->nsessions; i++)
+			CloseSession(&ejs->sessions[i]);
+	}
+	for (int i = 0; i < ejs->nsessions; i++)
+		ejs->sessions[i].sock = -1;
+	ejs->nsessions = 0;
+	ejs->kept = false;
+}
+
+static inline 
+TupleTableSlot *
+ExecExternalJoin(ExternalJoinState *ejs, ExternalSession *es)
+{
+	return ResultDecoder::decode(es, ejs->css.ss.ss_ScanTupleSlot, &ejs->instr);
+}
+
+/* wait for the first result buffer of a session, false if its stream is empty */
+static 
+bool 
+WaitFirstResult(ExternalJoinState *ejs, ExternalSession *es)
+{
+	instr_time wait;
 	
-	return ExecStoreVirtualTuple(tts);
+	es->poffset = 0;
+	ejs->instr.startTimer(&wait);
+	ejs->instr.getTrace()->record(PipelineTrace::RESULT_WAIT, PipelineTrace::BEGIN, PipelineTrace::BACKEND);
+	while ((es->psize = es->prb->getContentSize()) == 0) {
+		CHECK_FOR_INTERRUPTS();
+		::usleep(1);
+	}
+	ejs->instr.getTrace()->record(PipelineTrace::RESULT_WAIT, PipelineTrace::END, PipelineTrace::BACKEND);
+	ejs->instr.stopResultWait(&wait);
+	ejs->instr.markFirstResult();
+	if (es->psize == ResultBuffer::FAILED)
+		ereport(ERROR, (errcode(ERRCODE_EXTERNAL_ROUTINE_INVOCATION_EXCEPTION), 
+				errmsg("unexpected connection shutdown\n")));
+	if (es->psize < 0) {
+		es->finished = true;
+		return false;
+	}
+	return true;
+}
+
+/* merge the streams of the sessions that have results */
+static 
+void 
+BeginMerge(ExternalJoinState *ejs)
+{
+	ResultCursor *cursors[MAX_ENGINES];
+	int n = 0;
+	
+	for (int i = 0; i < ejs->nsessions; i++) {
+		if (WaitFirstResult(ejs, &ejs->sessions[i]))
+			cursors[n++] = &ejs->sessions[i];
+	}
+	ejs->merger.begin(cursors, n, ejs->css.ss.ss_ScanTupleSlot->tts_tupleDescriptor);
 }
 
 static 
 void *
 ReceiveResultFromExternal(void *arg)
 {
-	ExternalJoinState *ejs = static_cast<ExternalJoinState *>(arg);
-	int sock = ejs->sock;
-	DoubleResultBuffer *drb = &ejs->drb;
+	ExternalSession *es = static_cast<ExternalSession *>(arg);
+	int sock = es->sock;
+	DoubleResultBuffer *drb = &es->drb;
 	ResultBuffer *rb;
 	long csize;
+	instr_time t;
+	PipelineTrace *trace = es->instr->getTrace();
+	bool acked = false;
 	
 	rb = drb->getCurrentResultBuffer();
 	for (;;) {
@@ -516,19 +1927,39 @@ ReceiveResultFromExternal(void *arg)
 			break;
 		
 		/* receive data and fill result buffer */
-		csize = receiveStrong(sock, (*rb)[0], ResultBuffer::BUFSIZE);
+		es->instr->startTimer(&t);
+		trace->record(PipelineTrace::RECEIVE, PipelineTrace::BEGIN, PipelineTrace::receiverLane(es->index));
+		if (es->replay)
+			csize = ResultCache::readStream(sock, (*rb)[0], ResultBuffer::BUFSIZE);
+		else if (es->keep)
+			csize = ReceiveSegments(es, (*rb)[0], ResultBuffer::BUFSIZE);
+		else
+			csize = SessionReceive(es, (*rb)[0], ResultBuffer::BUFSIZE);
 		// printf("thread::csize = %ld\n", csize);
-		/* connection was closed */
+		trace->record(PipelineTrace::RECEIVE, PipelineTrace::END, PipelineTrace::receiverLane(es->index), 
+			      0, Max(csize, 0));
+		if (!acked && csize > 0) {
+			trace->record(PipelineTrace::ENGINE_ACK, PipelineTrace::INSTANT, PipelineTrace::receiverLane(es->index));
+			acked = true;
+		}
+		/* connection was closed, or the run of a kept session ended */
 		if (csize == 0) {
-			rb->setContentSize(-1);
+			if (es->cache != NULL)
+				es->cache->finish(es->index);
+			rb->setContentSize(ResultBuffer::END);
 			break;
 		}
+		/* this thread must not ereport(), the backend does when it reaches the buffer */
 		if (csize < 0) {
-			perror("sock error 2");
-			ereport(ERROR, (errcode(ERRCODE_EXTERNAL_ROUTINE_INVOCATION_EXCEPTION), 
-					errmsg("unexpected connection shutdown\n")));
+			es->keep = false;
+			rb->setContentSize(ResultBuffer::FAILED);
+			break;
 		}
 		
+		es->instr->countReceive(csize, &t);
+		es->bytes_received += csize;
+		if (es->cache != NULL)
+			es->cache->append(es->index, (*rb)[0], csize);
 		rb->setContentSize(csize);
 		next_rb = drb->getNextResultBuffer();
 		if (next_rb == rb) 
@@ -539,17 +1970,69 @@ ReceiveResultFromExternal(void *arg)
 	return NULL;
 }
 
+/* 
+ * Fill buf from the result segments of a kept session like receiveStrong():
+ * returns less than size only at the end of the run, 0 once it has ended.
+ * The engine was told to keep the session, so it must end every run with
+ * the terminating segment; a connection closed before it, by the engine or
+ * by the gateway, is -1 rather than an empty or truncated result.
+ */
+static 
+long 
+ReceiveSegments(ExternalSession *es, void *buf, long size)
+{
+	long filled = 0;
+	
+	while (filled < size) {
+		long n;
+		
+		if (es->segment_left == 0) {
+			uint64_t len;
+			
+			if (es->run_end)
+				break;
+			n = SessionReceive(es, &len, sizeof(len));
+			if (n != sizeof(len))
+				return -1;
+			/* the terminating segment, the engine waits for the next run */
+			if (len == 0) {
+				es->run_end = true;
+				break;
+			}
+			es->segment_left = len;
+		}
+		n = Min(static_cast<uint64_t>(size - filled), es->segment_left);
+		if (SessionReceive(es, static_cast<char *>(buf) + filled, n) != n)
+			return -1;
+		filled += n;
+		es->segment_left -= n;
+	}
+	return filled;
+}
+
+/* send all of data, unless an earlier send of the run failed; the backend reports it after the senders */
+static 
+void 
+SendToEngine(ExternalSession *es, void *data, long size)
+{
+	if (es->send_failed.load(std::memory_order_relaxed))
+		return ;
+	if (SessionSend(es, data, size) != size)
+		es->send_failed.store(true, std::memory_order_relaxed);
+}
+
 static 
 void * 
 SendTupleToExternal(void *arg)
 {
-	ExternalJoinState *ejs = static_cast<ExternalJoinState *>(arg);
-	int sock = ejs->sock;
+	ExternalSession *es = static_cast<ExternalSession *>(arg);
 	
 	/* if TupleBufferQueue is finalized, TupleBufferQueue->getLength() returns -1 */
-	while (ejs->tbq.getLength() >= 0) {
-		TupleBuffer *tb = ejs->tbq.pop();
+	while (es->tbq.getLength() >= 0) {
+		TupleBuffer *tb = es->tbq.pop();
+		ChunkHeader chunk;
 		std::size_t size;
+		instr_time t;
 		
 		/* wait for scan completion */
 		pthread_testcancel();
@@ -557,12 +2040,53 @@ SendTupleToExternal(void *arg)
 			::usleep(1);
 			continue;
 		}
-		size = tb->getContentSize();
-		/* send tuple buffer size to external */
-		sendStrong(sock, &size, sizeof(size));
-		/* send tuples to external */
-		sendStrong(sock, tb->getBufferPointer(), size);
-		TupleBuffer::destructor(tb);
+		es->instr->startTimer(&t);
+		es->instr->getTrace()->record(PipelineTrace::SEND, PipelineTrace::BEGIN, PipelineTrace::senderLane(es->index));
+		/* the run begins with its template and parameter values */
+		if (es->run_message != NULL) {
+			SendToEngine(es, const_cast<char *>(es->run_message), es->run_message_size);
+			es->run_message = NULL;
+		}
+		/* send planner estimates so that external can pre-size its tables */
+		if (tb->isFirst()) {
+			InputHeader header = *tb->getHint();
+			
+			if (es->keep)
+				header.flags |= INPUT_KEEP_SESSION;
+			SendToEngine(es, &header, sizeof(header));
+		}
+		if (tb->getContentSize() > 0) {
+			chunk.size = tb->getContentSize() - tb->getVarSize() - tb->getNullSize() - tb->getHashSize();
+			chunk.nrows = tb->getRowCount();
+			chunk.flags = 0;
+			chunk.var_size = tb->getVarSize();
+			chunk.null_size = tb->getNullSize();
+			chunk.hash_size = tb->getHashSize();
+			/* send chunk size to external */
+			SendToEngine(es, &chunk, sizeof(chunk));
+			/* send tuples, their variable length area, null bitmaps and hashes to external */
+			SendToEngine(es, tb->getBufferPointer(), tb->getContentSize());
+		}
+		/* terminate the input */
+		if (tb->isLast()) {
+			const FilterRequest *req = tb->getFilterRequest();
+			
+			std::memset(static_cast<void *>(&chunk), 0, sizeof(chunk));
+			if (req != NULL)
+				chunk.flags = CHUNK_FILTER_REQUEST;
+			SendToEngine(es, &chunk, sizeof(chunk));
+			/* the backend reads the reply itself */
+			if (req != NULL)
+				SendToEngine(es, const_cast<FilterRequest *>(req), sizeof(*req));
+		}
+		es->instr->getTrace()->record(PipelineTrace::SEND, PipelineTrace::END, PipelineTrace::senderLane(es->index), 
+					      0, tb->getContentSize());
+		es->instr->countSend(tb->getContentSize(), &t);
+		es->bytes_sent += tb->getContentSize();
+		/* TupleBuffer itself goes away with the query memory context, pfree() is not thread safe */
+		size = tb->getBufferSize();
+		tb->fini();
+		es->tbq.release(size);
 	}
 	return NULL;
 }
@@ -571,58 +2095,453 @@ static inline
 void 
 ScanTuple(PlanState *node, ExternalJoinState *ejs)
 {
-	if (node == NULL)
-		return ;
-	if (node->type >= T_ScanState && node->type <= T_CustomScanState) {
-		TupleBuffer *tb = TupleBuffer::constructor();
+	List *inputs = NIL;
+	ParallelScan *pscan = ParallelScan::constructor();
+	/* workers send all their rows to one session, so partitioned inputs are scanned here */
+	int nworkers = ejs->partitioner.isPartitioned() ? 0 : ScanWorkers;
+	/* workers would scan inputs the engines still hold as well */
+	if (ejs->reuse != NULL)
+		nworkers = 0;
+	ScanHashKey *keys = NULL;
+	ListCell *lc;
+	int i;
+	
+	CollectScanNode(node, &inputs);
+	/* the same walk as CollectScanNode(), so joins are in input order */
+	ejs->joins = static_cast<InputJoin *>(palloc(sizeof(InputJoin) * list_length(inputs)));
+	i = 0;
+	CollectInputJoins(node, JOIN_TYPE_INNER, 0, ejs->joins, &i);
+	pscan->setMemoryLimit(static_cast<std::size_t>(MaxBufferMemory) * 1024);
+	/* workers hash rows of hashed inputs themselves */
+	if (ejs->partitioner.isHashed()) {
+		keys = static_cast<ScanHashKey *>(palloc0(sizeof(ScanHashKey) * list_length(inputs)));
+		for (i = 0; i < list_length(inputs); i++)
+			ejs->partitioner.getHashKey(i, &keys[i]);
+	}
+	/* the filtered input gets its quals in this backend after the scan has begun */
+	if (pscan->begin(inputs, nworkers, node->state->es_snapshot, ejs->filter.getProbeInput(), keys)) {
+		/* workers may send tuples of any input from the start */
+		i = 0;
+		foreach(lc, inputs) {
+			PlanState *ps = static_cast<PlanState *>(lfirst(lc));
+			
+			if (pscan->isParallel(i)) {
+				TupleBuffer *tb = MakeTupleBufferForPlan(ps->plan, 1);
+				
+				tb->setFirst(true);
+				/* workers fill rows by the relation's descriptor */
+				tb->setDescriptor(RelationGetDescr(reinterpret_cast<ScanState *>(ps)->ss_currentRelation));
+				if (ejs->partitioner.isHashed())
+					tb->setRadixBits(ejs->partitioner.getRadixBits(), ejs->partitioner.getKeyAttno(i) - 1);
+				pscan->setOpenBuffer(i, tb);
+			}
+			i++;
+		}
+	}
+	
+	i = 0;
+	foreach(lc, inputs) {
+		PlanState *ps = static_cast<PlanState *>(lfirst(lc));
 		
-		elog(DEBUG5, "----- ScanNode [%p] -----", node);
-		elog_node_display(DEBUG5, "ScanNode->plan", node->plan, true);
+		elog(DEBUG5, "----- ScanNode [%p] -----", ps);
+		elog_node_display(DEBUG5, "ScanNode->plan", ps->plan, true);
+		if (bms_is_member(i, ejs->reuse))
+			ReuseInput(ps, i, ejs);
+		else if (pscan->isParallel(i))
+			ScanTupleParallel(pscan, i, ejs);
+		else
+			ScanTupleLocal(ps, i, ejs);
+		if (ejs->filter.isBuildInput(i))
+			ReceiveRuntimeFilter(ejs);
+		else if (ejs->filter.isProbeInput(i))
+			ejs->filter.restore();
+		i++;
+	}
+	ParallelScan::destructor(pscan);
+	if (keys != NULL)
+		pfree(keys);
+	pfree(ejs->joins);
+	ejs->joins = NULL;
+}
+
+static inline 
+void 
+ScanTupleLocal(PlanState *node, int input, ExternalJoinState *ejs)
+{
+	bool partitioned = ejs->partitioner.isPartitioned();
+	bool hashed = ejs->partitioner.isHashed();
+	/* the runtime filter may leave no row to join */
+	bool skip = ejs->filter.isProbeInput(input) && ejs->filter.isEmpty();
+	TupleDesc desc = node->ps_ResultTupleSlot->tts_tupleDescriptor;
+	/* one buffer per session, every session gets its partition of every input */
+	TupleBuffer *tbs[MAX_ENGINES];
+	
+	/* tuples need no slot on their way to a single session */
+	if (!partitioned && !skip && BulkHeapScan::isEligible(node)) {
+		ScanTupleBulk(reinterpret_cast<ScanState *>(node), input, ejs);
+		return ;
+	}
+	for (int i = 0; i < ejs->nsessions; i++) {
+		tbs[i] = MakeTupleBufferForPlan(node->plan, ejs->nsessions);
+		tbs[i]->setFirst(true);
+		tbs[i]->setDescriptor(desc);
+		if (hashed)
+			tbs[i]->setRadixBits(ejs->partitioner.getRadixBits(), ejs->partitioner.getKeyAttno(input) - 1);
+	}
+	/* scan tuple */
+	for (TupleTableSlot *tts = skip ? NULL : ExecProcNode(node); !TupIsNull(tts); tts = ExecProcNode(node)) {
+		uint32 hash = (partitioned || hashed) ? ejs->partitioner.getHash(input, tts) : 0;
+		int part = partitioned ? ejs->partitioner.getPartition(hash) : 0;
+		TupleBuffer *tb = tbs[part];
 		
-		/* scan tuple */
-		for (TupleTableSlot *tts = ExecProcNode(node); tts->tts_isempty == false; tts = ExecProcNode(node)) {
-			/* copy tuple to buffer */
-			tb->putTuple(tts);
-			ResetExprContext(node->ps_ExprContext);
+		/* hand a full buffer to the sender as a chunk */
+		if (tb->isFull(tb->getPutSize(tts))) {
+			TupleBuffer *prev = tb;
+			
+			tb = tbs[part] = TupleBuffer::constructor(prev->getBufferSize());
+			tb->follow(prev);
+			PushTupleBuffer(ejs, &ejs->sessions[part], input, prev);
+		}
+		/* copy tuple to buffer */
+		if (hashed)
+			tb->setHash(tb->getRowCount(), hash);
+		tb->putTuple(tts);
+		ResetExprContext(node->ps_ExprContext);
+	}
+	
+	/* scan is complete for this ScanNode, put last buffers into queues */
+	for (int i = 0; i < ejs->nsessions; i++) {
+		tbs[i]->setLast(true);
+		if (ejs->filter.isBuildInput(input))
+			tbs[i]->setFilterRequest(ejs->filter.getRequest());
+		PushTupleBuffer(ejs, &ejs->sessions[i], input, tbs[i]);
+	}
+}
+
+static inline 
+void 
+ScanTupleBulk(ScanState *node, int input, ExternalJoinState *ejs)
+{
+	TupleDesc desc = RelationGetDescr(node->ss_currentRelation);
+	Instrumentation *instrument = node->ps.instrument;
+	Datum *values = static_cast<Datum *>(palloc(sizeof(Datum) * desc->natts));
+	bool *isnull = static_cast<bool *>(palloc(sizeof(bool) * desc->natts));
+	TupleBuffer *tb = MakeTupleBufferForPlan(node->ps.plan, 1);
+	BulkHeapScan bulk;
+	HeapTupleData tuple;
+	int ntuples;
+	
+	tb->setFirst(true);
+	tb->setDescriptor(desc);
+	if (ejs->partitioner.isHashed())
+		tb->setRadixBits(ejs->partitioner.getRadixBits(), ejs->partitioner.getKeyAttno(input) - 1);
+	bulk.begin(node->ss_currentScanDesc);
+	while ((ntuples = bulk.nextPage()) >= 0) {
+		/* EXPLAIN ANALYZE still counts the rows of the SeqScan */
+		if (instrument != NULL)
+			InstrStartNode(instrument);
+		while (bulk.nextTuple(&tuple)) {
+			if (tb->isFull(tb->getRowSize())) {
+				TupleBuffer *prev = tb;
+				
+				tb = TupleBuffer::constructor(prev->getBufferSize());
+				tb->follow(prev);
+				PushTupleBuffer(ejs, &ejs->sessions[0], input, prev);
+			}
+			if (tb->isHashed()) {
+				bool keynull;
+				Datum key = heap_getattr(&tuple, ejs->partitioner.getKeyAttno(input), desc, &keynull);
+				
+				tb->setHash(tb->getRowCount(), ejs->partitioner.hashKey(input, key, keynull));
+			}
+			tb->putHeapTuple(&tuple, values, isnull);
 		}
+		if (instrument != NULL)
+			InstrStopNode(instrument, ntuples);
+	}
+	bulk.end();
+	pfree(values);
+	pfree(isnull);
+	
+	tb->setLast(true);
+	if (ejs->filter.isBuildInput(input))
+		tb->setFilterRequest(ejs->filter.getRequest());
+	PushTupleBuffer(ejs, &ejs->sessions[0], input, tb);
+}
+
+static inline 
+void 
+ScanTupleParallel(ParallelScan *pscan, int input, ExternalJoinState *ejs)
+{
+	ExternalSession *es = &ejs->sessions[0];
+	TupleBuffer *tb;
+	
+	for (;;) {
+		while ((tb = pscan->popFull(input)) != NULL)
+			PushTupleBuffer(ejs, es, input, tb);
+		if (pscan->isDone(input))
+			break;
+		pscan->receive();
+	}
+	tb = pscan->takeOpenBuffer(input);
+	tb->setLast(true);
+	if (ejs->filter.isBuildInput(input))
+		tb->setFilterRequest(ejs->filter.getRequest());
+	PushTupleBuffer(ejs, es, input, tb);
+}
+
+/* tell every engine to join the rows it holds from the last run, without scanning the input */
+static inline 
+void 
+ReuseInput(PlanState *node, int input, ExternalJoinState *ejs)
+{
+	/* node was rescanned with the subtree but is not read */
+	for (int i = 0; i < ejs->nsessions; i++) {
+		/* nothing but the InputHeader and the terminator is sent */
+		TupleBuffer *tb = TupleBuffer::constructor(TupleBuffer::MIN_BUFSIZE);
 		
-		/* scan is complete for this ScanNode, put buffer into queue */
-		ejs->tbq.push(tb);
+		tb->setFirst(true);
+		tb->setLast(true);
+		tb->setInputFlags(INPUT_REUSE);
+		PushTupleBuffer(ejs, &ejs->sessions[i], input, tb);
+	}
+	elog(DEBUG2, ":: input %d reused by kept sessions", input);
+}
+
+static inline 
+void 
+CollectScanNode(PlanState *node, List **inputs)
+{
+	if (node == NULL)
+		return ;
+	if (node->type >= T_ScanState && node->type <= T_CustomScanState) {
+		*inputs = lappend(*inputs, node);
+		/* children of a ScanNode (e.g. BitmapIndexScan) belong to the scan itself */
+		return ;
 	}
 	/* look for other ScanNode */
-	ScanTuple(outerPlanState(node), ejs);
-	ScanTuple(innerPlanState(node), ejs);
+	CollectScanNode(outerPlanState(node), inputs);
+	CollectScanNode(innerPlanState(node), inputs);
 }
 
+/* join and side of the inputs below node, which is below a join of type on side */
+static inline 
+void 
+CollectInputJoins(PlanState *node, uint32 type, uint32 side, InputJoin *joins, int *n)
+{
+	if (node == NULL)
+		return ;
+	if (node->type >= T_ScanState && node->type <= T_CustomScanState) {
+		joins[*n].type = type;
+		joins[*n].side = side;
+		(*n)++;
+		return ;
+	}
+	switch (nodeTag(node->plan)) {
+	case T_NestLoop:
+	case T_MergeJoin:
+	case T_HashJoin:
+		type = reinterpret_cast<Join *>(node->plan)->jointype;
+		CollectInputJoins(outerPlanState(node), type, INPUT_OUTER, joins, n);
+		CollectInputJoins(innerPlanState(node), type, INPUT_INNER, joins, n);
+		break;
+	default:
+		CollectInputJoins(outerPlanState(node), type, side, joins, n);
+		CollectInputJoins(innerPlanState(node), type, side, joins, n);
+		break;
+	}
+}
 
 static inline 
-uint64_t 
-bytesExtract(uint64_t x, int n)
+void 
+PushTupleBuffer(ExternalJoinState *ejs, ExternalSession *es, int input, TupleBuffer *tb)
 {
-	static constexpr uint64_t TABLE[] = {
-		0x00000000000000FF, 0x000000000000FFFF, 0x0000000000FFFFFF, 0x00000000FFFFFFFF, 
-		0x000000FFFFFFFFFF, 0x0000FFFFFFFFFFFF, 0x00FFFFFFFFFFFFFF, 0xFFFFFFFFFFFFFFFF
-	};
-	return x & TABLE[n];
+	std::size_t limit = static_cast<std::size_t>(MaxBufferMemory) * 1024 / ejs->nsessions;
+	
+	if (tb->isFirst() && ejs->joins != NULL)
+		tb->setJoin(ejs->joins[input].type, ejs->joins[input].side);
+	tb->seal();
+	ejs->instr.countChunk(input, tb->getRowCount(), tb->getContentSize());
+	ejs->instr.getTrace()->record(PipelineTrace::CHUNK_FILLED, PipelineTrace::INSTANT, PipelineTrace::BACKEND, 
+				      input, tb->getContentSize());
+	ReloadSpilledChunks(ejs, es);
+	/* chunks are sent in order, so once one is on disk the following ones queue up behind it */
+	if (!es->spill.isEmpty() || !es->tbq.hasRoom(tb->getBufferSize(), limit)) {
+		elog(DEBUG2, ":: TupleBuffer spilled (%zu bytes queued)", es->tbq.getBytes());
+		es->spill.put(tb);
+	}
+	else
+		es->tbq.push(tb);
 }
 
 static inline 
 void 
-CancelPreviousSessionThread(void)
+ReloadSpilledChunks(ExternalJoinState *ejs, ExternalSession *es)
 {
-	/* cancel previously not cancelled thread */
-	if (!pthread_equal(PreviousThread, InitialThread)) {
-		pthread_cancel(PreviousThread);
-		memcpy(static_cast<void *>(&PreviousThread), static_cast<void *>(&InitialThread), sizeof(InitialThread));
+	std::size_t limit = static_cast<std::size_t>(MaxBufferMemory) * 1024 / ejs->nsessions;
+	
+	/* move spilled chunks back as far as the sender has drained the queue */
+	while (!es->spill.isEmpty() && es->tbq.hasRoom(es->spill.getHeadSize(), limit))
+		es->tbq.push(es->spill.get());
+}
+
+/* wait until the sender threads have sent every chunk pushed so far */
+static inline 
+void 
+DrainSessions(ExternalJoinState *ejs)
+{
+	bool draining;
+	
+	do {
+		CHECK_FOR_INTERRUPTS();
+		draining = false;
+		for (int i = 0; i < ejs->nsessions; i++) {
+			ExternalSession *es = &ejs->sessions[i];
+			
+			ReloadSpilledChunks(ejs, es);
+			if (!es->spill.isEmpty() || es->tbq.getLength() > 0)
+				draining = true;
+		}
+		if (draining)
+			::usleep(1);
+	} while (draining);
+}
+
+/* the build input asked for a filter; engines answer once they have read all of it */
+static inline 
+void 
+ReceiveRuntimeFilter(ExternalJoinState *ejs)
+{
+	instr_time t;
+	
+	/* spilled chunks only reach the engine through this backend */
+	ejs->instr.startTimer(&t);
+	DrainSessions(ejs);
+	for (int i = 0; i < ejs->nsessions; i++) {
+		ejs->filter.receive(ejs->sessions[i].sock);
+		ejs->instr.getTrace()->record(PipelineTrace::ENGINE_ACK, PipelineTrace::INSTANT, PipelineTrace::BACKEND, i);
 	}
+	ejs->instr.stopDrainWait(&t);
+	ejs->filter.apply();
 }
 
 static inline 
+TupleBuffer *
+MakeTupleBufferForPlan(Plan *plan, int nparts)
+{
+	TupleBuffer *tb;
+	/* each of nparts partitions gets its share of the input */
+	double rows = plan->plan_rows / nparts;
+	/* plan_width does not count alignment padding inside tuple data areas */
+	double bytes = rows * MAXALIGN(plan->plan_width);
+	
+	if (rows <= 0 || bytes <= 0)
+		return TupleBuffer::constructor();
+	
+	/* leave headroom for estimation error, larger inputs are sent in several chunks */
+	tb = TupleBuffer::constructor(static_cast<std::size_t>(Min(bytes * 1.25, static_cast<double>(TupleBuffer::CHUNK_SIZE))));
+	tb->setHint(static_cast<uint64_t>(rows), static_cast<uint64_t>(bytes));
+	elog(DEBUG2, ":: TupleBuffer presized for %.0f rows, %.0f bytes", rows, bytes);
+	return tb;
+}
+
+
+void 
+ExternalJoinScanWorkerMain(dsm_segment *seg, shm_toc *toc)
+{
+	ParallelScan::workerMain(seg, toc);
+}
+
+static volatile sig_atomic_t GatewayTerminate = false;
+
+static 
+void 
+GatewaySigterm(SIGNAL_ARGS)
+{
+	int save_errno = errno;
+	
+	GatewayTerminate = true;
+	SetLatch(MyLatch);
+	errno = save_errno;
+}
+
+void 
+ExternalJoinGatewayMain(Datum arg)
+{
+	pqsignal(SIGTERM, GatewaySigterm);
+	BackgroundWorkerUnblockSignals();
+	/* dsm_attach() of the channels remembers the segments in the resource owner */
+	CurrentResourceOwner = ResourceOwnerCreate(NULL, "external_join gateway");
+	Gateway::instance()->run(GatewayConnections, &GatewayTerminate);
+	proc_exit(0);
+}
+
+static 
+void 
+AssignUseHugePages(bool newval, void *extra)
+{
+	BufferPool::instance()->setUseHugePages(newval);
+}
+
+static 
+void 
+AssignBufferPoolSize(int newval, void *extra)
+{
+	BufferPool::instance()->setIdleLimit(static_cast<std::size_t>(newval) * 1024UL);
+}
+
+/* JOIN_TYPE_* of the engines are the JoinType values */
+static_assert(JOIN_TYPE_LEFT == JOIN_LEFT && JOIN_TYPE_FULL == JOIN_FULL && JOIN_TYPE_RIGHT == JOIN_RIGHT && 
+	      JOIN_TYPE_SEMI == JOIN_SEMI && JOIN_TYPE_ANTI == JOIN_ANTI, "JOIN_TYPE_* differ from JoinType");
+
+static 
+bool 
+CheckJoinTypes(char **newval, void **extra, GucSource source)
+{
+	static const char *names[] = { "inner", "left", "full", "right", "semi", "anti" };
+	char *list = pstrdup(*newval);
+	List *elems;
+	ListCell *lc;
+	int mask = 0;
+	
+	if (!SplitIdentifierString(list, ',', &elems)) {
+		GUC_check_errdetail("List syntax is invalid.");
+		pfree(list);
+		list_free(elems);
+		return false;
+	}
+	foreach(lc, elems) {
+		const char *name = static_cast<const char *>(lfirst(lc));
+		int i;
+		
+		for (i = 0; i < static_cast<int>(lengthof(names)); i++) {
+			if (pg_strcasecmp(name, names[i]) == 0)
+				break;
+		}
+		if (i == static_cast<int>(lengthof(names))) {
+			GUC_check_errdetail("Unrecognized join type: \"%s\".", name);
+			pfree(list);
+			list_free(elems);
+			return false;
+		}
+		mask |= 1 << i;
+	}
+	pfree(list);
+	list_free(elems);
+	
+	/* guc.c free()s the extra */
+	*extra = std::malloc(sizeof(int));
+	if (*extra == NULL)
+		return false;
+	*static_cast<int *>(*extra) = mask;
+	return true;
+}
+
+static 
 void 
-SetCurrentSessionThread(pthread_t thread)
+AssignJoinTypes(const char *newval, void *extra)
 {
-	/* set current thread for later cancel */
-	memcpy(static_cast<void *>(&PreviousThread), static_cast<void *>(&thread), sizeof(InitialThread));
+	JoinTypeMask = *static_cast<int *>(extra);
 }
 END_C_SPACE
 
@@ -0,0 +1,82 @@
+#!/bin/bash
+# Regression check of the wire format against external_sample/join_sample:
+# joins of tables with NULL keys and values, and of text keys (encoded rows
+# with variable length areas), offloaded and native, must return the same rows.
+# Every query is a self-join, so its rows do not depend on which input the
+# planner scans first.
+#
+#   PORT   engine port (default 59999)
+#   PGBIN  directory of psql (default ../../../tmp_install/bin)
+#
+# The database must run with external_join installed (sh ext_install.sh).
+# Exits with 1 if a result differs, and leaves the rows in $TMPDIR/ej_regress.
+
+cd "$(dirname "$0")"
+
+PORT=${PORT:-59999}
+PGBIN=${PGBIN:-../../../tmp_install/bin}
+OUT=${TMPDIR:-/tmp}/ej_regress
+SAMPLE=../../../external_sample/join_sample
+PSQL="$PGBIN/psql -X -q -A -t -P null=NULL -v ON_ERROR_STOP=1"
+
+make -C ../../../external_sample > /dev/null || exit 1
+mkdir -p $OUT
+
+$PSQL <<EOF || exit 1
+DROP TABLE IF EXISTS ej_regress_f;
+DROP TABLE IF EXISTS ej_regress_t;
+-- join_sample's "key int, dval float8", NULL keys and NULL values
+CREATE TABLE ej_regress_f(key int, dval float);
+INSERT INTO ej_regress_f (SELECT CASE WHEN i % 7 = 0 THEN NULL ELSE i END,
+				 CASE WHEN i % 11 = 0 THEN NULL ELSE (i * 37) % 100 END
+			  FROM generate_series(1, 300) i);
+-- "key text, val int": duplicate, empty, multibyte, compressed and NULL keys
+CREATE TABLE ej_regress_t(key text, val int);
+INSERT INTO ej_regress_t (SELECT CASE WHEN i % 13 = 0 THEN NULL
+				      WHEN i % 17 = 0 THEN ''
+				      WHEN i % 19 = 0 THEN 'schlüssel ' || (i % 3)
+				      WHEN i % 23 = 0 THEN repeat(md5((i % 2)::text), 200)
+				      ELSE 'k' || (i % 40) END,
+				 CASE WHEN i % 5 = 0 THEN NULL ELSE i END
+			  FROM generate_series(1, 400) i);
+ANALYZE ej_regress_f;
+ANALYZE ej_regress_t;
+EOF
+
+# run query $3 as test $1 with join_sample $2, then natively, and compare the rows
+check() {
+	local name=$1 args=$2 query=$3 engine
+
+	if ! PGOPTIONS="-c external_join.enable=on" $PSQL -c "EXPLAIN $query" | grep -q ExternalJoin; then
+		echo "$name: not offloaded"
+		return 1
+	fi
+	$SAMPLE -p $PORT $args 2> $OUT/$name.log &
+	engine=$!
+	sleep 0.5
+	PGOPTIONS="-c external_join.enable=on -c external_join.port=$PORT" \
+		$PSQL -c "$query" > $OUT/$name.external 2>> $OUT/$name.log
+	kill $engine 2> /dev/null
+	wait $engine 2> /dev/null
+	PGOPTIONS="-c external_join.enable=off" $PSQL -c "$query" > $OUT/$name.native || return 1
+	LC_ALL=C sort -o $OUT/$name.external $OUT/$name.external
+	LC_ALL=C sort -o $OUT/$name.native $OUT/$name.native
+	if ! diff -u $OUT/$name.native $OUT/$name.external > $OUT/$name.diff; then
+		echo "$name: results differ, see $OUT/$name.diff"
+		return 1
+	fi
+	echo "$name: ok ($(wc -l < $OUT/$name.native) rows)"
+}
+
+FAILED=0
+check float_nulls "" \
+	"SELECT a.key, a.dval, b.key, b.dval FROM ej_regress_f a, ej_regress_f b WHERE (a.dval - b.dval)^2 < 10" || FAILED=1
+check float_semi "" \
+	"SELECT * FROM ej_regress_f a WHERE EXISTS (SELECT 1 FROM ej_regress_f b WHERE (a.dval - b.dval)^2 < 10)" || FAILED=1
+check float_anti "" \
+	"SELECT * FROM ej_regress_f a WHERE NOT EXISTS (SELECT 1 FROM ej_regress_f b WHERE (a.dval - b.dval)^2 < 10)" || FAILED=1
+check text_keys "-t" \
+	"SELECT a.key, a.val, b.key, b.val FROM ej_regress_t a, ej_regress_t b WHERE a.key = b.key" || FAILED=1
+
+$PSQL -c "DROP TABLE ej_regress_f; DROP TABLE ej_regress_t;"
+exit $FAILED